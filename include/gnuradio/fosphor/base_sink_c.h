@@ -14,17 +14,38 @@
 #include <gnuradio/sync_block.h>
 #include <gnuradio/fft/window.h>
 
+#include <memory>
+#include <string>
+#include <vector>
+
 namespace gr {
   namespace fosphor {
 
     /*!
      * \brief Base fosphor sink API interface
      * \ingroup fosphor
+     *
+     * Sinks take 1, 2, 4 or 8 inputs (channels). Several channels are
+     * processed together, each FFT batch and display pass covering all of
+     * them, and shown side by side in input order, each over the
+     * frequency span: the display covers channels * span around the
+     * center (adjacent channels, e.g. from a channelizer, line up). FFT
+     * overlap isn't available with several channels.
      */
     class GR_FOSPHOR_API base_sink_c : public gr::sync_block
     {
+     public:
+
+      /*! \brief Input sample format, converted to float on the GPU */
+      enum input_format_t {
+        INPUT_FC32,		/*!< \brief Complex float (gr_complex) */
+        INPUT_SC16,		/*!< \brief Complex interleaved int16 */
+        INPUT_SC8,		/*!< \brief Complex interleaved int8 */
+      };
+
      protected:
-      base_sink_c(const char *name = NULL);
+      base_sink_c(const char *name = NULL, input_format_t format = INPUT_FC32,
+                  int channels = 1);
 
      public:
 
@@ -47,6 +68,61 @@ namespace gr {
         CLICK,
       };
 
+      /*! \brief What to do with input samples when the display lags */
+      enum overflow_policy_t {
+        OVERFLOW_BLOCK,		/*!< \brief Back-pressure the flowgraph */
+        OVERFLOW_DROP_NEWEST,	/*!< \brief Drop incoming samples that don't fit */
+        OVERFLOW_DROP_OLDEST,	/*!< \brief Discard the oldest queued batches */
+      };
+
+      /*! \brief Spectrum averaging statistic (see set_averaging()) */
+      enum averaging_t {
+        AVG_MEAN,		/*!< \brief Mean */
+        AVG_RMS,		/*!< \brief Root mean square */
+        AVG_PEAK,		/*!< \brief Maximum */
+      };
+
+      /*! \brief What the max hold trace follows (see set_max_hold()) */
+      enum max_hold_t {
+        MAX_HOLD_DECAY,		/*!< \brief Peaks, slowly decaying toward live */
+        MAX_HOLD_NORMAL,	/*!< \brief Peaks, held */
+        MAX_HOLD_LIVE,		/*!< \brief Peaks of the live spectrum, held */
+        MAX_HOLD_HISTO,		/*!< \brief Top of the histogram persistence */
+      };
+
+      /*! \brief What the burst trigger does when it fires (see set_trigger()) */
+      enum trigger_action_t {
+        TRIGGER_FREEZE,		/*!< \brief Freeze the display on the burst */
+        TRIGGER_CAPTURE,	/*!< \brief Capture the input samples around it */
+      };
+
+      /*! \brief OpenCL device description (see list_devices()) */
+      struct device_info {
+        std::string selector;	/*!< \brief "P:D" selector for set_device() */
+        std::string name;
+        std::string vendor;
+        std::string pci_id;	/*!< \brief PCI bus ID, empty if unknown */
+        bool gpu;
+        bool gl_sharing;		/*!< \brief CL/GL sharing capable */
+        bool host_unified;	/*!< \brief Memory unified with the host */
+        uint64_t local_mem;	/*!< \brief Local memory size (bytes) */
+        uint64_t global_mem;	/*!< \brief Global memory size (bytes) */
+        int score;		/*!< \brief Automatic selection score, < 0 if unusable */
+      };
+
+      /*! \brief Results of one display update (see snapshot()) */
+      struct snapshot_t {
+        uint64_t seq;		/*!< \brief Sequence number, from 1 */
+        uint64_t offset;		/*!< \brief Input items consumed at the time */
+        double center;		/*!< \brief Displayed range center (Hz) */
+        double span;		/*!< \brief Displayed range span (Hz) */
+        int fft_len;
+        int histo_bins;		/*!< \brief Histogram rows, 0 if not available */
+        std::vector<float> live;	/*!< \brief fft_len dBFS, -fs/2 to +fs/2 */
+        std::vector<float> max_hold;	/*!< \brief fft_len dBFS, -fs/2 to +fs/2 */
+        std::vector<float> histogram;	/*!< \brief histo_bins rows of fft_len, in [0,1] */
+      };
+
       virtual void execute_ui_action(enum ui_action_t action) = 0;
       virtual void execute_mouse_action(enum mouse_action_t action, int x, int y) = 0;
 
@@ -55,8 +131,336 @@ namespace gr {
       virtual void set_frequency_center(const double center) = 0;
       virtual void set_frequency_span(const double span) = 0;
 
+      /*!
+       * \brief Follow the rx_freq / rx_rate stream tags (enabled by default)
+       *
+       * Tagged changes (e.g. a hardware retune) set the frequency center /
+       * span exactly from the FFT batch where the tagged sample is, and
+       * each waterfall row keeps the range it was computed with. Tags on
+       * the first input only are used.
+       */
+      virtual void set_frequency_tags(const bool enable) = 0;
+      virtual bool frequency_tags() const = 0;
+
       virtual void set_fft_window(const gr::fft::window::win_type win) = 0;
+
+      /*!
+       * \brief FFT length (per channel)
+       *
+       * Changing it while running builds the new instance (kernels,
+       * buffers, textures) while the current one keeps processing, then
+       * switches between two batches: no samples are skipped. Sizes
+       * needing a larger FIFO only apply after a restart.
+       */
       virtual void set_fft_size(const int size) = 0;
+
+      /*!
+       * \brief Overlap ratio between consecutive FFT windows
+       *
+       * Power of 2 up to 16. Windows are read directly from the input
+       * every fft_size / overlap samples (replaces an overlap_cc block
+       * in front of the sink, without multiplying the sample rate).
+       */
+      virtual void set_overlap(const int overlap) = 0;
+      virtual int overlap() const = 0;
+
+      /*!
+       * \brief Average consecutive spectra on the GPU before display
+       *
+       * Each displayed spectrum (and waterfall line) combines count FFTs
+       * (1 disables it), using mode over the linear power or, with
+       * log_domain, over the log power. Keeps the display readable at
+       * very high sample rates.
+       */
+      virtual void set_averaging(const int count,
+                                 const averaging_t mode = AVG_MEAN,
+                                 const bool log_domain = false) = 0;
+      virtual int averaging() const = 0;
+
+      /*!
+       * \brief Waterfall history length (rows)
+       *
+       * Power of 2 from 128 to 65536, bound by the device image and GL
+       * texture limits. Changing it while running re-initializes.
+       */
+      virtual void set_waterfall_depth(const int rows) = 0;
+      virtual int waterfall_depth() const = 0;
+
+      /*!
+       * \brief Displayed spectra per waterfall row
+       *
+       * Each row holds the peak of decim spectra, for a longer history
+       * scrolling at a readable speed (1 = every spectrum).
+       */
+      virtual void set_waterfall_decimation(const int decim) = 0;
+      virtual int waterfall_decimation() const = 0;
+
+      /*!
+       * \brief Max hold trace mode
+       *
+       * On the GPU each mode is its own display kernel, built the first
+       * time it's used and then kept for the device.
+       */
+      virtual void set_max_hold(const max_hold_t mode) = 0;
+      virtual max_hold_t max_hold() const = 0;
+
+      /*!
+       * \brief Histogram rise / decay and live spectrum smoothing
+       *
+       * Time constants in spectra (defaults 16 and 1024) and smoothing
+       * factor in ]0,1] (default 0.002). Changed without re-initializing.
+       */
+      virtual void set_persistence(const float histo_rise,
+                                   const float histo_decay,
+                                   const float live_alpha) = 0;
+
+      /*!
+       * \brief Histogram resolution (power bins)
+       *
+       * 64, 128, 256 or 512. Changing it while running re-initializes.
+       */
+      virtual void set_histogram_bins(const int bins) = 0;
+      virtual int histogram_bins() const = 0;
+
+      /*!
+       * \brief Waterfall and histogram stored as half floats
+       *
+       * Halves their memory and the readback / upload bandwidth, at about
+       * 3 significant digits (plenty for display). Silently full precision
+       * where the OpenCL device or GL don't support half float images.
+       * Changing it while running re-initializes.
+       */
+      virtual void set_half_precision(const bool enable) = 0;
+      virtual bool half_precision() const = 0;
+
+      /*!
+       * \brief Waterfall and histogram at the display resolution
+       *
+       * Bins are combined on the GPU (mode over their linear power)
+       * into about one column per pixel of the view, counting the zoom
+       * span, at most 16 bins per column. The spectra and detections
+       * keep all the bins. The width follows the window and zoom by
+       * powers of 2, each change re-initializes. No effect on headless
+       * sinks. display_width() is the current number of columns.
+       */
+      virtual void set_display_reduction(const bool enable,
+                                         const averaging_t mode = AVG_PEAK) = 0;
+      virtual int display_width() const = 0;
+
+      /*!
+       * \brief Zoom panel computed from its own band
+       *
+       * Instead of magnifying the main display, the zoom band is mixed
+       * to baseband and decimated on the GPU (by the largest power of 2
+       * keeping the panel within 80% of the band) and gets a second FFT
+       * of the same size, for that much finer a resolution. It falls back
+       * to magnifying with several channels, the CPU engine or headless.
+       */
+      virtual void set_zoom_fft(const bool enable) = 0;
+      virtual bool zoom_fft() const = 0;
+
+      virtual void set_overflow_policy(const overflow_policy_t policy) = 0;
+      virtual overflow_policy_t overflow_policy() const = 0;
+      virtual uint64_t dropped_samples() const = 0;
+
+      virtual void set_target_fps(const double fps) = 0;
+      virtual void set_fifo_high_water(const float level) = 0;
+      virtual float fifo_fill() const = 0;
+      virtual int batch_size() const = 0;
+      virtual int batch_count() const = 0;
+
+      /*!
+       * \brief Size the sample FIFO for a latency budget
+       *
+       * Holds latency seconds of input at sample_rate (per channel),
+       * never less than two minimal batches of the FFT size. 0 for the
+       * default (2M samples). Large ones are backed by huge pages when
+       * the system provides some. Takes effect when the flowgraph
+       * (re)starts. fifo_size() is the current capacity, in samples.
+       */
+      virtual void set_fifo_latency(const double sample_rate,
+                                    const double latency) = 0;
+      virtual int fifo_size() const = 0;
+
+      /*!
+       * \brief Spectra per compute batch at most (0 for the default)
+       *
+       * Bounds the device FFT buffers, which are otherwise sized for up
+       * to 1024 spectra (4M samples). Rounded down to a multiple of 16.
+       * Changing it while running re-initializes.
+       */
+      virtual void set_max_batch(const int spectra) = 0;
+      virtual int max_batch() const = 0;
+
+      /*!
+       * \brief Memory used by this sink, in bytes: {host, device}
+       *
+       * Host: the FIFO and the fosphor instances allocations. Device:
+       * their OpenCL buffers and images. Updated at each settings
+       * change and re-initialization.
+       */
+      virtual std::vector<uint64_t> memory_usage() const = 0;
+
+      /*!
+       * \brief Display frame rate limit (<= 0 for unlimited)
+       *
+       * Frames are only drawn when there are new spectra, a settings
+       * change or an expose, and never faster than this.
+       */
+      virtual void set_max_fps(const double fps) = 0;
+      virtual double max_fps() const = 0;
+
+      /*!
+       * \brief Scheduling of the sink own threads (render and compute)
+       *
+       * cpus: CPU indices they may run on (empty: any). With some, the
+       * FIFO is also first written from there when the flowgraph starts,
+       * so its pages come from their NUMA node. priority: real-time
+       * (SCHED_FIFO) priority, 1-99 and needing the privilege, 0 for the
+       * default scheduling. Each thread applies them to itself, when it
+       * starts and on change. Not the flowgraph thread calling work().
+       */
+      virtual void set_worker_affinity(const std::vector<int> &cpus) = 0;
+      virtual std::vector<int> worker_affinity() const = 0;
+      virtual void set_worker_priority(const int priority) = 0;
+      virtual int worker_priority() const = 0;
+
+      /*!
+       * \brief Share the OpenCL device fairly with the other sinks on it
+       *
+       * Opted-in sinks on a device take turns, one batch at a time, so
+       * a large FFT can't starve the others. Each gets device time in
+       * proportion to its weight. With a deadline (seconds, 0 for none),
+       * a sink whose batch would otherwise wait longer than that is
+       * served first. While waiting, the input queues up and goes in
+       * fewer, larger batches. Batches no longer overlap each other, for
+       * predictability over peak throughput. No effect on the CPU engine.
+       */
+      virtual void set_gpu_scheduling(const bool enable,
+                                      const double weight = 1.0,
+                                      const double deadline = 0.0) = 0;
+      virtual bool gpu_scheduling() const = 0;
+
+      /*! \brief Device time used by this sink's scheduled batches (s) */
+      virtual double gpu_time() const = 0;
+
+      /*!
+       * \brief Per stage timing, from OpenCL profiling events
+       *
+       * Changing it while running re-initializes. profile() returns the
+       * rolling average time per frame (seconds) of the samples upload,
+       * FFT, display kernels, readback, GL acquire / release and host
+       * render (draw + swap) stages, in that order. Empty when disabled.
+       */
+      virtual void set_profiling(const bool enable) = 0;
+      virtual std::vector<double> profile() const = 0;
+
+      /*!
+       * \brief Peak detection on the live spectrum, on the GPU
+       *
+       * Finds the local maxima at least threshold dB above the noise
+       * floor estimate and keeps the max_peaks strongest (0 disables).
+       * Each frame with detections publishes a PDU on the "detections"
+       * port: meta {offset, time, floor} and (frequency, power dBFS)
+       * pairs as a f64 vector, strongest first.
+       */
+      virtual void set_detection(const float threshold,
+                                 const int max_peaks) = 0;
+      virtual int detection_peaks() const = 0;
+
+      /*!
+       * \brief Burst trigger, evaluated on the GPU on every FFT
+       *
+       * Fires on the first spectrum whose total power between f_lo and
+       * f_hi (Hz from the center frequency) exceeds threshold (dBFS).
+       * TRIGGER_FREEZE then freezes the display as the space key does
+       * (which resumes it, still armed). TRIGGER_CAPTURE keeps running
+       * and collects the pre input samples before the burst and the post
+       * ones after it (single channel sinks only), then re-arms. Either
+       * way a PDU is published on the "trigger" port: meta {offset, time,
+       * power, center, span, pre} and the samples in the input format
+       * (none for a freeze). The fused kernels can't trigger, enabling
+       * it re-initializes without them.
+       */
+      virtual void set_trigger(const bool enable,
+                               const double f_lo, const double f_hi,
+                               const float threshold,
+                               const trigger_action_t action = TRIGGER_FREEZE,
+                               const int pre = 0, const int post = 0) = 0;
+      virtual uint64_t trigger_count() const = 0;
+
+      /*!
+       * \brief Record the spectra to a file at each display update
+       *
+       * Writes the live and / or max-hold spectra (full FFT resolution,
+       * dBFS) with their time and frequency range to a new file of fixed
+       * size records (format in lib/recorder.h), from a background thread
+       * that never stalls the display. An empty path stops, as do a FFT
+       * size change and the flowgraph stopping.
+       */
+      virtual void set_recording(const std::string &path,
+                                 const bool live = true,
+                                 const bool max_hold = false) = 0;
+      virtual std::string recording() const = 0;
+
+      /*!
+       * \brief Capture the rendered frames (video export)
+       *
+       * The window content is read back asynchronously (ring of pixel
+       * buffer objects, the display never waits) and written from a
+       * background thread as a stream of binary PPM images, to a file or,
+       * if target starts with '|', to the stdin of that encoder command.
+       * At most fps frames per second are taken (<= 0: every drawn frame),
+       * repeated when nothing was drawn so playback is real time at that
+       * rate. An empty target stops, as does the flowgraph stopping.
+       * Headless sinks have nothing to capture.
+       */
+      virtual void set_capture(const std::string &target,
+                               const double fps = 25.0) = 0;
+      virtual std::string capture() const = 0;
+
+      /*!
+       * \brief Keep the latest results for polling (e.g. from Python)
+       *
+       * At the first display update after snapshot() or snapshot_seq()
+       * was called, the spectra and, when the host holds a copy of it
+       * (headless or no CL/GL sharing), the histogram are copied into the
+       * back one of two preallocated snapshots, which then becomes the one
+       * snapshot() returns. Nothing is copied while nobody reads them.
+       * Returned snapshots are never modified: the back one is reused
+       * when no one holds it anymore, else a new one is allocated (as
+       * after a size change). snapshot_seq() is the seq of the latest one.
+       * snapshot() is NULL when disabled or before the first update.
+       */
+      virtual void set_snapshots(const bool enable) = 0;
+      virtual bool snapshots() const = 0;
+      virtual uint64_t snapshot_seq() const = 0;
+      virtual std::shared_ptr<snapshot_t> snapshot() const = 0;
+
+      /*!
+       * \brief Select the OpenCL device for this sink
+       *
+       * Either "P:D" (platform:device index), "pci:[dddd:]bb:dd.f" or a
+       * case insensitive name substring. Empty for automatic selection
+       * (or $FOSPHOR_CL_DEV). Changing it while running re-initializes.
+       */
+      virtual void set_device(const std::string &selector) = 0;
+      virtual std::string device() const = 0;
+
+      /*! \brief Enumerate the OpenCL devices */
+      static std::vector<device_info> list_devices();
+
+      /*!
+       * \brief Create the shared OpenCL context & programs up front
+       *
+       * Sinks not using CL/GL sharing (e.g. headless) on the same device
+       * share one context and its built programs. Sinks that will use
+       * CL/GL sharing (\p headless false, on a GPU that has it) get their
+       * own context at start, for those only the programs are built (into
+       * the program cache). Selecting a sink's device before start already
+       * starts this in the background, calling it waits for it to be done.
+       */
+      static bool warmup(const std::string &device = "", bool headless = true);
     };
 
   } // namespace fosphor
@@ -34,7 +34,7 @@ namespace gr {
        * class. fosphor::glfw_sink_c::make is the public interface for
        * creating new instances.
        */
-      static sptr make();
+      static sptr make(input_format_t format = INPUT_FC32, int channels = 1);
     };
 
   } // namespace fosphor
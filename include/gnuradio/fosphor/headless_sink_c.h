@@ -0,0 +1,73 @@
+/* -*- c++ -*- */
+/*
+ * Copyright 2013-2021 Sylvain Munaut <tnt@246tNt.com>
+ *
+ * This file is part of gr-fosphor
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <gnuradio/fosphor/api.h>
+#include <gnuradio/fosphor/base_sink_c.h>
+
+#include <gnuradio/sync_block.h>
+
+namespace gr {
+  namespace fosphor {
+
+    /*!
+     * \brief Headless version of fosphor sink
+     * \ingroup fosphor
+     *
+     * Runs the OpenCL processing without any window or GL context and
+     * publishes the results as PDUs (f32vector + metadata dict) :
+     *  - "spectrum"  : live spectrum, fft_size values in dBFS
+     *  - "max_hold"  : max-hold spectrum, fft_size values in dBFS
+     *  - "histogram" : "bins" (from the meta) rows of fft_size intensities
+     *                  in [0,1], lowest power first, spanning [db_min, db_max]
+     *
+     * Spectra go from center - span/2 to center + span/2.
+     *
+     * With a frame width set, compact display frames (u8vector PDUs, see
+     * lib/fosphor/frame.c) are published as well on "frames", at each
+     * update, for remote displays. They're self delimited so any byte
+     * transport carrying them in order works (ZeroMQ, TCP, file, ...).
+     */
+    class GR_FOSPHOR_API headless_sink_c : virtual public base_sink_c
+    {
+     public:
+      typedef std::shared_ptr<headless_sink_c> sptr;
+
+      /*!
+       * \brief Return a shared_ptr to a new instance of fosphor::headless_sink_c.
+       *
+       * To avoid accidental use of raw pointers, fosphor::headless_sink_c's
+       * constructor is in a private implementation
+       * class. fosphor::headless_sink_c::make is the public interface for
+       * creating new instances.
+       *
+       * \param rate Results publication rate (Hz)
+       * \param format Input sample format
+       * \param channels Number of inputs (1, 2, 4 or 8)
+       */
+      static sptr make(double rate = 10.0,
+                       input_format_t format = INPUT_FC32,
+                       int channels = 1);
+
+      /*! \brief Results publication rate (Hz), the same as max_fps() */
+      virtual void set_update_rate(const double rate) = 0;
+      virtual double update_rate() const = 0;
+
+      /*!
+       * \brief Display frames width (bins, power of 2 >= 512, 0 = off)
+       *
+       * Spectra wider than this are reduced to it (peak of the merged bins).
+       */
+      virtual void set_frame_width(const int width) = 0;
+      virtual int frame_width() const = 0;
+    };
+
+  } // namespace fosphor
+} // namespace gr
@@ -37,7 +37,9 @@ namespace gr {
        * class. fosphor::qt_sink_c::make is the public interface for
        * creating new instances.
        */
-      static sptr make(QWidget *parent=NULL);
+      static sptr make(QWidget *parent=NULL,
+                       input_format_t format=INPUT_FC32,
+                       int channels=1);
 
       virtual void exec_() = 0;
       virtual QWidget* qwidget() = 0;
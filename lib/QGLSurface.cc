@@ -8,62 +8,147 @@
  */
 
 #include <QtEvents>
-#include <QThread>
+#include <QOffscreenSurface>
+#include <QOpenGLContext>
+#include <QOpenGLExtraFunctions>
+#include <QOpenGLFramebufferObject>
+#include <QOpenGLFunctions>
+#include <QOpenGLTextureBlitter>
 
 #include "QGLSurface.h"
 #include "qt_sink_c_impl.h"
 
 #include <stdio.h>
 
+#include <utility>
+
 namespace gr {
   namespace fosphor {
 
 QGLSurface::QGLSurface(QWidget *parent, qt_sink_c_impl *block)
-  : QGLWidget(parent), d_block(block)
+  : QOpenGLWidget(parent), d_block(block), d_blitter(NULL),
+    d_share(NULL), d_offscreen(NULL), d_abort(false),
+    d_back(0), d_ready(1), d_front(2), d_fresh(false),
+    d_ctx(NULL), d_have_sync(false)
 {
-	/* Save the pointer to the main GUI thread */
-	this->d_gui_thread = this->thread();
+	for (auto &s : this->d_slots) {
+		s.fbo   = NULL;
+		s.fence = NULL;
+		s.read  = NULL;
+	}
 
 	/* QWidget policies */
 	this->setFocusPolicy(Qt::StrongFocus);
 	this->setSizePolicy(QSizePolicy::Expanding, QSizePolicy::Expanding);
+
+	/* With Qt::AA_ShareOpenGLContexts, the widget context will share
+	 * with the global one, the worker can too without waiting for the
+	 * widget to be shown */
+	if (QOpenGLContext::globalShareContext()) {
+		this->d_offscreen = new QOffscreenSurface();
+		this->d_offscreen->setFormat(QOpenGLContext::globalShareContext()->format());
+		this->d_offscreen->create();
+
+		this->d_share     = QOpenGLContext::globalShareContext();
+		this->d_init_size = this->size();
+	}
+}
+
+QGLSurface::~QGLSurface()
+{
+	if (this->d_blitter) {
+		this->makeCurrent();
+		this->d_blitter->destroy();
+		this->doneCurrent();
+		delete this->d_blitter;
+	}
+
+	delete this->d_offscreen;
 }
 
 
 void
-QGLSurface::hideEvent(QHideEvent *he)
+QGLSurface::initializeGL()
 {
-	this->d_block->cb_visibility(this->isVisible());
+	/* Compositing only */
+	this->d_blitter = new QOpenGLTextureBlitter();
+	this->d_blitter->create();
+
+	/* Let the worker create its context (the offscreen surface has to
+	 * be created from the GUI thread), unless it shares the global one */
+	QMutexLocker lock(&this->d_mutex);
+
+	if (this->d_share)
+		return;
+
+	this->d_offscreen = new QOffscreenSurface();
+	this->d_offscreen->setFormat(this->context()->format());
+	this->d_offscreen->create();
+
+	this->d_share     = this->context();
+	this->d_init_size = this->size();
+
+	this->d_cond.wakeAll();
 }
 
 void
-QGLSurface::showEvent(QShowEvent *he)
+QGLSurface::paintGL()
 {
-	this->d_block->cb_visibility(this->isVisible());
+	QOpenGLFunctions *f = this->context()->functions();
+	QMutexLocker lock(&this->d_mutex);
+	struct slot *s;
+
+	/* Take the latest frame, if any */
+	if (this->d_fresh) {
+		std::swap(this->d_front, this->d_ready);
+		this->d_fresh = false;
+	}
+
+	f->glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+	f->glClear(GL_COLOR_BUFFER_BIT);
+
+	s = &this->d_slots[this->d_front];
+	if (!s->fbo)
+		return;
+
+	/* Make the GPU (not us) wait for the worker rendering */
+	if (s->fence)
+		this->context()->extraFunctions()->glWaitSync(s->fence, 0, GL_TIMEOUT_IGNORED);
+
+	this->d_blitter->bind();
+	this->d_blitter->blit(s->fbo->texture(), QMatrix4x4(),
+		QOpenGLTextureBlitter::OriginBottomLeft);
+	this->d_blitter->release();
+
+	/* And the worker for that blit before it renders into it again */
+	if (this->d_have_sync) {
+		QOpenGLExtraFunctions *ef = this->context()->extraFunctions();
+
+		if (s->read)
+			ef->glDeleteSync(s->read);
+		s->read = ef->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		f->glFlush();
+	}
 }
 
 void
-QGLSurface::paintEvent(QPaintEvent *pe)
+QGLSurface::resizeGL(int w, int h)
 {
-	/* Don't do anything */
-
-	/*
-	 * The default implementation calls makeCurrent but here we want
-	 * _other_ threads to be current, so we need a dummy empty impl
-	 * for the paintEvent
-	 */
+	/* The worker renders at the new size from its next frame, until
+	 * then the last one is stretched */
+	this->d_block->cb_reshape(w, h);
 }
 
 void
-QGLSurface::resizeEvent(QResizeEvent *re)
+QGLSurface::hideEvent(QHideEvent *he)
 {
-	/*
-	 * The default implementation calls makeCurrent but here we want
-	 * _other_ threads to be current, so don't do that !
-	 */
+	this->d_block->cb_visibility(this->isVisible());
+}
 
-	/* Call back to main block */
-	this->d_block->cb_reshape(re->size().width(), re->size().height());
+void
+QGLSurface::showEvent(QShowEvent *he)
+{
+	this->d_block->cb_visibility(this->isVisible());
 }
 
 void
@@ -124,31 +209,160 @@ QGLSurface::mousePressEvent(QMouseEvent *me)
 }
 
 
+/*
+ * Worker side. The slots are only ever touched by the thread owning them
+ * at the time (back: worker, front: GUI), d_mutex protects the exchanges
+ */
+
 void
+QGLSurface::bindBack(int width, int height)
+{
+	struct slot *s = &this->d_slots[this->d_back];
+
+	if ((width <= 0) || (height <= 0))
+		return;
+
+	/* Done with by the GUI, it's ours to reuse once its last blit from
+	 * it went through (on the GPU, we don't wait) */
+	if (s->fence) {
+		this->d_ctx->extraFunctions()->glDeleteSync(s->fence);
+		s->fence = NULL;
+	}
+
+	if (s->read) {
+		this->d_ctx->extraFunctions()->glWaitSync(s->read, 0, GL_TIMEOUT_IGNORED);
+		this->d_ctx->extraFunctions()->glDeleteSync(s->read);
+		s->read = NULL;
+	}
+
+	if (s->fbo && (s->fbo->size() != QSize(width, height))) {
+		delete s->fbo;
+		s->fbo = NULL;
+	}
+
+	if (!s->fbo)
+		s->fbo = new QOpenGLFramebufferObject(width, height);
+
+	s->fbo->bind();
+}
+
+bool
 QGLSurface::grabContext()
 {
-	QMetaObject::invokeMethod(
-		this,
-		"giveContext",
-		Qt::BlockingQueuedConnection,
-		Q_ARG(QThread*, QThread::currentThread())
-	);
-
-	this->makeCurrent();
+	QSize size;
+
+	/* Wait for the widget context to share with (if it's not the global
+	 * one, see the constructor). The sink doesn't hold the flowgraph
+	 * meanwhile */
+	{
+		QMutexLocker lock(&this->d_mutex);
+
+		while (!this->d_share && !this->d_abort)
+			this->d_cond.wait(&this->d_mutex);
+
+		if (!this->d_share)
+			return false;
+
+		size = this->d_init_size;
+	}
+
+	this->d_ctx = new QOpenGLContext();
+	this->d_ctx->setFormat(this->d_share->format());
+	this->d_ctx->setShareContext(this->d_share);
+
+	if (!this->d_ctx->create() || !this->d_ctx->makeCurrent(this->d_offscreen)) {
+		fprintf(stderr, "[!] Unable to create the Qt render context\n");
+		delete this->d_ctx;
+		this->d_ctx = NULL;
+		return false;
+	}
+
+	this->d_have_sync = this->d_ctx->isOpenGLES() ?
+		(this->d_ctx->format().version() >= qMakePair(3, 0)) :
+		((this->d_ctx->format().version() >= qMakePair(3, 2)) ||
+		 this->d_ctx->hasExtension("GL_ARB_sync"));
+
+	this->bindBack(size.width(), size.height());
+
+	return true;
+}
+
+void
+QGLSurface::resizeContext(int width, int height)
+{
+	if (this->d_ctx)
+		this->bindBack(width, height);
+}
+
+void
+QGLSurface::swapContext()
+{
+	struct slot *s = &this->d_slots[this->d_back];
+	QSize size;
+
+	if (!this->d_ctx || !s->fbo)
+		return;
+
+	/* Mark the end of the rendering for the GUI, without waiting for it */
+	if (this->d_have_sync)
+		s->fence = this->d_ctx->extraFunctions()->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+	if (s->fence)
+		this->d_ctx->functions()->glFlush();
+	else
+		this->d_ctx->functions()->glFinish();
+
+	size = s->fbo->size();
+
+	/* Publish */
+	{
+		QMutexLocker lock(&this->d_mutex);
+		std::swap(this->d_back, this->d_ready);
+		this->d_fresh = true;
+	}
+
+	QMetaObject::invokeMethod(this, "update", Qt::QueuedConnection);
+
+	/* Next frame */
+	this->bindBack(size.width(), size.height());
 }
 
 void
 QGLSurface::releaseContext()
 {
-	this->doneCurrent();
-	this->context()->moveToThread(this->d_gui_thread);
+	QMutexLocker lock(&this->d_mutex);
+
+	this->d_abort = false;
+
+	if (!this->d_ctx)
+		return;
+
+	/* Nothing left for the GUI to composite */
+	for (auto &s : this->d_slots) {
+		if (s.fence)
+			this->d_ctx->extraFunctions()->glDeleteSync(s.fence);
+		if (s.read)
+			this->d_ctx->extraFunctions()->glDeleteSync(s.read);
+		delete s.fbo;
+		s.fbo   = NULL;
+		s.fence = NULL;
+		s.read  = NULL;
+	}
+
+	this->d_fresh = false;
+
+	this->d_ctx->doneCurrent();
+	delete this->d_ctx;
+	this->d_ctx = NULL;
 }
 
 void
-QGLSurface::giveContext(QThread *thread)
+QGLSurface::abortGrab()
 {
-	this->doneCurrent();
-	this->context()->moveToThread(thread);
+	QMutexLocker lock(&this->d_mutex);
+
+	this->d_abort = true;
+	this->d_cond.wakeAll();
 }
 
   } /* namespace fosphor */
@@ -9,38 +9,88 @@
 
 #pragma once
 
-#include <QGLWidget>
+#include <QMutex>
+#include <QOpenGLWidget>
+#include <QWaitCondition>
+#include <qopengl.h>
 
-class QThread;
+class QOffscreenSurface;
+class QOpenGLContext;
+class QOpenGLFramebufferObject;
+class QOpenGLTextureBlitter;
 
 namespace gr {
   namespace fosphor {
 
     class qt_sink_c_impl;
 
-    class QGLSurface : public ::QGLWidget
+    /*!
+     * \brief Widget compositing the frames rendered by the sink worker
+     *
+     * The worker draws with its own context, shared with the widget one,
+     * into a ring of three FBOs: it renders into the back one and makes
+     * it the ready one at each swap, the GUI thread takes the latest ready
+     * one when painting and only blits its texture. Fences make the GPU
+     * wait for the rendering before a blit, and for the last blit before
+     * the worker renders into that FBO again. Past the context creation,
+     * neither thread ever waits for the other.
+     */
+    class QGLSurface : public ::QOpenGLWidget
     {
       Q_OBJECT
 
       qt_sink_c_impl *d_block;
-      QThread *d_gui_thread;
+
+      /* GUI thread */
+      QOpenGLTextureBlitter *d_blitter;
+
+      /* Shared, under d_mutex */
+      QMutex d_mutex;
+      QWaitCondition d_cond;
+      QOpenGLContext *d_share;		/* Widget context, once initialized */
+      QOffscreenSurface *d_offscreen;
+      QSize d_init_size;
+      bool d_abort;
+
+      struct slot {
+        QOpenGLFramebufferObject *fbo;
+        GLsync fence;			/* Rendering done, NULL: glFinish'ed */
+        GLsync read;			/* Last GUI blit from it done */
+      } d_slots[3];
+
+      int d_back;			/* Worker renders into it */
+      int d_ready;			/* Latest complete frame */
+      int d_front;			/* GUI composites it */
+      bool d_fresh;			/* d_ready not taken by the GUI yet */
+
+      /* Worker thread */
+      QOpenGLContext *d_ctx;
+      bool d_have_sync;
+
+      void bindBack(int width, int height);
 
      protected:
+      void initializeGL();
+      void paintGL();
+      void resizeGL(int w, int h);
+
       void hideEvent(QHideEvent *he);
       void showEvent(QShowEvent *he);
-      void paintEvent(QPaintEvent *pe);
-      void resizeEvent(QResizeEvent *re);
       void keyPressEvent(QKeyEvent *ke);
       void mousePressEvent(QMouseEvent *me);
 
-     private slots:
-      void giveContext(QThread *thread);
-
      public:
       QGLSurface(QWidget *parent, qt_sink_c_impl *d_block);
+      ~QGLSurface();
 
-      void grabContext();
+      /* Worker side */
+      bool grabContext();
+      void resizeContext(int width, int height);
+      void swapContext();
       void releaseContext();
+
+      /* Don't wait for the widget to be shown before the worker stops */
+      void abortGrab();
     };
 
   } // namespace fosphor
@@ -11,13 +11,30 @@
 #include "config.h"
 #endif
 
+#include <math.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
+#ifndef _WIN32
+# include <pthread.h>
+# include <sched.h>
+#endif
+
+#include <algorithm>
+#include <climits>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <map>
+#include <thread>
+
 #include <gnuradio/io_signature.h>
 #include <gnuradio/thread/thread.h>
 
 #include "fifo.h"
+#include "frame_capture.h"
+#include "recorder.h"
 #include "base_sink_c_impl.h"
 
 #ifdef ENABLE_GLEW
@@ -33,29 +50,197 @@ extern "C" {
 namespace gr {
   namespace fosphor {
 
-base_sink_c::base_sink_c(const char *name)
+static size_t
+input_item_size(base_sink_c::input_format_t format)
+{
+	switch (format) {
+	case base_sink_c::INPUT_SC16: return 2 * sizeof(int16_t);
+	case base_sink_c::INPUT_SC8:  return 2 * sizeof(int8_t);
+	default:                      return sizeof(gr_complex);
+	}
+}
+
+base_sink_c::base_sink_c(const char *name, input_format_t format, int channels)
   : gr::sync_block(name,
-                   gr::io_signature::make(1, 1, sizeof(gr_complex)),
+                   gr::io_signature::make(channels, channels, input_item_size(format)),
                    gr::io_signature::make(0, 0, 0))
 {
 	/* Register message ports */
 	message_port_register_out(pmt::mp("freq"));
+	message_port_register_out(pmt::mp("overflow"));
+	message_port_register_out(pmt::mp("detections"));
+	message_port_register_out(pmt::mp("trigger"));
 }
 
 
 gr::thread::mutex base_sink_c_impl::s_boot_mutex;
 
+/* Held around the fosphor instances init / release only where the core
+ * can't run them in parallel, or if $FOSPHOR_SERIAL_INIT is set (for the
+ * OpenCL implementations that don't like it) */
+gr::thread::scoped_lock
+base_sink_c_impl::boot_lock()
+{
+	static const bool serial = !fosphor_init_parallel() || getenv("FOSPHOR_SERIAL_INIT");
+	gr::thread::scoped_lock lock;
+
+	if (serial)
+		lock = gr::thread::scoped_lock(s_boot_mutex);
+
+	return lock;
+}
+
+/* Background warmups, one per device selector and kind of sink for the
+ * whole process. They run detached so a warmup still going doesn't hold up
+ * exit, the sinks that asked for one wait for it in stop() */
+static gr::thread::mutex s_warmup_mutex;
+static std::map<std::pair<std::string, bool>, std::shared_future<bool>> s_warmups;
+
+/* Probes the device and builds the programs while the flowgraph is still
+ * being set up, the sinks init then finds them ready in the pool or the
+ * program cache (or waits for them there) instead of each doing it in turn */
+std::shared_future<bool>
+base_sink_c_impl::warmup_async(const std::string &device, bool headless)
+{
+	gr::thread::scoped_lock guard(s_warmup_mutex);
+	const std::pair<std::string, bool> key(device, headless);
+
+	auto it = s_warmups.find(key);
+	if (it != s_warmups.end())
+		return it->second;
+
+	std::packaged_task<bool()> task(std::bind(base_sink_c::warmup, device, headless));
+	std::shared_future<bool> done = task.get_future().share();
+
+	std::thread(std::move(task)).detach();
+
+	s_warmups[key] = done;
+
+	return done;
+}
+
+/* Upper bound of the configured FIFO length (items) */
+#define FIFO_LENGTH_MAX	(1 << 28)
+
+/* No trigger capture in progress */
+#define TRIG_NONE	UINT64_MAX
+
+/* Upper bound of the pre / post trigger samples (items) */
+#define TRIG_LENGTH_MAX	(1 << 26)
+
+/* FIFO able to hold two minimal (16 spectra) batches of that row and the
+ * latency budget if set. The fifo wants a power of 2, past one huge page
+ * (see fifo) that's also a whole number of them */
+int
+base_sink_c_impl::fifo_length(int row_len) const
+{
+	const int page = (2 * 1024 * 1024) / this->d_item_size;
+	double want = this->d_fifo_rate * this->d_fifo_latency * this->d_channels;
+	int64_t n;
+
+	if (want <= 0.0)
+		return std::max(2 * 1024 * 1024, 2 * 16 * row_len);
+
+	want = std::min(want, (double)FIFO_LENGTH_MAX);
+
+	for (n=page; n < want; n <<= 1);
+
+	return std::max((int)n, 2 * 16 * row_len);
+}
+
+bool
+base_sink_c::warmup(const std::string &device, bool headless)
+{
+	gr::thread::scoped_lock guard(base_sink_c_impl::boot_lock());
+	return fosphor_pool_warmup(device.c_str(), headless) == 0;
+}
+
+std::vector<base_sink_c::device_info>
+base_sink_c::list_devices()
+{
+	std::vector<device_info> rv;
+	std::vector<struct fosphor_device_info> list(16);
+	int n;
+
+	n = fosphor_list_devices(list.data(), list.size());
+	if (n > (int)list.size()) {
+		list.resize(n);
+		n = fosphor_list_devices(list.data(), list.size());
+	}
+
+	for (int i=0; i<n && i<(int)list.size(); i++) {
+		const struct fosphor_device_info *fdi = &list[i];
+		device_info di;
+
+		di.selector     = std::to_string(fdi->platform) + ":" + std::to_string(fdi->device);
+		di.name         = fdi->name;
+		di.vendor       = fdi->vendor;
+		di.pci_id       = fdi->pci_id;
+		di.gpu          = !!fdi->gpu;
+		di.gl_sharing   = !!(fdi->flags & FDI_GL_SHARING);
+		di.host_unified = !!(fdi->flags & FDI_HOST_UNIFIED);
+		di.local_mem    = fdi->local_mem;
+		di.global_mem   = fdi->global_mem;
+		di.score        = fdi->score;
+
+		rv.push_back(di);
+	}
+
+	return rv;
+}
+
 const int base_sink_c_impl::k_db_per_div[] = {1, 2, 5, 10, 20};
 
 
-base_sink_c_impl::base_sink_c_impl()
-  : d_db_ref(0), d_db_per_div_idx(3),
+base_sink_c_impl::base_sink_c_impl(bool headless, input_format_t format, int channels)
+  : d_visible(false), d_active(false), d_frozen(false), d_input_format(format),
+    d_item_size(input_item_size(format)), d_fifo_rate(0.0), d_fifo_latency(0.0),
+    d_max_batch(0), d_max_batch_cur(0), d_mem_host(0), d_mem_device(0),
+    d_overflow_policy(OVERFLOW_BLOCK), d_dropped(0), d_overflowing(false),
+    d_consuming(false), d_retune_dropped(0),
+    d_rt_priority(0), d_thread_cfg(0), d_gpu_sched(false), d_gpu_weight(1.0),
+    d_gpu_deadline(0.0), d_gpu_time(0.0), d_profiling(false),
+    d_profiling_cur(false), d_render_time(0.0), d_detect_threshold(10.0f),
+    d_detect_peaks(0), d_trig_enabled(false), d_trig_lo(0.0), d_trig_hi(0.0),
+    d_trig_threshold(-30.0f), d_trig_action(TRIGGER_FREEZE), d_trig_pre(0),
+    d_trig_post(0), d_trig_count(0), d_trig_pos(0), d_trig_ring_len(0),
+    d_trig_ring_next_len(-1), d_trig_fire(TRIG_NONE), d_trig_power(0.0f), d_trig_time(0.0), d_rec_flags(0),
+    d_recorder(NULL), d_cap_fps(25.0), d_capture(NULL), d_snap_enabled(false),
+    d_snap_seq(0), d_snap_wanted(true), d_freq_tags(true), d_fifo_wpos(0), d_fifo_rpos(0),
+    d_fifo_calls(0), d_channels(channels), d_db_ref(0), d_db_per_div_idx(3),
     d_zoom_enabled(false), d_zoom_center(0.5), d_zoom_width(0.2),
-    d_ratio(0.35f), d_frozen(false), d_active(false), d_visible(false),
-    d_frequency(), d_fft_window(gr::fft::window::WIN_BLACKMAN_hARRIS), d_fft_size(1024)
+    d_zoom_fft(false), d_ratio(0.35f), d_frequency(),
+    d_fft_window(gr::fft::window::WIN_BLACKMAN_hARRIS), d_fft_size(1024),
+    d_overlap(1), d_avg_count(1), d_avg_mode(AVG_MEAN), d_avg_log(false),
+    d_wf_depth(1024), d_wf_decim(1), d_histo_bins(128), d_max_hold(MAX_HOLD_DECAY),
+    d_histo_rise(16.0f), d_histo_decay(1024.0f), d_live_alpha(0.002f),
+    d_half(false), d_half_cur(false), d_disp_red(false), d_disp_red_mode(AVG_PEAK),
+    d_disp_len_cur(0), d_headless(headless)
 {
+	if ((channels < 1) || (channels > FOSPHOR_MAX_CHANNELS) || (channels & (channels - 1)))
+		throw std::invalid_argument("fosphor sinks take 1, 2, 4 or 8 channels");
+
+	if (!fosphor_fft_len_validate(this->row_len()))
+		throw std::invalid_argument("default FFT size unsupported with that many channels");
+
+	/* Channels are copied in whole FFT blocks */
+	if (channels > 1)
+		this->set_output_multiple(this->d_fft_size);
+
 	/* Init FIFO */
-	this->d_fifo = new fifo(2 * 1024 * 1024);
+	this->d_fifo = new fifo(this->fifo_length(this->row_len()), this->d_item_size);
+
+	/* Init scheduler */
+	this->d_sched.target_fps    = 60.0;
+	this->d_sched.high_water    = 0.5f;
+	this->d_sched.cost_spectrum = 0.0;
+	this->d_sched.fill          = 0.0f;
+	this->d_sched.batch_size    = 1024;
+	this->d_sched.batch_count   = 0;
+
+	/* Init frame pacing */
+	this->d_pacing.max_fps = 60.0;
+	this->d_pacing.redraw  = true;
 
 	/* Init render options */
 	this->d_render_main = new fosphor_render();
@@ -76,46 +261,82 @@ base_sink_c_impl::~base_sink_c_impl()
 
 void base_sink_c_impl::worker()
 {
+	unsigned int thread_cfg = 0;
+
+	this->thread_config(thread_cfg);
+
 	/* Zero-init */
 	this->d_fosphor = NULL;
-
-	/* Init GL context */
-	this->glctx_init();
+	this->d_fosphor_zoom = NULL;
+	this->d_fosphor_next = NULL;
+	this->d_fosphor_zoom_next = NULL;
+	this->d_zoom_decim = 0;
+
+	/* Init GL context, may wait for the GUI (stop() aborts that) */
+	if (!this->glctx_init()) {
+		GR_LOG_ERROR(d_logger, "Unable to get a GL context");
+		goto error;
+	}
 
 #ifdef ENABLE_GLEW
-	GLenum glew_err = glewInit();
-	if (glew_err != GLEW_OK) {
-		GR_LOG_ERROR(d_logger, boost::format("GLEW initialization error : %s") % glewGetErrorString(glew_err));
-		goto error;
+	if (!this->d_headless) {
+		/* Core profile contexts don't list their extensions the old way,
+		 * have GLEW load everything regardless */
+		glewExperimental = GL_TRUE;
+
+		GLenum glew_err = glewInit();
+		if (glew_err != GLEW_OK) {
+			GR_LOG_ERROR(d_logger, boost::format("GLEW initialization error : %s") % glewGetErrorString(glew_err));
+			goto error;
+		}
+
+		/* It queries GL_EXTENSIONS anyway, drop the GL_INVALID_ENUM */
+		while (glGetError() != GL_NO_ERROR);
 	}
 #endif
 
 	/* Init fosphor */
-	{
-		/* (prevent // init of multiple instance to be gentle on the OpenCL
-		 *  implementations that don't like this) */
-		gr::thread::scoped_lock guard(s_boot_mutex);
+	if (!this->core_init())
+		goto error;
 
-		this->d_fosphor = fosphor_init();
-		if (!this->d_fosphor) {
-			GR_LOG_ERROR(d_logger, "Failed to initialize fosphor");
-			goto error;
-		}
-	}
+	this->trigger_prepare();
+	this->settings_apply(~(SETTING_DIMENSIONS | SETTING_FFT_SIZE | SETTING_DEVICE));
 
-	this->settings_apply(~SETTING_DIMENSIONS);
+	/* Start feeding the GPU */
+	this->d_consuming = true;
+	this->d_compute = gr::thread::thread(_compute, this);
 
 	/* Main loop */
 	while (this->d_active)
 	{
-		this->render();
+		typedef std::chrono::steady_clock clock;
+		clock::time_point t0 = clock::now();
+		bool drawn;
+
+		this->thread_config(thread_cfg);
+
+		drawn = this->render();
 		this->glctx_poll();
+
+		this->pacing_wait(
+			std::chrono::duration<double>(clock::now() - t0).count(),
+			drawn);
 	}
 
+	this->d_compute.join();
+	this->d_consuming = false;
+
 error:
-	/* Cleanup fosphor */
-	if (this->d_fosphor)
-		fosphor_release(this->d_fosphor);
+	/* Recordings end with the flowgraph */
+	this->recording_stop("flowgraph stopped");
+	this->capture_stop("flowgraph stopped");
+
+	/* Cleanup fosphor, leaving the device to the other sinks */
+	this->d_gpu_client.reset();
+	this->core_fini();
+
+	/* Nothing's reading the FIFO anymore */
+	this->fifo_retire(0);
 
 	/* And GL context */
 	this->glctx_fini();
@@ -127,326 +348,2385 @@ void base_sink_c_impl::_worker(base_sink_c_impl *obj)
 }
 
 
-void
-base_sink_c_impl::render(void)
+bool base_sink_c_impl::core_init()
 {
-	const int fft_len    = this->d_fft_size;
-	const int batch_mult = 16;
-	const int batch_max  = 1024;
-	const int max_iter   = 8;
+	/* Sinks come up in parallel, only the shared state is locked
+	 * (in the core, see boot_lock()) */
+	gr::thread::scoped_lock guard(boot_lock());
 
-	int i, tot_len;
+	this->d_fosphor = this->core_create();
+	if (!this->d_fosphor)
+		return false;
 
-	/* Handle pending settings */
-	this->settings_apply(this->settings_get_and_reset_changed());
+	/* Zoom band instance, drawn from the same context */
+	if (this->d_zoom_fft && !this->d_headless)
+		this->d_fosphor_zoom = this->zoom_create();
 
-	/* Process as much we can */
-	tot_len = this->d_fifo->used();
+	return true;
+}
 
-	for (i=0; i<max_iter && tot_len; i++)
-	{
-		gr_complex *data;
-		int len;
+/* Builds the instance for the new settings while the compute thread keeps
+ * feeding the current one, settings_apply() then only has to switch over */
+bool base_sink_c_impl::core_prepare()
+{
+	gr::thread::scoped_lock guard(boot_lock());
 
-		/* How much can we get from FIFO in one block */
-		len = tot_len;
-		if (len > this->d_fifo->read_max_size())
-			len = this->d_fifo->read_max_size();
+	this->d_fosphor_next = this->core_create();
+	if (!this->d_fosphor_next)
+		return false;
 
-		/* Adapt to valid size for fosphor */
-		len &= ~((batch_mult * fft_len) - 1);
-		if (len > (batch_max * fft_len))
-			len = batch_max * fft_len;
+	if (this->d_zoom_fft && !this->d_headless)
+		this->d_fosphor_zoom_next = this->zoom_create();
 
-		/* Is it worth it ? */
-		tot_len -= len;
+	return true;
+}
 
-		if (!len)
-			break;
+/* The new instance couldn't be built, go back to the settings of the
+ * current one so it isn't tried again until the next change */
+void base_sink_c_impl::core_revert()
+{
+	this->d_fft_size    = fosphor_get_fft_len(this->d_fosphor) / this->d_channels;
+	this->d_wf_depth    = fosphor_get_waterfall_depth(this->d_fosphor);
+	this->d_histo_bins  = fosphor_get_histogram_bins(this->d_fosphor);
+	this->d_profiling   = this->d_profiling_cur;
+	this->d_half        = this->d_half_cur;
+	this->d_max_batch   = this->d_max_batch_cur;
 
-		/* Send to process (if not frozen) */
-		if (!this->d_frozen) {
-			data = this->d_fifo->read_peek(len, false);
-			fosphor_process(this->d_fosphor, data, len);
-		}
+	if (this->d_channels > 1)
+		this->set_output_multiple(this->d_fft_size);
 
-		/* Discard */
-		this->d_fifo->read_discard(len);
-	}
+	gr::thread::scoped_lock lock(this->d_settings_mutex);
+	this->d_device = this->d_device_cur;
+}
 
-	/* Are we visible ? */
-	{
-		gr::thread::scoped_lock guard(this->d_render_mutex);
+/* Whether the fused FFT/display kernels can be used, they don't average,
+ * decimate the waterfall or evaluate the trigger */
+bool base_sink_c_impl::core_fusable() const
+{
+	return (this->d_avg_count <= 1) && (this->d_wf_decim <= 1) && !this->d_trig_enabled;
+}
 
-		if (this->d_visible) {
-			/* Clear everything */
-			glClearColor( 0.0f, 0.0f, 0.0f, 0.0f );
-			glClear(GL_COLOR_BUFFER_BIT);
+/* Whether those settings changes need a new instance: the FFT length,
+ * waterfall depth, histogram bins, precision, display width, profiling
+ * and device are fixed for one, and so are the fused kernels */
+bool base_sink_c_impl::core_stale(uint32_t settings)
+{
+	if ((settings & (SETTING_AVERAGING | SETTING_WF_DECIMATION | SETTING_TRIGGER)) &&
+	    this->d_fosphor && fosphor_is_fused(this->d_fosphor) && !this->core_fusable())
+		return true;
+
+	if (!(settings & (SETTING_FFT_SIZE | SETTING_DEVICE | SETTING_WF_DEPTH |
+	                  SETTING_HISTO_BINS | SETTING_PROFILING | SETTING_HALF |
+	                  SETTING_DISP_REDUCTION | SETTING_DIMENSIONS | SETTING_RENDER_OPTIONS |
+	                  SETTING_BUFFERING)))
+		return false;
+
+	if (!this->d_fosphor)
+		return false;
+
+	return (this->device() != this->d_device_cur) ||
+	       (this->d_profiling != this->d_profiling_cur) ||
+	       (this->d_half != this->d_half_cur) ||
+	       (this->d_max_batch != this->d_max_batch_cur) ||
+	       (this->display_len() != this->d_disp_len_cur) ||
+	       (fosphor_get_fft_len(this->d_fosphor) != this->row_len()) ||
+	       (fosphor_get_waterfall_depth(this->d_fosphor) != this->d_wf_depth) ||
+	       (fosphor_get_histogram_bins(this->d_fosphor) != this->d_histo_bins);
+}
 
-			/* Draw */
-			fosphor_draw(this->d_fosphor, this->d_render_main);
+/* A new instance from the current settings (boot lock held) */
+struct fosphor *
+base_sink_c_impl::core_create()
+{
+	struct fosphor_options opts;
+	struct fosphor *fosphor;
+	std::string device;
 
-			if (this->d_zoom_enabled)
-				fosphor_draw(this->d_fosphor, this->d_render_zoom);
+	{
+		gr::thread::scoped_lock lock(this->d_settings_mutex);
+		device = this->d_device;
+	}
 
-			/* Done, swap buffer */
-			this->glctx_swap();
-		}
+	fosphor_options_defaults(&opts);
+	opts.device     = device.c_str();
+	opts.fft_len    = this->d_fft_size;
+	opts.channels   = this->d_channels;
+	opts.headless   = this->d_headless;
+	opts.wf_depth   = this->d_wf_depth;
+	opts.histo_bins = this->d_histo_bins;
+	opts.fused      = this->core_fusable();
+	opts.profiling  = this->d_profiling;
+	opts.half       = this->d_half;
+	opts.disp_len   = this->display_len();
+	opts.max_batch  = this->d_max_batch;
+
+	switch (this->d_disp_red_mode) {
+	case AVG_RMS:  opts.disp_mode = FOSPHOR_AVG_RMS;  break;
+	case AVG_MEAN: opts.disp_mode = FOSPHOR_AVG_MEAN; break;
+	default:       opts.disp_mode = FOSPHOR_AVG_PEAK; break;
 	}
 
-	if (!this->d_visible) {
-		/* If hidden, we can't draw or swap buffer, so just wait a bit */
-		boost::this_thread::sleep_for(boost::chrono::milliseconds(10));
+	switch (this->d_input_format) {
+	case INPUT_SC16: opts.input_format = FOSPHOR_INPUT_CS16; break;
+	case INPUT_SC8:  opts.input_format = FOSPHOR_INPUT_CS8;  break;
+	default:         opts.input_format = FOSPHOR_INPUT_CF32; break;
 	}
-}
 
+	fosphor = fosphor_init(&opts);
+	if (!fosphor) {
+		GR_LOG_ERROR(d_logger, "Failed to initialize fosphor");
+		return NULL;
+	}
 
-void
-base_sink_c_impl::settings_mark_changed(uint32_t setting)
+	/* What it was built with (see core_stale()) */
+	this->d_device_cur    = device;
+	this->d_profiling_cur = opts.profiling;
+	this->d_half_cur      = opts.half;
+	this->d_disp_len_cur  = opts.disp_len;
+	this->d_max_batch_cur = opts.max_batch;
+
+	/* Let the device pull samples straight from the FIFO storage */
+	if (fosphor_register_host_buffer(fosphor,
+	                                 this->d_fifo->storage(),
+	                                 this->d_fifo->storage_size()))
+		GR_LOG_INFO(d_logger, "FIFO storage not pinned, using staged uploads");
+
+	return fosphor;
+}
+
+void base_sink_c_impl::core_fini()
 {
-	gr::thread::scoped_lock lock(this->d_settings_mutex);
-	this->d_settings_changed |= setting;
+	gr::thread::scoped_lock guard(boot_lock());
+
+	this->zoom_fini();
+
+	if (this->d_fosphor) {
+		fosphor_wait(this->d_fosphor);
+		fosphor_release(this->d_fosphor);
+	}
+
+	this->d_fosphor = NULL;
 }
 
-uint32_t
-base_sink_c_impl::settings_get_and_reset_changed(void)
+
+/* Same FFT size as the main instance (boot lock held). If it fails, the
+ * zoom panel just keeps magnifying the main one */
+struct fosphor *
+base_sink_c_impl::zoom_create()
 {
-	gr::thread::scoped_lock lock(this->d_settings_mutex);
-	uint32_t v = this->d_settings_changed;
-	this->d_settings_changed = 0;
-	return v;
+	struct fosphor_options opts;
+	struct fosphor *fosphor;
+
+	fosphor_options_defaults(&opts);
+	opts.device     = this->d_device_cur.c_str();
+	opts.fft_len    = this->d_fft_size;
+	opts.wf_depth   = this->d_wf_depth;
+	opts.histo_bins = this->d_histo_bins;
+	opts.half       = this->d_half_cur;
+
+	fosphor = fosphor_init(&opts);
+	if (!fosphor)
+		GR_LOG_WARN(d_logger, "Failed to initialize the zoom FFT, magnifying instead");
+
+	return fosphor;
 }
 
-void
-base_sink_c_impl::settings_apply(uint32_t settings)
+void base_sink_c_impl::zoom_fini()
 {
-	if (settings & SETTING_DIMENSIONS)
-	{
-		this->glctx_update();
+	if (!this->d_fosphor_zoom)
+		return;
 
-		glMatrixMode(GL_MODELVIEW);
-		glLoadIdentity();
+	if (this->d_fosphor)
+		fosphor_set_ddc(this->d_fosphor, 0, 0.0);
 
-		glMatrixMode(GL_PROJECTION);
-		glLoadIdentity();
-		glOrtho(0.0, (double)this->d_width, 0.0, (double)this->d_height, -1.0, 1.0);
+	fosphor_release(this->d_fosphor_zoom);
 
-		glViewport(0, 0, this->d_width, this->d_height);
-	}
+	this->d_fosphor_zoom = NULL;
+	this->d_zoom_decim   = 0;
+	this->d_zoom_samples.clear();
+}
+
+/* Follows the zoom panel: the largest decimation keeping it within 80% of
+ * the band (the DDC filter rolls off past that) and the render shows that
+ * part of the zoom instance */
+void base_sink_c_impl::zoom_apply(uint32_t settings)
+{
+	int decim = 1;
+	double center;
+
+	if (!this->d_fosphor_zoom)
+		return;
 
 	if (settings & SETTING_POWER_RANGE) {
-		fosphor_set_power_range(this->d_fosphor,
+		fosphor_set_power_range(this->d_fosphor_zoom,
 			this->d_db_ref,
 			this->k_db_per_div[this->d_db_per_div_idx]
 		);
 	}
 
-	if (settings & SETTING_FREQUENCY_RANGE) {
-		fosphor_set_frequency_range(this->d_fosphor,
-			this->d_frequency.center,
-			this->d_frequency.span
-		);
+	if (settings & SETTING_FFT_OVERLAP) {
+		fosphor_set_fft_overlap(this->d_fosphor_zoom, this->d_overlap);
+	}
+
+	if (settings & SETTING_MAX_HOLD) {
+		fosphor_set_max_hold(this->d_fosphor_zoom, (int)this->d_max_hold);
+		fosphor_set_persistence(this->d_fosphor_zoom,
+			this->d_histo_rise, this->d_histo_decay, this->d_live_alpha);
 	}
 
 	if (settings & SETTING_FFT_WINDOW) {
 		std::vector<float> window =
 			gr::fft::window::build(this->d_fft_window, this->d_fft_size, 6.76);
-		fosphor_set_fft_window(this->d_fosphor, window.data());
+		fosphor_set_fft_window(this->d_fosphor_zoom, window.data());
 	}
 
-	if (settings & SETTING_FFT_SIZE) {
-		fosphor_fft_len_set(this->d_fft_size);
-		/* Rebuild window with new size */
-		std::vector<float> window =
-			gr::fft::window::build(this->d_fft_window, this->d_fft_size, 6.76);
-		fosphor_set_fft_window(this->d_fosphor, window.data());
+	if (!(settings & (SETTING_DIMENSIONS | SETTING_RENDER_OPTIONS | SETTING_FREQUENCY_RANGE)))
+		return;
+
+	while ((decim < FOSPHOR_DDC_DECIM_MAX) && (this->d_zoom_width * decim * 2 <= 0.8))
+		decim *= 2;
+
+	if (!this->d_zoom_enabled || (decim < 2))
+		decim = 0;
+
+	center = std::min(std::max(this->d_zoom_center - 0.5, -0.5), 0.5);
+
+	if ((decim != this->d_zoom_decim) ||
+	    (decim && (center != this->d_zoom_center_cur)))
+	{
+		if (fosphor_set_ddc(this->d_fosphor, decim, center) < 0) {
+			GR_LOG_WARN(d_logger, "Zoom FFT not available, magnifying instead");
+			this->zoom_fini();
+			return;
+		}
+
+		/* Samples of the old band are useless */
+		if (decim != this->d_zoom_decim)
+			this->d_zoom_samples.clear();
+
+		this->d_zoom_decim      = decim;
+		this->d_zoom_center_cur = center;
 	}
 
-	if (settings & (SETTING_DIMENSIONS | SETTING_RENDER_OPTIONS))
+	if (!this->d_zoom_decim)
+		return;
+
+	const freq_range freq = this->frequency();
+
+	fosphor_set_frequency_range(this->d_fosphor_zoom,
+		freq.center + center * freq.span,
+		freq.span / decim
+	);
+
+	this->d_render_zoom->freq_center = 0.5f;
+	this->d_render_zoom->freq_span   = (float)(this->d_zoom_width * decim);
+
+	fosphor_render_refresh(this->d_render_zoom);
+}
+
+/* Zoom band samples of the last main sync to the zoom instance, in batches
+ * as process() does (fosphor lock held) */
+void base_sink_c_impl::zoom_feed()
+{
+	const int batch_mult = 16;
+	const float *samples;
+	int n, fft_len, hop, tail, batch_max, done;
+
+	if (!this->d_zoom_decim)
+		return;
+
+	n = fosphor_get_ddc(this->d_fosphor, &samples);
+	if (n <= 0)
+		return;
+
+	this->d_zoom_samples.insert(this->d_zoom_samples.end(),
+		reinterpret_cast<const gr_complex *>(samples),
+		reinterpret_cast<const gr_complex *>(samples) + n);
+
+	fft_len   = fosphor_get_fft_len(this->d_fosphor_zoom);
+	hop       = fosphor_get_fft_hop(this->d_fosphor_zoom);
+	tail      = fft_len - hop;
+	batch_max = fosphor_get_max_batch(this->d_fosphor_zoom);
+	done      = 0;
+
+	while (true)
 	{
-		float f;
+		n = ((int)this->d_zoom_samples.size() - done - tail) / hop;
+		n &= ~(batch_mult - 1);
+		if (n > batch_max)
+			n = batch_max;
 
-		if (this->d_zoom_enabled) {
-			int a = (int)(this->d_width * 0.65f);
-			this->d_render_main->width = a;
-			this->d_render_main->options |= FRO_CHANNELS;
-			this->d_render_main->options &= ~FRO_COLOR_SCALE;
-			this->d_render_zoom->pos_x = a - 10;
-			this->d_render_zoom->width = this->d_width - a + 10;
-		} else {
-			this->d_render_main->width = this->d_width;
-			this->d_render_main->options &= ~FRO_CHANNELS;
-			this->d_render_main->options |= FRO_COLOR_SCALE;
-		}
+		if (n <= 0)
+			break;
 
-		this->d_render_main->height = this->d_height;
-		this->d_render_zoom->height = this->d_height;
+		fosphor_process(this->d_fosphor_zoom,
+			this->d_zoom_samples.data() + done, n * hop + tail);
 
-		this->d_render_main->histo_wf_ratio = this->d_ratio;
-		this->d_render_zoom->histo_wf_ratio = this->d_ratio;
+		done += n * hop;
+	}
 
-		this->d_render_main->channels[0].enabled = this->d_zoom_enabled;
-		this->d_render_main->channels[0].center  = (float)this->d_zoom_center;
-		this->d_render_main->channels[0].width   = (float)this->d_zoom_width;
+	if (!done)
+		return;
 
-		this->d_render_zoom->freq_center = (float)this->d_zoom_center;
-		this->d_render_zoom->freq_span   = (float)this->d_zoom_width;
+	this->d_zoom_samples.erase(this->d_zoom_samples.begin(),
+		this->d_zoom_samples.begin() + done);
 
-		fosphor_render_refresh(this->d_render_main);
-		fosphor_render_refresh(this->d_render_zoom);
+	fosphor_sync(this->d_fosphor_zoom);
+}
+
+
+void base_sink_c_impl::compute()
+{
+	unsigned int thread_cfg = 0;
+
+	while (this->d_active)
+	{
+		this->thread_config(thread_cfg);
+
+		/* Nothing to do, don't spin */
+		if (!this->process())
+			boost::this_thread::sleep_for(boost::chrono::milliseconds(1));
 	}
 }
 
+void base_sink_c_impl::_compute(base_sink_c_impl *obj)
+{
+	obj->compute();
+}
+
 
+/*
+ * The device reads the samples straight from the FIFO (mapped or async
+ * upload), so what a batch consumed is only handed back to the producer
+ * once the fosphor_process() calls that may read it are done. Released
+ * in order, tagged with the last call that may touch it.
+ */
 void
-base_sink_c_impl::cb_reshape(int width, int height)
+base_sink_c_impl::fifo_consume(int size)
 {
-	this->d_width    = width;
-	this->d_height   = height;
-	this->settings_mark_changed(SETTING_DIMENSIONS);
+	this->d_fifo->read_consume(size);
+	this->fifo_keep(size);
 }
 
 void
-base_sink_c_impl::cb_visibility(bool visible)
+base_sink_c_impl::fifo_keep(int size)
 {
-	gr::thread::scoped_lock guard(this->d_render_mutex);
-	this->d_visible = visible;
-}
+	if (size <= 0)
+		return;
 
+	if (!this->d_fifo_holds.empty() && this->d_fifo_holds.back().call == this->d_fifo_calls)
+		this->d_fifo_holds.back().size += size;
+	else
+		this->d_fifo_holds.push_back({ size, this->d_fifo_calls });
+}
 
 void
-base_sink_c_impl::execute_ui_action(enum ui_action_t action)
+base_sink_c_impl::fifo_retire(int pending)
 {
-	switch (action) {
-	case DB_PER_DIV_UP:
-		if (this->d_db_per_div_idx < 4)
-			this->d_db_per_div_idx++;
-		break;
+	uint64_t done = this->d_fifo_calls - (pending > 0 ? pending : 0);
 
-	case DB_PER_DIV_DOWN:
-		if (this->d_db_per_div_idx > 0)
-			this->d_db_per_div_idx--;
-		break;
+	while (!this->d_fifo_holds.empty() && this->d_fifo_holds.front().call <= done) {
+		this->d_fifo->read_release(this->d_fifo_holds.front().size);
+		this->d_fifo_holds.pop_front();
+	}
+}
 
-	case REF_UP:
-		this->d_db_ref += k_db_per_div[this->d_db_per_div_idx];
-		break;
+int
+base_sink_c_impl::process(void)
+{
+	typedef std::chrono::steady_clock clock;
 
-	case REF_DOWN:
-		this->d_db_ref -= k_db_per_div[this->d_db_per_div_idx];
-		break;
+	const int batch_mult = 16;
 
-	case ZOOM_TOGGLE:
-		this->d_zoom_enabled ^= 1;
-		break;
+	int fft_len, hop, tail, batch_max;
+	int tot_len, n_spectra, n_done, n_calls, n_drop, pending;
+	int64_t rt;
+	clock::time_point t0, t1;
+	std::shared_ptr<gpu_sched::client> gpu;
+
+	/* Geometry of the current instance, a new one (size, overlap) only
+	 * takes over between two batches */
+	{
+		gr::thread::scoped_lock guard(this->d_fosphor_mutex);
+		if (!this->d_fosphor)
+			return 0;
+
+		fft_len   = fosphor_get_fft_len(this->d_fosphor);
+		hop       = fosphor_get_fft_hop(this->d_fosphor);
+		batch_max = fosphor_get_max_batch(this->d_fosphor);
+		gpu       = this->d_gpu_client;
+		pending   = fosphor_pending(this->d_fosphor);
+	}
+
+	tail = fft_len - hop;		/* Extra samples for the last window */
+
+	/* Drop what the producer asked us to (overflow) */
+	n_drop = this->d_fifo->drop_apply();
+	this->d_dropped   += n_drop;
+	this->d_fifo_rpos += n_drop;
+	this->fifo_keep(n_drop);		/* Already consumed */
+
+	/* How much work for this pass */
+	tot_len = this->d_fifo->used();
+	n_spectra = this->sched_plan((tot_len > tail) ? ((tot_len - tail) / hop) : 0, batch_max);
+
+	/* Nothing new, have the device finish with what we still hold so
+	 * a producer waiting for that space isn't left there */
+	if (!n_spectra && !this->d_fifo_holds.empty()) {
+		gr::thread::scoped_lock guard(this->d_fosphor_mutex);
+		if (this->d_fosphor && !fosphor_wait(this->d_fosphor))
+			pending = 0;
+	}
+
+	this->fifo_retire(pending);
+
+	/* Process it */
+	n_done  = 0;
+	n_calls = 0;
+
+	t0 = clock::now();
+
+	while (n_done < n_spectra)
+	{
+		void *data;
+		int n, max;
+		bool stage;
+
+		/* How many spectra can we get from FIFO in one block. Sharing
+		 * the device, all there is: what queued up while waiting for
+		 * our turn goes in one launch rather than several small ones */
+		n = n_spectra - n_done;
+		if (gpu)
+			n = std::max(n, ((int)this->d_fifo->used() - tail) / hop);
+		else if (n > this->d_sched.batch_size)
+			n = this->d_sched.batch_size;
+
+		/* Without a mirrored mapping, a batch can't read past the end
+		 * of the buffer. When not even the smallest one fits before
+		 * it, that one goes through a copy */
+		max = (this->d_fifo->read_max_size() - tail) / hop;
+		stage = (max < batch_mult);
+		if (!stage && (n > max))
+			n = max;
+
+		/* Batches end where the frequency range changes. When that's
+		 * closer than the smallest batch, the few spectra of the old
+		 * range are skipped so the new one starts exactly there. Those
+		 * samples count as dropped, work() reports them */
+		rt = this->retune_apply();
+		if (rt > 0) {
+			int n_rt = (rt + hop - 1) / hop;
+
+			if (n_rt < batch_mult) {
+				/* (queued before the samples are committed) */
+				if (rt > this->d_fifo->used())
+					break;
+
+				this->fifo_consume(rt);
+				this->d_fifo_rpos += rt;
+				this->d_dropped += rt;
+				this->d_retune_dropped += rt;
+				n_done += n_rt;
+				continue;
+			}
+
+			if (n > n_rt)
+				n = n_rt;
+		}
+
+		/* Adapt to valid size for fosphor */
+		n &= ~(batch_mult - 1);
+		if (n > batch_max)
+			n = batch_max;
+
+		if (n <= 0)
+			break;
+
+		/* Send to process (if not frozen). Overlapping windows are
+		 * read by the GPU, we only need to pass the tail along */
+		if (!this->d_frozen) {
+			clock::time_point tb;
+			double t_gpu = 0.0;
+			void *mark = NULL;
+			bool stale;
+
+			/* Waiting for the device without the lock, so the
+			 * render thread goes on meanwhile */
+			if (gpu)
+				gpu->acquire();
+
+			{
+				gr::thread::scoped_lock guard(this->d_fosphor_mutex);
+
+				/* Switched to another FFT size / overlap since the
+				 * plan, the next pass goes on from here with it */
+				stale = !this->d_fosphor ||
+				        (fosphor_get_fft_len(this->d_fosphor) != fft_len) ||
+				        (fosphor_get_fft_hop(this->d_fosphor) != hop);
+
+				if (!stale) {
+					tb = clock::now();
+
+					if (stage) {
+						this->d_fifo_stage.resize((size_t)(n * hop + tail) * this->d_item_size);
+						this->d_fifo->read_copy(this->d_fifo_stage.data(), n * hop + tail);
+						data = this->d_fifo_stage.data();
+					} else {
+						data = this->d_fifo->read_peek(n * hop + tail, false);
+					}
+
+					fosphor_process(this->d_fosphor, data, n * hop + tail);
+					this->d_fifo_calls++;
+
+					/* The copy is reused by the next one */
+					if (stage)
+						fosphor_wait(this->d_fosphor);
+
+					this->d_trig_pos = this->d_fifo_rpos + n * hop;
+					this->trigger_feed(data, this->d_fifo_rpos, n * hop);
+
+					pending = fosphor_pending(this->d_fosphor);
+
+					if (gpu)
+						mark = fosphor_get_marker(this->d_fosphor);
+				}
+			}
+
+			if (gpu) {
+				/* Holding the device until done, the hold time
+				 * is the batch device time. Waited for without
+				 * the lock so render() isn't held meanwhile */
+				if (!stale) {
+					if (mark && !fosphor_wait_marker(mark))
+						pending = 0;
+					t_gpu = std::chrono::duration<double>(clock::now() - tb).count();
+				}
+
+				gpu->release(t_gpu);
+				this->d_gpu_time = this->d_gpu_time + t_gpu;
+			}
+
+			if (stale)
+				break;
+		}
+
+		/* Done with what's not needed by the next windows, its space
+		 * goes back once the device is too */
+		this->fifo_consume(n * hop);
+		this->fifo_retire(pending);
+		this->d_fifo_rpos += n * hop;
+
+		n_done += n;
+		n_calls++;
+	}
+
+	t1 = clock::now();
+
+	if (n_done && !this->d_frozen)
+		this->sched_update_process(
+			std::chrono::duration<double>(t1 - t0).count() / n_done);
+
+	this->d_sched.batch_count = n_calls;
+
+	return n_done;
+}
+
+/* Returns true if a frame was produced (drawn and swapped, or published) */
+bool
+base_sink_c_impl::render(void)
+{
+	typedef std::chrono::steady_clock clock;
+
+	clock::time_point t0;
+	uint32_t settings;
+	bool dirty;
+
+	/* Handle pending settings. A new instance is built without the lock,
+	 * the compute thread goes on with the current one meanwhile */
+	settings = this->settings_get_and_reset_changed();
+
+	if (this->core_stale(settings) && !this->core_prepare()) {
+		GR_LOG_WARN(d_logger, "New settings not usable, keeping the current ones");
+		this->core_revert();
+	}
+
+	if (settings & (SETTING_TRIGGER | SETTING_FREQUENCY_RANGE))
+		this->trigger_prepare();
+
+	{
+		gr::thread::scoped_lock guard(this->d_fosphor_mutex);
+		this->settings_apply(settings);
+	}
+
+	/* The previous one, once switched over */
+	if (this->d_fosphor_next) {
+		gr::thread::scoped_lock guard(boot_lock());
+		fosphor_release(this->d_fosphor_next);
+		this->d_fosphor_next = NULL;
+	}
+
+	/* Re-init failed (FFT size / device change), we're shutting down */
+	if (!this->d_fosphor)
+		return false;
+
+	/* Headless: no drawing, just hand over the new results */
+	if (this->d_headless) {
+		gr::thread::scoped_lock guard(this->d_fosphor_mutex);
+		if (fosphor_sync(this->d_fosphor) <= 0)
+			return false;
+		this->publish_results(this->d_fosphor);
+		this->detections_publish();
+		this->trigger_check();
+		this->recording_push();
+		this->snapshot_push();
+		this->profile_update(0.0);
+		return true;
+	}
+
+	/* Are we visible ? */
+	{
+		gr::thread::scoped_lock guard(this->d_render_mutex);
+
+		if (this->d_visible) {
+			/* Grab latest state from the compute thread */
+			{
+				gr::thread::scoped_lock guard(this->d_fosphor_mutex);
+				dirty = fosphor_sync(this->d_fosphor) > 0;
+				if (dirty) {
+					this->detections_publish();
+					this->trigger_check();
+					this->recording_push();
+					this->snapshot_push();
+					this->zoom_feed();
+				}
+			}
+
+			/* Nothing new (idle, frozen), keep the last frame */
+			dirty |= (settings != 0);
+			dirty |= this->d_pacing.redraw.exchange(false);
+
+			if (!dirty)
+				return false;
+
+			t0 = clock::now();
+
+			/* Clear everything */
+			glClearColor( 0.0f, 0.0f, 0.0f, 0.0f );
+			glClear(GL_COLOR_BUFFER_BIT);
+
+			/* Draw */
+			fosphor_draw(this->d_fosphor, this->d_render_main);
+
+			if (this->d_zoom_enabled)
+				fosphor_draw(this->d_zoom_decim ? this->d_fosphor_zoom : this->d_fosphor,
+				             this->d_render_zoom);
+
+			/* Capture (reads the back buffer) */
+			if (this->d_capture) {
+				if (this->d_capture->failed())
+					this->capture_stop("write error");
+				else
+					this->d_capture->frame(this->d_width, this->d_height);
+			}
+
+			/* Done, swap buffer */
+			this->glctx_swap();
+
+			{
+				gr::thread::scoped_lock guard(this->d_fosphor_mutex);
+				this->profile_update(
+					std::chrono::duration<double>(clock::now() - t0).count());
+			}
+
+			return true;
+		}
+	}
+
+	/* If hidden, we can't draw or swap buffer, so just wait a bit */
+	boost::this_thread::sleep_for(boost::chrono::milliseconds(10));
+
+	return false;
+}
+
+
+/*
+ * Profiling
+ *
+ * The device stages come from the fosphor instance, we add the host side
+ * of the render. Called after each productive sync, fosphor lock held.
+ */
+
+#define PROF_ALPHA	0.1
+
+void
+base_sink_c_impl::profile_update(double t_render)
+{
+	struct fosphor_profile prof;
+	std::vector<double> v;
+
+	if (!this->d_profiling_cur)
+		return;
+
+	this->d_render_time += PROF_ALPHA * (t_render - this->d_render_time);
+
+	if (fosphor_get_profile(this->d_fosphor, &prof))
+		return;
+
+	v.assign(prof.avg, prof.avg + FOSPHOR_PROF_STAGES);
+	v.push_back(this->d_render_time);
+
+	gr::thread::scoped_lock lock(this->d_settings_mutex);
+	this->d_profile.swap(v);
+}
+
+
+/*
+ * Peak detection
+ *
+ * The peaks are found on the device at each sync, we only pick the
+ * strongest ones and publish them. Called after each productive sync,
+ * fosphor lock held.
+ */
+
+void
+base_sink_c_impl::detections_publish()
+{
+	const int max_peaks = this->d_detect_peaks;
+	std::vector<struct fosphor_detection> det(max_peaks);
+	std::vector<double> data;
+	pmt::pmt_t meta;
+	float floor_db;
+	int n;
+
+	if (max_peaks <= 0)
+		return;
+
+	n = fosphor_get_detections(this->d_fosphor, det.data(), max_peaks, &floor_db);
+	if (n <= 0)
+		return;
+
+	for (int i=0; i<n; i++) {
+		data.push_back(det[i].freq);
+		data.push_back(det[i].power);
+	}
+
+	meta = pmt::make_dict();
+	meta = pmt::dict_add(meta, pmt::mp("offset"), pmt::from_uint64(this->nitems_read(0)));
+	meta = pmt::dict_add(meta, pmt::mp("time"),   pmt::from_double(
+		std::chrono::duration<double>(
+			std::chrono::system_clock::now().time_since_epoch()).count()));
+	meta = pmt::dict_add(meta, pmt::mp("floor"),  pmt::from_double(floor_db));
+
+	message_port_pub(pmt::mp("detections"),
+		pmt::cons(meta, pmt::init_f64vector(data.size(), data)));
+}
+
+
+/*
+ * Burst trigger
+ *
+ * The device tells at each sync whether (and in which spectrum) the band
+ * went over the threshold. A freeze is immediate, a capture waits for the
+ * post samples to have gone through process(), which keeps the history
+ * ring of its input. All of it under the fosphor lock, but the ring which
+ * render() allocates beforehand.
+ */
+
+/* Ring for the current settings (render thread, no lock). Beyond the pre
+ * and post samples, it holds what's processed between the burst and its
+ * detection at the next sync: two sync periods at the sample rate (the
+ * span), at least a FIFO worth, in powers of 2 so retunes rarely change
+ * it. If it can't be had, bursts are only reported */
+void
+base_sink_c_impl::trigger_prepare()
+{
+	const bool capture = this->d_trig_enabled &&
+	                     (this->d_trig_action == TRIGGER_CAPTURE) &&
+	                     (this->d_channels == 1);
+	const double fps = std::max(1.0, (double)this->d_pacing.max_fps);
+	uint64_t slack, want, len;
+
+	slack = (uint64_t)std::max(0.0, 2.0 * this->frequency().span / fps);
+	want  = std::max(slack, (uint64_t)this->d_fifo->free_max() + 1);
+
+	for (slack=1; slack < want; slack <<= 1);
+
+	len = capture ? std::min((uint64_t)this->d_trig_pre + this->d_trig_post + slack,
+	                         (uint64_t)INT_MAX / this->d_item_size) : 0;
+
+	if ((int)len == this->d_trig_ring_len) {
+		this->d_trig_ring_next_len = -1;
+		return;
+	}
+
+	try {
+		std::vector<char>(len * this->d_item_size).swap(this->d_trig_ring_next);
+		this->d_trig_ring_next_len = len;
+	} catch (std::bad_alloc &e) {
+		GR_LOG_WARN(d_logger, boost::format("Unable to allocate the %d items trigger capture ring, only reporting bursts") % len);
+		std::vector<char>().swap(this->d_trig_ring_next);
+		this->d_trig_ring_next_len = 0;
+	}
+}
+
+int
+base_sink_c_impl::trigger_apply()
+{
+	const double span = this->frequency().span * this->d_channels;
+
+	if (this->d_trig_ring_next_len >= 0) {
+		this->d_trig_ring.swap(this->d_trig_ring_next);
+		this->d_trig_ring_len = this->d_trig_ring_next_len;
+		this->d_trig_ring_next_len = -1;
+		std::vector<char>().swap(this->d_trig_ring_next);
+
+		/* Whatever was being captured isn't in there */
+		this->d_trig_fire = TRIG_NONE;
+	}
+
+	if (this->d_trig_ring.empty())
+		this->d_trig_fire = TRIG_NONE;
+
+	return fosphor_set_trigger(this->d_fosphor, this->d_trig_enabled,
+		this->d_trig_lo / span, this->d_trig_hi / span,
+		this->d_trig_threshold
+	);
+}
+
+void
+base_sink_c_impl::trigger_check()
+{
+	const uint64_t end = this->d_trig_pos;
+	uint64_t back, pos;
+	double now;
+	float power;
+	int age;
+
+	if (!this->d_trig_enabled || this->d_frozen)
+		return;
+
+	if (fosphor_get_trigger(this->d_fosphor, &age, &power) <= 0)
+		return;
+
+	/* One capture at a time, bursts during it are part of it */
+	if (this->d_trig_fire != TRIG_NONE)
+		return;
+
+	back = (uint64_t)(age + 1) * fosphor_get_fft_hop(this->d_fosphor);
+	pos  = (back < end) ? (end - back) : 0;
+	now  = std::chrono::duration<double>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+
+	this->d_trig_count++;
+
+	if (this->d_trig_ring.empty()) {
+		if (this->d_trig_action == TRIGGER_FREEZE) {
+			this->d_frozen = true;
+			this->settings_mark_changed(SETTING_FREQUENCY_RANGE | SETTING_RENDER_OPTIONS);
+		}
+		this->trigger_publish(pos, power, now, NULL, 0, 0);
+		return;
+	}
+
+	this->d_trig_fire  = pos;
+	this->d_trig_power = power;
+	this->d_trig_time  = now;
+}
+
+/* Keeps the n items at FIFO position pos, then publishes the capture in
+ * progress once it has all its post samples */
+void
+base_sink_c_impl::trigger_feed(const void *data, uint64_t pos, int n)
+{
+	const size_t is = this->d_item_size;
+	const uint64_t len = this->d_trig_ring_len;
+	const char *src = (const char *)data;
+	uint64_t start, stop, fire;
+	std::vector<char> samples;
+
+	if (!len)
+		return;
+
+	/* Only the latest ones if that's more than the ring holds */
+	if ((uint64_t)n > len) {
+		src += (n - len) * is;
+		pos += n - len;
+		n = len;
+	}
+
+	while (n > 0) {
+		uint64_t ofs = pos % len;
+		int m = std::min((uint64_t)n, len - ofs);
+
+		memcpy(&this->d_trig_ring[ofs * is], src, m * is);
+		src += m * is;
+		pos += m;
+		n   -= m;
+	}
+
+	/* Capture complete ? */
+	fire = this->d_trig_fire;
+	if ((fire == TRIG_NONE) || (pos < fire + this->d_trig_post))
+		return;
+
+	/* What's still in the ring of [fire - pre, fire + post) */
+	stop  = fire + this->d_trig_post;
+	start = (fire > (uint64_t)this->d_trig_pre) ? (fire - this->d_trig_pre) : 0;
+	if (pos > len)
+		start = std::max(start, pos - len);
+
+	samples.resize((stop - start) * is);
+	for (uint64_t p = start; p < stop; ) {
+		uint64_t ofs = p % len;
+		uint64_t m = std::min(stop - p, len - ofs);
+
+		memcpy(&samples[(p - start) * is], &this->d_trig_ring[ofs * is], m * is);
+		p += m;
+	}
+
+	this->d_trig_fire = TRIG_NONE;
+
+	this->trigger_publish(fire, this->d_trig_power, this->d_trig_time,
+		samples.data(), stop - start, fire - start);
+}
+
+void
+base_sink_c_impl::trigger_publish(uint64_t pos, float power, double time,
+                                  const char *samples, int n, int pre)
+{
+	const freq_range freq = this->frequency();
+	pmt::pmt_t meta, data;
+
+	meta = pmt::make_dict();
+	meta = pmt::dict_add(meta, pmt::mp("offset"), pmt::from_uint64(pos));
+	meta = pmt::dict_add(meta, pmt::mp("time"),   pmt::from_double(time));
+	meta = pmt::dict_add(meta, pmt::mp("power"),  pmt::from_double(power));
+	meta = pmt::dict_add(meta, pmt::mp("center"), pmt::from_double(freq.center));
+	meta = pmt::dict_add(meta, pmt::mp("span"),   pmt::from_double(freq.span * this->d_channels));
+	meta = pmt::dict_add(meta, pmt::mp("pre"),    pmt::from_long(pre));
+
+	switch (this->d_input_format) {
+	case INPUT_SC16:
+		data = pmt::init_s16vector(2 * n, (const int16_t *)samples);
+		break;
+	case INPUT_SC8:
+		data = pmt::init_s8vector(2 * n, (const int8_t *)samples);
+		break;
+	default:
+		data = pmt::init_c32vector(n, (const gr_complex *)samples);
+		break;
+	}
+
+	message_port_pub(pmt::mp("trigger"), pmt::cons(meta, data));
+}
+
+
+/*
+ * Spectrum recording
+ *
+ * The recorder is (re)created when the settings are applied and fed after
+ * each productive sync, both with the fosphor lock held. A recording that
+ * stops for any reason is not resumed, that would truncate the file.
+ */
+
+void
+base_sink_c_impl::recording_apply()
+{
+	const int fft_len = fosphor_get_fft_len(this->d_fosphor);
+	std::string path;
+	int flags;
+
+	{
+		gr::thread::scoped_lock lock(this->d_settings_mutex);
+		path  = this->d_rec_path;
+		flags = this->d_rec_flags;
+	}
+
+	/* Stop or switch the current one */
+	if (this->d_recorder) {
+		if (this->d_recorder->fft_size() != fft_len) {
+			this->recording_stop("FFT size changed");
+			path.clear();
+		} else if ((this->d_recorder->path() != path) ||
+		         (this->d_recorder->flags() != flags)) {
+			delete this->d_recorder;
+			this->d_recorder = NULL;
+		}
+	}
+
+	if (!path.empty() && !this->d_recorder) {
+		const freq_range freq = this->frequency();
+
+		try {
+			this->d_recorder = new recorder(path, fft_len, flags,
+				this->d_fft_window,
+				freq.center, freq.span * this->d_channels);
+		} catch (std::exception &e) {
+			GR_LOG_ERROR(d_logger, e.what());
+
+			gr::thread::scoped_lock lock(this->d_settings_mutex);
+			this->d_rec_path.clear();
+		}
+	}
+
+	this->readback_apply();
+}
+
+void
+base_sink_c_impl::recording_push()
+{
+	const int fft_len = fosphor_get_fft_len(this->d_fosphor);
+	float *live, *max_hold;
+	double center, span;
+	float *p;
+
+	if (!this->d_recorder)
+		return;
+
+	if (this->d_recorder->failed()) {
+		this->recording_stop("write error");
+		return;
+	}
+
+	/* Full queue: dropped (and counted) */
+	p = this->d_recorder->write_prepare();
+	if (!p)
+		return;
+
+	live     = (this->d_recorder->flags() & recorder::REC_LIVE) ? p : NULL;
+	max_hold = (this->d_recorder->flags() & recorder::REC_MAX_HOLD) ? (live ? p + fft_len : p) : NULL;
+
+	if (fosphor_get_spectrum(this->d_fosphor, live, max_hold, fft_len))
+		return;
+
+	this->displayed_frequency(this->d_fosphor, center, span);
+
+	this->d_recorder->write_commit(this->nitems_read(0), center, span);
+}
+
+void
+base_sink_c_impl::recording_stop(const char *reason)
+{
+	if (!this->d_recorder)
+		return;
+
+	GR_LOG_INFO(d_logger, boost::format("Recording to %s stopped (%s), %d spectra, %d dropped")
+		% this->d_recorder->path() % reason
+		% this->d_recorder->records() % this->d_recorder->dropped());
+
+	delete this->d_recorder;
+	this->d_recorder = NULL;
+
+	gr::thread::scoped_lock lock(this->d_settings_mutex);
+	this->d_rec_path.clear();
+}
+
+/* With CL/GL sharing, the spectra need an extra readback for the host */
+void
+base_sink_c_impl::readback_apply()
+{
+	fosphor_set_spectrum_readback(this->d_fosphor,
+		(this->d_recorder != NULL) || this->d_snap_enabled);
+}
+
+
+/*
+ * Results snapshots
+ *
+ * Two of them, the render thread fills the back one after a productive
+ * sync and swaps it to the front for snapshot(). Readers never block it
+ * (d_snap_mutex only covers the swap) and hold their own references, so a
+ * size change just starts new ones. Copying everything (fosphor lock held)
+ * is only worth it if someone looks, so it's done at the first sync after
+ * a snapshot() or snapshot_seq() call.
+ */
+
+void
+base_sink_c_impl::snapshot_apply()
+{
+	if (!this->d_snap_enabled) {
+		gr::thread::scoped_lock lock(this->d_snap_mutex);
+		this->d_snap_front.reset();
+		this->d_snap_back.reset();
+	}
+
+	this->readback_apply();
+}
+
+void
+base_sink_c_impl::snapshot_push()
+{
+	const int fft_len = fosphor_get_fft_len(this->d_fosphor);
+	const int bins    = fosphor_get_histogram_bins(this->d_fosphor);
+	std::shared_ptr<snapshot_t> &s = this->d_snap_back;
+	uint64_t seq;
+
+	if (!this->d_snap_enabled || !this->d_snap_wanted.exchange(false, std::memory_order_relaxed))
+		return;
+
+	/* Published snapshots are never written again: the back one is only
+	 * reused once nobody holds it anymore (e.g. a NumPy view of it) */
+	if (!s || (s.use_count() > 1) ||
+	    (s->fft_len != fft_len) || (s->histogram.size() != (size_t)fft_len * bins)) {
+		s = std::make_shared<snapshot_t>();
+		s->fft_len = fft_len;
+		s->live.resize(fft_len);
+		s->max_hold.resize(fft_len);
+		s->histogram.resize((size_t)fft_len * bins);
+	}
+
+	seq = this->d_snap_seq.load(std::memory_order_relaxed) + 1;
+
+	s->seq    = seq;
+	s->offset = this->nitems_read(0);
+	this->displayed_frequency(this->d_fosphor, s->center, s->span);
+
+	if (fosphor_get_spectrum(this->d_fosphor, s->live.data(), s->max_hold.data(), fft_len))
+		return;
+
+	s->histo_bins = fosphor_get_histogram(this->d_fosphor, s->histogram.data(), fft_len) ? 0 : bins;
+
+	/* Publish */
+	gr::thread::scoped_lock lock(this->d_snap_mutex);
+	std::swap(this->d_snap_front, this->d_snap_back);
+	this->d_snap_seq.store(seq, std::memory_order_release);
+}
+
+
+/*
+ * Rendered frames capture
+ *
+ * Lives in the GL context of the worker, applied with the settings and
+ * fed after each draw.
+ */
+
+void
+base_sink_c_impl::capture_apply()
+{
+	std::string target;
+	double fps;
+
+	{
+		gr::thread::scoped_lock lock(this->d_settings_mutex);
+		target = this->d_cap_target;
+		fps    = this->d_cap_fps;
+	}
+
+	/* Nothing drawn, nothing to capture */
+	if (this->d_headless && !target.empty()) {
+		GR_LOG_ERROR(d_logger, "Headless sinks can't capture frames");
+
+		gr::thread::scoped_lock lock(this->d_settings_mutex);
+		this->d_cap_target.clear();
+		return;
+	}
+
+	/* Stop or switch the current one */
+	if (this->d_capture &&
+	    ((this->d_capture->target() != target) || (this->d_capture->fps() != fps))) {
+		delete this->d_capture;
+		this->d_capture = NULL;
+	}
+
+	if (!target.empty() && !this->d_capture) {
+		try {
+			this->d_capture = new frame_capture(target, fps);
+		} catch (std::exception &e) {
+			GR_LOG_ERROR(d_logger, e.what());
+
+			gr::thread::scoped_lock lock(this->d_settings_mutex);
+			this->d_cap_target.clear();
+		}
+	}
+}
+
+void
+base_sink_c_impl::capture_stop(const char *reason)
+{
+	if (!this->d_capture)
+		return;
+
+	GR_LOG_INFO(d_logger, boost::format("Capture to %s stopped (%s), %d frames, %d dropped")
+		% this->d_capture->target() % reason
+		% this->d_capture->frames() % this->d_capture->dropped());
+
+	delete this->d_capture;
+	this->d_capture = NULL;
+
+	gr::thread::scoped_lock lock(this->d_settings_mutex);
+	this->d_cap_target.clear();
+}
+
+
+/*
+ * Frame pacing
+ *
+ * Sleep off the rest of the frame period. Idle iterations (nothing was
+ * drawn) still wait a full period, so a static or frozen display only
+ * polls for events and new data instead of redrawing the same frame.
+ */
+
+/*
+ * Stream tags retuning
+ *
+ * work() turns rx_freq / rx_rate tags into retunes positioned in the FIFO
+ * stream (ahead of the first whole row after the tagged sample) and the
+ * compute thread applies them when it gets there, before processing the
+ * spectra that follow. The core stamps each waterfall row with the range
+ * current when it's computed.
+ */
+
+void
+base_sink_c_impl::retune_queue(int n_taken, int n_written)
+{
+	static const pmt::pmt_t s_rx_freq = pmt::mp("rx_freq");
+	static const pmt::pmt_t s_rx_rate = pmt::mp("rx_rate");
+
+	const int chans = this->d_channels;
+	const int blk   = (chans > 1) ? this->d_fft_size : 1;
+	const uint64_t base = this->nitems_read(0);
+	std::vector<gr::tag_t> tags;
+
+	this->get_tags_in_range(tags, 0, base, base + n_taken);
+	if (tags.empty())
+		return;
+
+	gr::thread::scoped_lock lock(this->d_retune_mutex);
+
+	for (const gr::tag_t &tag : tags)
+	{
+		const bool is_freq = pmt::eq(tag.key, s_rx_freq);
+		const int64_t i = tag.offset - base;
+		uint64_t pos;
+
+		if ((!is_freq && !pmt::eq(tag.key, s_rx_rate)) || !pmt::is_number(tag.value))
+			continue;
+
+		/* Dropped samples: from the next ones written */
+		pos = this->d_fifo_wpos +
+			std::min(((i + blk - 1) / blk) * blk, (int64_t)n_written) * chans;
+
+		if (this->d_retunes.empty() || (this->d_retunes.back().pos != pos))
+			this->d_retunes.push_back(retune{ pos, NAN, NAN });
+
+		if (is_freq)
+			this->d_retunes.back().center = pmt::to_double(tag.value);
+		else
+			this->d_retunes.back().span   = pmt::to_double(tag.value);
+	}
+}
+
+/* Applies the retunes that are due, returns the FIFO items until the next
+ * one (-1 if none) */
+int64_t
+base_sink_c_impl::retune_apply()
+{
+	gr::thread::scoped_lock lock(this->d_retune_mutex);
+
+	while (!this->d_retunes.empty())
+	{
+		const retune &rt = this->d_retunes.front();
+		freq_range freq;
+
+		if (rt.pos > this->d_fifo_rpos)
+			return rt.pos - this->d_fifo_rpos;
+
+		{
+			gr::thread::scoped_lock lock(this->d_settings_mutex);
+			if (!isnan(rt.center))
+				this->d_frequency.center = rt.center;
+			if (!isnan(rt.span))
+				this->d_frequency.span   = rt.span;
+			freq = this->d_frequency;
+		}
+
+		this->d_retunes.pop_front();
+
+		/* A frozen display catches up when it resumes */
+		gr::thread::scoped_lock guard(this->d_fosphor_mutex);
+		if (this->d_fosphor && !this->d_frozen)
+			fosphor_set_frequency_range(this->d_fosphor,
+				freq.center,
+				freq.span * this->d_channels
+			);
+
+		/* The zoom and trigger bands follow from the render thread */
+		if (this->d_fosphor_zoom || this->d_trig_enabled)
+			this->settings_mark_changed(SETTING_FREQUENCY_RANGE);
+	}
+
+	return -1;
+}
+
+void
+base_sink_c_impl::displayed_frequency(struct fosphor *fosphor, double &center, double &span)
+{
+	if (fosphor_get_waterfall_frequency(fosphor, 0, &center, &span)) {
+		const freq_range freq = this->frequency();
+		center = freq.center;
+		span   = freq.span * this->d_channels;
+	}
+}
+
+base_sink_c_impl::freq_range
+base_sink_c_impl::frequency() const
+{
+	gr::thread::scoped_lock lock(this->d_settings_mutex);
+	return this->d_frequency;
+}
+
+
+void
+base_sink_c_impl::pacing_wait(double t_frame, bool drawn)
+{
+	double fps = this->d_pacing.max_fps;
+	double t_wait;
+
+	if (fps > 0.0)
+		t_wait = 1.0 / fps - (drawn ? t_frame : 0.0);
+	else
+		t_wait = drawn ? 0.0 : 1e-3;	/* Unlimited, but don't spin idle */
+
+	if (t_wait > 0.0)
+		boost::this_thread::sleep_for(
+			boost::chrono::microseconds((int64_t)(t_wait * 1e6)));
+}
+
+
+/*
+ * Adaptive batch scheduler
+ *
+ * We keep a running average of the cost of a spectrum in fosphor_process()
+ * and limit each compute pass to about one frame period worth of work, so
+ * the render thread gets to sync at the target rate. If the FIFO fills
+ * above the high water mark, we favor draining over frame rate.
+ */
+
+#define SCHED_ALPHA	0.1
+
+int
+base_sink_c_impl::sched_plan(int n_avail, int batch_max)
+{
+	const int batch_mult = 16;
+
+	double budget;
+	float fill;
+	int n;
+
+	/* Current FIFO fill */
+	fill = (float)this->d_fifo->used() / (float)this->d_fifo->free_max();
+	this->d_sched.fill = fill;
+
+	/* Processing time budget for this pass */
+	budget = 1.0 / this->d_sched.target_fps;
+
+	/* Number of spectra that fits in it */
+	if ((fill >= this->d_sched.high_water) || (this->d_sched.cost_spectrum <= 0.0))
+		n = n_avail;
+	else if (budget / this->d_sched.cost_spectrum < (double)n_avail)
+		n = (int)(budget / this->d_sched.cost_spectrum);
+	else
+		n = n_avail;
+
+	/* Always make some progress */
+	n &= ~(batch_mult - 1);
+	if (!n && (n_avail >= batch_mult))
+		n = batch_mult;
+
+	/* Use the largest batches we can, fewer calls are cheaper */
+	this->d_sched.batch_size = (n > batch_max) ? batch_max : (n ? n : batch_mult);
+
+	return n;
+}
+
+void
+base_sink_c_impl::sched_update_process(double t_spectrum)
+{
+	double c = this->d_sched.cost_spectrum;
+	this->d_sched.cost_spectrum = (c > 0.0) ?
+		(c + SCHED_ALPHA * (t_spectrum - c)) :
+		t_spectrum;
+}
+
+
+
+void
+base_sink_c_impl::settings_mark_changed(uint32_t setting)
+{
+	gr::thread::scoped_lock lock(this->d_settings_mutex);
+	this->d_settings_changed |= setting;
+}
+
+uint32_t
+base_sink_c_impl::settings_get_and_reset_changed(void)
+{
+	gr::thread::scoped_lock lock(this->d_settings_mutex);
+	uint32_t v = this->d_settings_changed;
+	this->d_settings_changed = 0;
+	return v;
+}
+
+void
+base_sink_c_impl::settings_apply(uint32_t settings)
+{
+	if (this->d_fosphor_next)
+	{
+		/* Prepared by core_prepare(), switch to it between two batches
+		 * (process() holds the lock for each) and reload everything
+		 * before it gets any. The previous one is released by render() */
+		this->zoom_fini();
+
+		/* The samples held for the old one are released on the
+		 * new one's count, it must be done with them */
+		fosphor_wait(this->d_fosphor);
+
+		std::swap(this->d_fosphor, this->d_fosphor_next);
+		this->d_fosphor_zoom      = this->d_fosphor_zoom_next;
+		this->d_fosphor_zoom_next = NULL;
+
+		settings |= ~(SETTING_DIMENSIONS | SETTING_FFT_SIZE | SETTING_DEVICE);
+	}
+
+	if (settings & (SETTING_AVERAGING | SETTING_WF_DECIMATION))
+	{
+		/* Instances using the fused kernels can't average / decimate,
+		 * render() had one without them prepared (see core_stale()).
+		 * If that failed, this one goes on without */
+		if (this->averaging_apply() == -ENOTSUP)
+			GR_LOG_WARN(d_logger, "Averaging / waterfall decimation not available, keeping the current instance");
+	}
+
+	if (settings & (SETTING_TRIGGER | SETTING_FREQUENCY_RANGE))
+	{
+		/* Same for the trigger (its band follows the span) */
+		if (this->trigger_apply() == -ENOTSUP)
+			GR_LOG_WARN(d_logger, "Burst trigger not available, keeping the current instance");
+	}
+
+	if (settings & SETTING_ZOOM_FFT)
+	{
+		/* The zoom instance comes and goes on its own (a re-init above
+		 * already took care of it) */
+		if (this->d_zoom_fft && !this->d_fosphor_zoom && !this->d_headless) {
+			gr::thread::scoped_lock guard(boot_lock());
+			this->d_fosphor_zoom = this->zoom_create();
+			if (this->d_fosphor_zoom)
+				settings |= SETTING_POWER_RANGE | SETTING_FFT_OVERLAP |
+				            SETTING_FFT_WINDOW | SETTING_RENDER_OPTIONS |
+				            SETTING_MAX_HOLD;
+		} else if (!this->d_zoom_fft && this->d_fosphor_zoom) {
+			this->zoom_fini();
+			settings |= SETTING_RENDER_OPTIONS;
+		}
+	}
+
+	if (settings & SETTING_DIMENSIONS)
+	{
+		this->glctx_update();
+
+		/* The core profile renderer projects from the viewport */
+		if (!fosphor_is_gl_core(this->d_fosphor)) {
+			glMatrixMode(GL_MODELVIEW);
+			glLoadIdentity();
+
+			glMatrixMode(GL_PROJECTION);
+			glLoadIdentity();
+			glOrtho(0.0, (double)this->d_width, 0.0, (double)this->d_height, -1.0, 1.0);
+		}
+
+		glViewport(0, 0, this->d_width, this->d_height);
+	}
+
+	if (settings & SETTING_POWER_RANGE) {
+		fosphor_set_power_range(this->d_fosphor,
+			this->d_db_ref,
+			this->k_db_per_div[this->d_db_per_div_idx]
+		);
+	}
+
+	if (settings & SETTING_FREQUENCY_RANGE) {
+		const freq_range freq = this->frequency();
+
+		fosphor_set_frequency_range(this->d_fosphor,
+			freq.center,
+			freq.span * this->d_channels
+		);
+	}
+
+	if (settings & SETTING_DETECTION) {
+		fosphor_set_detection(this->d_fosphor,
+			this->d_detect_peaks > 0,
+			this->d_detect_threshold
+		);
+	}
+
+	if (settings & SETTING_MAX_HOLD) {
+		if (fosphor_set_max_hold(this->d_fosphor, (int)this->d_max_hold) == -EIO)
+			GR_LOG_WARN(d_logger, "Unable to build the display kernel of that max hold mode");
+		fosphor_set_persistence(this->d_fosphor,
+			this->d_histo_rise, this->d_histo_decay, this->d_live_alpha);
+	}
+
+	if (settings & SETTING_RECORDING) {
+		this->recording_apply();
+	}
+
+	if (settings & SETTING_CAPTURE) {
+		this->capture_apply();
+	}
+
+	if (settings & SETTING_SNAPSHOTS) {
+		this->snapshot_apply();
+	}
+
+	if (settings & SETTING_FFT_OVERLAP) {
+		fosphor_set_fft_overlap(this->d_fosphor, this->d_overlap);
+	}
+
+	if (settings & SETTING_FFT_WINDOW) {
+		std::vector<float> window =
+			gr::fft::window::build(this->d_fft_window,
+				fosphor_get_fft_len(this->d_fosphor) / this->d_channels, 6.76);
+		fosphor_set_fft_window(this->d_fosphor, window.data());
+	}
+
+	if (settings & (SETTING_DIMENSIONS | SETTING_RENDER_OPTIONS))
+	{
+		float f;
+
+		if (this->d_zoom_enabled) {
+			int a = (int)(this->d_width * 0.65f);
+			this->d_render_main->width = a;
+			this->d_render_main->options |= FRO_CHANNELS;
+			this->d_render_main->options &= ~FRO_COLOR_SCALE;
+			this->d_render_zoom->pos_x = a - 10;
+			this->d_render_zoom->width = this->d_width - a + 10;
+		} else {
+			this->d_render_main->width = this->d_width;
+			this->d_render_main->options &= ~FRO_CHANNELS;
+			this->d_render_main->options |= FRO_COLOR_SCALE;
+		}
+
+		this->d_render_main->height = this->d_height;
+		this->d_render_zoom->height = this->d_height;
+
+		this->d_render_main->histo_wf_ratio = this->d_ratio;
+		this->d_render_zoom->histo_wf_ratio = this->d_ratio;
+
+		this->d_render_main->channels[0].enabled = this->d_zoom_enabled;
+		this->d_render_main->channels[0].center  = (float)this->d_zoom_center;
+		this->d_render_main->channels[0].width   = (float)this->d_zoom_width;
+
+		this->d_render_zoom->freq_center = (float)this->d_zoom_center;
+		this->d_render_zoom->freq_span   = (float)this->d_zoom_width;
+
+		fosphor_render_refresh(this->d_render_main);
+		fosphor_render_refresh(this->d_render_zoom);
+	}
+
+	this->zoom_apply(settings);
+
+	if (settings & SETTING_GPU_SCHED) {
+		this->gpu_sched_update();
+	}
+
+	this->memory_update();
+}
+
+/* Joins the scheduler of the instance device, again on a new instance or
+ * new parameters (fosphor lock held) */
+void
+base_sink_c_impl::gpu_sched_update()
+{
+	const void *dev = this->d_gpu_sched ? fosphor_get_device(this->d_fosphor) : NULL;
+	gpu_sched::client *c = this->d_gpu_client.get();
+
+	if (!dev) {
+		this->d_gpu_client.reset();
+		return;
+	}
+
+	if (c && (c->device() == dev) &&
+	    (c->weight() == this->d_gpu_weight) && (c->deadline() == this->d_gpu_deadline))
+		return;
+
+	this->d_gpu_client = std::make_shared<gpu_sched::client>(
+		gpu_sched::get(dev), this->d_gpu_weight, this->d_gpu_deadline);
+}
+
+void
+base_sink_c_impl::memory_update()
+{
+	size_t host, device, h, d;
+
+	host   = this->d_fifo->storage_size();
+	device = 0;
+
+	for (struct fosphor *f : { this->d_fosphor, this->d_fosphor_zoom }) {
+		if (!f)
+			continue;
+		fosphor_get_memory(f, &h, &d);
+		host   += h;
+		device += d;
+	}
+
+	this->d_mem_host   = host;
+	this->d_mem_device = device;
+}
+
+
+void
+base_sink_c_impl::cb_reshape(int width, int height)
+{
+	this->d_width    = width;
+	this->d_height   = height;
+	this->settings_mark_changed(SETTING_DIMENSIONS);
+}
+
+void
+base_sink_c_impl::cb_visibility(bool visible)
+{
+	gr::thread::scoped_lock guard(this->d_render_mutex);
+	this->d_visible = visible;
+	this->d_pacing.redraw = true;
+}
+
+void
+base_sink_c_impl::cb_expose()
+{
+	this->d_pacing.redraw = true;
+}
+
+
+void
+base_sink_c_impl::execute_ui_action(enum ui_action_t action)
+{
+	switch (action) {
+	case DB_PER_DIV_UP:
+		if (this->d_db_per_div_idx < 4)
+			this->d_db_per_div_idx++;
+		break;
+
+	case DB_PER_DIV_DOWN:
+		if (this->d_db_per_div_idx > 0)
+			this->d_db_per_div_idx--;
+		break;
+
+	case REF_UP:
+		this->d_db_ref += k_db_per_div[this->d_db_per_div_idx];
+		break;
+
+	case REF_DOWN:
+		this->d_db_ref -= k_db_per_div[this->d_db_per_div_idx];
+		break;
+
+	case ZOOM_TOGGLE:
+		this->d_zoom_enabled ^= 1;
+		break;
 
 	case ZOOM_WIDTH_UP:
 		if (this->d_zoom_enabled)
 			this->d_zoom_width *= 2.0;
 		break;
 
-	case ZOOM_WIDTH_DOWN:
-		if (this->d_zoom_enabled)
-			this->d_zoom_width /= 2.0;
-		break;
+	case ZOOM_WIDTH_DOWN:
+		if (this->d_zoom_enabled)
+			this->d_zoom_width /= 2.0;
+		break;
+
+	case ZOOM_CENTER_UP:
+		if (this->d_zoom_enabled)
+			this->d_zoom_center += this->d_zoom_width / 8.0;
+		break;
+
+	case ZOOM_CENTER_DOWN:
+		if (this->d_zoom_enabled)
+			this->d_zoom_center -= this->d_zoom_width / 8.0;
+		break;
+
+	case RATIO_UP:
+		if (this->d_ratio < 0.8f)
+			this->d_ratio += 0.05f;
+		break;
+
+	case RATIO_DOWN:
+		if (this->d_ratio > 0.2f)
+			this->d_ratio -= 0.05f;
+		break;
+
+	case FREEZE_TOGGLE:
+		this->d_frozen ^= 1;
+		this->settings_mark_changed(SETTING_FREQUENCY_RANGE);
+		break;
+	}
+
+	this->settings_mark_changed(
+		SETTING_POWER_RANGE |
+		SETTING_RENDER_OPTIONS
+	);
+}
+
+void
+base_sink_c_impl::execute_mouse_action(enum mouse_action_t action, int x, int y)
+{
+	if (action != CLICK)
+		return;
+
+	/* Identify position */
+	int in_main = fosphor_render_pos_inside(this->d_render_main, x, y);
+	int in_zoom = this->d_zoom_enabled ? fosphor_render_pos_inside(this->d_render_zoom, x, y) : 0;
+
+	/* Send frequency */
+	if (in_main & 1)
+	{
+		double freq = fosphor_pos2freq(this->d_fosphor, this->d_render_main, x);
+		message_port_pub(pmt::mp("freq"), pmt::cons(pmt::mp("freq"), pmt::from_double(freq)));
+	}
+	else if (in_zoom & 1)
+	{
+		double freq = fosphor_pos2freq(
+			this->d_zoom_decim ? this->d_fosphor_zoom : this->d_fosphor,
+			this->d_render_zoom, x);
+		message_port_pub(pmt::mp("freq"), pmt::cons(pmt::mp("freq"), pmt::from_double(freq)));
+	}
+}
+
+void
+base_sink_c_impl::set_frequency_range(const double center, const double span)
+{
+	{
+		gr::thread::scoped_lock lock(this->d_settings_mutex);
+		this->d_frequency.center = center;
+		this->d_frequency.span   = span;
+	}
+	this->settings_mark_changed(SETTING_FREQUENCY_RANGE);
+}
+
+void
+base_sink_c_impl::set_frequency_center(const double center)
+{
+	{
+		gr::thread::scoped_lock lock(this->d_settings_mutex);
+		this->d_frequency.center = center;
+	}
+	this->settings_mark_changed(SETTING_FREQUENCY_RANGE);
+}
+
+void
+base_sink_c_impl::set_frequency_span(const double span)
+{
+	{
+		gr::thread::scoped_lock lock(this->d_settings_mutex);
+		this->d_frequency.span   = span;
+	}
+	this->settings_mark_changed(SETTING_FREQUENCY_RANGE);
+}
+
+void
+base_sink_c_impl::set_frequency_tags(const bool enable)
+{
+	this->d_freq_tags = enable;
+}
+
+bool
+base_sink_c_impl::frequency_tags() const
+{
+	return this->d_freq_tags;
+}
+
+void
+base_sink_c_impl::set_fft_window(const gr::fft::window::win_type win)
+{
+	if (win == this->d_fft_window)	/* Reloading FFT window takes time */
+		return;			/* avoid doing it if possible */
+
+	this->d_fft_window = win;
+	this->settings_mark_changed(SETTING_FFT_WINDOW);
+}
+
+void
+base_sink_c_impl::set_overflow_policy(const overflow_policy_t policy)
+{
+	this->d_overflow_policy = policy;
+}
+
+base_sink_c::overflow_policy_t
+base_sink_c_impl::overflow_policy() const
+{
+	return this->d_overflow_policy;
+}
+
+uint64_t
+base_sink_c_impl::dropped_samples() const
+{
+	return this->d_dropped.load();
+}
+
+void
+base_sink_c_impl::set_target_fps(const double fps)
+{
+	if (fps > 0.0)
+		this->d_sched.target_fps = fps;
+}
+
+void
+base_sink_c_impl::set_max_fps(const double fps)
+{
+	this->d_pacing.max_fps = fps;
+}
+
+double
+base_sink_c_impl::max_fps() const
+{
+	return this->d_pacing.max_fps.load();
+}
+
+void
+base_sink_c_impl::set_worker_affinity(const std::vector<int> &cpus)
+{
+	{
+		gr::thread::scoped_lock lock(this->d_settings_mutex);
+		this->d_cpu_affinity = cpus;
+	}
+
+	this->d_thread_cfg++;
+}
+
+std::vector<int>
+base_sink_c_impl::worker_affinity() const
+{
+	gr::thread::scoped_lock lock(this->d_settings_mutex);
+	return this->d_cpu_affinity;
+}
+
+void
+base_sink_c_impl::set_worker_priority(const int priority)
+{
+	this->d_rt_priority = std::max(0, std::min(priority, 99));
+	this->d_thread_cfg++;
+}
+
+int
+base_sink_c_impl::worker_priority() const
+{
+	return this->d_rt_priority;
+}
+
+void
+base_sink_c_impl::set_gpu_scheduling(const bool enable, const double weight,
+                                     const double deadline)
+{
+	if (!(weight > 0.0) || !(deadline >= 0.0))
+		return;
+
+	this->d_gpu_sched    = enable;
+	this->d_gpu_weight   = weight;
+	this->d_gpu_deadline = deadline;
+	this->settings_mark_changed(SETTING_GPU_SCHED);
+}
+
+bool
+base_sink_c_impl::gpu_scheduling() const
+{
+	return this->d_gpu_sched;
+}
+
+double
+base_sink_c_impl::gpu_time() const
+{
+	return this->d_gpu_time;
+}
+
+void
+base_sink_c_impl::set_profiling(const bool enable)
+{
+	if (enable == this->d_profiling)
+		return;
+
+	this->d_profiling = enable;
+	this->settings_mark_changed(SETTING_PROFILING);
+
+	gr::thread::scoped_lock lock(this->d_settings_mutex);
+	this->d_profile.clear();
+}
+
+std::vector<double>
+base_sink_c_impl::profile() const
+{
+	gr::thread::scoped_lock lock(this->d_settings_mutex);
+	return this->d_profile;
+}
+
+void
+base_sink_c_impl::set_detection(const float threshold, const int max_peaks)
+{
+	this->d_detect_threshold = threshold;
+	this->d_detect_peaks     = std::max(0, std::min(max_peaks, FOSPHOR_DETECT_MAX));
+	this->settings_mark_changed(SETTING_DETECTION);
+}
+
+int
+base_sink_c_impl::detection_peaks() const
+{
+	return this->d_detect_peaks;
+}
+
+void
+base_sink_c_impl::set_trigger(const bool enable,
+                              const double f_lo, const double f_hi,
+                              const float threshold, const trigger_action_t action,
+                              const int pre, const int post)
+{
+	if (enable && !(f_lo < f_hi)) {
+		GR_LOG_WARN(d_logger, "Trigger band must have f_lo < f_hi");
+		return;
+	}
+
+	this->d_trig_lo        = f_lo;
+	this->d_trig_hi        = f_hi;
+	this->d_trig_threshold = threshold;
+	this->d_trig_action    = action;
+	this->d_trig_pre       = std::max(0, std::min(pre,  TRIG_LENGTH_MAX));
+	this->d_trig_post      = std::max(0, std::min(post, TRIG_LENGTH_MAX));
+	this->d_trig_enabled   = enable;
+
+	if (enable && (action == TRIGGER_CAPTURE) && (this->d_channels > 1))
+		GR_LOG_WARN(d_logger, "Trigger capture needs a single channel, only publishing the events");
+
+	this->settings_mark_changed(SETTING_TRIGGER);
+}
+
+uint64_t
+base_sink_c_impl::trigger_count() const
+{
+	return this->d_trig_count;
+}
+
+void
+base_sink_c_impl::set_recording(const std::string &path,
+                                const bool live, const bool max_hold)
+{
+	{
+		gr::thread::scoped_lock lock(this->d_settings_mutex);
+		this->d_rec_path  = path;
+		this->d_rec_flags = (live     ? recorder::REC_LIVE     : 0) |
+		                    (max_hold ? recorder::REC_MAX_HOLD : 0);
+	}
+
+	this->settings_mark_changed(SETTING_RECORDING);
+}
+
+std::string
+base_sink_c_impl::recording() const
+{
+	gr::thread::scoped_lock lock(this->d_settings_mutex);
+	return this->d_rec_path;
+}
+
+void
+base_sink_c_impl::set_capture(const std::string &target, const double fps)
+{
+	{
+		gr::thread::scoped_lock lock(this->d_settings_mutex);
+		this->d_cap_target = target;
+		this->d_cap_fps    = fps;
+	}
+
+	this->settings_mark_changed(SETTING_CAPTURE);
+}
+
+std::string
+base_sink_c_impl::capture() const
+{
+	gr::thread::scoped_lock lock(this->d_settings_mutex);
+	return this->d_cap_target;
+}
+
+void
+base_sink_c_impl::set_snapshots(const bool enable)
+{
+	this->d_snap_enabled = enable;
+	this->settings_mark_changed(SETTING_SNAPSHOTS);
+}
+
+bool
+base_sink_c_impl::snapshots() const
+{
+	return this->d_snap_enabled;
+}
 
-	case ZOOM_CENTER_UP:
-		if (this->d_zoom_enabled)
-			this->d_zoom_center += this->d_zoom_width / 8.0;
-		break;
+uint64_t
+base_sink_c_impl::snapshot_seq() const
+{
+	this->d_snap_wanted.store(true, std::memory_order_relaxed);
+	return this->d_snap_seq.load(std::memory_order_acquire);
+}
 
-	case ZOOM_CENTER_DOWN:
-		if (this->d_zoom_enabled)
-			this->d_zoom_center -= this->d_zoom_width / 8.0;
-		break;
+std::shared_ptr<base_sink_c::snapshot_t>
+base_sink_c_impl::snapshot() const
+{
+	this->d_snap_wanted.store(true, std::memory_order_relaxed);
 
-	case RATIO_UP:
-		if (this->d_ratio < 0.8f)
-			this->d_ratio += 0.05f;
-		break;
+	gr::thread::scoped_lock lock(this->d_snap_mutex);
+	return this->d_snap_front;
+}
 
-	case RATIO_DOWN:
-		if (this->d_ratio > 0.2f)
-			this->d_ratio -= 0.05f;
-		break;
+void
+base_sink_c_impl::set_fifo_high_water(const float level)
+{
+	if ((level > 0.0f) && (level <= 1.0f))
+		this->d_sched.high_water = level;
+}
 
-	case FREEZE_TOGGLE:
-		this->d_frozen ^= 1;
-		break;
-	}
+void
+base_sink_c_impl::set_fifo_latency(const double sample_rate, const double latency)
+{
+	this->d_fifo_rate    = std::max(0.0, sample_rate);
+	this->d_fifo_latency = std::max(0.0, latency);
 
-	this->settings_mark_changed(
-		SETTING_POWER_RANGE |
-		SETTING_RENDER_OPTIONS
-	);
+	/* The FIFO is only replaced while stopped */
+	if (this->d_active && (this->fifo_length(this->row_len()) != this->d_fifo->free_max() + 1))
+		GR_LOG_INFO(d_logger, "New FIFO size used from the next restart");
+}
+
+int
+base_sink_c_impl::fifo_size() const
+{
+	return this->d_fifo->free_max() + 1;
 }
 
 void
-base_sink_c_impl::execute_mouse_action(enum mouse_action_t action, int x, int y)
+base_sink_c_impl::set_max_batch(const int spectra)
 {
-	if (action != CLICK)
+	this->d_max_batch = std::max(0, spectra);
+	this->settings_mark_changed(SETTING_BUFFERING);
+}
+
+int
+base_sink_c_impl::max_batch() const
+{
+	return this->d_max_batch;
+}
+
+std::vector<uint64_t>
+base_sink_c_impl::memory_usage() const
+{
+	return { this->d_mem_host.load(), this->d_mem_device.load() };
+}
+
+float
+base_sink_c_impl::fifo_fill() const
+{
+	return this->d_sched.fill.load();
+}
+
+int
+base_sink_c_impl::batch_size() const
+{
+	return this->d_sched.batch_size.load();
+}
+
+int
+base_sink_c_impl::batch_count() const
+{
+	return this->d_sched.batch_count.load();
+}
+
+void
+base_sink_c_impl::overflow_report(int dropped)
+{
+	/* Only report the start and the end of each overflow run */
+	if ((dropped > 0) == this->d_overflowing)
 		return;
 
-	/* Identify position */
-	int in_main = fosphor_render_pos_inside(this->d_render_main, x, y);
-	int in_zoom = this->d_zoom_enabled ? fosphor_render_pos_inside(this->d_render_zoom, x, y) : 0;
+	this->d_overflowing = (dropped > 0);
 
-	/* Send frequency */
-	if (in_main & 1)
-	{
-		double freq = fosphor_pos2freq(this->d_fosphor, this->d_render_main, x);
-		message_port_pub(pmt::mp("freq"), pmt::cons(pmt::mp("freq"), pmt::from_double(freq)));
+	pmt::pmt_t msg = pmt::make_dict();
+	msg = pmt::dict_add(msg, pmt::mp("overflow"), pmt::from_bool(this->d_overflowing));
+	msg = pmt::dict_add(msg, pmt::mp("offset"),   pmt::from_uint64(this->nitems_read(0)));
+	msg = pmt::dict_add(msg, pmt::mp("dropped"),  pmt::from_uint64(this->d_dropped.load()));
+
+	message_port_pub(pmt::mp("overflow"), msg);
+}
+
+
+void
+base_sink_c_impl::set_fft_size(const int size)
+{
+	if (size == this->d_fft_size)
+		return;
+
+	/* The instance takes size * channels bins */
+	if (!fosphor_fft_len_validate(size) || !fosphor_fft_len_validate(size * this->d_channels)) {
+		GR_LOG_ERROR(d_logger, boost::format("FFT size %d unsupported with %d channel(s)") % size % this->d_channels);
+		return;
 	}
-	else if (in_zoom & 1)
+
+	/* And by the device we're running on, if any yet */
 	{
-		double freq = fosphor_pos2freq(this->d_fosphor, this->d_render_zoom, x);
-		message_port_pub(pmt::mp("freq"), pmt::cons(pmt::mp("freq"), pmt::from_double(freq)));
+		gr::thread::scoped_lock guard(this->d_fosphor_mutex);
+
+		if (this->d_fosphor &&
+		    fosphor_fft_len_check(this->d_fosphor, size, this->display_len(size * this->d_channels))) {
+			GR_LOG_ERROR(d_logger, boost::format("FFT size %d exceeds the device limits") % size);
+			return;
+		}
+	}
+
+	/* The FIFO can only grow while stopped */
+	if (this->d_active && (this->fifo_length(size * this->d_channels) > this->d_fifo->free_max() + 1)) {
+		GR_LOG_ERROR(d_logger, boost::format("FFT size %d can only be used after a restart") % size);
+		return;
 	}
+
+	if (this->d_channels > 1)
+		this->set_output_multiple(size);
+
+	this->d_fft_size = size;
+	this->settings_mark_changed(SETTING_FFT_SIZE);
 }
 
+
 void
-base_sink_c_impl::set_frequency_range(const double center, const double span)
+base_sink_c_impl::set_overlap(const int overlap)
 {
-	this->d_frequency.center = center;
-	this->d_frequency.span   = span;
-	this->settings_mark_changed(SETTING_FREQUENCY_RANGE);
+	if (overlap == this->d_overlap)
+		return;
+
+	if ((this->d_channels > 1) && (overlap != 1)) {
+		GR_LOG_ERROR(d_logger, "FFT overlap isn't available with several channels");
+		return;
+	}
+
+	if ((overlap >= 1) && (overlap <= 16) && !(overlap & (overlap - 1))) {
+		this->d_overlap = overlap;
+		this->settings_mark_changed(SETTING_FFT_OVERLAP);
+	}
+}
+
+int
+base_sink_c_impl::overlap() const
+{
+	return this->d_overlap;
 }
 
 void
-base_sink_c_impl::set_frequency_center(const double center)
+base_sink_c_impl::set_averaging(const int count, const averaging_t mode,
+                                const bool log_domain)
 {
-	this->d_frequency.center = center;
-	this->settings_mark_changed(SETTING_FREQUENCY_RANGE);
+	if ((count < 1) || (count > FOSPHOR_AVG_MAX))
+		return;
+
+	this->d_avg_count = count;
+	this->d_avg_mode  = mode;
+	this->d_avg_log   = log_domain;
+	this->settings_mark_changed(SETTING_AVERAGING);
+}
+
+int
+base_sink_c_impl::averaging() const
+{
+	return this->d_avg_count;
+}
+
+int
+base_sink_c_impl::averaging_apply()
+{
+	int mode, rv;
+
+	switch (this->d_avg_mode) {
+	case AVG_RMS:  mode = FOSPHOR_AVG_RMS;  break;
+	case AVG_PEAK: mode = FOSPHOR_AVG_PEAK; break;
+	default:       mode = FOSPHOR_AVG_MEAN; break;
+	}
+
+	if (this->d_avg_log)
+		mode |= FOSPHOR_AVG_LOG;
+
+	rv = fosphor_set_averaging(this->d_fosphor, this->d_avg_count, mode);
+	if (rv)
+		return rv;
+
+	return fosphor_set_waterfall_decimation(this->d_fosphor, this->d_wf_decim);
 }
 
 void
-base_sink_c_impl::set_frequency_span(const double span)
+base_sink_c_impl::set_waterfall_depth(const int rows)
 {
-	this->d_frequency.span   = span;
-	this->settings_mark_changed(SETTING_FREQUENCY_RANGE);
+	if (rows == this->d_wf_depth)
+		return;
+
+	if (!fosphor_wf_depth_validate(rows))
+		return;
+
+	this->d_wf_depth = rows;
+	this->settings_mark_changed(SETTING_WF_DEPTH);
+}
+
+int
+base_sink_c_impl::waterfall_depth() const
+{
+	return this->d_wf_depth;
 }
 
 void
-base_sink_c_impl::set_fft_window(const gr::fft::window::win_type win)
+base_sink_c_impl::set_waterfall_decimation(const int decim)
 {
-	if (win == this->d_fft_window)	/* Reloading FFT window takes time */
-		return;			/* avoid doing it if possible */
+	if ((decim < 1) || (decim > FOSPHOR_AVG_MAX))
+		return;
 
-	this->d_fft_window = win;
-	this->settings_mark_changed(SETTING_FFT_WINDOW);
+	this->d_wf_decim = decim;
+	this->settings_mark_changed(SETTING_WF_DECIMATION);
+}
+
+int
+base_sink_c_impl::waterfall_decimation() const
+{
+	return this->d_wf_decim;
 }
 
 void
-base_sink_c_impl::set_fft_size(const int size)
+base_sink_c_impl::set_max_hold(const max_hold_t mode)
 {
-	if (size == this->d_fft_size)
+	if ((mode < MAX_HOLD_DECAY) || (mode > MAX_HOLD_HISTO))
+		return;
+
+	this->d_max_hold = mode;
+	this->settings_mark_changed(SETTING_MAX_HOLD);
+}
+
+base_sink_c::max_hold_t
+base_sink_c_impl::max_hold() const
+{
+	return this->d_max_hold;
+}
+
+void
+base_sink_c_impl::set_persistence(const float histo_rise, const float histo_decay,
+                                  const float live_alpha)
+{
+	if (!(histo_rise > 0.0f) || !(histo_decay > 0.0f) ||
+	    !(live_alpha > 0.0f) || (live_alpha > 1.0f))
+		return;
+
+	this->d_histo_rise  = histo_rise;
+	this->d_histo_decay = histo_decay;
+	this->d_live_alpha  = live_alpha;
+	this->settings_mark_changed(SETTING_MAX_HOLD);
+}
+
+void
+base_sink_c_impl::set_histogram_bins(const int bins)
+{
+	if (bins == this->d_histo_bins)
+		return;
+
+	if (!fosphor_histo_bins_validate(bins))
+		return;
+
+	this->d_histo_bins = bins;
+	this->settings_mark_changed(SETTING_HISTO_BINS);
+}
+
+int
+base_sink_c_impl::histogram_bins() const
+{
+	return this->d_histo_bins;
+}
+
+void
+base_sink_c_impl::set_half_precision(const bool enable)
+{
+	if (enable == this->d_half)
+		return;
+
+	this->d_half = enable;
+	this->settings_mark_changed(SETTING_HALF);
+}
+
+bool
+base_sink_c_impl::half_precision() const
+{
+	return this->d_half;
+}
+
+/* Waterfall & histogram width for the current view (0 = all the bins) */
+int
+base_sink_c_impl::display_len(int row_len) const
+{
+	int main_w, len;
+
+	if (!this->d_disp_red || this->d_headless || (this->d_width <= 0))
+		return 0;
+
+	/* Same split as the renders (see settings_apply) */
+	main_w = this->d_zoom_enabled ? (int)(this->d_width * 0.65f) : this->d_width;
+
+	len = fosphor_display_len_select(row_len, main_w, 1.0f);
+
+	if (this->d_zoom_enabled)
+		len = std::max(len, fosphor_display_len_select(row_len,
+			this->d_width - main_w + 10, (float)this->d_zoom_width));
+
+	return len;
+}
+
+void
+base_sink_c_impl::set_display_reduction(const bool enable, const averaging_t mode)
+{
+	if ((enable == this->d_disp_red) && (mode == this->d_disp_red_mode))
+		return;
+
+	this->d_disp_red      = enable;
+	this->d_disp_red_mode = mode;
+	this->settings_mark_changed(SETTING_DISP_REDUCTION);
+}
+
+int
+base_sink_c_impl::display_width() const
+{
+	return this->d_disp_len_cur ? this->d_disp_len_cur : this->row_len();
+}
+
+void
+base_sink_c_impl::set_zoom_fft(const bool enable)
+{
+	if (enable == this->d_zoom_fft)
 		return;
 
-	if (size == 512 || size == 1024 || size == 2048 || 
-	    size == 4096 || size == 8192 || size == 16384 || size == 32768) {
-		this->d_fft_size = size;
-		this->settings_mark_changed(SETTING_FFT_SIZE);
+	this->d_zoom_fft = enable;
+	this->settings_mark_changed(SETTING_ZOOM_FFT);
+}
+
+bool
+base_sink_c_impl::zoom_fft() const
+{
+	return this->d_zoom_fft;
+}
+
+void
+base_sink_c_impl::set_device(const std::string &selector)
+{
+	/* Selected before start: get it ready while the rest of the flowgraph
+	 * is built */
+	if (!this->d_active)
+		this->d_warmup = warmup_async(selector, this->d_headless);
+
+	{
+		gr::thread::scoped_lock lock(this->d_settings_mutex);
+		if (selector == this->d_device)
+			return;
+		this->d_device = selector;
 	}
+
+	this->settings_mark_changed(SETTING_DEVICE);
+}
+
+std::string
+base_sink_c_impl::device() const
+{
+	gr::thread::scoped_lock lock(this->d_settings_mutex);
+	return this->d_device;
 }
 
 
@@ -456,36 +2736,151 @@ base_sink_c_impl::work(
 	gr_vector_const_void_star &input_items,
 	gr_vector_void_star &output_items)
 {
-	const gr_complex *in = (const gr_complex *) input_items[0];
-	gr_complex *dst;
-	int l, mw;
-
-	/* How much can we hope to write */
-	l = noutput_items;
+	const int chans = this->d_channels;
+	const int blk   = (chans > 1) ? this->d_fft_size : 1;	/* Items per channel block */
+	const int row   = blk * chans;
+	/* Nothing to block on while no one drains the FIFO (still waiting
+	 * for the GUI, or init failed) */
+	const bool blocking = (this->d_overflow_policy == OVERFLOW_BLOCK) && this->d_consuming;
+	char *dst;
+	int l, mw, drop = 0, short_by = 0;
+	int skipped = this->d_retune_dropped.exchange(0);
+
+	/* How much can we hope to write (FIFO items, whole blocks of each
+	 * channel in turn) */
+	l = (noutput_items - noutput_items % blk) * chans;
 	mw = this->d_fifo->write_max_size();
 
 	if (l > mw)
-		l = mw;
-	if (!l)
-		return 0;
+		l = mw - mw % row;
+
+	/* If we're not allowed to block, whatever doesn't fit is dropped */
+	if (!blocking) {
+		int f = this->d_fifo->free();
+
+		f -= f % row;
+
+		if (l > f) {
+			short_by = l - f;
+			l = f;
+
+			if (this->d_overflow_policy == OVERFLOW_DROP_OLDEST) {
+				/* Ask the render thread to make room by dropping
+				 * whole batches of old data (it counts them). The
+				 * input that didn't fit stays for the next call */
+				int bl = 16 * this->row_len();
+				this->d_fifo->drop_request((short_by + bl - 1) & ~(bl - 1));
+			} else {
+				drop = short_by;
+				this->d_dropped += drop;
+			}
+		}
+	}
 
-	/* Get a pointer */
-	dst = this->d_fifo->write_prepare(l, true);
-	if (!dst)
-		return 0;
+	/* (Samples skipped at retunes are already counted) */
+	this->overflow_report(short_by + skipped);
+
+	if (l) {
+		/* Get a pointer */
+		dst = (char *) this->d_fifo->write_prepare(l, blocking);
+		if (!dst)
+			l = 0;
+	}
+
+	/* Frequency changes, positioned in the FIFO stream */
+	if (this->d_freq_tags)
+		this->retune_queue((l + drop) / chans, l / chans);
+
+	if (l) {
+		/* Do the copy. Channels are stored from the middle one so they
+		 * come out in order once the display centers the row */
+		if (chans == 1) {
+			memcpy(dst, input_items[0], this->d_item_size * l);
+		} else {
+			const size_t bs = this->d_item_size * blk;
+
+			for (int b=0; b<l/row; b++)
+				for (int s=0; s<chans; s++)
+					memcpy(dst + bs * (b * chans + s),
+					       (const char *)input_items[(s + chans / 2) % chans] + bs * b,
+					       bs);
+		}
+
+		this->d_fifo->write_commit(l);
+		this->d_fifo_wpos += l;
+	}
+
+	/* Report what we took (including what we dropped) */
+	return (l + drop) / chans;
+}
+
+/* Applies the scheduling settings to the calling thread if they changed
+ * since it last did (nothing is touched until they're first set) */
+void
+base_sink_c_impl::thread_config(unsigned int &applied)
+{
+	const unsigned int cfg = this->d_thread_cfg;
+	std::vector<int> cpus;
+
+	if (cfg == applied)
+		return;
+
+	applied = cfg;
 
-	/* Do the copy */
-	memcpy(dst, in, sizeof(gr_complex) * l);
-	this->d_fifo->write_commit(l);
+	{
+		gr::thread::scoped_lock lock(this->d_settings_mutex);
+		cpus = this->d_cpu_affinity;
+	}
+
+	if (cpus.empty())
+		gr::thread::thread_unbind();
+	else
+		gr::thread::thread_bind_to_processor(cpus);
+
+#ifndef _WIN32
+	{
+		struct sched_param param;
+		int prio = this->d_rt_priority;
+
+		param.sched_priority = prio;
+
+		if (pthread_setschedparam(pthread_self(), prio ? SCHED_FIFO : SCHED_OTHER, &param))
+			GR_LOG_WARN(d_logger, boost::format("Unable to set real-time priority %d") % prio);
+	}
+#else
+	if (this->d_rt_priority)
+		GR_LOG_WARN(d_logger, "Real-time priority not supported on this platform");
+#endif
+}
 
-	/* Report what we took */
-	return l;
+/* Has the FIFO pages allocated on the NUMA node of the worker CPUs */
+static void
+fifo_place(fifo *f, std::vector<int> cpus)
+{
+	gr::thread::thread_bind_to_processor(cpus);
+	f->prefault();
 }
 
 bool base_sink_c_impl::start()
 {
 	bool rv = base_sink_c::start();
 	if (!this->d_active) {
+		/* Resize the FIFO for large FFTs or the latency budget,
+		 * nothing's using it yet */
+		if (this->fifo_length(this->row_len()) != this->d_fifo->free_max() + 1) {
+			delete this->d_fifo;
+			this->d_fifo = new fifo(this->fifo_length(this->row_len()), this->d_item_size);
+			this->d_fifo_rpos = this->d_fifo_wpos;
+			this->d_fifo_holds.clear();
+		}
+
+		/* From the worker CPUs, before anything else writes it */
+		{
+			std::vector<int> cpus = this->worker_affinity();
+			if (!cpus.empty())
+				gr::thread::thread(fifo_place, this->d_fifo, cpus).join();
+		}
+
 		this->d_active = true;
 		this->d_worker = gr::thread::thread(_worker, this);
 	}
@@ -499,6 +2894,10 @@ bool base_sink_c_impl::stop()
 		this->d_active = false;
 		this->d_worker.join();
 	}
+	if (this->d_warmup.valid()) {
+		this->d_warmup.wait();
+		this->d_warmup = std::shared_future<bool>();
+	}
 	return rv;
 }
 
@@ -11,10 +11,19 @@
 
 #include <stdint.h>
 
+#include <atomic>
+#include <deque>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
 #include <gnuradio/thread/thread.h>
 
 #include <gnuradio/fosphor/base_sink_c.h>
 
+#include "gpu_sched.h"
+
 struct fosphor;
 struct fosphor_render;
 
@@ -22,6 +31,8 @@ namespace gr {
   namespace fosphor {
 
     class fifo;
+    class frame_capture;
+    class recorder;
 
     /*!
      * \brief Base class for fosphor sink implementation
@@ -30,7 +41,7 @@ namespace gr {
     class base_sink_c_impl : virtual public base_sink_c
     {
      private:
-      /* Worker thread */
+      /* Worker thread (GL context, settings & display) */
       gr::thread::thread d_worker;
       bool d_visible;
       bool d_active;
@@ -41,16 +52,220 @@ namespace gr {
 
       gr::thread::mutex d_render_mutex;
 
+      /* Compute thread (feeds fosphor_process) */
+      gr::thread::thread d_compute;
+
+      void compute();
+      static void _compute(base_sink_c_impl *obj);
+
+      gr::thread::mutex d_fosphor_mutex;
+
       /* fosphor core */
+      const input_format_t d_input_format;
+      const size_t d_item_size;
       fifo *d_fifo;
+      double d_fifo_rate;		/* Latency budget, 0: default size */
+      double d_fifo_latency;
+
+      int fifo_length(int row_len) const;
+
+      int d_max_batch;			/* 0: library default */
+      int d_max_batch_cur;		/* The instance was created with */
+
+      std::atomic<uint64_t> d_mem_host;	/* As of the last settings change */
+      std::atomic<uint64_t> d_mem_device;
+
+      void memory_update();
 
       struct fosphor *d_fosphor;
       struct fosphor_render *d_render_main;
       struct fosphor_render *d_render_zoom;
 
-      void render();
+      bool core_init();
+      void core_fini();
+
+      /* hot reconfiguration, the next instance until it's switched to
+       * (and the previous one until released) */
+      struct fosphor *d_fosphor_next;
+      struct fosphor *d_fosphor_zoom_next;
+
+      struct fosphor *core_create();
+      bool core_prepare();
+      bool core_fusable() const;
+      bool core_stale(uint32_t settings);
+      void core_revert();
+
+      /* zoom FFT, an instance fed with the zoom band of the main one */
+      struct fosphor *d_fosphor_zoom;	/* NULL: magnifying the main one */
+      int d_zoom_decim;			/* 0: not configured yet */
+      double d_zoom_center_cur;		/* Band the DDC is on */
+      std::vector<gr_complex> d_zoom_samples;
+
+      struct fosphor *zoom_create();
+      void zoom_fini();
+      void zoom_apply(uint32_t settings);
+      void zoom_feed();
+
+      int  process();
+      bool render();
 
       static gr::thread::mutex s_boot_mutex;
+      static gr::thread::scoped_lock boot_lock();
+      static std::shared_future<bool> warmup_async(const std::string &device, bool headless);
+
+      friend class base_sink_c;
+
+      /* overflow handling */
+      overflow_policy_t d_overflow_policy;
+      std::atomic<uint64_t> d_dropped;
+      bool d_overflowing;
+      std::atomic<bool> d_consuming;	/* Compute thread draining the FIFO */
+      std::atomic<int> d_retune_dropped;	/* Skipped at retunes, not reported yet */
+
+      void overflow_report(int dropped);
+
+      /* adaptive batch scheduler */
+      struct {
+        double target_fps;
+        float  high_water;		/* FIFO fill ratio forcing a drain */
+        double cost_spectrum;		/* Averaged, seconds / spectrum */
+        std::atomic<float> fill;	/* Monitoring */
+        std::atomic<int>   batch_size;	/* Spectra per fosphor_process */
+        std::atomic<int>   batch_count;	/* fosphor_process per frame */
+      } d_sched;
+
+      int  sched_plan(int n_avail, int batch_max);
+      void sched_update_process(double t_spectrum);
+
+      /* frame pacing */
+      struct {
+        std::atomic<double> max_fps;	/* <= 0: unlimited */
+        std::atomic<bool>   redraw;	/* Forced by expose / visibility */
+      } d_pacing;
+
+      void pacing_wait(double t_frame, bool drawn);
+
+      /* worker threads scheduling, applied by each to itself */
+      std::vector<int> d_cpu_affinity;	/* Under d_settings_mutex, empty: any */
+      std::atomic<int> d_rt_priority;	/* 0: default scheduling */
+      std::atomic<unsigned int> d_thread_cfg;	/* Bumped at each change */
+
+      void thread_config(unsigned int &applied);
+
+      /* device fair share with the other sinks on it */
+      bool d_gpu_sched;
+      double d_gpu_weight;
+      double d_gpu_deadline;		/* s, 0: none */
+      std::shared_ptr<gpu_sched::client> d_gpu_client;	/* Under d_fosphor_mutex */
+      std::atomic<double> d_gpu_time;	/* Compute thread, monitoring */
+
+      void gpu_sched_update();
+
+      /* profiling */
+      bool d_profiling;
+      bool d_profiling_cur;		/* The instance was created with */
+      double d_render_time;		/* Averaged, seconds / frame */
+      std::vector<double> d_profile;	/* Snapshot, under d_settings_mutex */
+
+      void profile_update(double t_render);
+
+      /* peak detection */
+      float d_detect_threshold;		/* dB above the noise floor */
+      int d_detect_peaks;		/* 0: disabled */
+
+      void detections_publish();
+
+      /* burst trigger */
+      bool d_trig_enabled;
+      double d_trig_lo;			/* Hz from the center */
+      double d_trig_hi;
+      float d_trig_threshold;		/* dBFS, band total */
+      trigger_action_t d_trig_action;
+      int d_trig_pre;			/* Input items around the burst */
+      int d_trig_post;
+      std::atomic<uint64_t> d_trig_count;
+
+      /* Under d_fosphor_mutex, positions are in FIFO items since start */
+      uint64_t d_trig_pos;		/* End of the processed input */
+      std::vector<char> d_trig_ring;	/* Input history (capture only) */
+      int d_trig_ring_len;		/* items */
+      std::vector<char> d_trig_ring_next;	/* Allocated by trigger_prepare() */
+      int d_trig_ring_next_len;		/* -1: nothing to switch to */
+      uint64_t d_trig_fire;		/* Burst being captured, TRIG_NONE if none */
+      float d_trig_power;
+      double d_trig_time;
+
+      void trigger_prepare();
+      int  trigger_apply();
+      void trigger_check();
+      void trigger_feed(const void *data, uint64_t pos, int n);
+      void trigger_publish(uint64_t pos, float power, double time,
+                           const char *samples, int n, int pre);
+
+      /* spectrum recording */
+      std::string d_rec_path;		/* Under d_settings_mutex */
+      int d_rec_flags;
+      recorder *d_recorder;
+
+      void recording_apply();
+      void recording_push();
+      void recording_stop(const char *reason);
+
+      /* rendered frames capture */
+      std::string d_cap_target;		/* Under d_settings_mutex */
+      double d_cap_fps;
+      frame_capture *d_capture;
+
+      void capture_apply();
+      void capture_stop(const char *reason);
+
+      /* results snapshots, written by the render thread */
+      std::atomic<bool> d_snap_enabled;
+      std::atomic<uint64_t> d_snap_seq;		/* Of the last published one */
+      mutable std::atomic<bool> d_snap_wanted;	/* Read since the last one */
+      std::shared_ptr<snapshot_t> d_snap_front;	/* Under d_snap_mutex */
+      std::shared_ptr<snapshot_t> d_snap_back;
+      mutable gr::thread::mutex d_snap_mutex;
+
+      void snapshot_apply();
+      void snapshot_push();
+
+      void readback_apply();
+
+      /* stream tags retuning, positions are in FIFO items since start */
+      struct retune {
+        uint64_t pos;			/* First FIFO item of the new range */
+        double center;			/* NAN: unchanged */
+        double span;
+      };
+
+      std::atomic<bool> d_freq_tags;
+      std::deque<retune> d_retunes;	/* Under d_retune_mutex */
+      gr::thread::mutex d_retune_mutex;
+      uint64_t d_fifo_wpos;		/* Written (work) */
+      uint64_t d_fifo_rpos;		/* Consumed (compute thread) */
+
+      /* FIFO spans consumed but maybe still read by the device, handed
+       * back to the producer in order once their batch retired. Compute
+       * thread, the calls count is of fosphor_process() */
+      struct fifo_hold {
+        int size;
+        uint64_t call;			/* Last call that may read it */
+      };
+
+      std::deque<fifo_hold> d_fifo_holds;
+      uint64_t d_fifo_calls;
+
+      /* Contiguous copy of a batch across the end of a non mirrored
+       * fifo (compute thread) */
+      std::vector<char> d_fifo_stage;
+
+      void fifo_consume(int size);
+      void fifo_keep(int size);
+      void fifo_retire(int pending);
+
+      void    retune_queue(int n_taken, int n_written);
+      int64_t retune_apply();
 
       /* settings refresh logic */
       enum {
@@ -60,14 +275,43 @@ namespace gr {
         SETTING_FFT_WINDOW      = (1 << 3),
         SETTING_RENDER_OPTIONS  = (1 << 4),
         SETTING_FFT_SIZE        = (1 << 5),
+        SETTING_DEVICE          = (1 << 6),
+        SETTING_FFT_OVERLAP     = (1 << 7),
+        SETTING_AVERAGING       = (1 << 8),
+        SETTING_WF_DEPTH        = (1 << 9),
+        SETTING_WF_DECIMATION   = (1 << 10),
+        SETTING_HISTO_BINS      = (1 << 11),
+        SETTING_PROFILING       = (1 << 12),
+        SETTING_DETECTION       = (1 << 13),
+        SETTING_RECORDING       = (1 << 14),
+        SETTING_CAPTURE         = (1 << 15),
+        SETTING_HALF            = (1 << 16),
+        SETTING_DISP_REDUCTION  = (1 << 17),
+        SETTING_ZOOM_FFT        = (1 << 18),
+        SETTING_SNAPSHOTS       = (1 << 19),
+        SETTING_BUFFERING       = (1 << 20),
+        SETTING_MAX_HOLD        = (1 << 21),
+        SETTING_GPU_SCHED       = (1 << 22),
+        SETTING_TRIGGER         = (1 << 23),
       };
 
       uint32_t d_settings_changed;
-      gr::thread::mutex d_settings_mutex;
+      mutable gr::thread::mutex d_settings_mutex;
 
       void     settings_mark_changed(uint32_t setting);
       uint32_t settings_get_and_reset_changed(void);
       void     settings_apply(uint32_t settings);
+      int      averaging_apply();
+
+     protected:
+      base_sink_c_impl(bool headless = false,
+                       input_format_t format = INPUT_FC32,
+                       int channels = 1);
+
+      /* Inputs, their FFTs are side by side in each displayed row */
+      const int d_channels;
+
+      int row_len() const { return this->d_fft_size * this->d_channels; }
 
       /* settings values */
       int d_width;
@@ -80,22 +324,58 @@ namespace gr {
       bool  d_zoom_enabled;
       double d_zoom_center;
       double d_zoom_width;
+      bool  d_zoom_fft;
 
       float d_ratio;
 
-      struct {
+      struct freq_range {
         double center;
         double span;
-      } d_frequency;
+      } d_frequency;			/* Under d_settings_mutex */
+
+      freq_range frequency() const;
 
       gr::fft::window::win_type d_fft_window;
       int d_fft_size;
+      int d_overlap;
 
-     protected:
-      base_sink_c_impl();
+      int d_avg_count;
+      averaging_t d_avg_mode;
+      bool d_avg_log;
+
+      int d_wf_depth;
+      int d_wf_decim;
+      int d_histo_bins;
+
+      max_hold_t d_max_hold;
+      float d_histo_rise;
+      float d_histo_decay;
+      float d_live_alpha;
+      bool d_half;
+      bool d_half_cur;		/* The instance was created with */
+
+      bool d_disp_red;
+      averaging_t d_disp_red_mode;
+      int d_disp_len_cur;		/* The instance was created with */
+
+      int display_len(int row_len) const;
+      int display_len() const { return this->display_len(this->row_len()); }
+
+      std::string d_device;
+      std::string d_device_cur;	/* The instance was created with */
+      std::shared_future<bool> d_warmup;	/* Of the device selected before start */
+
+      /* Headless sinks have no GL context and don't draw, they get the
+       * results after each productive sync instead (fosphor lock held) */
+      const bool d_headless;
+
+      virtual void publish_results(struct fosphor *fosphor) { }
+
+      /* Frequency range of the newest displayed spectrum (fosphor lock held) */
+      void displayed_frequency(struct fosphor *fosphor, double &center, double &span);
 
       /* Delegated implementation of GL context management */
-      virtual void glctx_init() = 0;
+      virtual bool glctx_init() = 0;
       virtual void glctx_poll() = 0;
       virtual void glctx_swap() = 0;
       virtual void glctx_fini() = 0;
@@ -104,6 +384,7 @@ namespace gr {
       /* Callbacks from GL window */
       void cb_reshape(int width, int height);
       void cb_visibility(bool visible);
+      void cb_expose();
 
      public:
       virtual ~base_sink_c_impl();
@@ -117,9 +398,96 @@ namespace gr {
       void set_frequency_center(const double center);
       void set_frequency_span(const double span);
 
+      void set_frequency_tags(const bool enable);
+      bool frequency_tags() const;
+
       void set_fft_window(const gr::fft::window::win_type win);
       void set_fft_size(const int size);
 
+      void set_overflow_policy(const overflow_policy_t policy);
+      overflow_policy_t overflow_policy() const;
+      uint64_t dropped_samples() const;
+
+      void set_target_fps(const double fps);
+      void set_fifo_high_water(const float level);
+      void set_fifo_latency(const double sample_rate, const double latency);
+      int fifo_size() const;
+      void set_max_batch(const int spectra);
+      int max_batch() const;
+      std::vector<uint64_t> memory_usage() const;
+      float fifo_fill() const;
+      int batch_size() const;
+      int batch_count() const;
+
+      void set_max_fps(const double fps);
+      double max_fps() const;
+
+      void set_worker_affinity(const std::vector<int> &cpus);
+      std::vector<int> worker_affinity() const;
+      void set_worker_priority(const int priority);
+      int worker_priority() const;
+
+      void set_gpu_scheduling(const bool enable, const double weight,
+                              const double deadline);
+      bool gpu_scheduling() const;
+      double gpu_time() const;
+
+      void set_profiling(const bool enable);
+      std::vector<double> profile() const;
+
+      void set_detection(const float threshold, const int max_peaks);
+      int detection_peaks() const;
+
+      void set_trigger(const bool enable,
+                       const double f_lo, const double f_hi,
+                       const float threshold, const trigger_action_t action,
+                       const int pre, const int post);
+      uint64_t trigger_count() const;
+
+      void set_recording(const std::string &path,
+                         const bool live, const bool max_hold);
+      std::string recording() const;
+
+      void set_capture(const std::string &target, const double fps);
+      std::string capture() const;
+
+      void set_snapshots(const bool enable);
+      bool snapshots() const;
+      uint64_t snapshot_seq() const;
+      std::shared_ptr<snapshot_t> snapshot() const;
+
+      void set_overlap(const int overlap);
+      int overlap() const;
+
+      void set_averaging(const int count, const averaging_t mode,
+                         const bool log_domain);
+      int averaging() const;
+
+      void set_waterfall_depth(const int rows);
+      int waterfall_depth() const;
+      void set_waterfall_decimation(const int decim);
+      int waterfall_decimation() const;
+
+      void set_max_hold(const max_hold_t mode);
+      max_hold_t max_hold() const;
+      void set_persistence(const float histo_rise, const float histo_decay,
+                           const float live_alpha);
+
+      void set_histogram_bins(const int bins);
+      int histogram_bins() const;
+
+      void set_half_precision(const bool enable);
+      bool half_precision() const;
+
+      void set_display_reduction(const bool enable, const averaging_t mode);
+      int display_width() const;
+
+      void set_zoom_fft(const bool enable);
+      bool zoom_fft() const;
+
+      void set_device(const std::string &selector);
+      std::string device() const;
+
       /* gr::sync_block implementation */
       int work (int noutput_items,
                 gr_vector_const_void_star &input_items,
@@ -9,92 +9,393 @@
 
 #include <gnuradio/thread/thread.h>
 
+#ifdef __linux__
+# include <linux/futex.h>
+# include <sys/syscall.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+# define FIFO_HAS_MIRROR
+# include <fcntl.h>
+# include <stdint.h>
+# include <stdio.h>
+# include <sys/mman.h>
+# include <unistd.h>
+#endif
+
+#if defined(__linux__) && defined(MFD_HUGETLB)
+# define FIFO_HAS_HUGETLB
+#endif
+
+#include <string.h>
+
+#include <algorithm>
+#include <stdexcept>
+
 #include "fifo.h"
 
 namespace gr {
   namespace fosphor {
 
-fifo::fifo(int length) :
-	d_len(length), d_rp(0), d_wp(0)
+/* Number of polls before going to sleep */
+#define FIFO_SPIN_COUNT 128
+
+/* Default huge page size, storage from which to try them */
+#define FIFO_HUGE_PAGE	(2 * 1024 * 1024)
+#define FIFO_HUGE_MIN	(16 * 1024 * 1024)
+
+
+#ifdef __linux__
+static void
+futex_wait(std::atomic<unsigned int> *addr, unsigned int val)
+{
+	syscall(SYS_futex, reinterpret_cast<unsigned int *>(addr),
+		FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void
+futex_wake(std::atomic<unsigned int> *addr)
 {
-	this->d_buf = new gr_complex[this->d_len];
+	syscall(SYS_futex, reinterpret_cast<unsigned int *>(addr),
+		FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+#endif
+
+
+fifo::fifo(int length, size_t item_size, bool mirrored) :
+	d_buf(NULL), d_len(length), d_item_size(item_size), d_mirrored(false),
+	d_huge(false), d_rp(0), d_rc(0), d_wp(0), d_drop_req(0)
+{
+	/* Indexes wrap with a mask */
+	if ((length <= 0) || (length & (length - 1)))
+		throw std::invalid_argument("fifo length must be a power of 2");
+
+#ifdef FIFO_HAS_HUGETLB
+	if (mirrored && ((size_t)this->d_len * this->d_item_size >= FIFO_HUGE_MIN))
+		this->d_huge = this->d_mirrored = this->alloc_mirrored(true);
+#endif
+
+	if (mirrored && !this->d_mirrored)
+		this->d_mirrored = this->alloc_mirrored(false);
+
+	if (!this->d_mirrored)
+		this->d_buf = new char[this->d_len * this->d_item_size];
+
+	this->d_wq_empty.seq = 0;
+	this->d_wq_empty.waiters = 0;
+	this->d_wq_full.seq = 0;
+	this->d_wq_full.waiters = 0;
 }
 
 fifo::~fifo()
 {
-	delete[] this->d_buf;
+	if (this->d_mirrored)
+		this->release_mirrored();
+	else
+		delete[] this->d_buf;
+}
+
+bool
+fifo::alloc_mirrored(bool huge)
+{
+#ifdef FIFO_HAS_MIRROR
+	size_t sz = this->d_len * this->d_item_size;
+	size_t align = huge ? FIFO_HUGE_PAGE : sysconf(_SC_PAGESIZE);
+	char *raw, *base;
+	void *m0, *m1;
+	int fd;
+
+	/* Both mappings need to be page aligned */
+	if (sz % align)
+		return false;
+
+	/* Anonymous shared memory object */
+#ifdef FIFO_HAS_HUGETLB
+	fd = memfd_create("fosphor-fifo", MFD_CLOEXEC | (huge ? MFD_HUGETLB : 0));
+#elif defined(__linux__)
+	fd = memfd_create("fosphor-fifo", MFD_CLOEXEC);
+#else
+	{
+		char name[64];
+		snprintf(name, sizeof(name), "/fosphor-fifo-%d-%p", (int)getpid(), (void*)this);
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd >= 0)
+			shm_unlink(name);
+	}
+#endif
+	if (fd < 0)
+		return false;
+
+	if (ftruncate(fd, sz))
+		goto err_fd;
+
+	/* Reserve the address space for both copies, aligned for the pages */
+	raw = (char *) mmap(NULL, 2 * sz + align, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (raw == MAP_FAILED)
+		goto err_fd;
+
+	base = (char *) (((uintptr_t)raw + align - 1) & ~(uintptr_t)(align - 1));
+
+	if (base != raw)
+		munmap(raw, base - raw);
+	munmap(base + 2 * sz, raw + align - base);
+
+	/* Map the same pages twice, back to back. Huge pages are reserved
+	 * here, so this fails (rather than faulting later) without enough */
+	m0 = mmap(base,      sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+	m1 = mmap(base + sz, sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+
+	if ((m0 != base) || (m1 != base + sz)) {
+		munmap(base, 2 * sz);
+		goto err_fd;
+	}
+
+	close(fd);
+
+#ifdef MADV_HUGEPAGE
+	/* Transparent ones otherwise, fewer TLB misses streaming through it */
+	if (!huge && (sz >= FIFO_HUGE_MIN))
+		madvise(base, 2 * sz, MADV_HUGEPAGE);
+#endif
+
+	this->d_buf = base;
+
+	return true;
+
+err_fd:
+	close(fd);
+#endif
+	return false;
+}
+
+void
+fifo::release_mirrored()
+{
+#ifdef FIFO_HAS_MIRROR
+	munmap(this->d_buf, 2 * this->d_len * this->d_item_size);
+#endif
 }
 
+void
+fifo::prefault()
+{
+	memset(this->d_buf, 0x00, this->d_len * this->d_item_size);
+}
+
+template <typename Cond> void
+fifo::wait(waitq &wq, Cond cond)
+{
+	/* Short spin first, the other side is usually about to act */
+	for (int i=0; i<FIFO_SPIN_COUNT; i++)
+		if (cond())
+			return;
+
+	while (1) {
+		unsigned int seq = wq.seq.load(std::memory_order_acquire);
+
+		wq.waiters.fetch_add(1, std::memory_order_seq_cst);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		if (cond()) {
+			wq.waiters.fetch_sub(1, std::memory_order_relaxed);
+			return;
+		}
+
+#ifdef __linux__
+		futex_wait(&wq.seq, seq);
+#else
+		{
+			gr::thread::scoped_lock lock(wq.mutex);
+			while (wq.seq.load(std::memory_order_acquire) == seq)
+				wq.cond.wait(lock);
+		}
+#endif
+
+		wq.waiters.fetch_sub(1, std::memory_order_relaxed);
+	}
+}
+
+void
+fifo::wake(waitq &wq)
+{
+	/* Pairs with the fence in wait(): either the waiter sees our
+	 * pointer update, or we see it registered */
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	if (!wq.waiters.load(std::memory_order_relaxed))
+		return;
+
+#ifdef __linux__
+	wq.seq.fetch_add(1, std::memory_order_release);
+	futex_wake(&wq.seq);
+#else
+	{
+		gr::thread::scoped_lock lock(wq.mutex);
+		wq.seq.fetch_add(1, std::memory_order_release);
+	}
+	wq.cond.notify_one();
+#endif
+}
+
+/* Producer side: space not holding samples, consumed ones not released
+ * yet included */
 int
 fifo::free()
 {
-	return (this->d_len - 1) - this->used();
+	int wp = this->d_wp.load(std::memory_order_acquire);
+	int rp = this->d_rp.load(std::memory_order_acquire);
+	return (this->d_len - 1) - ((wp - rp) & (this->d_len - 1));
 }
 
+/* Consumer side: samples not consumed yet */
 int
 fifo::used()
 {
-	return (this->d_wp - this->d_rp) & (this->d_len - 1);
+	int wp = this->d_wp.load(std::memory_order_acquire);
+	int rc = this->d_rc.load(std::memory_order_acquire);
+	return (wp - rc) & (this->d_len - 1);
+}
+
+/* Consumer side: consumed but not released */
+int
+fifo::held()
+{
+	int rc = this->d_rc.load(std::memory_order_relaxed);
+	int rp = this->d_rp.load(std::memory_order_relaxed);
+	return (rc - rp) & (this->d_len - 1);
 }
 
 int
 fifo::write_max_size()
 {
-	return this->d_len - this->d_wp;
+	if (this->d_mirrored)
+		return this->d_len - 1;
+
+	return this->d_len - this->d_wp.load(std::memory_order_relaxed);
 }
 
-gr_complex *
+void *
 fifo::write_prepare(int size, bool wait)
 {
-	gr::thread::scoped_lock lock(this->d_mutex);
-
-	if (!wait && (this->free() < size))
-		return NULL;
+	if (this->free() < size) {
+		if (!wait)
+			return NULL;
 
-	while (this->free() < size)
-		this->d_cond_full.wait(lock);
+		this->wait(this->d_wq_full, [this, size] {
+			return this->free() >= size;
+		});
+	}
 
-	return &this->d_buf[this->d_wp];
+	return &this->d_buf[this->d_wp.load(std::memory_order_relaxed) * this->d_item_size];
 }
 
 void
 fifo::write_commit(int size)
 {
-	gr::thread::scoped_lock lock(this->d_mutex);
+	int wp = this->d_wp.load(std::memory_order_relaxed);
 
-	this->d_wp = (this->d_wp + size) & (this->d_len - 1);
+	this->d_wp.store((wp + size) & (this->d_len - 1), std::memory_order_release);
 
-	this->d_cond_empty.notify_one();
+	this->wake(this->d_wq_empty);
 }
 
 int
 fifo::read_max_size()
 {
-	return this->d_len - this->d_rp;
+	if (this->d_mirrored)
+		return this->d_len - 1;
+
+	return this->d_len - this->d_rc.load(std::memory_order_relaxed);
 }
 
-gr_complex *
+void *
 fifo::read_peek(int size, bool wait)
 {
-	gr::thread::scoped_lock lock(this->d_mutex);
+	if (this->used() < size) {
+		if (!wait)
+			return NULL;
 
-	if (!wait && (this->used() < size))
-		return NULL;
+		this->wait(this->d_wq_empty, [this, size] {
+			return this->used() >= size;
+		});
+	}
 
-	while (this->used() < size)
-		this->d_cond_empty.wait(lock);
+	return &this->d_buf[this->d_rc.load(std::memory_order_relaxed) * this->d_item_size];
+}
 
-	return &this->d_buf[this->d_rp];
+/* Copies `size` samples (that are there) from the read cursor on, across
+ * the end of the buffer if needed. For reads a non mirrored fifo can't
+ * give in one piece */
+void
+fifo::read_copy(void *dst, int size)
+{
+	int rc = this->d_rc.load(std::memory_order_relaxed);
+	int n1 = std::min(size, this->d_len - rc);
+
+	memcpy(dst, &this->d_buf[rc * this->d_item_size], n1 * this->d_item_size);
+	memcpy((char *)dst + n1 * this->d_item_size, this->d_buf, (size - n1) * this->d_item_size);
 }
 
+/* Moves the read cursor past `size` samples, their space stays reserved
+ * until read_release() */
+void
+fifo::read_consume(int size)
+{
+	int rc = this->d_rc.load(std::memory_order_relaxed);
+
+	this->d_rc.store((rc + size) & (this->d_len - 1), std::memory_order_relaxed);
+}
+
+/* Hands the oldest `size` consumed samples back to the producer */
+void
+fifo::read_release(int size)
+{
+	int rp = this->d_rp.load(std::memory_order_relaxed);
+
+	if (size > this->held())
+		size = this->held();
+
+	this->d_rp.store((rp + size) & (this->d_len - 1), std::memory_order_release);
+
+	this->wake(this->d_wq_full);
+}
+
+/* Consume and release at once, only when nothing is held */
 void
 fifo::read_discard(int size)
 {
-	gr::thread::scoped_lock lock(this->d_mutex);
+	this->read_consume(size);
+	this->read_release(size);
+}
+
+/* Producer side: ask for at least `size` of the oldest samples to go */
+void
+fifo::drop_request(int size)
+{
+	int cur = this->d_drop_req.load(std::memory_order_relaxed);
+
+	while ((cur < size) &&
+	       !this->d_drop_req.compare_exchange_weak(cur, size, std::memory_order_relaxed));
+}
+
+/* Consumer side: carry out pending drop request, returns # dropped. Those
+ * are consumed, the caller releases them (in order behind what it holds) */
+int
+fifo::drop_apply()
+{
+	int size = this->d_drop_req.exchange(0, std::memory_order_relaxed);
+	int used;
+
+	if (!size)
+		return 0;
+
+	used = this->used();
+	if (size > used)
+		size = used;
 
-	this->d_rp = (this->d_rp + size) & (this->d_len - 1);
+	this->read_consume(size);
 
-	this->d_cond_full.notify_one();
+	return size;
 }
 
   } /* namespace fosphor */
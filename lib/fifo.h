@@ -14,35 +14,107 @@
 #include <gnuradio/gr_complex.h>
 #include <gnuradio/thread/thread.h>
 
+#include <atomic>
+
 namespace gr {
   namespace fosphor {
 
+   /*!
+    * \brief Single producer / single consumer sample FIFO
+    *
+    * The read and write pointers are atomics owned respectively by the
+    * consumer and the producer so the fast path never takes a lock.
+    * Blocking (the `wait` argument) is opt-in and only the side that
+    * actually needs to sleep pays for it.
+    *
+    * When possible the storage is mapped twice back to back in virtual
+    * memory (mirrored mode) so any span up to the capacity is contiguous
+    * and reads / writes never need to split at the wrap point. Large
+    * mirrored ones use explicit huge pages when the system has some
+    * reserved, else ask for transparent ones.
+    *
+    * The consumer reads at its own cursor and releases the space to the
+    * producer separately, in order, so a span read in place by the compute
+    * device stays valid until the device is done with it.
+    *
+    * Sizes and positions are in items, gr_complex by default.
+    */
    class GR_FOSPHOR_API fifo
    {
     private:
-     gr_complex *d_buf;
+     /* Wait queue: sleeping side registers in `waiters` and sleeps until
+      * `seq` changes. The other side only bumps `seq` / wakes when there
+      * is someone registered */
+     struct waitq {
+       std::atomic<unsigned int> seq;
+       std::atomic<int> waiters;
+       thread::mutex mutex;		/* Only used without futex support */
+       thread::condition_variable cond;
+     };
+
+     char *d_buf;
      int d_len;
-     int d_rp;
-     int d_wp;
+     size_t d_item_size;
+     bool d_mirrored;
+     bool d_huge;
+
+     /* Keep each side's pointers on their own cache line */
+     std::atomic<int> d_rp;		/* Released to the producer */
+     std::atomic<int> d_rc;		/* Consumed (read cursor) */
+     char d_pad0[64 - 2 * sizeof(std::atomic<int>)];
+     std::atomic<int> d_wp;
+     char d_pad1[64 - sizeof(std::atomic<int>)];
+
+     waitq d_wq_empty;	/* Consumer waiting for data */
+     waitq d_wq_full;	/* Producer waiting for space */
+
+     /* Pending discard of the oldest samples (asked by the producer,
+      * carried out by the consumer) */
+     std::atomic<int> d_drop_req;
 
-     thread::mutex d_mutex;
-     thread::condition_variable d_cond_empty;
-     thread::condition_variable d_cond_full;
+     template <typename Cond> void wait(waitq &wq, Cond cond);
+     void wake(waitq &wq);
+
+     bool alloc_mirrored(bool huge);
+     void release_mirrored();
 
     public:
-     fifo(int length);
+     /* length must be a power of 2 (items) */
+     fifo(int length, size_t item_size=sizeof(gr_complex), bool mirrored=true);
      ~fifo();
 
+     bool mirrored() const { return this->d_mirrored; }
+     bool hugepages() const { return this->d_huge; }
+
+     /* Whole backing storage (both views if mirrored), for registration
+      * with the compute device */
+     void  *storage() const { return this->d_buf; }
+     size_t storage_size() const {
+       return (this->d_mirrored ? 2 : 1) * this->d_len * this->d_item_size;
+     }
+
+     /* Touch all the storage from the calling thread, its NUMA node
+      * then holds the pages (first touch placement) */
+     void prefault();
+
      int free();
      int used();
+     int held();
+     int free_max() const { return this->d_len - 1; }
 
      int write_max_size();
-     gr_complex *write_prepare(int size, bool wait=true);
+     void *write_prepare(int size, bool wait=true);
      void write_commit(int size);
 
      int read_max_size();
-     gr_complex *read_peek(int size, bool wait=true);
+     void *read_peek(int size, bool wait=true);
+     void read_copy(void *dst, int size);
+     void read_consume(int size);
+     void read_release(int size);
      void read_discard(int size);
+
+     void drop_request(int size);
+     int  drop_apply();
    };
 
   } // namespace fosphor
@@ -0,0 +1,445 @@
+/*
+ * bench.c
+ *
+ * Headless throughput benchmark
+ *
+ * Copyright (C) 2013-2021 Sylvain Munaut
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#if !defined(_WIN32) && (defined(__WIN32__) || defined(WIN32) || defined(__CYGWIN__))
+# define _WIN32
+#endif
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <time.h>
+#endif
+
+#include "fosphor.h"
+#include "private.h"
+
+
+/* ------------------------------------------------------------------------ */
+/* Timing / Statistics utils                                                */
+/* ------------------------------------------------------------------------ */
+
+static double
+time_now(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER f, c;
+	QueryPerformanceFrequency(&f);
+	QueryPerformanceCounter(&c);
+	return (double)c.QuadPart / (double)f.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double da = *(const double *)a, db = *(const double *)b;
+	return (da > db) - (da < db);
+}
+
+/* Percentile of a sorted series (nearest rank) */
+static double
+percentile(const double *v, int n, int p)
+{
+	int i;
+
+	if (!n)
+		return 0.0;
+
+	i = (int)ceil(n * p / 100.0) - 1;
+	if (i < 0)
+		i = 0;
+
+	return v[i];
+}
+
+
+/* ------------------------------------------------------------------------ */
+/* Benchmark                                                                */
+/* ------------------------------------------------------------------------ */
+
+#define MAX_DEVICES	32
+#define MAX_SAMPLES	4096		/* Syncs recorded per run */
+
+static const int k_batches[] = { 16, 64, 256, 1024 };
+
+static const char *k_stages[FOSPHOR_PROF_STAGES] = {
+	"upload", "fft", "display", "readback", "gl",
+};
+
+static const int k_pct[] = { 50, 90, 99 };
+#define N_PCT	(sizeof(k_pct) / sizeof(k_pct[0]))
+
+struct bench_opts
+{
+	const char *device;	/* NULL = all usable */
+	int fft_len;		/* 0 = all */
+	int batch;		/* 0 = all */
+	int per_sync;		/* fosphor_process calls per sync */
+	double duration;	/* Seconds per run */
+	int json;
+};
+
+struct bench_result
+{
+	double msps;
+	double iter[N_PCT];				/* Whole sync period */
+	double stage[FOSPHOR_PROF_STAGES][N_PCT];	/* Device time */
+	int n_sync;
+};
+
+/* Synthetic input: a tone over some noise */
+static float *
+bench_samples(int len)
+{
+	float *samples;
+	int i;
+
+	samples = malloc(2 * sizeof(float) * len);
+	if (!samples)
+		return NULL;
+
+	for (i=0; i<len; i++) {
+		float n_i = (float)rand() / RAND_MAX - 0.5f;
+		float n_q = (float)rand() / RAND_MAX - 0.5f;
+		samples[2*i+0] = 0.5f * cosf(0.1f * i) + 0.01f * n_i;
+		samples[2*i+1] = 0.5f * sinf(0.1f * i) + 0.01f * n_q;
+	}
+
+	return samples;
+}
+
+static int
+bench_run(const struct bench_opts *bo, const char *device,
+          int fft_len, int batch, struct bench_result *res)
+{
+	struct fosphor_options opts;
+	struct fosphor_profile prof;
+	struct fosphor *fosphor;
+	double *t_iter = NULL, *t_stage[FOSPHOR_PROF_STAGES];
+	float *samples = NULL;
+	double t_start, t_prev, t;
+	long long n_samples = 0;
+	int len, n, i, j, rv = 0;
+
+	/* Instance */
+	fosphor_options_defaults(&opts);
+	opts.device    = device;
+	opts.fft_len   = fft_len;
+	opts.headless  = 1;
+	opts.profiling = 1;
+
+	fosphor = fosphor_init(&opts);
+	if (!fosphor)
+		return -EIO;
+
+	len = fft_len * batch;
+
+	samples = bench_samples(len);
+	if (!samples) {
+		rv = -ENOMEM;
+		goto done;
+	}
+
+	/* Storage for the per sync timings */
+	t_iter = malloc(MAX_SAMPLES * sizeof(double) * (FOSPHOR_PROF_STAGES + 1));
+	if (!t_iter) {
+		rv = -ENOMEM;
+		goto done;
+	}
+
+	for (i=0; i<FOSPHOR_PROF_STAGES; i++)
+		t_stage[i] = t_iter + (i + 1) * MAX_SAMPLES;
+
+	/* Warm up (first runs clear buffers, may compile / page things in) */
+	for (i=0; i<4; i++) {
+		rv = fosphor_process(fosphor, samples, len);
+		if (rv)
+			goto done;
+		fosphor_sync(fosphor);
+	}
+
+	fosphor_reset_profile(fosphor);
+
+	/* Timed runs */
+	t_start = t_prev = time_now();
+	n = 0;
+
+	do {
+		for (j=0; j<bo->per_sync; j++) {
+			rv = fosphor_process(fosphor, samples, len);
+			if (rv)
+				goto done;
+			n_samples += len;
+		}
+
+		fosphor_sync(fosphor);
+
+		t = time_now();
+
+		if (n < MAX_SAMPLES) {
+			fosphor_get_profile(fosphor, &prof);
+
+			t_iter[n] = t - t_prev;
+			for (i=0; i<FOSPHOR_PROF_STAGES; i++)
+				t_stage[i][n] = prof.last[i];
+			n++;
+		}
+
+		t_prev = t;
+	} while (t - t_start < bo->duration);
+
+	/* Results */
+	res->msps  = n_samples / (t - t_start) / 1e6;
+	res->n_sync = n;
+
+	qsort(t_iter, n, sizeof(double), cmp_double);
+	for (j=0; j<N_PCT; j++)
+		res->iter[j] = percentile(t_iter, n, k_pct[j]);
+
+	for (i=0; i<FOSPHOR_PROF_STAGES; i++) {
+		qsort(t_stage[i], n, sizeof(double), cmp_double);
+		for (j=0; j<N_PCT; j++)
+			res->stage[i][j] = percentile(t_stage[i], n, k_pct[j]);
+	}
+
+done:
+	free(t_iter);
+	free(samples);
+	fosphor_release(fosphor);
+
+	return rv;
+}
+
+
+/* ------------------------------------------------------------------------ */
+/* Output                                                                   */
+/* ------------------------------------------------------------------------ */
+
+static void
+print_header(const struct bench_opts *bo)
+{
+	int i, j;
+
+	if (bo->json) {
+		printf("[\n");
+		return;
+	}
+
+	printf("device,name,global_mem,local_mem,fft_len,batch,msps,syncs");
+
+	for (j=0; j<N_PCT; j++)
+		printf(",sync_p%d_us", k_pct[j]);
+
+	for (i=0; i<FOSPHOR_PROF_STAGES; i++)
+		for (j=0; j<N_PCT; j++)
+			printf(",%s_p%d_us", k_stages[i], k_pct[j]);
+
+	printf("\n");
+}
+
+static void
+print_result(const struct bench_opts *bo, const char *device,
+             const struct fosphor_device_info *di,
+             int fft_len, int batch, const struct bench_result *res,
+             int first)
+{
+	int i, j;
+
+	if (!bo->json)
+	{
+		/* Device names may contain commas (but not quotes) */
+		printf("%s,\"%s\",%lu,%lu,%d,%d,%.3f,%d",
+			device, di->name, di->global_mem, di->local_mem,
+			fft_len, batch, res->msps, res->n_sync);
+
+		for (j=0; j<N_PCT; j++)
+			printf(",%.1f", res->iter[j] * 1e6);
+
+		for (i=0; i<FOSPHOR_PROF_STAGES; i++)
+			for (j=0; j<N_PCT; j++)
+				printf(",%.1f", res->stage[i][j] * 1e6);
+
+		printf("\n");
+	}
+	else
+	{
+		printf("%s  {\"device\": \"%s\", \"name\": \"%s\", "
+			"\"global_mem\": %lu, \"local_mem\": %lu, "
+			"\"fft_len\": %d, \"batch\": %d, \"msps\": %.3f, \"syncs\": %d,\n",
+			first ? "" : ",\n",
+			device, di->name, di->global_mem, di->local_mem,
+			fft_len, batch, res->msps, res->n_sync);
+
+		printf("   \"latency_us\": {\"sync\": [");
+		for (j=0; j<N_PCT; j++)
+			printf("%s%.1f", j ? ", " : "", res->iter[j] * 1e6);
+		printf("]");
+
+		for (i=0; i<FOSPHOR_PROF_STAGES; i++) {
+			printf(", \"%s\": [", k_stages[i]);
+			for (j=0; j<N_PCT; j++)
+				printf("%s%.1f", j ? ", " : "", res->stage[i][j] * 1e6);
+			printf("]");
+		}
+
+		printf("}}");
+	}
+
+	fflush(stdout);
+}
+
+static void
+print_footer(const struct bench_opts *bo)
+{
+	if (bo->json) {
+		printf("\n]\n");
+	}
+}
+
+
+/* ------------------------------------------------------------------------ */
+/* Main                                                                     */
+/* ------------------------------------------------------------------------ */
+
+static void
+usage(const char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [-d device] [-s fft_len] [-b batch] [-n per_sync] [-t seconds] [-j]\n"
+		"\n"
+		"  -d  Only this OpenCL device (\"P:D\", see fosphor_list_devices)\n"
+		"  -s  Only this FFT length (default: all supported)\n"
+		"  -b  Only this batch size (default: 16, 64, 256, 1024)\n"
+		"  -n  fosphor_process() calls per sync (default: 4)\n"
+		"  -t  Duration of each run (default: 1.0 s)\n"
+		"  -j  JSON output (default: CSV)\n"
+		"\n"
+		"Latencies are percentiles (%d/%d/%d) of the time per sync, whole\n"
+		"period and device time per stage\n",
+		argv0, k_pct[0], k_pct[1], k_pct[2]);
+}
+
+int main(int argc, char *argv[])
+{
+	struct fosphor_device_info devs[MAX_DEVICES];
+	struct bench_opts bo;
+	int n_devs, d, fft_len, b, i, first = 1;
+
+	/* Options */
+	memset(&bo, 0x00, sizeof(bo));
+	bo.per_sync = 4;
+	bo.duration = 1.0;
+
+	for (i=1; i<argc; i++)
+	{
+		const char *arg = argv[i];
+		const char *val = (i + 1 < argc) ? argv[i+1] : NULL;
+
+		if (!strcmp(arg, "-j")) {
+			bo.json = 1;
+			continue;
+		}
+
+		if (!val || (arg[0] != '-') || arg[2]) {
+			usage(argv[0]);
+			return -EINVAL;
+		}
+
+		switch (arg[1]) {
+		case 'd': bo.device   = val;       break;
+		case 's': bo.fft_len  = atoi(val); break;
+		case 'b': bo.batch    = atoi(val); break;
+		case 'n': bo.per_sync = atoi(val); break;
+		case 't': bo.duration = atof(val); break;
+		default:
+			usage(argv[0]);
+			return -EINVAL;
+		}
+
+		i++;
+	}
+
+	if ((bo.fft_len && !fosphor_fft_len_validate(bo.fft_len)) ||
+	    (bo.batch && (bo.batch % FOSPHOR_FFT_MULT_BATCH)) ||
+	    (bo.per_sync < 1)) {
+		usage(argv[0]);
+		return -EINVAL;
+	}
+
+	/* Devices */
+	n_devs = fosphor_list_devices(devs, MAX_DEVICES);
+	if (n_devs <= 0) {
+		fprintf(stderr, "[!] No OpenCL device found\n");
+		return -ENODEV;
+	}
+
+	if (n_devs > MAX_DEVICES)
+		n_devs = MAX_DEVICES;
+
+	/* Sweep */
+	print_header(&bo);
+
+	for (d=0; d<n_devs; d++)
+	{
+		char sel[16];
+
+		snprintf(sel, sizeof(sel), "%d:%d", devs[d].platform, devs[d].device);
+
+		if (bo.device ? strcmp(bo.device, sel) : (devs[d].score < 0))
+			continue;
+
+		/* Build the programs once, not in the first run */
+		fosphor_pool_warmup(sel, 1);
+
+		for (fft_len=FOSPHOR_FFT_LEN_MIN; fft_len<=FOSPHOR_FFT_LEN_MAX; fft_len<<=1)
+		{
+			if (bo.fft_len && (fft_len != bo.fft_len))
+				continue;
+
+			for (b=0; b<(int)(sizeof(k_batches)/sizeof(k_batches[0])); b++)
+			{
+				struct bench_result res;
+				int batch = bo.batch ? bo.batch : k_batches[b];
+
+				if (bo.batch && b)
+					break;
+
+				if (batch > fosphor_fft_max_batch(fft_len))
+					continue;
+
+				if (bench_run(&bo, sel, fft_len, batch, &res)) {
+					fprintf(stderr, "[w] %s, FFT %d, batch %d: failed\n",
+						sel, fft_len, batch);
+					continue;
+				}
+
+				print_result(&bo, sel, &devs[d], fft_len, batch, &res, first);
+				first = 0;
+			}
+		}
+	}
+
+	print_footer(&bo);
+
+	fosphor_pool_flush();
+
+	return 0;
+}
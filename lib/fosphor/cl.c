@@ -17,13 +17,36 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <math.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#ifdef _WIN32
+# define strcasecmp  _stricmp
+# define strncasecmp _strnicmp
+#else
+# include <strings.h>
+#endif
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#ifdef _WIN32
+# include <direct.h>
+# include <process.h>
+# define mkdir(p, m) _mkdir(p)
+#else
+# include <unistd.h>
+#endif
 
 #include "cl_platform.h"
 #include "cl_compat.h"
 
+#ifdef ENABLE_CLFFT
+# include <clFFT.h>
+#endif
+
 #if defined(__APPLE__) || defined(MACOSX)
 # include <OpenGL/OpenGL.h>
 # include <OpenGL/gl.h>
@@ -39,6 +62,10 @@
 #include "private.h"
 #include "resource.h"
 
+#ifndef M_PI
+# define M_PI 3.14159265358979323846
+#endif
+
 
 struct fosphor_cl_features
 {
@@ -47,51 +74,196 @@ struct fosphor_cl_features
 #define FLG_CL_OPENCL_11	(1<<2)
 #define FLG_CL_LOCAL_ATOMIC_EXT	(1<<3)
 #define FLG_CL_IMAGE		(1<<4)
+#define FLG_CL_OPENCL_12	(1<<5)
+#define FLG_CL_HOST_UNIFIED	(1<<6)
 
 	cl_device_type type;
 	char name[128];
 	char vendor[128];
+	char pci_id[16];	/* dddd:bb:dd.f, empty if unknown */
 	unsigned long local_mem;
+	unsigned long global_mem;
+	unsigned long mem_align;
+	size_t img_max_width;
+	size_t img_max_height;
+	size_t max_wg;
+	unsigned long max_alloc;
 	int flags;
 	int wg_size;
 	int wg_size_dim[2];
 };
 
+#define CL_INPUT_FORMATS	3	/* FOSPHOR_INPUT_??? */
+#define CL_HISTO_VARIANTS	4	/* 64 to 512 histogram bins */
+#define CL_MAX_HOLD_MODES	4	/* FOSPHOR_MAX_HOLD_??? */
+
+/* Context & programs, shared by all the instances using a device without
+ * CL/GL sharing (pooled), or private to one instance with CL/GL sharing */
+struct fosphor_cl_shared
+{
+	struct fosphor_cl_shared *next;
+	int refcnt;
+	int pooled;
+
+	cl_device_id dev_id;
+	cl_context   ctx;
+	cl_program   prog_fft[CL_INPUT_FORMATS][CL_HISTO_VARIANTS];	/* Built on first use */
+	cl_program   prog_display[CL_MAX_HOLD_MODES][CL_HISTO_VARIANTS];
+
+	int fft_backend[21];	/* Per log2(chan_len), 0 = not benchmarked yet */
+};
+
 struct fosphor_cl_state
 {
 	cl_platform_id   pl_id;
 	cl_device_id     dev_id;
-	cl_context       ctx;
+	cl_context       ctx;		/* == shared->ctx */
+	struct fosphor_cl_shared *shared;
 	cl_command_queue cq;
+	cl_command_queue cq_xfer;	/* == cq if not pipelined */
 
 	/* Features */
 	struct fosphor_cl_features feat;
 
-	/* FFT */
-	cl_mem		mem_fft_in;
-	cl_mem		mem_fft_out;
+	/* FFT (rotating buffer sets when pipelined) */
+#define CL_MAX_SETS	3
+	int		n_sets;
+	int		cur_set;
+
+	cl_mem		mem_fft_in[CL_MAX_SETS];
+	cl_mem		mem_fft_out[CL_MAX_SETS];
+	cl_event	ev_fft[CL_MAX_SETS];	/* Last FFT using that set */
+	int		in_flight;		/* Latest _process() calls maybe still reading their samples */
 	cl_mem		mem_fft_win;
 
-	cl_program	prog_fft;
 	cl_kernel	kern_fft;
 
+	/* Multi-pass FFT (> 4096, kern_fft unused), a first pass reading
+	 * the samples then radix-8 ones, ping-pong with the output buffer */
+	cl_kernel	kern_fft_first;
+	cl_kernel	kern_fft_pass;
+	cl_mem		mem_fft_tmp;
+	int		fft_max_batch;
+
+	/* FFT backend when not fused: the kernels above, or a tuned library
+	 * transforming mem_fft_out in place once windowed by kern_fft_win */
+#define CL_FFT_BUILTIN	1
+#define CL_FFT_CLFFT	2
+	int		fft_backend;
+#ifdef ENABLE_CLFFT
+#define CL_CLFFT_PLANS	4
+	cl_kernel	kern_fft_win;
+	struct {
+		clfftPlanHandle	plan;
+		int		batch;		/* 0 = unused slot */
+	} clfft[CL_CLFFT_PLANS];
+	int		clfft_next;		/* Slot to replace */
+#endif
+
+	/* Fused FFT + display (kern_fft / kern_display are the fused
+	 * variants and there is no FFT output buffer) */
+#define CL_FUSED_GROUPS	128
+	int		fused;
+	cl_mem		mem_fused_part;		/* Per group live sum & max */
+	cl_mem		mem_histo_cnt;		/* Histogram hit counts */
+
+	/* Spectrum averaging (not fused only, buffers created on first use) */
+	cl_kernel	kern_avg;
+	cl_mem		mem_avg_acc;		/* Partial result, per bin */
+	cl_mem		mem_avg_out;		/* Averaged spectra */
+	int		avg_count;		/* 1 = disabled */
+	int		avg_mode;
+	int		avg_phase;		/* Spectra in mem_avg_acc */
+
+	/* Waterfall decimation (same restrictions) */
+	cl_kernel	kern_wf;
+	cl_mem		mem_wf_acc;		/* Partial peak, per bin */
+	int		wf_decim;		/* 1 = disabled */
+	int		wf_phase;		/* Spectra in mem_wf_acc */
+
+	/* Peak detection on the live spectrum (buffers created on first use) */
+#define CL_DETECT_WG	256
+	cl_kernel	kern_detect;
+	cl_mem		mem_detect;		/* Count & floor, then peaks */
+	cl_float	*detect_host;		/* Copy as of last sync */
+	int		detect_enabled;
+	int		detect_valid;		/* detect_host holds results */
+
+	/* Burst trigger, on the raw spectra of each batch (not fused) */
+	cl_kernel	kern_trigger;
+	cl_mem		mem_trigger;		/* First index over, peak power */
+	cl_uint		trigger_host[2];	/* Copy as of last sync */
+	cl_uint		trigger_base;		/* Spectra since last sync */
+	cl_uint		trigger_len;		/* Spectra of the last synced ones */
+	int		trigger_enabled;
+	int		trigger_valid;		/* trigger_host holds results */
+
+	/* Zoom band down conversion (buffers created on first use) */
+#define CL_DDC_TAPS_PER_DECIM	32		/* Filter length, per decimation */
+#define CL_DDC_RING		(1<<20)		/* Output samples held between syncs */
+	cl_kernel	kern_ddc;
+	cl_mem		mem_ddc_taps;
+	cl_mem		mem_ddc_hist[2];	/* Ping-pong, last input samples */
+	cl_mem		mem_ddc_out;		/* Output ring */
+	cl_float	*ddc_taps;		/* Uploaded by the next process */
+	cl_float	*ddc_host;		/* Output copy as of last sync */
+	int		ddc_decim;		/* 1 = disabled */
+	int		ddc_taps_updated;
+	int		ddc_hist_reset;		/* Clear history before next use */
+	int		ddc_hist_sel;		/* mem_ddc_hist[] holding the last one */
+	cl_uint		ddc_first;		/* Next output position in next input */
+	cl_uint		ddc_nco_phase;		/* At next input (2^32 = 1 turn) */
+	cl_uint		ddc_nco_inc;
+	cl_uint		ddc_wpos;		/* Outputs written to the ring */
+	cl_uint		ddc_rpos;		/* Outputs read back */
+	int		ddc_pending;		/* Read back by the current sync */
+	int		ddc_valid;		/* In ddc_host */
+
+	/* Registered host sample buffer */
+	cl_mem		mem_host;
+	char		*host_base;
+	size_t		host_len;
+
 	float		*fft_win;
 	int		fft_win_updated;
 
-	/* Display */
+	/* Display (CL only work objects, written by the kernels) */
 	cl_mem		mem_waterfall;
 	cl_mem		mem_histogram;
 	cl_mem		mem_spectrum;
 
-	cl_program	prog_display;
-	cl_kernel	kern_display;
+	/* Display (GL shared copies, only touched during sync) */
+	cl_mem		mem_waterfall_gl;
+	cl_mem		mem_histogram_gl;
+	cl_mem		mem_spectrum_gl;
+
+	cl_kernel	kern_display;		/* Of the max_hold program variant */
+	int		max_hold;		/* FOSPHOR_MAX_HOLD_??? */
+
+	/* Persistence (rise / decay in spectra, live average weight) */
+	cl_float	histo_t0r;
+	cl_float	histo_t0d;
+	cl_float	live_alpha;
 
 	/* Histogram range */
 	float		histo_scale;
 	float		histo_offset;
 
+	/* Profiling, events of the timed commands until they complete */
+#define CL_PROF_PENDING	256
+	struct {
+		int		enabled;
+		int		n_pend;
+		cl_event	ev[CL_PROF_PENDING];
+		int		stage[CL_PROF_PENDING];
+		cl_ulong	acc[FOSPHOR_PROF_STAGES];	/* ns since last sync */
+		struct fosphor_profile stats;
+	} prof;
+
 	/* State */
 	int		waterfall_pos;
+	int		waterfall_pos_sync;	/* As of last sync */
+	int		waterfall_dirty;	/* Rows written since last sync */
 	enum {
 		CL_BOOTING = 0,
 		CL_PENDING,
@@ -114,13 +286,60 @@ struct fosphor_cl_state
 	}
 
 
+static void
+cl_device_query_pci(cl_device_id dev_id, const char *ext, char *pci_id, size_t len)
+{
+	unsigned int domain = 0, bus, dev, fn;
+
+	if (strstr(ext, "cl_khr_pci_bus_info")) {
+		cl_uint info[4];	/* domain, bus, device, function */
+
+		if (clGetDeviceInfo(dev_id, CL_DEVICE_PCI_BUS_INFO_KHR, sizeof(info), info, NULL) != CL_SUCCESS)
+			return;
+
+		domain = info[0];
+		bus    = info[1];
+		dev    = info[2];
+		fn     = info[3];
+	} else if (strstr(ext, "cl_nv_device_attribute_query")) {
+		cl_uint nv_bus, nv_slot;
+
+		if ((clGetDeviceInfo(dev_id, CL_DEVICE_PCI_BUS_ID_NV,  sizeof(cl_uint), &nv_bus,  NULL) != CL_SUCCESS) ||
+		    (clGetDeviceInfo(dev_id, CL_DEVICE_PCI_SLOT_ID_NV, sizeof(cl_uint), &nv_slot, NULL) != CL_SUCCESS))
+			return;
+
+		bus = nv_bus;
+		dev = nv_slot >> 3;
+		fn  = nv_slot & 7;
+	} else if (strstr(ext, "cl_amd_device_attribute_query")) {
+		union {
+			struct { cl_uint type; cl_uint data[5]; } raw;
+			struct { cl_uint type; cl_char unused[17]; cl_char bus, device, function; } pcie;
+		} topo;
+
+		if ((clGetDeviceInfo(dev_id, CL_DEVICE_TOPOLOGY_AMD, sizeof(topo), &topo, NULL) != CL_SUCCESS) ||
+		    (topo.raw.type != 1))	/* PCIe */
+			return;
+
+		bus = (unsigned char)topo.pcie.bus;
+		dev = (unsigned char)topo.pcie.device;
+		fn  = (unsigned char)topo.pcie.function;
+	} else {
+		return;
+	}
+
+	snprintf(pci_id, len, "%04x:%02x:%02x.%x", domain, bus, dev, fn);
+}
+
 static int
 cl_device_query(cl_device_id dev_id, struct fosphor_cl_features *feat)
 {
 	char txt[2048];
 	cl_int err;
 	int has_nv_attr;
-	cl_bool has_image;
+	int ver_maj, ver_min;
+	cl_bool has_image, has_unified;
+	cl_uint align;
 
 	memset(feat, 0x00, sizeof(struct fosphor_cl_features));
 
@@ -144,6 +363,11 @@ cl_device_query(cl_device_id dev_id, struct fosphor_cl_features *feat)
 	if (err != CL_SUCCESS)
 		return -1;
 
+	/* Work group size, the local memory FFTs use len / 8 items */
+	err = clGetDeviceInfo(dev_id, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &feat->max_wg, NULL);
+	if (err != CL_SUCCESS)
+		return -1;
+
 	/* Image support */
 	err = clGetDeviceInfo(dev_id, CL_DEVICE_IMAGE_SUPPORT, sizeof(cl_bool), &has_image, NULL);
 	if (err != CL_SUCCESS)
@@ -151,6 +375,37 @@ cl_device_query(cl_device_id dev_id, struct fosphor_cl_features *feat)
 
 	feat->flags |= (has_image == CL_TRUE) ? FLG_CL_IMAGE : 0;
 
+	if (has_image == CL_TRUE) {
+		err = clGetDeviceInfo(dev_id, CL_DEVICE_IMAGE2D_MAX_WIDTH, sizeof(size_t), &feat->img_max_width, NULL);
+		if (err != CL_SUCCESS)
+			return -1;
+
+		err = clGetDeviceInfo(dev_id, CL_DEVICE_IMAGE2D_MAX_HEIGHT, sizeof(size_t), &feat->img_max_height, NULL);
+		if (err != CL_SUCCESS)
+			return -1;
+	}
+
+	err = clGetDeviceInfo(dev_id, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &feat->max_alloc, NULL);
+	if (err != CL_SUCCESS)
+		return -1;
+
+	err = clGetDeviceInfo(dev_id, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(cl_ulong), &feat->global_mem, NULL);
+	if (err != CL_SUCCESS)
+		return -1;
+
+	/* Host / Device memory sharing */
+	err = clGetDeviceInfo(dev_id, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(cl_bool), &has_unified, NULL);
+	if (err != CL_SUCCESS)
+		has_unified = CL_FALSE;
+
+	feat->flags |= (has_unified == CL_TRUE) ? FLG_CL_HOST_UNIFIED : 0;
+
+	err = clGetDeviceInfo(dev_id, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(cl_uint), &align, NULL);
+	if ((err != CL_SUCCESS) || (align < 8))
+		align = 1024;	/* Conservative default */
+
+	feat->mem_align = align >> 3;
+
 	/* CL/GL extension */
 	err = clGetDeviceInfo(dev_id, CL_DEVICE_EXTENSIONS, sizeof(txt)-1, txt, NULL);
 	if (err != CL_SUCCESS)
@@ -165,6 +420,9 @@ cl_device_query(cl_device_id dev_id, struct fosphor_cl_features *feat)
 	/* Check for NV attributes */
 	has_nv_attr = !!strstr(txt, "cl_nv_device_attribute_query");
 
+	/* Location on the PCI bus (if we can tell) */
+	cl_device_query_pci(dev_id, txt, feat->pci_id, sizeof(feat->pci_id));
+
 	/* Check for cl_khr_local_int32_base_atomics extension */
 	if (strstr(txt, "cl_khr_local_int32_base_atomics"))
 		feat->flags |= FLG_CL_LOCAL_ATOMIC_EXT;
@@ -179,6 +437,10 @@ cl_device_query(cl_device_id dev_id, struct fosphor_cl_features *feat)
 	if (!memcmp(txt, "OpenCL 1.", 9) && txt[9] >= '1')
 		feat->flags |= FLG_CL_OPENCL_11;
 
+	if ((sscanf(txt, "OpenCL %d.%d", &ver_maj, &ver_min) == 2) &&
+	    ((ver_maj > 1) || (ver_min >= 2)))
+		feat->flags |= FLG_CL_OPENCL_12;
+
 	/* Check if a NVidia SM11 architecture */
 	if (has_nv_attr) {
 		cl_uint nv_maj, nv_min;
@@ -263,8 +525,53 @@ cl_device_score(cl_device_id dev_id, struct fosphor_cl_features *feat)
 	return score;
 }
 
+/*
+ * Device selectors:
+ *  - "P:D"           platform / device index (as listed)
+ *  - "pci:[dddd:]bb:dd.f"  PCI bus ID
+ *  - anything else   case insensitive device name substring
+ * Among matching devices, the best scoring usable one is picked.
+ */
+static int
+cl_device_match(const char *sel, int pl_idx, int dev_idx,
+                const struct fosphor_cl_features *feat)
+{
+	char buf[sizeof(feat->name)], sub[sizeof(feat->name)];
+	int id_sel[2], n, i;
+
+	/* Auto */
+	if (!sel || !sel[0])
+		return 1;
+
+	/* Index */
+	if ((sscanf(sel, "%d:%d%n", &id_sel[0], &id_sel[1], &n) == 2) && !sel[n])
+		return (id_sel[0] == pl_idx) && (id_sel[1] == dev_idx);
+
+	/* PCI ID (domain is optional) */
+	if (!strncasecmp(sel, "pci:", 4)) {
+		size_t l = strlen(sel + 4);
+
+		if (!feat->pci_id[0] || (l > strlen(feat->pci_id)))
+			return 0;
+
+		return !strcasecmp(feat->pci_id + strlen(feat->pci_id) - l, sel + 4);
+	}
+
+	/* Name */
+	for (i=0; i<sizeof(buf)-1 && feat->name[i]; i++)
+		buf[i] = tolower(feat->name[i]);
+	buf[i] = 0;
+
+	for (i=0; i<sizeof(sub)-1 && sel[i]; i++)
+		sub[i] = tolower(sel[i]);
+	sub[i] = 0;
+
+	return !!strstr(buf, sub);
+}
+
 static int
-cl_find_device(cl_platform_id *pl_id_p, cl_device_id *dev_id_p,
+cl_find_device(const char *sel,
+               cl_platform_id *pl_id_p, cl_device_id *dev_id_p,
                struct fosphor_cl_features *feat)
 {
 	cl_platform_id pl_list[MAX_PLATFORMS], pl_id;
@@ -272,14 +579,10 @@ cl_find_device(cl_platform_id *pl_id_p, cl_device_id *dev_id_p,
 	cl_uint pl_count, dev_count, i, j;
 	cl_int err;
 	int score = -1;
-	char *env_sel;
-	int id_sel[2];
 
-	/* Check for manual selection */
-	env_sel = getenv("FOSPHOR_CL_DEV");
-	if (!env_sel || (sscanf(env_sel, "%d:%d", &id_sel[0], &id_sel[1]) != 2)) {
-		id_sel[0] = id_sel[1] = -1;
-	}
+	/* Default to the environment selection */
+	if (!sel || !sel[0])
+		sel = getenv("FOSPHOR_CL_DEV");
 
 	/* Scan each platforms */
 	err = clGetPlatformIDs(MAX_PLATFORMS, pl_list, &pl_count);
@@ -301,9 +604,10 @@ cl_find_device(cl_platform_id *pl_id_p, cl_device_id *dev_id_p,
 		{
 			struct fosphor_cl_features feat_cur;
 			int s = cl_device_score(dev_list[j], &feat_cur);
-			fprintf(stderr, "[+] Available device: %d:%d <%s> %s\n",
-				i, j, feat_cur.vendor, feat_cur.name);
-			if ((id_sel[0] == -1) ? (s > score) : ((id_sel[0] == i) && (id_sel[1] == j))) {
+			fprintf(stderr, "[+] Available device: %d:%d <%s> %s%s%s\n",
+				i, j, feat_cur.vendor, feat_cur.name,
+				feat_cur.pci_id[0] ? " @ " : "", feat_cur.pci_id);
+			if ((s > score) && cl_device_match(sel, i, j, &feat_cur)) {
 				pl_id  = pl_list[i];
 				dev_id = dev_list[j];
 				memcpy(feat, &feat_cur, sizeof(struct fosphor_cl_features));
@@ -318,6 +622,8 @@ cl_find_device(cl_platform_id *pl_id_p, cl_device_id *dev_id_p,
 		*dev_id_p = dev_id;
 		err = 0;
 	} else {
+		if (sel && sel[0])
+			fprintf(stderr, "[!] No usable OpenCL device matching '%s'\n", sel);
 		err = -ENODEV;
 	}
 
@@ -325,6 +631,227 @@ error:
 	return err;
 }
 
+/*
+ * Program binary cache
+ *
+ * Built programs are kept on disk, keyed by a hash of everything that
+ * could change the result (device, driver, build options & source), so
+ * following starts only need a (fast) binary load. Anything wrong with a
+ * cached binary just makes us fall back to a source build.
+ *
+ * Location is $FOSPHOR_CL_CACHE if set (empty disables the cache), else
+ * the user cache directory.
+ */
+
+#define CL_CACHE_MAGIC	"fosphor-clbin-1"
+
+static uint64_t
+cl_cache_hash(uint64_t h, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	/* FNV-1a */
+	while (len--)
+		h = (h ^ *p++) * 0x100000001b3ULL;
+
+	return h;
+}
+
+static uint64_t
+cl_cache_key(cl_device_id dev_id, const char *src, const char *opts)
+{
+	const cl_device_info infos[] = {
+		CL_DEVICE_NAME, CL_DEVICE_VENDOR, CL_DEVICE_VERSION, CL_DRIVER_VERSION,
+	};
+	uint64_t h = 0xcbf29ce484222325ULL;
+	char txt[256];
+	int i;
+
+	h = cl_cache_hash(h, CL_CACHE_MAGIC, sizeof(CL_CACHE_MAGIC));
+
+	for (i=0; i<4; i++) {
+		if (clGetDeviceInfo(dev_id, infos[i], sizeof(txt), txt, NULL) != CL_SUCCESS)
+			txt[0] = '\0';
+		h = cl_cache_hash(h, txt, strlen(txt) + 1);
+	}
+
+	h = cl_cache_hash(h, opts ? opts : "", strlen(opts ? opts : "") + 1);
+	h = cl_cache_hash(h, src, strlen(src));
+
+	return h;
+}
+
+static int
+cl_cache_dir(char *path, size_t len)
+{
+	const char *base, *sub;
+	int rv;
+
+	if ((base = getenv("FOSPHOR_CL_CACHE")) != NULL) {
+		sub = "";
+#ifdef _WIN32
+	} else if ((base = getenv("LOCALAPPDATA")) != NULL) {
+		sub = "/gr-fosphor";
+#else
+	} else if ((base = getenv("XDG_CACHE_HOME")) != NULL) {
+		sub = "/gr-fosphor";
+	} else if ((base = getenv("HOME")) != NULL) {
+		sub = "/.cache/gr-fosphor";
+#endif
+	} else {
+		return -ENOENT;
+	}
+
+	if (!base[0])
+		return -ENOENT;
+
+	rv = snprintf(path, len, "%s%s", base, sub);
+
+	return ((rv < 0) || ((size_t)rv >= len)) ? -ENAMETOOLONG : 0;
+}
+
+static int
+cl_cache_path(char *path, size_t len, const char *resource_name, uint64_t key)
+{
+	size_t l;
+	int rv;
+
+	rv = cl_cache_dir(path, len);
+	if (rv)
+		return rv;
+
+	l = strlen(path);
+	rv = snprintf(path + l, len - l, "/%s-%016llx.bin",
+		resource_name, (unsigned long long)key);
+
+	return ((rv < 0) || ((size_t)(l + rv) >= len)) ? -ENAMETOOLONG : 0;
+}
+
+static cl_program
+cl_cache_load(cl_device_id dev_id, cl_context ctx,
+              const char *resource_name, uint64_t key, const char *opts)
+{
+	cl_program prog = NULL;
+	char path[1024], magic[sizeof(CL_CACHE_MAGIC)];
+	unsigned char *bin = NULL;
+	uint64_t file_key;
+	size_t bin_len;
+	cl_int err, status;
+	FILE *fh;
+
+	if (cl_cache_path(path, sizeof(path), resource_name, key))
+		return NULL;
+
+	fh = fopen(path, "rb");
+	if (!fh)
+		return NULL;
+
+	/* Header: magic, key, length */
+	if ((fread(magic, sizeof(magic), 1, fh) != 1) ||
+	    memcmp(magic, CL_CACHE_MAGIC, sizeof(magic)) ||
+	    (fread(&file_key, sizeof(file_key), 1, fh) != 1) ||
+	    (file_key != key) ||
+	    (fread(&bin_len, sizeof(bin_len), 1, fh) != 1) ||
+	    (bin_len == 0) || (bin_len > (64 << 20)))
+		goto done;
+
+	/* Binary */
+	bin = malloc(bin_len);
+	if (!bin || (fread(bin, bin_len, 1, fh) != 1))
+		goto done;
+
+	/* Try to use it (needs a build, but no compilation happens) */
+	prog = clCreateProgramWithBinary(ctx, 1, &dev_id, &bin_len,
+		(const unsigned char **)&bin, &status, &err);
+	if ((err != CL_SUCCESS) || (status != CL_SUCCESS)) {
+		prog = NULL;
+		goto done;
+	}
+
+	err = clBuildProgram(prog, 0, NULL, opts, NULL, NULL);
+	if (err != CL_SUCCESS) {
+		clReleaseProgram(prog);
+		prog = NULL;
+	}
+
+done:
+	if (!prog)
+		fprintf(stderr, "[w] Cached binary for '%s' rejected, rebuilding\n", resource_name);
+
+	free(bin);
+	fclose(fh);
+
+	return prog;
+}
+
+static void
+cl_cache_store(cl_program prog, const char *resource_name, uint64_t key)
+{
+	char path[1024], path_tmp[1100];
+	unsigned char *bin = NULL;
+	size_t bin_len, l;
+	cl_int err;
+	FILE *fh;
+
+	/* Fetch binary (single device programs) */
+	err = clGetProgramInfo(prog, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &bin_len, NULL);
+	if ((err != CL_SUCCESS) || !bin_len)
+		return;
+
+	bin = malloc(bin_len);
+	if (!bin)
+		return;
+
+	err = clGetProgramInfo(prog, CL_PROGRAM_BINARIES, sizeof(unsigned char *), &bin, NULL);
+	if (err != CL_SUCCESS)
+		goto done;
+
+	/* Make sure the directory exists (parent included, for the default) */
+	if (cl_cache_dir(path, sizeof(path)))
+		goto done;
+
+	for (l=1; path[l]; l++) {
+		if (path[l] != '/')
+			continue;
+		path[l] = '\0';
+		mkdir(path, 0755);
+		path[l] = '/';
+	}
+	mkdir(path, 0755);
+
+	/* Write to a temp file and rename so readers never see partial files */
+	if (cl_cache_path(path, sizeof(path), resource_name, key))
+		goto done;
+
+	snprintf(path_tmp, sizeof(path_tmp), "%s.%d.%lx", path, (int)getpid(),
+		(unsigned long)(uintptr_t)prog);	/* (instances build in parallel) */
+
+	fh = fopen(path_tmp, "wb");
+	if (!fh)
+		goto done;
+
+	if ((fwrite(CL_CACHE_MAGIC, sizeof(CL_CACHE_MAGIC), 1, fh) != 1) ||
+	    (fwrite(&key, sizeof(key), 1, fh) != 1) ||
+	    (fwrite(&bin_len, sizeof(bin_len), 1, fh) != 1) ||
+	    (fwrite(bin, bin_len, 1, fh) != 1)) {
+		fclose(fh);
+		remove(path_tmp);
+		fprintf(stderr, "[w] Unable to write program cache '%s'\n", path);
+		goto done;
+	}
+
+	fclose(fh);
+
+#ifdef _WIN32
+	remove(path);
+#endif
+	if (rename(path_tmp, path))
+		remove(path_tmp);
+
+done:
+	free(bin);
+}
+
 static cl_program
 cl_load_program(cl_device_id dev_id, cl_context ctx,
                 const char *resource_name, const char *opts,
@@ -332,6 +859,7 @@ cl_load_program(cl_device_id dev_id, cl_context ctx,
 {
 	cl_program prog = NULL;
 	const char *src;
+	uint64_t key;
 	cl_int err;
 
 	/* Grab resource */
@@ -342,6 +870,15 @@ cl_load_program(cl_device_id dev_id, cl_context ctx,
 		goto error;
 	}
 
+	/* Try the binary cache first */
+	key = cl_cache_key(dev_id, src, opts);
+
+	prog = cl_cache_load(dev_id, ctx, resource_name, key, opts);
+	if (prog) {
+		resource_put(src);
+		return prog;
+	}
+
 	/* Create the program from sources */
 	prog = clCreateProgramWithSource(ctx, 1, (const char **)&src, NULL, &err);
 	CL_ERR_CHECK(err, "Failed to create program");
@@ -389,7 +926,12 @@ cl_load_program(cl_device_id dev_id, cl_context ctx,
 	}
 #endif
 
+	/* Save for next time */
+	cl_cache_store(prog, resource_name, key);
+
 	/* All good */
+	resource_put(src);
+
 	return prog;
 
 	/* Error path */
@@ -397,12 +939,261 @@ error:
 	if (prog)
 		clReleaseProgram(prog);
 
+	if (src)
+		resource_put(src);
+
 	if (err_ptr)
 		*err_ptr = err;
 
 	return NULL;
 }
 
+/*
+ * Context / program pool
+ *
+ * Instances that don't use CL/GL sharing only need a plain context on
+ * their device, so they all use the same one, along with the programs
+ * built in it. Each instance still has its own queues, buffers and
+ * kernels. Pooled entries stay around once created so re-creating
+ * instances (restart, FFT size change) is cheap, until flushed.
+ *
+ * The pool, the builds of its programs and the other process wide state
+ * (clFFT, compat layer) are under g_cl_lock. Instances with a private
+ * context build theirs without it, in parallel.
+ */
+
+static struct fosphor_cl_shared *g_cl_pool = NULL;
+FOSPHOR_LOCK_DEFINE(g_cl_lock);
+
+static int
+cl_histo_variant(int bins)
+{
+	int v;
+
+	for (v=0; (64 << v) < bins; v++);
+
+	return v;
+}
+
+/* Histogram bins the display kernel can count in local memory at once,
+ * next to its live / max (and NV transpose) buffers */
+static int
+cl_histo_local(const struct fosphor_cl_features *feat, int bins)
+{
+	unsigned long fixed;
+	int n;
+
+	fixed = ((feat->flags & FLG_CL_NVIDIA_SM11) ? 3 : 2) * 16 * 16 * sizeof(cl_float);
+
+	for (n=bins; (n > 64) && (fixed + 16 * n * sizeof(cl_uint) > feat->local_mem); n>>=1);
+
+	return n;
+}
+
+static void
+cl_display_opts(const struct fosphor_cl_features *feat, int bins, int max_hold,
+                char *opts, int len)
+{
+	static const char *max_hold_opts[CL_MAX_HOLD_MODES] = {
+		[FOSPHOR_MAX_HOLD_DECAY]  = " -DMAX_HOLD_DECAY",
+		[FOSPHOR_MAX_HOLD_NORMAL] = " -DMAX_HOLD_NORMAL",
+		[FOSPHOR_MAX_HOLD_LIVE]   = " -DMAX_HOLD_LIVE",
+		[FOSPHOR_MAX_HOLD_HISTO]  = " -DMAX_HOLD_HISTO",
+	};
+	const char *atomics;
+
+	if (feat->flags & FLG_CL_NVIDIA_SM11)
+		atomics = " -DUSE_NV_SM11_ATOMICS";
+	else if (!(feat->flags & FLG_CL_OPENCL_11))
+		atomics = " -DUSE_EXT_ATOMICS";
+	else
+		atomics = "";
+
+	snprintf(opts, len, "-DHISTO_BINS=%d -DHISTO_LOCAL=%d%s%s",
+		bins, cl_histo_local(feat, bins), atomics, max_hold_opts[max_hold]);
+}
+
+static void
+cl_fft_opts(const struct fosphor_cl_features *feat, int input_format,
+            int bins, char *opts, int len)
+{
+	static const char *input_opts[CL_INPUT_FORMATS] = {
+		[FOSPHOR_INPUT_CF32] = "",
+		[FOSPHOR_INPUT_CS16] = " -DINPUT_SC16",
+		[FOSPHOR_INPUT_CS8]  = " -DINPUT_SC8",
+	};
+
+	/* Fused kernels use global atomics */
+	snprintf(opts, len, "-DHISTO_BINS=%d%s%s",
+		bins,
+		(feat->flags & FLG_CL_OPENCL_11) ? " -DUSE_FUSED" : "",
+		input_opts[input_format]);
+}
+
+static void
+cl_shared_free(struct fosphor_cl_shared *sh)
+{
+	int i, j;
+
+	for (j=0; j<CL_HISTO_VARIANTS; j++) {
+		for (i=0; i<CL_MAX_HOLD_MODES; i++)
+			if (sh->prog_display[i][j])
+				clReleaseProgram(sh->prog_display[i][j]);
+
+		for (i=0; i<CL_INPUT_FORMATS; i++)
+			if (sh->prog_fft[i][j])
+				clReleaseProgram(sh->prog_fft[i][j]);
+	}
+
+	if (sh->ctx)
+		clReleaseContext(sh->ctx);
+
+	free(sh);
+}
+
+/* FFT program for an input format & histogram size, built on first use */
+static cl_program
+cl_shared_prog_fft(struct fosphor_cl_shared *sh,
+                   const struct fosphor_cl_features *feat,
+                   int input_format, int bins)
+{
+	cl_program *prog = &sh->prog_fft[input_format][cl_histo_variant(bins)];
+	cl_program rv;
+	char opts[64];
+	cl_int err;
+
+	if (sh->pooled)
+		fosphor_lock(g_cl_lock);
+
+	if (!*prog) {
+		cl_fft_opts(feat, input_format, bins, opts, sizeof(opts));
+		*prog = cl_load_program(sh->dev_id, sh->ctx, "fft.cl", opts, &err);
+	}
+
+	rv = *prog;
+
+	if (sh->pooled)
+		fosphor_unlock(g_cl_lock);
+
+	return rv;
+}
+
+/* Display program for a histogram size & max hold mode, built on first use */
+static cl_program
+cl_shared_prog_display(struct fosphor_cl_shared *sh,
+                       const struct fosphor_cl_features *feat, int bins, int max_hold)
+{
+	cl_program *prog = &sh->prog_display[max_hold][cl_histo_variant(bins)];
+	cl_program rv;
+	char opts[128];
+	cl_int err;
+
+	if (sh->pooled)
+		fosphor_lock(g_cl_lock);
+
+	if (!*prog) {
+		cl_display_opts(feat, bins, max_hold, opts, sizeof(opts));
+		*prog = cl_load_program(sh->dev_id, sh->ctx, "display.cl", opts, &err);
+	}
+
+	rv = *prog;
+
+	if (sh->pooled)
+		fosphor_unlock(g_cl_lock);
+
+	return rv;
+}
+
+/* Takes ownership of ctx, even on failure */
+static struct fosphor_cl_shared *
+cl_shared_create(cl_device_id dev_id, cl_context ctx,
+                 const struct fosphor_cl_features *feat)
+{
+	struct fosphor_cl_shared *sh;
+
+	sh = calloc(1, sizeof(struct fosphor_cl_shared));
+	if (!sh) {
+		clReleaseContext(ctx);
+		return NULL;
+	}
+
+	sh->refcnt = 1;
+	sh->dev_id = dev_id;
+	sh->ctx    = ctx;
+
+	if (!cl_shared_prog_fft(sh, feat, FOSPHOR_INPUT_CF32, FOSPHOR_HISTO_BINS_DEFAULT))
+		goto error;
+
+	if (!cl_shared_prog_display(sh, feat, FOSPHOR_HISTO_BINS_DEFAULT, FOSPHOR_MAX_HOLD_DECAY))
+		goto error;
+
+	return sh;
+
+error:
+	cl_shared_free(sh);
+	return NULL;
+}
+
+/* An instance getting it while another one (or a warmup) creates it waits
+ * for that rather than building it again */
+static struct fosphor_cl_shared *
+cl_shared_get(cl_device_id dev_id, const struct fosphor_cl_features *feat)
+{
+	struct fosphor_cl_shared *sh;
+	cl_context ctx;
+	cl_int err;
+
+	fosphor_lock(g_cl_lock);
+
+	/* Already there ? */
+	for (sh=g_cl_pool; sh; sh=sh->next) {
+		if (sh->dev_id == dev_id) {
+			sh->refcnt++;
+			goto done;
+		}
+	}
+
+	/* Create new entry (not pooled yet, its builds don't lock) */
+	ctx = clCreateContext(NULL, 1, &dev_id, NULL, NULL, &err);
+	CL_ERR_CHECK(err, "Unable to create context");
+
+	sh = cl_shared_create(dev_id, ctx, feat);
+	if (!sh)
+		goto done;
+
+	sh->pooled = 1;
+	sh->next   = g_cl_pool;
+	g_cl_pool  = sh;
+
+done:
+	fosphor_unlock(g_cl_lock);
+	return sh;
+
+error:
+	fosphor_unlock(g_cl_lock);
+	return NULL;
+}
+
+static void
+cl_shared_put(struct fosphor_cl_shared *sh)
+{
+	int dead;
+
+	if (!sh)
+		return;
+
+	if (sh->pooled)
+		fosphor_lock(g_cl_lock);
+
+	dead = !--sh->refcnt && !sh->pooled;
+
+	if (sh->pooled)
+		fosphor_unlock(g_cl_lock);
+
+	if (dead)
+		cl_shared_free(sh);
+}
+
 static cl_int
 cl_queue_clear_buffers(struct fosphor *self)
 {
@@ -424,11 +1215,14 @@ cl_queue_clear_buffers(struct fosphor *self)
 	);
 	CL_ERR_CHECK(err, "Unable to queue clear of spectrum buffer");
 
-	/* Init the waterfall image to noise floor */
+	/* Init the waterfall image to noise floor (all of it needs to go
+	 * out on next sync) */
 	color[0] = noise_floor;
 
-	img_region[0] = self->fft_len;
-	img_region[1] = 1024;
+	cl->waterfall_dirty = self->wf_depth;
+
+	img_region[0] = self->img_len;
+	img_region[1] = self->wf_depth;
 	img_region[2] = 1;
 
 	err = clEnqueueFillImage(cl->cq,
@@ -442,8 +1236,8 @@ cl_queue_clear_buffers(struct fosphor *self)
 	/* Init the histogram image to all 0.0f values */
 	color[0] = 0.0f;
 
-	img_region[0] = self->fft_len;
-	img_region[1] = 128;
+	img_region[0] = self->img_len;
+	img_region[1] = self->histo_bins;
 	img_region[2] = 1;
 
 	err = clEnqueueFillImage(cl->cq,
@@ -472,7 +1266,7 @@ cl_init_buffers_gl(struct fosphor *self)
 
 	/* GL shared objects */
 		/* Waterfall texture */
-	cl->mem_waterfall = clCreateFromGLTexture(cl->ctx,
+	cl->mem_waterfall_gl = clCreateFromGLTexture(cl->ctx,
 		CL_MEM_WRITE_ONLY, GL_TEXTURE_2D, 0,
 		fosphor_gl_get_shared_id(self, GL_ID_TEX_WATERFALL),
 		&err
@@ -480,15 +1274,15 @@ cl_init_buffers_gl(struct fosphor *self)
 	CL_ERR_CHECK(err, "Unable to share waterfall texture into OpenCL context");
 
 		/* Histogram texture */
-	cl->mem_histogram = clCreateFromGLTexture(cl->ctx,
-		CL_MEM_READ_WRITE, GL_TEXTURE_2D, 0,
+	cl->mem_histogram_gl = clCreateFromGLTexture(cl->ctx,
+		CL_MEM_WRITE_ONLY, GL_TEXTURE_2D, 0,
 		fosphor_gl_get_shared_id(self, GL_ID_TEX_HISTOGRAM),
 		&err
 	);
 	CL_ERR_CHECK(err, "Unable to share histogram texture into OpenCL context");
 
 		/* Spectrum VBO */
-	cl->mem_spectrum = clCreateFromGLBuffer(cl->ctx,
+	cl->mem_spectrum_gl = clCreateFromGLBuffer(cl->ctx,
 		CL_MEM_WRITE_ONLY,
 		fosphor_gl_get_shared_id(self, GL_ID_VBO_SPECTRUM),
 		&err
@@ -503,19 +1297,58 @@ error:
 }
 
 static int
-cl_init_buffers_nogl(struct fosphor *self)
+cl_have_half_images(cl_context ctx)
 {
-	struct fosphor_cl_state *cl = self->cl;
-	cl_image_format img_fmt;
-	cl_image_desc img_desc;
-	cl_int err;
+	cl_image_format *fmts;
+	cl_uint i, n = 0;
+	int rv = 0;
+
+	if (clGetSupportedImageFormats(ctx, CL_MEM_READ_WRITE, CL_MEM_OBJECT_IMAGE2D,
+	                               0, NULL, &n) != CL_SUCCESS || !n)
+		return 0;
+
+	fmts = malloc(n * sizeof(cl_image_format));
+	if (!fmts)
+		return 0;
+
+	if (clGetSupportedImageFormats(ctx, CL_MEM_READ_WRITE, CL_MEM_OBJECT_IMAGE2D,
+	                               n, fmts, NULL) == CL_SUCCESS) {
+		for (i=0; i<n; i++) {
+			if ((fmts[i].image_channel_order == CL_R) &&
+			    (fmts[i].image_channel_data_type == CL_HALF_FLOAT)) {
+				rv = 1;
+				break;
+			}
+		}
+	}
+
+	free(fmts);
+
+	return rv;
+}
+
+static int
+cl_init_buffers_nogl(struct fosphor *self)
+{
+	struct fosphor_cl_state *cl = self->cl;
+	cl_image_format img_fmt;
+	cl_image_desc img_desc;
+	cl_int err;
 
 	/* Common settings */
-	img_fmt.image_channel_order = CL_R;
-	img_fmt.image_channel_data_type = CL_FLOAT;
+	if (cl->mem_waterfall_gl) {
+		/* Match the shared images so we can copy into them */
+		err = clGetImageInfo(cl->mem_waterfall_gl, CL_IMAGE_FORMAT,
+		                     sizeof(img_fmt), &img_fmt, NULL);
+		CL_ERR_CHECK(err, "Unable to query shared waterfall image format");
+	} else {
+		img_fmt.image_channel_order = CL_R;
+		img_fmt.image_channel_data_type =
+			(self->flags & FLG_FOSPHOR_HALF) ? CL_HALF_FLOAT : CL_FLOAT;
+	}
 
 	img_desc.image_type = CL_MEM_OBJECT_IMAGE2D;
-	img_desc.image_width = self->fft_len;
+	img_desc.image_width = self->img_len;
 	img_desc.image_depth = 0;
 	img_desc.image_array_size = 0;
 	img_desc.image_row_pitch = 0;
@@ -525,7 +1358,7 @@ cl_init_buffers_nogl(struct fosphor *self)
 	img_desc.buffer = NULL;
 
 	/* Waterfall texture */
-	img_desc.image_height = 1024;
+	img_desc.image_height = self->wf_depth;
 
 	cl->mem_waterfall = clCreateImage(
 		cl->ctx,
@@ -538,7 +1371,7 @@ cl_init_buffers_nogl(struct fosphor *self)
 	CL_ERR_CHECK(err, "Unable to create waterfall image");
 
 	/* Histogram texture */
-	img_desc.image_height = 128;
+	img_desc.image_height = self->histo_bins;
 
 	cl->mem_histogram = clCreateImage(
 		cl->ctx,
@@ -567,517 +1400,2444 @@ error:
 	return err;
 }
 
-
-static int
-cl_do_init(struct fosphor *self)
+/* Accounts the completed timed commands, keep the others for later */
+static void
+cl_prof_harvest(struct fosphor_cl_state *cl)
 {
-	struct fosphor_cl_state *cl = self->cl;
-	cl_context_properties ctx_props[7];
-	const char *disp_opts;
-	cl_int err;
+	int i, n = 0;
 
-	/* Setup some options */
-	if ((cl->feat.type == CL_DEVICE_TYPE_GPU) &&
-	    (cl->feat.flags & FLG_CL_GL_SHARING))
+	for (i=0; i<cl->prof.n_pend; i++)
 	{
-		/* Only use CLGL sharing with GPU. Most CPU impl of it will
-		 * just fail with float textures */
-		self->flags |= FLG_FOSPHOR_USE_CLGL_SHARING;
-	}
+		cl_event ev = cl->prof.ev[i];
+		cl_ulong t_start, t_end;
+		cl_int err, status;
 
-	/* Context */
-	ctx_props[0] = 0;
+		if (!ev)	/* Enqueue failed */
+			continue;
 
-	if (self->flags & FLG_FOSPHOR_USE_CLGL_SHARING)
-	{
-		/* Setup context properties */
-#if defined(__APPLE__) || defined(MACOSX)
+		err = clGetEventInfo(ev, CL_EVENT_COMMAND_EXECUTION_STATUS,
+			sizeof(cl_int), &status, NULL);
 
-			/* OSX variant */
-		ctx_props[0] = CL_CONTEXT_PROPERTY_USE_CGL_SHAREGROUP_APPLE;
-		ctx_props[1] = (cl_context_properties) CGLGetShareGroup(CGLGetCurrentContext());
-		ctx_props[2] = 0;
+		if ((err == CL_SUCCESS) && (status > CL_COMPLETE)) {
+			cl->prof.ev[n]    = ev;
+			cl->prof.stage[n] = cl->prof.stage[i];
+			n++;
+			continue;
+		}
 
-#elif defined(_WIN32)
+		if ((err == CL_SUCCESS) && (status == CL_COMPLETE) &&
+		    (clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_START,
+				sizeof(cl_ulong), &t_start, NULL) == CL_SUCCESS) &&
+		    (clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_END,
+				sizeof(cl_ulong), &t_end, NULL) == CL_SUCCESS) &&
+		    (t_end > t_start))
+			cl->prof.acc[cl->prof.stage[i]] += t_end - t_start;
 
-			/* Win 32 variant */
-		ctx_props[0] = CL_GL_CONTEXT_KHR;
-		ctx_props[1] = (cl_context_properties) wglGetCurrentContext();
-		ctx_props[2] = CL_WGL_HDC_KHR;
-		ctx_props[3] = (cl_context_properties) wglGetCurrentDC();
-		ctx_props[4] = CL_CONTEXT_PLATFORM;
-		ctx_props[5] = (cl_context_properties) cl->pl_id;
-		ctx_props[6] = 0;
+		clReleaseEvent(ev);
+	}
 
-#else
+	cl->prof.n_pend = n;
+}
 
-			/* Linux variant */
-		ctx_props[0] = CL_GL_CONTEXT_KHR;
-		ctx_props[1] = (cl_context_properties) glXGetCurrentContext();
-		ctx_props[2] = CL_GLX_DISPLAY_KHR;
-		ctx_props[3] = (cl_context_properties) glXGetCurrentDisplay();
-		ctx_props[4] = CL_CONTEXT_PLATFORM;
-		ctx_props[5] = (cl_context_properties) cl->pl_id;
-		ctx_props[6] = 0;
+/* Event to attach to a command of that stage (NULL if not profiling) */
+static cl_event *
+cl_prof_ev(struct fosphor_cl_state *cl, int stage)
+{
+	int n;
 
-#endif
+	if (!cl->prof.enabled)
+		return NULL;
 
-		/* Attempt to create context */
-		cl->ctx = clCreateContext(ctx_props, 1, &cl->dev_id, NULL, NULL, &err);
-		if (err != CL_SUCCESS) {
-			/* Failed, we'll retry again without CL/GL sharing */
-			fprintf(stderr, "[w] CL Error (%d, %s:%d): "
-				"Unable to create context with CL/GL sharing, retrying without\n",
-				err, __FILE__, __LINE__);
+	if (cl->prof.n_pend == CL_PROF_PENDING)
+		cl_prof_harvest(cl);
 
-			self->flags &= ~FLG_FOSPHOR_USE_CLGL_SHARING;
-			ctx_props[0] = 0;
-		}
+	if (cl->prof.n_pend == CL_PROF_PENDING) {
+		cl->prof.stats.lost++;
+		return NULL;
 	}
 
-	if (!(self->flags & FLG_FOSPHOR_USE_CLGL_SHARING))
-	{
-		cl->ctx = clCreateContext(ctx_props, 1, &cl->dev_id, NULL, NULL, &err);
-		CL_ERR_CHECK(err, "Unable to create context");
-	}
+	n = cl->prof.n_pend++;
 
-	/* Command Queue */
-	cl->cq = clCreateCommandQueue(cl->ctx, cl->dev_id, 0, &err);
-	CL_ERR_CHECK(err, "Unable to create command queue");
+	cl->prof.ev[n]    = NULL;
+	cl->prof.stage[n] = stage;
 
-	/* FFT buffers */
-	cl->mem_fft_in = clCreateBuffer(cl->ctx,
-		CL_MEM_READ_ONLY,
-		2 * sizeof(cl_float) * self->fft_len * FOSPHOR_FFT_MAX_BATCH,
-		NULL,
-		&err
-	);
-	CL_ERR_CHECK(err, "Unable to allocate FFT input buffer");
+	return &cl->prof.ev[n];
+}
 
-	cl->mem_fft_out = clCreateBuffer(cl->ctx,
-		CL_MEM_READ_WRITE,
-		2 * sizeof(cl_float) * self->fft_len * FOSPHOR_FFT_MAX_BATCH,
-		NULL,
-		&err
-	);
-	CL_ERR_CHECK(err, "Unable to allocate FFT output buffer");
+/* Time a command whose event is also used for something else */
+static void
+cl_prof_add(struct fosphor_cl_state *cl, int stage, cl_event ev)
+{
+	cl_event *ev_p;
 
-	cl->mem_fft_win = clCreateBuffer(cl->ctx,
-		CL_MEM_READ_ONLY,
-		2 * sizeof(cl_float) * self->fft_len,
-		NULL,
-		&err
-	);
-	CL_ERR_CHECK(err, "Unable to allocate FFT window buffer");
+	if (!ev)
+		return;
 
-	/* FFT program/kernels */
-	cl->prog_fft = cl_load_program(cl->dev_id, cl->ctx, "fft.cl", NULL, &err);
-	if (!cl->prog_fft)
-		goto error;
+	ev_p = cl_prof_ev(cl, stage);
+	if (!ev_p)
+		return;
 
-	char kernel_name[32];
-	snprintf(kernel_name, sizeof(kernel_name), "fft1D_%d", self->fft_len);
-	cl->kern_fft = clCreateKernel(cl->prog_fft, kernel_name, &err);
-	CL_ERR_CHECK(err, "Unable to create FFT kernel");
+	clRetainEvent(ev);
+	*ev_p = ev;
+}
 
-	/* Configure static FFT kernel args */
-	err  = clSetKernelArg(cl->kern_fft, 0, sizeof(cl_mem), &cl->mem_fft_in);
-	err |= clSetKernelArg(cl->kern_fft, 1, sizeof(cl_mem), &cl->mem_fft_out);
-	err |= clSetKernelArg(cl->kern_fft, 2, sizeof(cl_mem), &cl->mem_fft_win);
+/* End of a sync period, update the statistics */
+#define CL_PROF_ALPHA	0.1
 
-	CL_ERR_CHECK(err, "Unable to configure FFT kernel");
+static void
+cl_prof_sync(struct fosphor_cl_state *cl)
+{
+	struct fosphor_profile *st = &cl->prof.stats;
+	int i;
 
-	/* Display kernel result memory objects */
-	if (self->flags & FLG_FOSPHOR_USE_CLGL_SHARING)
-		err = cl_init_buffers_gl(self);
-	else
-		err = cl_init_buffers_nogl(self);
+	if (!cl->prof.enabled)
+		return;
 
-	if (err != CL_SUCCESS)
-		goto error;
+	cl_prof_harvest(cl);
 
-	/* Display program/kernel */
-	if (cl->feat.flags & FLG_CL_NVIDIA_SM11)
-		disp_opts = "-DUSE_NV_SM11_ATOMICS";
-	else if (!(cl->feat.flags & FLG_CL_OPENCL_11))
-		disp_opts = "-DUSE_EXT_ATOMICS";
-	else
-		disp_opts = NULL;
+	for (i=0; i<FOSPHOR_PROF_STAGES; i++)
+	{
+		double v = cl->prof.acc[i] * 1e-9;
 
-	cl->prog_display = cl_load_program(cl->dev_id, cl->ctx, "display.cl", disp_opts, &err);
-	if (!cl->prog_display)
-		goto error;
+		st->last[i] = v;
+		st->avg[i]  = st->syncs ? (st->avg[i] + CL_PROF_ALPHA * (v - st->avg[i])) : v;
+		if (v > st->max[i])
+			st->max[i] = v;
 
-	cl->kern_display = clCreateKernel(cl->prog_display, "display", &err);
-	CL_ERR_CHECK(err, "Unable to create display kernel");
+		cl->prof.acc[i] = 0;
+	}
 
-	/* Configure static display kernel args */
-	cl_uint fft_log2_len = fosphor_fft_len_log_get();
-	cl_float histo_t0r   = 16.0f;
-	cl_float histo_t0d   = 1024.0f;
-	cl_float live_alpha  = 0.002f;
+	st->syncs++;
+}
 
-	err  = clSetKernelArg(cl->kern_display,  0, sizeof(cl_mem),   &cl->mem_fft_out);
-	err |= clSetKernelArg(cl->kern_display,  1, sizeof(cl_int),   &fft_log2_len);
 
-	err |= clSetKernelArg(cl->kern_display,  3, sizeof(cl_mem),   &cl->mem_waterfall);
+static cl_int
+cl_upload_samples(struct fosphor *self, int set, void *samples, int len,
+                  cl_mem *in_p, cl_mem *sub_p, cl_event *ev_p)
+{
+	struct fosphor_cl_state *cl = self->cl;
+	size_t size = self->sample_size * len;
+	cl_int err;
 
-	err |= clSetKernelArg(cl->kern_display,  5, sizeof(cl_mem),   &cl->mem_histogram);
-	err |= clSetKernelArg(cl->kern_display,  6, sizeof(cl_mem),   &cl->mem_histogram);
-	err |= clSetKernelArg(cl->kern_display,  7, sizeof(cl_float), &histo_t0r);
-	err |= clSetKernelArg(cl->kern_display,  8, sizeof(cl_float), &histo_t0d);
+	*in_p  = NULL;
+	*sub_p = NULL;
+	*ev_p  = NULL;
 
-	err |= clSetKernelArg(cl->kern_display, 11, sizeof(cl_mem),   &cl->mem_spectrum);
-	err |= clSetKernelArg(cl->kern_display, 12, sizeof(cl_float), &live_alpha);
+	if (cl->mem_host &&
+	    ((char *)samples >= cl->host_base) &&
+	    ((char *)samples + size <= cl->host_base + cl->host_len))
+	{
+		/* Samples are in the registered (pinned) host area */
+		size_t ofs = (char *)samples - cl->host_base;
+		void *ptr;
+
+		/* Map / Unmap hands the up-to-date region over to the device.
+		 * This is free for implementations that don't shadow it */
+		ptr = clEnqueueMapBuffer(cl->cq_xfer, cl->mem_host, CL_FALSE,
+			CL_MAP_WRITE_INVALIDATE_REGION, ofs, size,
+			0, NULL, cl_prof_ev(cl, FOSPHOR_PROF_UPLOAD), &err);
+		CL_ERR_CHECK(err, "Unable to map host sample buffer");
+
+		/* If the device works from host memory anyway, read in place */
+		if ((cl->feat.flags & FLG_CL_HOST_UNIFIED) && !(ofs % cl->feat.mem_align))
+		{
+			cl_buffer_region rgn = { ofs, size };
 
-	CL_ERR_CHECK(err, "Unable to configure display kernel");
+			*sub_p = clCreateSubBuffer(cl->mem_host, CL_MEM_READ_ONLY,
+				CL_BUFFER_CREATE_TYPE_REGION, &rgn, &err);
+			if (err != CL_SUCCESS)
+				*sub_p = NULL;
+		}
 
-	/* All done */
-	err = 0;
+		err = clEnqueueUnmapMemObject(cl->cq_xfer, cl->mem_host, ptr,
+			0, NULL, *sub_p ? ev_p : cl_prof_ev(cl, FOSPHOR_PROF_UPLOAD));
+		CL_ERR_CHECK(err, "Unable to unmap host sample buffer");
+
+		if (*sub_p) {
+			*in_p = *sub_p;
+		} else {
+			/* DMA copy from pinned memory */
+			*in_p = cl->mem_fft_in[set];
+
+			err = clEnqueueCopyBuffer(cl->cq_xfer,
+				cl->mem_host, cl->mem_fft_in[set],
+				ofs, 0, size,
+				0, NULL, ev_p
+			);
+			CL_ERR_CHECK(err, "Unable to copy data to FFT input buffer");
+		}
+	}
+	else
+	{
+		/* Plain copy from user memory */
+		*in_p = cl->mem_fft_in[set];
+
+		err = clEnqueueWriteBuffer(
+			cl->cq_xfer,
+			cl->mem_fft_in[set],
+			CL_FALSE,
+			0, size, samples,
+			0, NULL, ev_p
+		);
+		CL_ERR_CHECK(err, "Unable to copy data to FFT input buffer");
+	}
+
+	return CL_SUCCESS;
 
 error:
+	if (*sub_p) {
+		clReleaseMemObject(*sub_p);
+		*sub_p = NULL;
+	}
+
+	if (*ev_p) {
+		clReleaseEvent(*ev_p);
+		*ev_p = NULL;
+	}
+
 	return err;
 }
 
-static void
-cl_do_release(struct fosphor_cl_state *cl)
+
+/* Fused FFT + display kernel if the FFT size and device allow it */
+static cl_kernel
+cl_fused_kernel(struct fosphor *self, cl_program prog)
 {
-	if (cl->kern_display)
-		clReleaseKernel(cl->kern_display);
+	struct fosphor_cl_state *cl = self->cl;
+	char kernel_name[32];
+	size_t wg_size;
+	cl_ulong local_mem;
+	cl_kernel kern;
+	cl_int err;
 
-	if (cl->prog_display)
-		clReleaseProgram(cl->prog_display);
+	/* Only for the sizes done all in local memory */
+	if (!self->opts.fused ||
+	    (self->fft_len > 4096) ||
+	    !(cl->feat.flags & FLG_CL_OPENCL_11) ||
+	    (cl->feat.local_mem < 2 * sizeof(cl_float) * self->fft_len))
+		return NULL;
 
-	if (cl->mem_spectrum)
-		clReleaseMemObject(cl->mem_spectrum);
+	snprintf(kernel_name, sizeof(kernel_name), "fft1D_%d_fused", self->fft_len);
+	kern = clCreateKernel(prog, kernel_name, &err);
+	if (err != CL_SUCCESS)
+		return NULL;
 
-	if (cl->mem_histogram)
-		clReleaseMemObject(cl->mem_histogram);
+	/* The accumulators use more registers, check it still fits */
+	err  = clGetKernelWorkGroupInfo(kern, cl->dev_id, CL_KERNEL_WORK_GROUP_SIZE,
+	                                sizeof(size_t), &wg_size, NULL);
+	err |= clGetKernelWorkGroupInfo(kern, cl->dev_id, CL_KERNEL_LOCAL_MEM_SIZE,
+	                                sizeof(cl_ulong), &local_mem, NULL);
 
-	if (cl->mem_waterfall)
-		clReleaseMemObject(cl->mem_waterfall);
+	if ((err != CL_SUCCESS) ||
+	    (wg_size < (size_t)(self->fft_len / 8)) ||
+	    (local_mem > cl->feat.local_mem))
+	{
+		clReleaseKernel(kern);
+		return NULL;
+	}
 
-	if (cl->kern_fft)
-		clReleaseKernel(cl->kern_fft);
+	return kern;
+}
 
-	if (cl->prog_fft)
-		clReleaseProgram(cl->prog_fft);
+/* Zoom band of n_in new samples into the output ring. Failures only stop
+ * the down conversion, the spectrum goes on */
+static cl_int
+cl_queue_ddc(struct fosphor *self, cl_mem mem_in, cl_uint n_in, cl_event *ev_p)
+{
+	struct fosphor_cl_state *cl = self->cl;
+	cl_uint decim  = cl->ddc_decim;
+	cl_uint n_taps = CL_DDC_TAPS_PER_DECIM * decim;
+	cl_uint n_hist = n_taps - 1;
+	cl_uint n_out, out_pos, out_mask = CL_DDC_RING - 1;
+	cl_mem mem_hist_in  = cl->mem_ddc_hist[cl->ddc_hist_sel];
+	cl_mem mem_hist_out = cl->mem_ddc_hist[cl->ddc_hist_sel ^ 1];
+	size_t global;
+	cl_int err;
 
-	if (cl->mem_fft_win)
-		clReleaseMemObject(cl->mem_fft_win);
+	/* New filter, or new decimation too */
+	if (cl->ddc_taps_updated) {
+		err = clEnqueueWriteBuffer(
+			cl->cq,
+			cl->mem_ddc_taps,
+			CL_FALSE,
+			0, 2 * sizeof(cl_float) * n_taps, cl->ddc_taps,
+			0, NULL, cl_prof_ev(cl, FOSPHOR_PROF_UPLOAD)
+		);
+		CL_ERR_CHECK(err, "Unable to copy data to zoom filter buffer");
 
-	if (cl->mem_fft_out)
-		clReleaseMemObject(cl->mem_fft_out);
+		cl->ddc_taps_updated = 0;
+	}
 
-	if (cl->mem_fft_in)
-		clReleaseMemObject(cl->mem_fft_in);
+	if (cl->ddc_hist_reset) {
+		const cl_float zero = 0.0f;
 
-	if (cl->cq)
-		clReleaseCommandQueue(cl->cq);
+		err = clEnqueueFillBuffer(cl->cq,
+			mem_hist_in,
+			&zero, sizeof(cl_float),
+			0, 2 * sizeof(cl_float) * n_hist,
+			0, NULL, NULL
+		);
+		CL_ERR_CHECK(err, "Unable to queue clear of zoom history buffer");
 
-	if (cl->ctx)
-		clReleaseContext(cl->ctx);
-}
+		cl->ddc_hist_reset = 0;
+	}
 
+	/* Outputs falling in this input */
+	n_out = (cl->ddc_first < n_in) ? ((n_in - 1 - cl->ddc_first) / decim + 1) : 0;
+	out_pos = cl->ddc_wpos & out_mask;
 
-static cl_int
-cl_lock_unlock(struct fosphor_cl_state *cl, int lock, cl_event *event)
-{
-	cl_mem objs[3];
+	err  = 0;
+	err |= clSetKernelArg(cl->kern_ddc,  0, sizeof(cl_mem),   &mem_in);
+	err |= clSetKernelArg(cl->kern_ddc,  1, sizeof(cl_uint),  &n_in);
+	err |= clSetKernelArg(cl->kern_ddc,  2, sizeof(cl_float), &self->sample_scale);
+	err |= clSetKernelArg(cl->kern_ddc,  3, sizeof(cl_mem),   &mem_hist_in);
+	err |= clSetKernelArg(cl->kern_ddc,  4, sizeof(cl_mem),   &mem_hist_out);
+	err |= clSetKernelArg(cl->kern_ddc,  5, sizeof(cl_mem),   &cl->mem_ddc_taps);
+	err |= clSetKernelArg(cl->kern_ddc,  6, sizeof(cl_uint),  &n_taps);
+	err |= clSetKernelArg(cl->kern_ddc,  7, sizeof(cl_uint),  &decim);
+	err |= clSetKernelArg(cl->kern_ddc,  8, sizeof(cl_uint),  &cl->ddc_first);
+	err |= clSetKernelArg(cl->kern_ddc,  9, sizeof(cl_uint),  &n_out);
+	err |= clSetKernelArg(cl->kern_ddc, 10, sizeof(cl_uint),  &cl->ddc_nco_phase);
+	err |= clSetKernelArg(cl->kern_ddc, 11, sizeof(cl_uint),  &cl->ddc_nco_inc);
+	err |= clSetKernelArg(cl->kern_ddc, 12, sizeof(cl_mem),   &cl->mem_ddc_out);
+	err |= clSetKernelArg(cl->kern_ddc, 13, sizeof(cl_uint),  &out_pos);
+	err |= clSetKernelArg(cl->kern_ddc, 14, sizeof(cl_uint),  &out_mask);
+	CL_ERR_CHECK(err, "Unable to configure zoom kernel");
+
+	/* One work item per output, then per history sample */
+	global = n_out + n_hist;
+
+	err = clEnqueueNDRangeKernel(cl->cq, cl->kern_ddc, 1, NULL, &global, NULL,
+		0, NULL, ev_p);
+	CL_ERR_CHECK(err, "Unable to queue zoom kernel execution");
+
+	/* Where the next input starts */
+	cl->ddc_hist_sel ^= 1;
+	cl->ddc_first += n_out * decim - n_in;
+	cl->ddc_nco_phase += cl->ddc_nco_inc * n_in;
+	cl->ddc_wpos += n_out;
 
-	objs[0] = cl->mem_waterfall;
-	objs[1] = cl->mem_histogram;
-	objs[2] = cl->mem_spectrum;
+	return CL_SUCCESS;
 
-	return lock ?
-		clEnqueueAcquireGLObjects(cl->cq, 3, objs, 0, NULL, event) :
-		clEnqueueReleaseGLObjects(cl->cq, 3, objs, 0, NULL, event);
+error:
+	cl->ddc_decim = 1;
+	return err;
 }
 
-
-/* -------------------------------------------------------------------------- */
-/* Exposed API                                                                */
-/* -------------------------------------------------------------------------- */
-
-int
-fosphor_cl_init(struct fosphor *self)
+/* Multi-pass FFT of a batch into mem_fft_out[set] */
+static cl_int
+cl_queue_fft_passes(struct fosphor *self, int set, cl_mem mem_in,
+                    cl_uint hop, int n_spectra, cl_event ev_upload)
 {
-	struct fosphor_cl_state *cl;
+	struct fosphor_cl_state *cl = self->cl;
+	cl_mem src, dst;
+	cl_uint p;
+	size_t global[2];
 	cl_int err;
+	int n_passes, log2_radix, pass;
 
-	/* Allocate structure */
-	cl = malloc(sizeof(struct fosphor_cl_state));
-	if (!cl)
-		return -ENOMEM;
+	/* First pass does the leftover bits (or radix-8), then radix-8 */
+	log2_radix = self->chan_len_log % 3;
+	if (!log2_radix)
+		log2_radix = 3;
 
-	self->cl = cl;
+	n_passes = 1 + (self->chan_len_log - log2_radix) / 3;
 
-	memset(cl, 0, sizeof(struct fosphor_cl_state));
+	/* Ping-pong so that the last pass lands in the output */
+	dst = ((n_passes - 1) & 1) ? cl->mem_fft_tmp : cl->mem_fft_out[set];
 
-	cl->state = CL_BOOTING;
+	err  = clSetKernelArg(cl->kern_fft_first, 0, sizeof(cl_mem),  &mem_in);
+	err |= clSetKernelArg(cl->kern_fft_first, 1, sizeof(cl_mem),  &dst);
+	err |= clSetKernelArg(cl->kern_fft_first, 3, sizeof(cl_uint), &hop);
+	CL_ERR_CHECK(err, "Unable to configure FFT pass kernel");
 
-	/* Find suitable device */
-	if (cl_find_device(&cl->pl_id, &cl->dev_id, &cl->feat)) {
-		fprintf(stderr, "[!] No suitable OpenCL device found\n");
-		goto error;
-	}
+	global[0] = self->chan_len >> log2_radix;
+	global[1] = n_spectra;
 
-	/* Report selected device */
-	fprintf(stderr, "[+] Selected device: %s\n", cl->feat.name);
+	err = clEnqueueNDRangeKernel(cl->cq, cl->kern_fft_first, 2, NULL, global, NULL,
+		ev_upload ? 1 : 0, ev_upload ? &ev_upload : NULL,
+		(n_passes == 1) ? &cl->ev_fft[set] : cl_prof_ev(cl, FOSPHOR_PROF_FFT));
+	CL_ERR_CHECK(err, "Unable to queue FFT pass kernel execution");
 
-	/* Setup compatibility layer for this platform */
-	cl_compat_init();
-	cl_compat_check_platform(cl->pl_id);
+	/* Remaining passes */
+	p = 1 << log2_radix;
+	global[0] = self->chan_len >> 3;
 
-	/* Initialize selected platform / device */
-	err = cl_do_init(self);
-	if (err)
-		goto error;
+	for (pass=1; pass<n_passes; pass++)
+	{
+		src = dst;
+		dst = ((n_passes - 1 - pass) & 1) ? cl->mem_fft_tmp : cl->mem_fft_out[set];
 
-	/* Done */
-	return 0;
+		err  = clSetKernelArg(cl->kern_fft_pass, 0, sizeof(cl_mem),  &src);
+		err |= clSetKernelArg(cl->kern_fft_pass, 1, sizeof(cl_mem),  &dst);
+		err |= clSetKernelArg(cl->kern_fft_pass, 2, sizeof(cl_uint), &p);
+		CL_ERR_CHECK(err, "Unable to configure FFT pass kernel");
 
-	/* Error path */
-error:
-	fosphor_cl_release(self);
+		err = clEnqueueNDRangeKernel(cl->cq, cl->kern_fft_pass, 2, NULL, global, NULL,
+			0, NULL, (pass == n_passes - 1) ? &cl->ev_fft[set] : cl_prof_ev(cl, FOSPHOR_PROF_FFT));
+		CL_ERR_CHECK(err, "Unable to queue FFT pass kernel execution");
 
-	return -EIO;
+		p <<= 3;
+	}
+
+	return CL_SUCCESS;
+
+error:
+	return err;
 }
 
-void
-fosphor_cl_release(struct fosphor *self)
+#ifdef ENABLE_CLFFT
+/* The library has global state, set up for the first instance using it */
+static int g_clfft_users = 0;
+
+static int
+cl_clfft_get(void)
 {
-	struct fosphor_cl_state *cl = self->cl;
+	clfftSetupData sd;
+	int rv = 0;
 
-	/* Safety */
-	if (!cl)
-		return;
+	fosphor_lock(g_cl_lock);
 
-	/* Release the GL objects */
-	if ((cl->state == CL_PENDING) && (self->flags & FLG_FOSPHOR_USE_CLGL_SHARING))
-	{
-		cl_lock_unlock(cl, 0, NULL);
-	}
+	if (g_clfft_users++)
+		goto done;
 
-	/* Release all allocated OpenCL resources */
-	cl_do_release(cl);
+	clfftInitSetupData(&sd);
 
-	/* Release structure */
-	free(cl);
+	if (clfftSetup(&sd) != CLFFT_SUCCESS) {
+		fprintf(stderr, "[!] Unable to initialize clFFT\n");
+		g_clfft_users = 0;
+		rv = -1;
+	}
 
-	/* Nothing left */
-	self->cl = NULL;
+done:
+	fosphor_unlock(g_cl_lock);
+	return rv;
 }
 
-int
-fosphor_cl_process(struct fosphor *self,
-                   void *samples, int len)
+static void
+cl_clfft_put(void)
 {
-	struct fosphor_cl_state *cl = self->cl;
+	fosphor_lock(g_cl_lock);
 
+	if (g_clfft_users && !--g_clfft_users)
+		clfftTeardown();
+
+	fosphor_unlock(g_cl_lock);
+}
+
+/* Plan for batch FFTs, baked on first use. A few are kept as the batch
+ * size seldom varies much */
+static clfftPlanHandle *
+cl_clfft_plan(struct fosphor *self, int batch)
+{
+	struct fosphor_cl_state *cl = self->cl;
+	size_t len = self->chan_len;
+	clfftStatus st;
+	int i;
+
+	for (i=0; i<CL_CLFFT_PLANS; i++)
+		if (cl->clfft[i].batch == batch)
+			return &cl->clfft[i].plan;
+
+	i = cl->clfft_next;
+	cl->clfft_next = (i + 1) % CL_CLFFT_PLANS;
+
+	if (cl->clfft[i].batch) {
+		clfftDestroyPlan(&cl->clfft[i].plan);
+		cl->clfft[i].batch = 0;
+	}
+
+	st = clfftCreateDefaultPlan(&cl->clfft[i].plan, cl->ctx, CLFFT_1D, &len);
+	if (st != CLFFT_SUCCESS)
+		return NULL;
+
+	st = clfftSetPlanPrecision(cl->clfft[i].plan, CLFFT_SINGLE);
+	if (st == CLFFT_SUCCESS)
+		st = clfftSetLayout(cl->clfft[i].plan,
+			CLFFT_COMPLEX_INTERLEAVED, CLFFT_COMPLEX_INTERLEAVED);
+	if (st == CLFFT_SUCCESS)
+		st = clfftSetResultLocation(cl->clfft[i].plan, CLFFT_INPLACE);
+	if (st == CLFFT_SUCCESS)
+		st = clfftSetPlanBatchSize(cl->clfft[i].plan, batch);
+	if (st == CLFFT_SUCCESS)
+		st = clfftSetPlanDistance(cl->clfft[i].plan, len, len);
+	if (st == CLFFT_SUCCESS)
+		st = clfftBakePlan(cl->clfft[i].plan, 1, &cl->cq, NULL, NULL);
+
+	if (st != CLFFT_SUCCESS) {
+		clfftDestroyPlan(&cl->clfft[i].plan);
+		return NULL;
+	}
+
+	cl->clfft[i].batch = batch;
+
+	return &cl->clfft[i].plan;
+}
+
+static void
+cl_clfft_release(struct fosphor_cl_state *cl)
+{
+	int i;
+
+	for (i=0; i<CL_CLFFT_PLANS; i++) {
+		if (cl->clfft[i].batch)
+			clfftDestroyPlan(&cl->clfft[i].plan);
+		cl->clfft[i].batch = 0;
+	}
+
+	if (cl->kern_fft_win) {
+		clReleaseKernel(cl->kern_fft_win);
+		cl->kern_fft_win = NULL;
+		cl_clfft_put();
+	}
+}
+
+/* Window into mem_fft_out[set], then in place library FFT */
+static cl_int
+cl_queue_fft_clfft(struct fosphor *self, int set, cl_mem mem_in,
+                   cl_uint hop, int n_ffts, cl_event ev_upload)
+{
+	struct fosphor_cl_state *cl = self->cl;
+	clfftPlanHandle *plan;
+	size_t global[2];
 	cl_int err;
-	int locked = 0;
+
+	err  = clSetKernelArg(cl->kern_fft_win, 0, sizeof(cl_mem),  &mem_in);
+	err |= clSetKernelArg(cl->kern_fft_win, 1, sizeof(cl_mem),  &cl->mem_fft_out[set]);
+	err |= clSetKernelArg(cl->kern_fft_win, 3, sizeof(cl_uint), &hop);
+	CL_ERR_CHECK(err, "Unable to configure FFT window kernel");
+
+	global[0] = self->chan_len;
+	global[1] = n_ffts;
+
+	err = clEnqueueNDRangeKernel(cl->cq, cl->kern_fft_win, 2, NULL, global, NULL,
+		ev_upload ? 1 : 0, ev_upload ? &ev_upload : NULL,
+		cl_prof_ev(cl, FOSPHOR_PROF_FFT));
+	CL_ERR_CHECK(err, "Unable to queue FFT window kernel execution");
+
+	plan = cl_clfft_plan(self, n_ffts);
+	if (!plan) {
+		err = CL_OUT_OF_RESOURCES;
+		CL_ERR_CHECK(err, "Unable to create clFFT plan");
+	}
+
+	err = clfftEnqueueTransform(*plan, CLFFT_FORWARD, 1, &cl->cq,
+		0, NULL, &cl->ev_fft[set], &cl->mem_fft_out[set], NULL, NULL);
+	CL_ERR_CHECK(err, "Unable to queue clFFT transform");
+
+	return CL_SUCCESS;
+
+error:
+	return err;
+}
+#endif /* ENABLE_CLFFT */
+
+/* FFT of n_ffts windows, hop samples apart, into mem_fft_out[set] with
+ * the selected backend (not fused) */
+static cl_int
+cl_queue_fft(struct fosphor *self, int set, cl_mem mem_in,
+             cl_uint hop, int n_ffts, cl_event ev_upload)
+{
+	struct fosphor_cl_state *cl = self->cl;
 	size_t local[2], global[2];
-	int n_spectra = len / self->fft_len;
+	cl_int err;
 
-	/* Validate batch size */
-	if (len & ((FOSPHOR_FFT_MULT_BATCH*self->fft_len)-1))
-		return -EINVAL;
+#ifdef ENABLE_CLFFT
+	if (cl->fft_backend == CL_FFT_CLFFT)
+		return cl_queue_fft_clfft(self, set, mem_in, hop, n_ffts, ev_upload);
+#endif
+
+	/* Large FFTs, multiple passes through global memory */
+	if (!cl->kern_fft)
+		return cl_queue_fft_passes(self, set, mem_in, hop, n_ffts, ev_upload);
+
+	/* One work group per spectrum */
+	err  = clSetKernelArg(cl->kern_fft, 0, sizeof(cl_mem),  &mem_in);
+	err |= clSetKernelArg(cl->kern_fft, 1, sizeof(cl_mem),  &cl->mem_fft_out[set]);
+	err |= clSetKernelArg(cl->kern_fft, 3, sizeof(cl_uint), &hop);
+	CL_ERR_CHECK(err, "Unable to configure FFT kernel");
+
+	global[0] = self->chan_len / 8;
+	global[1] = n_ffts;
+	local[0] = global[0];
+	local[1] = 1;
+
+	err = clEnqueueNDRangeKernel(cl->cq, cl->kern_fft, 2, NULL, global, local,
+		ev_upload ? 1 : 0, ev_upload ? &ev_upload : NULL, &cl->ev_fft[set]);
+	CL_ERR_CHECK(err, "Unable to queue FFT kernel execution");
+
+	return CL_SUCCESS;
+
+error:
+	return err;
+}
+
+#ifdef ENABLE_CLFFT
+static double
+cl_time_now(void)
+{
+#ifdef _WIN32
+	return (double)clock() / CLOCKS_PER_SEC;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+/* Best time of a few full batches with a backend, < 0 if it fails */
+static double
+cl_fft_bench(struct fosphor *self, int backend)
+{
+	struct fosphor_cl_state *cl = self->cl;
+	double t, best = -1.0;
+	int i;
+
+	cl->fft_backend = backend;
+
+	for (i=0; i<4; i++)
+	{
+		t = cl_time_now();
+
+		if (cl_queue_fft(self, 0, cl->mem_fft_in[0], self->chan_len,
+		                 cl->fft_max_batch * self->channels, NULL) != CL_SUCCESS)
+			return -1.0;
+
+		clFinish(cl->cq);
+
+		t = cl_time_now() - t;
+
+		if (cl->ev_fft[0]) {
+			clReleaseEvent(cl->ev_fft[0]);
+			cl->ev_fft[0] = NULL;
+		}
+
+		/* First run bakes plans / warms caches */
+		if (i && ((best < 0.0) || (t < best)))
+			best = t;
+	}
+
+	return best;
+}
+#endif
+
+/* Choose the FFT backend for our length. $FOSPHOR_FFT_BACKEND ("builtin"
+ * or "clfft") forces it, else the first instance of each length on the
+ * device times them and the result is kept with the shared context */
+static void
+cl_fft_select(struct fosphor *self, cl_program prog_fft)
+{
+	struct fosphor_cl_state *cl = self->cl;
+	const char *sel = getenv("FOSPHOR_FFT_BACKEND");
+
+	cl->fft_backend = CL_FFT_BUILTIN;
+
+	if (cl->fused || (sel && !strcasecmp(sel, "builtin")))
+		return;
+
+#ifdef ENABLE_CLFFT
+	{
+		int *known = &cl->shared->fft_backend[self->chan_len_log];
+		const cl_uint zero = 0;
+		cl_uint fft_log2_len = self->chan_len_log;
+		int prof = cl->prof.enabled;
+		double t_builtin, t_clfft;
+		cl_int err;
+
+		if (*known && !sel) {
+			cl->fft_backend = *known;
+			if (cl->fft_backend == CL_FFT_BUILTIN)
+				return;
+		}
+
+		if (cl_clfft_get())
+			return;
+
+		cl->kern_fft_win = clCreateKernel(prog_fft, "fft_window", &err);
+		if (err == CL_SUCCESS) {
+			err  = clSetKernelArg(cl->kern_fft_win, 2, sizeof(cl_mem), &cl->mem_fft_win);
+			err |= clSetKernelArg(cl->kern_fft_win, 4, sizeof(cl_uint), &fft_log2_len);
+		}
+		if (err != CL_SUCCESS) {
+			if (cl->kern_fft_win)
+				clReleaseKernel(cl->kern_fft_win);
+			cl->kern_fft_win = NULL;
+			cl_clfft_put();
+			cl->fft_backend = CL_FFT_BUILTIN;
+			return;
+		}
+
+		if (cl->fft_backend == CL_FFT_CLFFT)
+			return;
+
+		/* Time both on a silent batch, out of the profiling stats */
+		cl->prof.enabled = 0;
+
+		clEnqueueFillBuffer(cl->cq, cl->mem_fft_in[0], &zero, sizeof(cl_uint),
+			0, self->sample_size * self->fft_len * cl->fft_max_batch,
+			0, NULL, NULL);
+
+		t_builtin = cl_fft_bench(self, CL_FFT_BUILTIN);
+		t_clfft   = cl_fft_bench(self, CL_FFT_CLFFT);
+
+		cl->prof.enabled = prof;
+
+		if (sel && !strcasecmp(sel, "clfft"))
+			cl->fft_backend = (t_clfft >= 0.0) ? CL_FFT_CLFFT : CL_FFT_BUILTIN;
+		else if ((t_clfft >= 0.0) && ((t_builtin < 0.0) || (t_clfft < t_builtin)))
+			cl->fft_backend = CL_FFT_CLFFT;
+		else
+			cl->fft_backend = CL_FFT_BUILTIN;
+
+		if (!sel)
+			*known = cl->fft_backend;
+
+		fprintf(stderr, "[+] FFT %d: built-in %.2f ms, clFFT %.2f ms per batch, using %s\n",
+			self->chan_len, t_builtin * 1e3, t_clfft * 1e3,
+			(cl->fft_backend == CL_FFT_CLFFT) ? "clFFT" : "built-in kernels");
+
+		if (cl->fft_backend == CL_FFT_BUILTIN)
+			cl_clfft_release(cl);
+	}
+#endif
+}
+
+/* Persistence args of the display kernels, no rebuild needed */
+static cl_int
+cl_persistence_args(struct fosphor_cl_state *cl)
+{
+	cl_int err;
+
+	err  = clSetKernelArg(cl->kern_display,  7, sizeof(cl_float), &cl->histo_t0r);
+	err |= clSetKernelArg(cl->kern_display,  8, sizeof(cl_float), &cl->histo_t0d);
+	err |= clSetKernelArg(cl->kern_display, 12, sizeof(cl_float), &cl->live_alpha);
+
+	if (cl->fused)
+		err |= clSetKernelArg(cl->kern_fft, 10, sizeof(cl_float), &cl->live_alpha);
+
+	return err;
+}
+
+/* (Re)creates the display kernel from the program variant of the current
+ * max hold mode and sets its static args. The mode being a build option,
+ * the kernel has no branch for it */
+static cl_int
+cl_display_kernel(struct fosphor *self)
+{
+	struct fosphor_cl_state *cl = self->cl;
+	cl_program prog;
+	cl_kernel kern;
+	cl_uint fft_log2_len = self->fft_len_log;
+	cl_uint disp_red     = self->img_red;
+	cl_uint disp_mode    = self->opts.disp_mode;
+	cl_uint wf_write     = (cl->wf_decim <= 1);
+	cl_int err;
+
+	prog = cl_shared_prog_display(cl->shared, &cl->feat, self->histo_bins, cl->max_hold);
+	if (!prog)
+		return CL_BUILD_PROGRAM_FAILURE;
+
+	kern = clCreateKernel(prog, cl->fused ? "display_merge" : "display", &err);
+	CL_ERR_CHECK(err, "Unable to create display kernel");
+
+	/* Commands already queued keep the previous one alive */
+	if (cl->kern_display)
+		clReleaseKernel(cl->kern_display);
+
+	cl->kern_display = kern;
+
+	if (cl->fused)
+	{
+		err  = clSetKernelArg(cl->kern_display,  0, sizeof(cl_mem),   &cl->mem_fused_part);
+		err |= clSetKernelArg(cl->kern_display,  2, sizeof(cl_int),   &fft_log2_len);
+
+		err |= clSetKernelArg(cl->kern_display,  4, sizeof(cl_mem),   &cl->mem_histo_cnt);
+		err |= clSetKernelArg(cl->kern_display,  5, sizeof(cl_mem),   &cl->mem_histogram);
+		err |= clSetKernelArg(cl->kern_display,  6, sizeof(cl_mem),   &cl->mem_histogram);
+
+		err |= clSetKernelArg(cl->kern_display, 11, sizeof(cl_mem),   &cl->mem_spectrum);
+	}
+	else
+	{
+		err  = clSetKernelArg(cl->kern_display,  1, sizeof(cl_int),   &fft_log2_len);
+
+		err |= clSetKernelArg(cl->kern_display,  3, sizeof(cl_mem),   &cl->mem_waterfall);
+
+		err |= clSetKernelArg(cl->kern_display,  5, sizeof(cl_mem),   &cl->mem_histogram);
+		err |= clSetKernelArg(cl->kern_display,  6, sizeof(cl_mem),   &cl->mem_histogram);
+
+		err |= clSetKernelArg(cl->kern_display, 11, sizeof(cl_mem),   &cl->mem_spectrum);
+
+		err |= clSetKernelArg(cl->kern_display, 13, sizeof(cl_uint),  &wf_write);
+		err |= clSetKernelArg(cl->kern_display, 14, sizeof(cl_uint),  &disp_red);
+		err |= clSetKernelArg(cl->kern_display, 15, sizeof(cl_uint),  &disp_mode);
+	}
+
+	err |= cl_persistence_args(cl);
+	CL_ERR_CHECK(err, "Unable to configure display kernel");
+
+error:
+	return err;
+}
+
+/* Only use CLGL sharing with GPU. Most CPU impl of it will just fail
+ * with float textures */
+static int
+cl_want_clgl_sharing(const struct fosphor_cl_features *feat, int headless)
+{
+	return (feat->type == CL_DEVICE_TYPE_GPU) &&
+	       (feat->flags & FLG_CL_GL_SHARING) &&
+	       !headless;
+}
+
+static int
+cl_do_init(struct fosphor *self)
+{
+	struct fosphor_cl_state *cl = self->cl;
+	cl_context_properties ctx_props[7];
+	cl_program prog_fft, prog_display;
+	cl_int err;
+	int i;
+
+	/* Setup some options */
+	if (cl_want_clgl_sharing(&cl->feat, self->opts.headless))
+		self->flags |= FLG_FOSPHOR_USE_CLGL_SHARING;
+
+	/* Context */
+	ctx_props[0] = 0;
+
+	if (self->flags & FLG_FOSPHOR_USE_CLGL_SHARING)
+	{
+		/* Setup context properties */
+#if defined(__APPLE__) || defined(MACOSX)
+
+			/* OSX variant */
+		ctx_props[0] = CL_CONTEXT_PROPERTY_USE_CGL_SHAREGROUP_APPLE;
+		ctx_props[1] = (cl_context_properties) CGLGetShareGroup(CGLGetCurrentContext());
+		ctx_props[2] = 0;
+
+#elif defined(_WIN32)
+
+			/* Win 32 variant */
+		ctx_props[0] = CL_GL_CONTEXT_KHR;
+		ctx_props[1] = (cl_context_properties) wglGetCurrentContext();
+		ctx_props[2] = CL_WGL_HDC_KHR;
+		ctx_props[3] = (cl_context_properties) wglGetCurrentDC();
+		ctx_props[4] = CL_CONTEXT_PLATFORM;
+		ctx_props[5] = (cl_context_properties) cl->pl_id;
+		ctx_props[6] = 0;
+
+#else
+
+			/* Linux variant */
+		ctx_props[0] = CL_GL_CONTEXT_KHR;
+		ctx_props[1] = (cl_context_properties) glXGetCurrentContext();
+		ctx_props[2] = CL_GLX_DISPLAY_KHR;
+		ctx_props[3] = (cl_context_properties) glXGetCurrentDisplay();
+		ctx_props[4] = CL_CONTEXT_PLATFORM;
+		ctx_props[5] = (cl_context_properties) cl->pl_id;
+		ctx_props[6] = 0;
+
+#endif
+
+		/* Attempt to create context (private to this instance) */
+		cl->ctx = clCreateContext(ctx_props, 1, &cl->dev_id, NULL, NULL, &err);
+		if (err == CL_SUCCESS) {
+			cl->shared = cl_shared_create(cl->dev_id, cl->ctx, &cl->feat);
+			if (!cl->shared) {
+				err = CL_BUILD_PROGRAM_FAILURE;
+				goto error;
+			}
+		} else {
+			/* Failed, we'll retry again without CL/GL sharing */
+			fprintf(stderr, "[w] CL Error (%d, %s:%d): "
+				"Unable to create context with CL/GL sharing, retrying without\n",
+				err, __FILE__, __LINE__);
+
+			self->flags &= ~FLG_FOSPHOR_USE_CLGL_SHARING;
+			ctx_props[0] = 0;
+		}
+	}
+
+	if (!(self->flags & FLG_FOSPHOR_USE_CLGL_SHARING))
+	{
+		/* Use the pooled context for this device */
+		cl->shared = cl_shared_get(cl->dev_id, &cl->feat);
+		if (!cl->shared) {
+			err = CL_INVALID_CONTEXT;
+			goto error;
+		}
+	}
+
+	cl->ctx = cl->shared->ctx;
+
+	/* Half float display images, if the device can write them */
+	if ((self->flags & FLG_FOSPHOR_HALF) && !cl_have_half_images(cl->ctx)) {
+		fprintf(stderr, "[w] No CL half float images, using full precision\n");
+		fosphor_img_full(self);
+	}
+
+	/* Command Queues */
+	cl->prof.enabled = !!self->opts.profiling;
+
+	cl->cq = clCreateCommandQueue(cl->ctx, cl->dev_id,
+		cl->prof.enabled ? CL_QUEUE_PROFILING_ENABLE : 0, &err);
+	CL_ERR_CHECK(err, "Unable to create command queue");
+
+	if (cl->n_sets > 1) {
+		/* Uploads get their own queue so they overlap compute */
+		cl->cq_xfer = clCreateCommandQueue(cl->ctx, cl->dev_id,
+			cl->prof.enabled ? CL_QUEUE_PROFILING_ENABLE : 0, &err);
+		CL_ERR_CHECK(err, "Unable to create transfer command queue");
+	} else {
+		cl->cq_xfer = cl->cq;
+	}
+
+	/* FFT window */
+	cl->mem_fft_win = clCreateBuffer(cl->ctx,
+		CL_MEM_READ_ONLY,
+		2 * sizeof(cl_float) * self->chan_len,
+		NULL,
+		&err
+	);
+	CL_ERR_CHECK(err, "Unable to allocate FFT window buffer");
+
+	/* FFT program for our input format */
+	prog_fft = cl_shared_prog_fft(cl->shared, &cl->feat,
+		self->opts.input_format, self->histo_bins);
+	if (!prog_fft) {
+		err = CL_BUILD_PROGRAM_FAILURE;
+		goto error;
+	}
+
+	/* FFT kernel, fused with the display one if possible */
+	cl->kern_fft = cl_fused_kernel(self, prog_fft);
+	cl->fused = !!cl->kern_fft;
+
+	if (cl->fused) {
+		fprintf(stderr, "[+] Using fused FFT/display kernels\n");
+	} else if (self->chan_len <= 4096) {
+		char kernel_name[32];
+		snprintf(kernel_name, sizeof(kernel_name), "fft1D_%d", self->chan_len);
+		cl->kern_fft = clCreateKernel(prog_fft, kernel_name, &err);
+		CL_ERR_CHECK(err, "Unable to create FFT kernel");
+	} else {
+		char kernel_name[32];
+		cl_uint fft_log2_len = self->chan_len_log;
+		int rem = self->chan_len_log % 3;
+
+		/* First pass (radix-2/4 for the leftover bits if any) */
+		snprintf(kernel_name, sizeof(kernel_name), "fft_global_first_r%d", 1 << (rem ? rem : 3));
+		cl->kern_fft_first = clCreateKernel(prog_fft, kernel_name, &err);
+		CL_ERR_CHECK(err, "Unable to create FFT pass kernel");
+
+		err  = clSetKernelArg(cl->kern_fft_first, 2, sizeof(cl_mem), &cl->mem_fft_win);
+		err |= clSetKernelArg(cl->kern_fft_first, 4, sizeof(cl_uint), &fft_log2_len);
+		CL_ERR_CHECK(err, "Unable to configure FFT pass kernel");
+
+		/* Then only radix-8 */
+		cl->kern_fft_pass = clCreateKernel(prog_fft, "fft_global_r8", &err);
+		CL_ERR_CHECK(err, "Unable to create FFT pass kernel");
+
+		err = clSetKernelArg(cl->kern_fft_pass, 3, sizeof(cl_uint), &fft_log2_len);
+		CL_ERR_CHECK(err, "Unable to configure FFT pass kernel");
+	}
+
+	/* FFT buffers (sized for the largest batch of that length) */
+	cl->fft_max_batch = self->fft_max_batch;
+
+	for (i=0; i<cl->n_sets; i++)
+	{
+		cl->mem_fft_in[i] = clCreateBuffer(cl->ctx,
+			CL_MEM_READ_ONLY,
+			self->sample_size * self->fft_len * cl->fft_max_batch,
+			NULL,
+			&err
+		);
+		CL_ERR_CHECK(err, "Unable to allocate FFT input buffer");
+
+		if (cl->fused)
+			continue;
+
+		cl->mem_fft_out[i] = clCreateBuffer(cl->ctx,
+			CL_MEM_READ_WRITE,
+			2 * sizeof(cl_float) * self->fft_len * cl->fft_max_batch,
+			NULL,
+			&err
+		);
+		CL_ERR_CHECK(err, "Unable to allocate FFT output buffer");
+	}
+
+	if (!cl->kern_fft && !cl->fused) {
+		cl->mem_fft_tmp = clCreateBuffer(cl->ctx,
+			CL_MEM_READ_WRITE,
+			2 * sizeof(cl_float) * self->fft_len * cl->fft_max_batch,
+			NULL,
+			&err
+		);
+		CL_ERR_CHECK(err, "Unable to allocate FFT scratch buffer");
+	}
+
+	if (cl->fused)
+	{
+		const cl_uint zero = 0;
+
+		cl->mem_fused_part = clCreateBuffer(cl->ctx,
+			CL_MEM_READ_WRITE,
+			2 * sizeof(cl_float) * self->fft_len * CL_FUSED_GROUPS,
+			NULL,
+			&err
+		);
+		CL_ERR_CHECK(err, "Unable to allocate fused partials buffer");
+
+		cl->mem_histo_cnt = clCreateBuffer(cl->ctx,
+			CL_MEM_READ_WRITE,
+			sizeof(cl_uint) * self->fft_len * self->histo_bins,
+			NULL,
+			&err
+		);
+		CL_ERR_CHECK(err, "Unable to allocate histogram counts buffer");
+
+		/* The merge kernel resets them after each use */
+		err = clEnqueueFillBuffer(cl->cq,
+			cl->mem_histo_cnt,
+			&zero, sizeof(cl_uint),
+			0, sizeof(cl_uint) * self->fft_len * self->histo_bins,
+			0, NULL, NULL
+		);
+		CL_ERR_CHECK(err, "Unable to queue clear of histogram counts buffer");
+	}
+
+	/* Configure static FFT kernel args (in/out depend on the set) */
+	if (cl->kern_fft) {
+		err = clSetKernelArg(cl->kern_fft, 2, sizeof(cl_mem), &cl->mem_fft_win);
+		CL_ERR_CHECK(err, "Unable to configure FFT kernel");
+	}
+
+	/* Built-in kernels or library, whichever is faster here */
+	cl_fft_select(self, prog_fft);
+
+	/* Zoom band down conversion, configured when enabled */
+	cl->kern_ddc = clCreateKernel(prog_fft, "ddc", &err);
+	CL_ERR_CHECK(err, "Unable to create zoom kernel");
+
+	cl->ddc_decim = 1;
+
+	/* Display kernel result memory objects. The kernels always work
+	 * in CL only objects, shared ones are just the sync destination */
+	if (self->flags & FLG_FOSPHOR_USE_CLGL_SHARING) {
+		err = cl_init_buffers_gl(self);
+		if (err != CL_SUCCESS)
+			goto error;
+	}
+
+	err = cl_init_buffers_nogl(self);
+	if (err != CL_SUCCESS)
+		goto error;
+
+	/* Display kernels, the others don't depend on the max hold mode */
+	cl->avg_count  = 1;
+	cl->wf_decim   = 1;
+	cl->max_hold   = FOSPHOR_MAX_HOLD_DECAY;
+	cl->histo_t0r  = 16.0f;
+	cl->histo_t0d  = 1024.0f;
+	cl->live_alpha = 0.002f;
+
+	prog_display = cl_shared_prog_display(cl->shared, &cl->feat, self->histo_bins, cl->max_hold);
+	if (!prog_display) {
+		err = CL_BUILD_PROGRAM_FAILURE;
+		goto error;
+	}
+
+	if (!cl->fused) {
+		cl->kern_avg = clCreateKernel(prog_display, "average", &err);
+		CL_ERR_CHECK(err, "Unable to create averaging kernel");
+
+		cl->kern_wf = clCreateKernel(prog_display, "waterfall", &err);
+		CL_ERR_CHECK(err, "Unable to create waterfall kernel");
+
+		cl->kern_trigger = clCreateKernel(prog_display, "trigger", &err);
+		CL_ERR_CHECK(err, "Unable to create trigger kernel");
+	}
+
+	cl->kern_detect = clCreateKernel(prog_display, "detect", &err);
+	CL_ERR_CHECK(err, "Unable to create peak detection kernel");
+
+	/* Configure static kernel args */
+	cl_uint fft_log2_len = self->fft_len_log;
+	cl_uint disp_red     = self->img_red;
+	cl_uint disp_mode    = self->opts.disp_mode;
+
+	if (cl->fused)
+	{
+		err  = clSetKernelArg(cl->kern_fft,      1, sizeof(cl_mem),   &cl->mem_fused_part);
+		err |= clSetKernelArg(cl->kern_fft,      5, sizeof(cl_mem),   &cl->mem_waterfall);
+		err |= clSetKernelArg(cl->kern_fft,      7, sizeof(cl_mem),   &cl->mem_histo_cnt);
+
+		CL_ERR_CHECK(err, "Unable to configure fused kernels");
+	}
+	else
+	{
+		err  = clSetKernelArg(cl->kern_avg,      1, sizeof(cl_int),   &fft_log2_len);
+
+		err |= clSetKernelArg(cl->kern_wf,       1, sizeof(cl_int),   &fft_log2_len);
+		err |= clSetKernelArg(cl->kern_wf,       6, sizeof(cl_mem),   &cl->mem_waterfall);
+		err |= clSetKernelArg(cl->kern_wf,       8, sizeof(cl_uint),  &disp_red);
+		err |= clSetKernelArg(cl->kern_wf,       9, sizeof(cl_uint),  &disp_mode);
+
+		err |= clSetKernelArg(cl->kern_trigger,  1, sizeof(cl_uint),  &fft_log2_len);
+
+		CL_ERR_CHECK(err, "Unable to configure averaging / waterfall kernels");
+	}
+
+	err = cl_display_kernel(self);
+	if (err != CL_SUCCESS)
+		goto error;
+
+	err  = clSetKernelArg(cl->kern_detect, 0, sizeof(cl_mem), &cl->mem_spectrum);
+	err |= clSetKernelArg(cl->kern_detect, 1, sizeof(cl_int), &fft_log2_len);
+	CL_ERR_CHECK(err, "Unable to configure peak detection kernel");
+
+	/* All done */
+	err = 0;
+
+error:
+	return err;
+}
+
+static void
+cl_ddc_free(struct fosphor_cl_state *cl)
+{
+	int i;
+
+	if (cl->mem_ddc_out)
+		clReleaseMemObject(cl->mem_ddc_out);
+
+	for (i=0; i<2; i++)
+		if (cl->mem_ddc_hist[i])
+			clReleaseMemObject(cl->mem_ddc_hist[i]);
+
+	if (cl->mem_ddc_taps)
+		clReleaseMemObject(cl->mem_ddc_taps);
+
+	free(cl->ddc_host);
+	free(cl->ddc_taps);
+
+	cl->mem_ddc_out     = NULL;
+	cl->mem_ddc_hist[0] = NULL;
+	cl->mem_ddc_hist[1] = NULL;
+	cl->mem_ddc_taps    = NULL;
+	cl->ddc_host = NULL;
+	cl->ddc_taps = NULL;
+}
+
+static void
+cl_do_release(struct fosphor_cl_state *cl)
+{
+	int i;
+
+	for (i=0; i<cl->prof.n_pend; i++)
+		if (cl->prof.ev[i])
+			clReleaseEvent(cl->prof.ev[i]);
+
+	cl_ddc_free(cl);
+
+	if (cl->kern_ddc)
+		clReleaseKernel(cl->kern_ddc);
+
+	free(cl->detect_host);
+
+	if (cl->mem_detect)
+		clReleaseMemObject(cl->mem_detect);
+
+	if (cl->kern_detect)
+		clReleaseKernel(cl->kern_detect);
+
+	if (cl->mem_trigger)
+		clReleaseMemObject(cl->mem_trigger);
+
+	if (cl->kern_trigger)
+		clReleaseKernel(cl->kern_trigger);
+
+	if (cl->mem_wf_acc)
+		clReleaseMemObject(cl->mem_wf_acc);
+
+	if (cl->kern_wf)
+		clReleaseKernel(cl->kern_wf);
+
+	if (cl->mem_avg_out)
+		clReleaseMemObject(cl->mem_avg_out);
+
+	if (cl->mem_avg_acc)
+		clReleaseMemObject(cl->mem_avg_acc);
+
+	if (cl->kern_avg)
+		clReleaseKernel(cl->kern_avg);
+
+	if (cl->kern_display)
+		clReleaseKernel(cl->kern_display);
+
+	if (cl->mem_spectrum_gl)
+		clReleaseMemObject(cl->mem_spectrum_gl);
+
+	if (cl->mem_histogram_gl)
+		clReleaseMemObject(cl->mem_histogram_gl);
+
+	if (cl->mem_waterfall_gl)
+		clReleaseMemObject(cl->mem_waterfall_gl);
+
+	if (cl->mem_spectrum)
+		clReleaseMemObject(cl->mem_spectrum);
+
+	if (cl->mem_histogram)
+		clReleaseMemObject(cl->mem_histogram);
+
+	if (cl->mem_waterfall)
+		clReleaseMemObject(cl->mem_waterfall);
+
+	if (cl->mem_histo_cnt)
+		clReleaseMemObject(cl->mem_histo_cnt);
+
+	if (cl->mem_fused_part)
+		clReleaseMemObject(cl->mem_fused_part);
+
+#ifdef ENABLE_CLFFT
+	cl_clfft_release(cl);
+#endif
+
+	if (cl->mem_fft_tmp)
+		clReleaseMemObject(cl->mem_fft_tmp);
+
+	if (cl->kern_fft_pass)
+		clReleaseKernel(cl->kern_fft_pass);
+
+	if (cl->kern_fft_first)
+		clReleaseKernel(cl->kern_fft_first);
+
+	if (cl->kern_fft)
+		clReleaseKernel(cl->kern_fft);
+
+	if (cl->mem_fft_win)
+		clReleaseMemObject(cl->mem_fft_win);
+
+	for (i=0; i<CL_MAX_SETS; i++)
+	{
+		if (cl->ev_fft[i])
+			clReleaseEvent(cl->ev_fft[i]);
+
+		if (cl->mem_fft_out[i])
+			clReleaseMemObject(cl->mem_fft_out[i]);
+
+		if (cl->mem_fft_in[i])
+			clReleaseMemObject(cl->mem_fft_in[i]);
+	}
+
+	if (cl->mem_host)
+		clReleaseMemObject(cl->mem_host);
+
+	if (cl->cq_xfer && (cl->cq_xfer != cl->cq))
+		clReleaseCommandQueue(cl->cq_xfer);
+
+	if (cl->cq)
+		clReleaseCommandQueue(cl->cq);
+
+	cl_shared_put(cl->shared);
+}
+
+
+static cl_int
+cl_lock_unlock(struct fosphor_cl_state *cl, int lock, cl_event *event)
+{
+	cl_mem objs[3];
+
+	objs[0] = cl->mem_waterfall_gl;
+	objs[1] = cl->mem_histogram_gl;
+	objs[2] = cl->mem_spectrum_gl;
+
+	return lock ?
+		clEnqueueAcquireGLObjects(cl->cq, 3, objs, 0, NULL, event) :
+		clEnqueueReleaseGLObjects(cl->cq, 3, objs, 0, NULL, event);
+}
+
+
+/* -------------------------------------------------------------------------- */
+/* Exposed API                                                                */
+/* -------------------------------------------------------------------------- */
+
+/* Describe all devices (up to max), returns the total count */
+int
+fosphor_cl_list_devices(struct fosphor_device_info *list, int max)
+{
+	cl_platform_id pl_list[MAX_PLATFORMS];
+	cl_device_id dev_list[MAX_DEVICES];
+	cl_uint pl_count, dev_count, i, j;
+	cl_int err;
+	int n = 0;
+
+	err = clGetPlatformIDs(MAX_PLATFORMS, pl_list, &pl_count);
+	CL_ERR_CHECK(err, "Unable to fetch platform IDs");
+
+	for (i=0; i<pl_count; i++)
+	{
+		if (clGetDeviceIDs(pl_list[i], CL_DEVICE_TYPE_ALL, MAX_DEVICES, dev_list, &dev_count) != CL_SUCCESS)
+			continue;
+
+		for (j=0; j<dev_count; j++, n++)
+		{
+			struct fosphor_cl_features feat;
+			struct fosphor_device_info *di = &list[n];
+			int s;
+
+			if (n >= max)
+				continue;
+
+			s = cl_device_score(dev_list[j], &feat);
+
+			memset(di, 0x00, sizeof(struct fosphor_device_info));
+
+			di->platform  = i;
+			di->device    = j;
+			di->gpu       = (feat.type == CL_DEVICE_TYPE_GPU);
+			di->local_mem  = feat.local_mem;
+			di->global_mem = feat.global_mem;
+			di->score     = s;
+
+			memcpy(di->name,   feat.name,   sizeof(di->name) - 1);
+			memcpy(di->vendor, feat.vendor, sizeof(di->vendor) - 1);
+			memcpy(di->pci_id, feat.pci_id, sizeof(di->pci_id) - 1);
+
+			if (feat.flags & FLG_CL_GL_SHARING)	di->flags |= FDI_GL_SHARING;
+			if (feat.flags & FLG_CL_IMAGE)		di->flags |= FDI_IMAGE;
+			if (feat.flags & FLG_CL_OPENCL_11)	di->flags |= FDI_OPENCL_11;
+			if (feat.flags & FLG_CL_OPENCL_12)	di->flags |= FDI_OPENCL_12;
+			if (feat.flags & FLG_CL_HOST_UNIFIED)	di->flags |= FDI_HOST_UNIFIED;
+		}
+	}
+
+	return n;
+
+error:
+	return -EIO;
+}
+
+/* Create the pooled context & programs for the device fosphor_cl_init()
+ * would select, so the first init doesn't pay for them. Instances that
+ * will use CL/GL sharing get a private context at init instead, for those
+ * only the program cache is filled (from a context released right away) */
+int
+fosphor_cl_pool_warmup(const char *device, int headless)
+{
+	struct fosphor_cl_shared *sh;
+	struct fosphor_cl_features feat;
+	cl_platform_id pl_id;
+	cl_device_id dev_id;
+	cl_context ctx;
+	cl_int err;
+
+	if (cl_find_device(device, &pl_id, &dev_id, &feat)) {
+		fprintf(stderr, "[!] No suitable OpenCL device found\n");
+		return -ENODEV;
+	}
+
+	fosphor_lock(g_cl_lock);
+	cl_compat_init();
+	cl_compat_check_platform(pl_id);
+	fosphor_unlock(g_cl_lock);
+
+	if (cl_want_clgl_sharing(&feat, headless)) {
+		ctx = clCreateContext(NULL, 1, &dev_id, NULL, NULL, &err);
+		CL_ERR_CHECK(err, "Unable to create context");
+
+		sh = cl_shared_create(dev_id, ctx, &feat);
+	} else {
+		sh = cl_shared_get(dev_id, &feat);
+	}
+
+	if (!sh)
+		return -EIO;
+
+	cl_shared_put(sh);
+
+	return 0;
+
+error:
+	return -EIO;
+}
+
+/* Release the pooled entries no instance uses anymore */
+void
+fosphor_cl_pool_flush(void)
+{
+	struct fosphor_cl_shared **p = &g_cl_pool;
+
+	fosphor_lock(g_cl_lock);
+
+	while (*p) {
+		struct fosphor_cl_shared *sh = *p;
+
+		if (sh->refcnt) {
+			p = &sh->next;
+			continue;
+		}
+
+		*p = sh->next;
+		cl_shared_free(sh);
+	}
+
+	fosphor_unlock(g_cl_lock);
+}
+
+int
+fosphor_cl_init(struct fosphor *self)
+{
+	struct fosphor_cl_state *cl;
+	cl_int err;
+
+	/* Allocate structure */
+	cl = malloc(sizeof(struct fosphor_cl_state));
+	if (!cl)
+		return -ENOMEM;
+
+	self->cl = cl;
+
+	memset(cl, 0, sizeof(struct fosphor_cl_state));
+
+	cl->state = CL_BOOTING;
+
+	cl->n_sets = self->opts.pipeline_depth;
+	if (cl->n_sets < 1)
+		cl->n_sets = 1;
+	else if (cl->n_sets > CL_MAX_SETS)
+		cl->n_sets = CL_MAX_SETS;
+
+	/* Find suitable device */
+	if (cl_find_device(self->opts.device, &cl->pl_id, &cl->dev_id, &cl->feat)) {
+		fprintf(stderr, "[!] No suitable OpenCL device found\n");
+		goto error;
+	}
+
+	/* Report selected device */
+	fprintf(stderr, "[+] Selected device: %s\n", cl->feat.name);
+
+	/* Display images are one texel per column, and one row per line */
+	if ((size_t)self->img_len > cl->feat.img_max_width) {
+		fprintf(stderr, "[!] Display width %d exceeds the device image width limit (%d)\n",
+			self->img_len, (int)cl->feat.img_max_width);
+		goto error;
+	}
+
+	if (((size_t)self->wf_depth > cl->feat.img_max_height) ||
+	    ((unsigned long)self->img_len * self->wf_depth * self->img_size > cl->feat.max_alloc)) {
+		fprintf(stderr, "[!] Waterfall depth %d exceeds the device limits\n",
+			self->wf_depth);
+		goto error;
+	}
+
+	/* Setup compatibility layer for this platform */
+	fosphor_lock(g_cl_lock);
+	cl_compat_init();
+	cl_compat_check_platform(cl->pl_id);
+	fosphor_unlock(g_cl_lock);
+
+	/* Initialize selected platform / device */
+	err = cl_do_init(self);
+	if (err)
+		goto error;
+
+	/* Done */
+	return 0;
+
+	/* Error path */
+error:
+	fosphor_cl_release(self);
+
+	return -EIO;
+}
+
+void
+fosphor_cl_release(struct fosphor *self)
+{
+	struct fosphor_cl_state *cl = self->cl;
+
+	/* Safety */
+	if (!cl)
+		return;
+
+	/* Release all allocated OpenCL resources */
+	cl_do_release(cl);
+
+	/* Release structure */
+	free(cl);
+
+	/* Nothing left */
+	self->cl = NULL;
+}
+
+int
+fosphor_cl_process(struct fosphor *self,
+                   void *samples, int len)
+{
+	struct fosphor_cl_state *cl = self->cl;
+
+	cl_int err;
+	cl_mem mem_in, mem_sub, mem_disp;
+	cl_event ev_upload, ev_ddc;
+	size_t local[2], global[2];
+	cl_uint hop = self->fft_hop;
+	cl_uint win_hop = hop / self->channels;	/* Channels windows are contiguous */
+	cl_uint n_groups;
+	int n_spectra, n_rows, n_wf, i;
+	int set = cl->cur_set;
+
+	/* Validate batch size. With overlap, windows start every hop samples
+	 * and the last one needs (fft_len - hop) samples past the last hop */
+	len -= self->fft_len - hop;
+	if ((len <= 0) || (len % (FOSPHOR_FFT_MULT_BATCH * hop)))
+		return -EINVAL;
+
+	n_spectra = len / hop;
+	if (n_spectra > cl->fft_max_batch)
+		return -EINVAL;
+
+	n_rows = n_spectra;
+	n_wf   = n_spectra;
+
+	len += self->fft_len - hop;
+
+	/* Copy new window if needed */
+	if (cl->fft_win_updated) {
+		err = clEnqueueWriteBuffer(
+			cl->cq,
+			cl->mem_fft_win,
+			CL_FALSE,
+			0, sizeof(cl_float) * self->chan_len, cl->fft_win,
+			0, NULL, cl_prof_ev(cl, FOSPHOR_PROF_UPLOAD)
+		);
+		CL_ERR_CHECK(err, "Unable to copy data to FFT window buffer");
+
+		cl->fft_win_updated = 0;
+	}
+
+	/* Wait until that buffer set is free again. This also bounds the
+	 * amount of work in flight to the number of sets : that event is the
+	 * last reader of the input of the call n_sets ago (queues are in
+	 * order, and its FFT waited for its upload), so it and all before it
+	 * are done with their samples */
+	if (cl->ev_fft[set]) {
+		clWaitForEvents(1, &cl->ev_fft[set]);
+		clReleaseEvent(cl->ev_fft[set]);
+		cl->ev_fft[set] = NULL;
+
+		if (cl->in_flight > cl->n_sets - 1)
+			cl->in_flight = cl->n_sets - 1;
+	}
+
+	/* If this is the first run, make sure to pre-clear the buffers
+	 * (before anything writes the waterfall) */
+	if (cl->state == CL_BOOTING) {
+		err = cl_queue_clear_buffers(self);
+		if (err != CL_SUCCESS)
+			goto error;
+	}
+
+	/* Copy samples data. From here the device may read them until this
+	 * call retires (see fosphor_cl_pending()) */
+	cl->in_flight++;
+
+	err = cl_upload_samples(self, set, samples, len, &mem_in, &mem_sub, &ev_upload);
+	if (err != CL_SUCCESS)
+		goto error;
+
+	cl_prof_add(cl, FOSPHOR_PROF_UPLOAD, ev_upload);
+
+	if (cl->cq_xfer != cl->cq)
+		clFlush(cl->cq_xfer);
+
+	/* Fused kernel groups each handle a share of the spectra */
+	n_groups = (n_spectra < CL_FUSED_GROUPS) ? n_spectra : CL_FUSED_GROUPS;
+
+	if (!cl->fused)
+	{
+		/* Channels spectra follow each other so each row of the
+		 * output holds all of them */
+		err = cl_queue_fft(self, set, mem_in, win_hop,
+			n_spectra * self->channels, ev_upload);
+	}
+	else
+	{
+		err  = clSetKernelArg(cl->kern_fft, 0, sizeof(cl_mem), &mem_in);
+		err |= clSetKernelArg(cl->kern_fft, 3, sizeof(cl_uint), &win_hop);
+		err |= clSetKernelArg(cl->kern_fft, 4, sizeof(cl_uint), &n_spectra);
+		err |= clSetKernelArg(cl->kern_fft, 6, sizeof(cl_uint), &cl->waterfall_pos);
+		err |= clSetKernelArg(cl->kern_fft, 8, sizeof(cl_float), &cl->histo_scale);
+		err |= clSetKernelArg(cl->kern_fft, 9, sizeof(cl_float), &cl->histo_offset);
+
+		/* Execute FFT kernel, one work group per group of spectra */
+		global[0] = self->chan_len / 8;
+		global[1] = n_groups;
+		local[0] = global[0];
+		local[1] = 1;
+
+		if (err == CL_SUCCESS)
+			err = clEnqueueNDRangeKernel(cl->cq, cl->kern_fft, 2, NULL, global, local,
+				ev_upload ? 1 : 0, ev_upload ? &ev_upload : NULL, &cl->ev_fft[set]);
+	}
+
+	/* Zoom band, from the new samples only (the next call starts past
+	 * them). Queued after the FFT, so it's the last to read the input */
+	ev_ddc = NULL;
+
+	if ((err == CL_SUCCESS) && (cl->ddc_decim > 1))
+		cl_queue_ddc(self, mem_in, n_spectra * hop, &ev_ddc);
+
+	if (ev_upload)
+		clReleaseEvent(ev_upload);
+
+	if (mem_sub)
+		clReleaseMemObject(mem_sub);	/* Deferred until kernel is done */
+
+	CL_ERR_CHECK(err, "Unable to queue FFT kernel execution");
+
+	cl_prof_add(cl, FOSPHOR_PROF_FFT, cl->ev_fft[set]);
+
+	if (ev_ddc) {
+		cl_prof_add(cl, FOSPHOR_PROF_FFT, ev_ddc);
+		clReleaseEvent(cl->ev_fft[set]);
+		cl->ev_fft[set] = ev_ddc;
+	}
+
+	/* Burst trigger, on each FFT before any averaging */
+	if (cl->trigger_enabled)
+	{
+		size_t global = CL_DETECT_WG * n_spectra;
+		size_t local  = CL_DETECT_WG;
+
+		err  = clSetKernelArg(cl->kern_trigger, 0, sizeof(cl_mem),  &cl->mem_fft_out[set]);
+		err |= clSetKernelArg(cl->kern_trigger, 5, sizeof(cl_uint), &cl->trigger_base);
+		CL_ERR_CHECK(err, "Unable to configure trigger kernel");
+
+		err = clEnqueueNDRangeKernel(cl->cq, cl->kern_trigger, 1, NULL, &global, &local,
+			0, NULL, cl_prof_ev(cl, FOSPHOR_PROF_DISPLAY));
+		CL_ERR_CHECK(err, "Unable to queue trigger kernel execution");
+
+		cl->trigger_base += n_spectra;
+	}
+
+	/* Fused: only the merge of the partials remains */
+	if (cl->fused)
+	{
+		err  = 0;
+		err |= clSetKernelArg(cl->kern_display,  1, sizeof(cl_uint),  &n_groups);
+		err |= clSetKernelArg(cl->kern_display,  3, sizeof(cl_uint),  &n_spectra);
+		err |= clSetKernelArg(cl->kern_display,  9, sizeof(cl_float), &cl->histo_scale);
+		err |= clSetKernelArg(cl->kern_display, 10, sizeof(cl_float), &cl->histo_offset);
+		CL_ERR_CHECK(err, "Unable to configure display merge kernel");
+
+		global[0] = self->fft_len;
+
+		err = clEnqueueNDRangeKernel(cl->cq, cl->kern_display, 1, NULL, global, NULL,
+			0, NULL, cl_prof_ev(cl, FOSPHOR_PROF_DISPLAY));
+		CL_ERR_CHECK(err, "Unable to queue display merge kernel execution");
+
+		goto done;
+	}
+
+	/* Averaging: the display only gets the completed averages, and
+	 * nothing at all if this batch didn't complete any */
+	mem_disp = cl->mem_fft_out[set];
+
+	if (cl->avg_count > 1)
+	{
+		cl_uint count = cl->avg_count;
+		cl_uint phase = cl->avg_phase;
+		cl_uint mode  = cl->avg_mode;
+
+		err  = 0;
+		err |= clSetKernelArg(cl->kern_avg, 0, sizeof(cl_mem),  &cl->mem_fft_out[set]);
+		err |= clSetKernelArg(cl->kern_avg, 2, sizeof(cl_uint), &n_spectra);
+		err |= clSetKernelArg(cl->kern_avg, 3, sizeof(cl_mem),  &cl->mem_avg_acc);
+		err |= clSetKernelArg(cl->kern_avg, 4, sizeof(cl_uint), &count);
+		err |= clSetKernelArg(cl->kern_avg, 5, sizeof(cl_uint), &phase);
+		err |= clSetKernelArg(cl->kern_avg, 6, sizeof(cl_uint), &mode);
+		err |= clSetKernelArg(cl->kern_avg, 7, sizeof(cl_mem),  &cl->mem_avg_out);
+		CL_ERR_CHECK(err, "Unable to configure averaging kernel");
+
+		global[0] = self->fft_len;
+
+		err = clEnqueueNDRangeKernel(cl->cq, cl->kern_avg, 1, NULL, global, NULL,
+			0, NULL, cl_prof_ev(cl, FOSPHOR_PROF_DISPLAY));
+		CL_ERR_CHECK(err, "Unable to queue averaging kernel execution");
+
+		n_rows = (cl->avg_phase + n_spectra) / cl->avg_count;
+		cl->avg_phase = (cl->avg_phase + n_spectra) % cl->avg_count;
+
+		n_wf = n_rows;
+
+		if (!n_rows)
+			goto done;
+
+		mem_disp = cl->mem_avg_out;
+	}
+
+	/* Configure display kernel */
+	err  = 0;
+	err |= clSetKernelArg(cl->kern_display,  0, sizeof(cl_mem),   &mem_disp);
+	err |= clSetKernelArg(cl->kern_display,  2, sizeof(cl_int),   &n_rows);
+	err |= clSetKernelArg(cl->kern_display,  4, sizeof(cl_int),   &cl->waterfall_pos);
+	err |= clSetKernelArg(cl->kern_display,  9, sizeof(cl_float), &cl->histo_scale);
+	err |= clSetKernelArg(cl->kern_display, 10, sizeof(cl_float), &cl->histo_offset);
+	CL_ERR_CHECK(err, "Unable to configure display kernel");
+
+	/* Execute display kernel */
+	global[0] = self->fft_len;
+	global[1] = 16;
+	local[0] = 16;
+	local[1] = 16;
+
+	err = clEnqueueNDRangeKernel(cl->cq, cl->kern_display, 2, NULL, global, local,
+		0, NULL, cl_prof_ev(cl, FOSPHOR_PROF_DISPLAY));
+	CL_ERR_CHECK(err, "Unable to queue display kernel execution");
+
+	/* Decimated waterfall, one row every wf_decim displayed spectra */
+	if (cl->wf_decim > 1)
+	{
+		cl_uint decim = cl->wf_decim;
+		cl_uint phase = cl->wf_phase;
+
+		err  = 0;
+		err |= clSetKernelArg(cl->kern_wf, 0, sizeof(cl_mem),  &mem_disp);
+		err |= clSetKernelArg(cl->kern_wf, 2, sizeof(cl_uint), &n_rows);
+		err |= clSetKernelArg(cl->kern_wf, 3, sizeof(cl_mem),  &cl->mem_wf_acc);
+		err |= clSetKernelArg(cl->kern_wf, 4, sizeof(cl_uint), &decim);
+		err |= clSetKernelArg(cl->kern_wf, 5, sizeof(cl_uint), &phase);
+		err |= clSetKernelArg(cl->kern_wf, 7, sizeof(cl_uint), &cl->waterfall_pos);
+		CL_ERR_CHECK(err, "Unable to configure waterfall kernel");
+
+		global[0] = self->img_len;
+
+		err = clEnqueueNDRangeKernel(cl->cq, cl->kern_wf, 1, NULL, global, NULL,
+			0, NULL, cl_prof_ev(cl, FOSPHOR_PROF_DISPLAY));
+		CL_ERR_CHECK(err, "Unable to queue waterfall kernel execution");
+
+		n_wf = (cl->wf_phase + n_rows) / cl->wf_decim;
+		cl->wf_phase = (cl->wf_phase + n_rows) % cl->wf_decim;
+	}
+
+done:
+	/* Get things moving and rotate sets */
+	if (cl->n_sets > 1)
+		clFlush(cl->cq);
+
+	cl->cur_set = (set + 1) % cl->n_sets;
+
+	/* Advance waterfall, the new rows are from the current range */
+	for (i=0; (i<n_wf) && (i<self->wf_depth); i++) {
+		struct fosphor_wf_freq *wff =
+			&self->wf_freq[(cl->waterfall_pos + n_wf - 1 - i) & (self->wf_depth - 1)];
+		wff->center = self->frequency.center;
+		wff->span   = self->frequency.span;
+	}
+
+	cl->waterfall_pos = (cl->waterfall_pos + n_wf) & (self->wf_depth - 1);
+
+	cl->waterfall_dirty += n_wf;
+	if (cl->waterfall_dirty > self->wf_depth)
+		cl->waterfall_dirty = self->wf_depth;
+
+	/* New state */
+	cl->state = CL_PENDING;
+
+	return 0;
+
+error:
+	return -EIO;
+}
+
+int
+fosphor_cl_finish(struct fosphor *self)
+{
+	struct fosphor_cl_state *cl = self->cl;
+
+	cl_event ev_done = NULL;
+	cl_int err;
+
+	/* Check if we really need to do anything */
+	if (cl->state == CL_READY) {
+		cl->ddc_valid     = 0;
+		cl->trigger_valid = 0;
+		return 0;
+	}
+
+	/* If no data was processed, we may need to finish the boot */
+	if (cl->state == CL_BOOTING) {
+		err = cl_queue_clear_buffers(self);
+		if (err != CL_SUCCESS)
+			goto error;
+	}
+
+	/* Peak detection, read back along with the other results */
+	if (cl->detect_enabled)
+	{
+		size_t global = CL_DETECT_WG;
+		size_t local  = CL_DETECT_WG;
+
+		err = clEnqueueNDRangeKernel(cl->cq, cl->kern_detect, 1, NULL, &global, &local,
+			0, NULL, cl_prof_ev(cl, FOSPHOR_PROF_DISPLAY));
+		CL_ERR_CHECK(err, "Unable to queue peak detection kernel");
+
+		err = clEnqueueReadBuffer(cl->cq,
+			cl->mem_detect,
+			CL_FALSE,
+			0,
+			2 * sizeof(cl_float) * (1 + FOSPHOR_DETECT_MAX),
+			cl->detect_host,
+			0, NULL, cl_prof_ev(cl, FOSPHOR_PROF_READBACK)
+		);
+		CL_ERR_CHECK(err, "Unable to queue readback of detections");
+	}
+
+	/* Trigger state of the batches since last time, then start over */
+	if (cl->trigger_enabled)
+	{
+		static const cl_uint trigger_reset[2] = { 0xffffffff, 0 };
+
+		err = clEnqueueReadBuffer(cl->cq, cl->mem_trigger, CL_FALSE,
+			0, sizeof(cl->trigger_host), cl->trigger_host,
+			0, NULL, cl_prof_ev(cl, FOSPHOR_PROF_READBACK));
+		CL_ERR_CHECK(err, "Unable to queue readback of trigger state");
+
+		err = clEnqueueWriteBuffer(cl->cq, cl->mem_trigger, CL_FALSE,
+			0, sizeof(trigger_reset), trigger_reset,
+			0, NULL, NULL);
+		CL_ERR_CHECK(err, "Unable to queue reset of trigger state");
+
+		cl->trigger_len  = cl->trigger_base;
+		cl->trigger_base = 0;
+	}
+
+	/* Zoom band samples since last time (the oldest are lost if the
+	 * ring was overrun) */
+	cl->ddc_pending = 0;
+
+	if (cl->ddc_decim > 1)
+	{
+		cl_uint n = cl->ddc_wpos - cl->ddc_rpos;
+		cl_uint pos, m;
+
+		if (n > CL_DDC_RING)
+			n = CL_DDC_RING;
+
+		pos = (cl->ddc_wpos - n) & (CL_DDC_RING - 1);
+
+		while (cl->ddc_pending < n)
+		{
+			m = n - cl->ddc_pending;
+			if (pos + m > CL_DDC_RING)
+				m = CL_DDC_RING - pos;
+
+			err = clEnqueueReadBuffer(cl->cq,
+				cl->mem_ddc_out,
+				CL_FALSE,
+				2 * sizeof(cl_float) * pos,
+				2 * sizeof(cl_float) * m,
+				cl->ddc_host + 2 * cl->ddc_pending,
+				0, NULL, cl_prof_ev(cl, FOSPHOR_PROF_READBACK)
+			);
+			CL_ERR_CHECK(err, "Unable to queue readback of zoom samples");
+
+			pos = (pos + m) & (CL_DDC_RING - 1);
+			cl->ddc_pending += m;
+		}
+
+		cl->ddc_rpos = cl->ddc_wpos;
+	}
+
+	/* Act depending on current mode */
+	if (self->flags & FLG_FOSPHOR_USE_CLGL_SHARING)
+	{
+		/* Copy the work objects into the shared ones */
+		size_t img_origin[3] = { 0, 0, 0 };
+		size_t img_region[3] = { self->img_len, 0, 1 };
+
+			/* Host copy of the spectra, if asked for */
+		if (self->buf_spectrum) {
+			err = clEnqueueReadBuffer(cl->cq,
+				cl->mem_spectrum,
+				CL_FALSE,
+				0,
+				2 * 2 * sizeof(cl_float) * self->fft_len,
+				self->buf_spectrum,
+				0, NULL, cl_prof_ev(cl, FOSPHOR_PROF_READBACK)
+			);
+			CL_ERR_CHECK(err, "Unable to queue readback of spectrum buffer");
+		}
+
+		err = cl_lock_unlock(cl, 1, cl_prof_ev(cl, FOSPHOR_PROF_GL));
+		CL_ERR_CHECK(err, "Unable to acquire GL objects");
+
+			/* Waterfall */
+		img_region[1] = self->wf_depth;
+
+		err = clEnqueueCopyImage(cl->cq,
+			cl->mem_waterfall, cl->mem_waterfall_gl,
+			img_origin, img_origin, img_region,
+			0, NULL, cl_prof_ev(cl, FOSPHOR_PROF_READBACK)
+		);
+		if (err != CL_SUCCESS)
+			cl_lock_unlock(cl, 0, NULL);
+		CL_ERR_CHECK(err, "Unable to queue copy of waterfall image");
+
+			/* Histogram */
+		img_region[1] = self->histo_bins;
+
+		err = clEnqueueCopyImage(cl->cq,
+			cl->mem_histogram, cl->mem_histogram_gl,
+			img_origin, img_origin, img_region,
+			0, NULL, cl_prof_ev(cl, FOSPHOR_PROF_READBACK)
+		);
+		if (err != CL_SUCCESS)
+			cl_lock_unlock(cl, 0, NULL);
+		CL_ERR_CHECK(err, "Unable to queue copy of histogram image");
+
+			/* Live spectrum */
+		err = clEnqueueCopyBuffer(cl->cq,
+			cl->mem_spectrum, cl->mem_spectrum_gl,
+			0, 0,
+			2 * 2 * sizeof(cl_float) * self->fft_len,
+			0, NULL, cl_prof_ev(cl, FOSPHOR_PROF_READBACK)
+		);
+		if (err != CL_SUCCESS)
+			cl_lock_unlock(cl, 0, NULL);
+		CL_ERR_CHECK(err, "Unable to queue copy of spectrum buffer");
+
+		/* Hand them back to GL */
+		err = cl_lock_unlock(cl, 0, &ev_done);
+		CL_ERR_CHECK(err, "Unable to release GL objects");
+
+		cl_prof_add(cl, FOSPHOR_PROF_GL, ev_done);
+	}
+	else
+	{
+		/* If we don't use CL/GL sharing, we need to fetch the results */
+		size_t img_origin[3] = { 0, 0, 0 };
+		size_t img_region[3] = { self->img_len, 0, 1 };
+		int row, n, rem;
+
+			/* Waterfall (only the rows written since last time) */
+		row = cl->waterfall_pos_sync;
+		rem = cl->waterfall_dirty;
+
+		while (rem > 0)
+		{
+			n = (row + rem > self->wf_depth) ? (self->wf_depth - row) : rem;
+
+			img_origin[1] = row;
+			img_region[1] = n;
+
+			err = clEnqueueReadImage(cl->cq,
+				cl->mem_waterfall,
+				CL_FALSE,
+				img_origin,
+				img_region,
+				0,
+				0,
+				(char *)self->img_waterfall + (size_t)row * self->img_len * self->img_size,
+				0, NULL, cl_prof_ev(cl, FOSPHOR_PROF_READBACK)
+			);
+			CL_ERR_CHECK(err, "Unable to queue readback of waterfall image");
+
+			row = (row + n) & (self->wf_depth - 1);
+			rem -= n;
+		}
+
+		img_origin[1] = 0;
+
+			/* Histogram */
+		img_region[1] = self->histo_bins;
+
+		err = clEnqueueReadImage(cl->cq,
+			cl->mem_histogram,
+			CL_FALSE,
+			img_origin,
+			img_region,
+			0,
+			0,
+			self->img_histogram,
+			0, NULL, cl_prof_ev(cl, FOSPHOR_PROF_READBACK)
+		);
+		CL_ERR_CHECK(err, "Unable to queue readback of histogram image");
+
+			/* Live spectrum */
+		err = clEnqueueReadBuffer(cl->cq,
+			cl->mem_spectrum,
+			CL_FALSE,
+			0,
+			2 * 2 * sizeof(cl_float) * self->fft_len,
+			self->buf_spectrum,
+			0, NULL, &ev_done
+		);
+		CL_ERR_CHECK(err, "Unable to queue readback of spectrum buffer");
+
+		cl_prof_add(cl, FOSPHOR_PROF_READBACK, ev_done);
+	}
+
+	/* What we copied matches this position */
+	self->wf_dirty.start = cl->waterfall_pos_sync;
+	self->wf_dirty.len   = cl->waterfall_dirty;
+
+	cl->waterfall_pos_sync = cl->waterfall_pos;
+	cl->waterfall_dirty    = 0;
+
+	/* Wait for the display results only (in-order queue), uploads for
+	 * the next batches may keep going on the transfer queue */
+	clWaitForEvents(1, &ev_done);
+	clReleaseEvent(ev_done);
+
+	/* Queued after all the batches reads of their samples */
+	cl->in_flight = 0;
+
+	cl_prof_sync(cl);
+
+	cl->detect_valid  = cl->detect_enabled;
+	cl->trigger_valid = cl->trigger_enabled;
+	cl->ddc_valid     = cl->ddc_pending;
+
+	/* New state */
+	cl->state = CL_READY;
+
+	return 1;
+
+error:
+	return -EIO;
+}
+
+
+void
+fosphor_cl_load_fft_window(struct fosphor *self, float *win)
+{
+	struct fosphor_cl_state *cl = self->cl;
+
+	cl->fft_win = win;
+	cl->fft_win_updated = 1;
+}
+
+/* Switches to the display kernel of that mode, its program variant built
+ * on first use and then kept with the device context */
+int
+fosphor_cl_set_max_hold(struct fosphor *self, int mode)
+{
+	struct fosphor_cl_state *cl = self->cl;
+	int prev = cl->max_hold;
+
+	if (mode == cl->max_hold)
+		return 0;
+
+	cl->max_hold = mode;
+
+	if (cl_display_kernel(self) != CL_SUCCESS) {
+		cl->max_hold = prev;
+		cl_display_kernel(self);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+int
+fosphor_cl_set_persistence(struct fosphor *self,
+                           float histo_rise, float histo_decay, float live_alpha)
+{
+	struct fosphor_cl_state *cl = self->cl;
+
+	cl->histo_t0r  = histo_rise;
+	cl->histo_t0d  = histo_decay;
+	cl->live_alpha = live_alpha;
+
+	return (cl_persistence_args(cl) == CL_SUCCESS) ? 0 : -EIO;
+}
+
+int
+fosphor_cl_set_waterfall_decimation(struct fosphor *self, int decim)
+{
+	struct fosphor_cl_state *cl = self->cl;
+	cl_uint wf_write = (decim <= 1);
+	cl_int err;
+
+	if (cl->fused)
+		return (decim > 1) ? -ENOTSUP : 0;
+
+	if ((decim > 1) && !cl->mem_wf_acc)
+	{
+		cl->mem_wf_acc = clCreateBuffer(cl->ctx,
+			CL_MEM_READ_WRITE,
+			sizeof(cl_float) * self->fft_len,
+			NULL,
+			&err
+		);
+		CL_ERR_CHECK(err, "Unable to allocate waterfall decimation buffer");
+	}
+
+	cl->wf_decim = decim;
+	cl->wf_phase = 0;
+
+	/* The display kernel writes the waterfall when not decimating */
+	err = clSetKernelArg(cl->kern_display, 13, sizeof(cl_uint), &wf_write);
+	CL_ERR_CHECK(err, "Unable to configure display kernel");
+
+	return 0;
+
+error:
+	return -ENOMEM;
+}
+
+int
+fosphor_cl_set_averaging(struct fosphor *self, int count, int mode)
+{
+	struct fosphor_cl_state *cl = self->cl;
+	cl_int err;
 
-	if (len > (self->fft_len * FOSPHOR_FFT_MAX_BATCH))
-		return -EINVAL;
+	/* The fused kernels never write out the spectra */
+	if (cl->fused)
+		return (count > 1) ? -ENOTSUP : 0;
 
-	/* Copy new window if needed */
-	if (cl->fft_win_updated) {
-		err = clEnqueueWriteBuffer(
-			cl->cq,
-			cl->mem_fft_win,
-			CL_FALSE,
-			0, sizeof(cl_float) * self->fft_len, cl->fft_win,
-			0, NULL, NULL
+	/* Buffers on first use. At most one output every 2 inputs, plus
+	 * one completed from the previous batch */
+	if ((count > 1) && !cl->mem_avg_out)
+	{
+		cl->mem_avg_acc = clCreateBuffer(cl->ctx,
+			CL_MEM_READ_WRITE,
+			2 * sizeof(cl_float) * self->fft_len,
+			NULL,
+			&err
 		);
-		CL_ERR_CHECK(err, "Unable to copy data to FFT window buffer");
+		CL_ERR_CHECK(err, "Unable to allocate averaging buffer");
 
-		cl->fft_win_updated = 0;
+		cl->mem_avg_out = clCreateBuffer(cl->ctx,
+			CL_MEM_READ_WRITE,
+			2 * sizeof(cl_float) * self->fft_len * (cl->fft_max_batch / 2 + 1),
+			NULL,
+			&err
+		);
+		CL_ERR_CHECK(err, "Unable to allocate averaging buffer");
 	}
 
-	/* Copy samples data */
-	err = clEnqueueWriteBuffer(
-		cl->cq,
-		cl->mem_fft_in,
-		CL_FALSE,
-		0, 2 * sizeof(cl_float) * len, samples,
-		0, NULL, NULL
-	);
-	CL_ERR_CHECK(err, "Unable to copy data to FFT input buffer");
+	/* Start over (the kernel reloads acc on phase 0) */
+	cl->avg_count = count;
+	cl->avg_mode  = mode;
+	cl->avg_phase = 0;
 
-	/* Execute FFT kernel with appropriate work group size */
-	if (self->fft_len <= 4096) {
-		/* Original design for smaller FFTs */
-		global[0] = self->fft_len / 8;
-		global[1] = n_spectra;
-		local[0] = global[0];
-		local[1] = 1;
-	} else {
-		/* Memory-optimized design for larger FFTs */
-		global[0] = 64;  /* Fixed workgroup size for large kernels */
-		global[1] = n_spectra;
-		local[0] = 64;
-		local[1] = 1;
+	return 0;
+
+error:
+	if (cl->mem_avg_acc) {
+		clReleaseMemObject(cl->mem_avg_acc);
+		cl->mem_avg_acc = NULL;
 	}
 
-	err = clEnqueueNDRangeKernel(cl->cq, cl->kern_fft, 2, NULL, global, local, 0, NULL, NULL);
-	CL_ERR_CHECK(err, "Unable to queue FFT kernel execution");
+	return -ENOMEM;
+}
 
-	/* Capture all GL objects */
-	if ((cl->state != CL_PENDING) && (self->flags & FLG_FOSPHOR_USE_CLGL_SHARING)) {
-		err = cl_lock_unlock(cl, 1, NULL);
-		CL_ERR_CHECK(err, "Unable to acquire GL objects");
-		locked = 1;
+/* Threshold is in the spectrum units (log10 magnitude) */
+int
+fosphor_cl_set_detection(struct fosphor *self, int enable, float threshold)
+{
+	struct fosphor_cl_state *cl = self->cl;
+	cl_uint max_det = FOSPHOR_DETECT_MAX;
+	cl_int err;
+
+	if (enable && !cl->mem_detect)
+	{
+		cl->detect_host = malloc(2 * sizeof(cl_float) * (1 + FOSPHOR_DETECT_MAX));
+		if (!cl->detect_host)
+			return -ENOMEM;
+
+		cl->mem_detect = clCreateBuffer(cl->ctx,
+			CL_MEM_WRITE_ONLY,
+			2 * sizeof(cl_float) * (1 + FOSPHOR_DETECT_MAX),
+			NULL,
+			&err
+		);
+		CL_ERR_CHECK(err, "Unable to allocate peak detection buffer");
 	}
 
-	/* If this is the first run, make sure to pre-clear the buffers */
-	if (cl->state == CL_BOOTING) {
-		err = cl_queue_clear_buffers(self);
-		if (err != CL_SUCCESS)
-			goto error;
+	if (enable)
+	{
+		err  = clSetKernelArg(cl->kern_detect, 2, sizeof(cl_float), &threshold);
+		err |= clSetKernelArg(cl->kern_detect, 3, sizeof(cl_uint),  &max_det);
+		err |= clSetKernelArg(cl->kern_detect, 4, sizeof(cl_mem),   &cl->mem_detect);
+		CL_ERR_CHECK(err, "Unable to configure peak detection kernel");
 	}
 
-	/* Configure display kernel */
-	err  = 0;
-	err |= clSetKernelArg(cl->kern_display,  2, sizeof(cl_int),   &n_spectra);
-	err |= clSetKernelArg(cl->kern_display,  4, sizeof(cl_int),   &cl->waterfall_pos);
-	err |= clSetKernelArg(cl->kern_display,  9, sizeof(cl_float), &cl->histo_scale);
-	err |= clSetKernelArg(cl->kern_display, 10, sizeof(cl_float), &cl->histo_offset);
-	CL_ERR_CHECK(err, "Unable to configure display kernel");
+	cl->detect_enabled = enable;
+	cl->detect_valid   = 0;
 
-	/* Execute display kernel */
-	global[0] = self->fft_len;
-	global[1] = 16;
-	local[0] = 16;
-	local[1] = 16;
+	return 0;
 
-	err = clEnqueueNDRangeKernel(cl->cq, cl->kern_display, 2, NULL, global, local, 0, NULL, NULL);
-	CL_ERR_CHECK(err, "Unable to queue display kernel execution");
+error:
+	free(cl->detect_host);
+	cl->detect_host = NULL;
+	cl->mem_detect  = NULL;
+	cl->detect_enabled = 0;
 
-	/* Advance waterfall */
-	cl->waterfall_pos = (cl->waterfall_pos + n_spectra) & 1023;
+	return -ENOMEM;
+}
 
-	/* New state */
-	cl->state = CL_PENDING;
+/* Band of [bin_lo, bin_hi) in frequency order, threshold on the sum of
+ * |X|^2 over it. Needs the FFT output, so not for fused instances */
+int
+fosphor_cl_set_trigger(struct fosphor *self, int enable,
+                       int bin_lo, int bin_hi, float threshold)
+{
+	struct fosphor_cl_state *cl = self->cl;
+	static const cl_uint trigger_reset[2] = { 0xffffffff, 0 };
+	cl_uint lo = bin_lo, hi = bin_hi;
+	cl_int err;
 
-	return 0;
+	if (!enable) {
+		cl->trigger_enabled = 0;
+		cl->trigger_valid   = 0;
+		return 0;
+	}
 
-error:
-	if (locked) {
-		err = cl_lock_unlock(cl, 0, NULL);
-		CL_ERR_CHECK(err, "Unable to release GL objects");
+	if (cl->fused)
+		return -ENOTSUP;
+
+	if (!cl->mem_trigger)
+	{
+		cl->mem_trigger = clCreateBuffer(cl->ctx,
+			CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+			sizeof(trigger_reset),
+			(void *)trigger_reset,
+			&err
+		);
+		CL_ERR_CHECK(err, "Unable to allocate trigger buffer");
+	}
+
+	err  = clSetKernelArg(cl->kern_trigger, 2, sizeof(cl_uint),  &lo);
+	err |= clSetKernelArg(cl->kern_trigger, 3, sizeof(cl_uint),  &hi);
+	err |= clSetKernelArg(cl->kern_trigger, 4, sizeof(cl_float), &threshold);
+	err |= clSetKernelArg(cl->kern_trigger, 6, sizeof(cl_mem),   &cl->mem_trigger);
+	CL_ERR_CHECK(err, "Unable to configure trigger kernel");
+
+	/* Arming starts from scratch, a change while armed applies from the
+	 * next batch */
+	if (!cl->trigger_enabled) {
+		err = clEnqueueWriteBuffer(cl->cq, cl->mem_trigger, CL_FALSE,
+			0, sizeof(trigger_reset), trigger_reset, 0, NULL, NULL);
+		CL_ERR_CHECK(err, "Unable to reset trigger state");
+
+		cl->trigger_valid = 0;
+		cl->trigger_base  = 0;
 	}
 
+	cl->trigger_enabled = 1;
+
+	return 0;
+
+error:
 	return -EIO;
 }
 
+/* As of the last sync: 1 if it fired, age then being how many spectra of
+ * those processed came after the first one over, power its band power */
 int
-fosphor_cl_finish(struct fosphor *self)
+fosphor_cl_get_trigger(struct fosphor *self, int *age, float *power)
+{
+	struct fosphor_cl_state *cl = self->cl;
+	union { cl_uint u; cl_float f; } p;
+
+	if (!cl->trigger_valid)
+		return -ENODATA;
+
+	if (cl->trigger_host[0] >= cl->trigger_len)
+		return 0;
+
+	p.u = cl->trigger_host[1];
+
+	*age   = cl->trigger_len - cl->trigger_host[0] - 1;
+	*power = p.f;
+
+	return 1;
+}
+
+/* Raw results as of the last sync: (count, floor) then (bin, power) pairs,
+ * the strongest FOSPHOR_DETECT_MAX at most */
+int
+fosphor_cl_get_detections(struct fosphor *self, const float **det)
 {
 	struct fosphor_cl_state *cl = self->cl;
 
+	if (!cl->detect_valid)
+		return -ENODATA;
+
+	*det = cl->detect_host;
+
+	return 0;
+}
+
+/* Center is in cycles per sample. The low pass stops short of the output
+ * band edge, a windowed sinc shifted to the band center */
+int
+fosphor_cl_set_ddc(struct fosphor *self, int decim, double center)
+{
+	struct fosphor_cl_state *cl = self->cl;
+	const int max_taps = CL_DDC_TAPS_PER_DECIM * FOSPHOR_DDC_DECIM_MAX;
+	double fc, fo, x, h, sum;
+	cl_uint inc;
 	cl_int err;
+	int i, n_taps;
 
-	/* Check if we really need to do anything */
-	if (cl->state == CL_READY)
+	if (decim <= 1) {
+		cl->ddc_decim = 1;
+		cl->ddc_valid = 0;
 		return 0;
+	}
 
-	/* If no data was processed, we may need to finish the boot */
-	if (cl->state == CL_BOOTING) {
-		/* Acquire GL objects if needed */
-		if (self->flags & FLG_FOSPHOR_USE_CLGL_SHARING)
-		{
-			err = cl_lock_unlock(cl, 1, NULL);
-			CL_ERR_CHECK(err, "Unable to acquire GL objects");
+	if (!cl->mem_ddc_out)
+	{
+		cl->ddc_taps = malloc(2 * sizeof(cl_float) * max_taps);
+		cl->ddc_host = malloc(2 * sizeof(cl_float) * CL_DDC_RING);
+		if (!cl->ddc_taps || !cl->ddc_host) {
+			cl_ddc_free(cl);
+			return -ENOMEM;
 		}
 
-		/* Clear the buffers */
-		err = cl_queue_clear_buffers(self);
-		if (err != CL_SUCCESS)
-			goto error;
+		cl->mem_ddc_taps = clCreateBuffer(cl->ctx,
+			CL_MEM_READ_ONLY,
+			2 * sizeof(cl_float) * max_taps,
+			NULL,
+			&err
+		);
+		CL_ERR_CHECK(err, "Unable to allocate zoom filter buffer");
+
+		for (i=0; i<2; i++) {
+			cl->mem_ddc_hist[i] = clCreateBuffer(cl->ctx,
+				CL_MEM_READ_WRITE,
+				2 * sizeof(cl_float) * max_taps,
+				NULL,
+				&err
+			);
+			CL_ERR_CHECK(err, "Unable to allocate zoom history buffer");
+		}
+
+		cl->mem_ddc_out = clCreateBuffer(cl->ctx,
+			CL_MEM_READ_WRITE,
+			2 * sizeof(cl_float) * CL_DDC_RING,
+			NULL,
+			&err
+		);
+		CL_ERR_CHECK(err, "Unable to allocate zoom output buffer");
 	}
 
-	/* Act depending on current mode */
-	if (self->flags & FLG_FOSPHOR_USE_CLGL_SHARING)
+	/* A new decimation restarts the filter, only the taps change when
+	 * just moving (the NCO phase carries on) */
+	if (decim != cl->ddc_decim) {
+		cl->ddc_hist_reset = 1;
+		cl->ddc_first      = decim - 1;
+		cl->ddc_rpos       = cl->ddc_wpos;
+	}
+
+	inc = (cl_uint)(int64_t)llrint(center * 4294967296.0);
+	fo  = (double)(int32_t)inc / 4294967296.0;
+
+	n_taps = CL_DDC_TAPS_PER_DECIM * decim;
+	fc  = 0.45 / decim;
+	sum = 0.0;
+
+	for (i=0; i<n_taps; i++)
 	{
-		/* If we use CL/GL sharing, we need to release the objects */
-		err = cl_lock_unlock(cl, 0, NULL);
-		CL_ERR_CHECK(err, "Unable to release GL objects");
+		x = i - (n_taps - 1) / 2.0;
+		h = (x == 0.0) ? (2.0 * fc) : (sin(2.0 * M_PI * fc * x) / (M_PI * x));
+		h *= 0.42 -
+		     0.50 * cos(2.0 * M_PI * i / (n_taps - 1)) +
+		     0.08 * cos(4.0 * M_PI * i / (n_taps - 1));
+
+		cl->ddc_taps[2*i] = h;
+		sum += h;
 	}
-	else
+
+	for (i=0; i<n_taps; i++)
 	{
-		/* If we don't use CL/GL sharing, we need to fetch the results */
-		size_t img_origin[3] = { 0, 0, 0 };
-		size_t img_region[3] = { 1024, 0, 1 };
+		h = cl->ddc_taps[2*i] / sum;
+		cl->ddc_taps[2*i]   = h * cos(2.0 * M_PI * fo * i);
+		cl->ddc_taps[2*i+1] = h * sin(2.0 * M_PI * fo * i);
+	}
 
-			/* Waterfall */
-		img_region[1] = 1024;
+	cl->ddc_nco_inc      = inc;
+	cl->ddc_taps_updated = 1;
+	cl->ddc_decim        = decim;
 
-		err = clEnqueueReadImage(cl->cq,
-			cl->mem_waterfall,
-			CL_FALSE,
-			img_origin,
-			img_region,
-			0,
-			0,
-			self->img_waterfall,
-			0, NULL, NULL
-		);
-		CL_ERR_CHECK(err, "Unable to queue readback of waterfall image");
+	return 0;
 
-			/* Histogram */
-		img_region[1] = 128;
+error:
+	cl_ddc_free(cl);
+	cl->ddc_decim = 1;
 
-		err = clEnqueueReadImage(cl->cq,
-			cl->mem_histogram,
-			CL_FALSE,
-			img_origin,
-			img_region,
-			0,
-			0,
-			self->img_histogram,
-			0, NULL, NULL
-		);
-		CL_ERR_CHECK(err, "Unable to queue readback of histogram image");
+	return -ENOMEM;
+}
 
-			/* Live spectrum */
-		err = clEnqueueReadBuffer(cl->cq,
-			cl->mem_spectrum,
-			CL_FALSE,
-			0,
-			2 * 2 * sizeof(cl_float) * self->fft_len,
-			self->buf_spectrum,
-			0, NULL, NULL
-		);
-		CL_ERR_CHECK(err, "Unable to queue readback of spectrum buffer");
-	}
+/* Samples from the last sync, complex float pairs at 1/decim the rate */
+int
+fosphor_cl_get_ddc(struct fosphor *self, const float **samples)
+{
+	struct fosphor_cl_state *cl = self->cl;
 
-	/* Ensure CL is done */
-	clFinish(cl->cq);
+	if (cl->ddc_decim <= 1)
+		return -ENODATA;
 
-	/* New state */
-	cl->state = CL_READY;
+	*samples = cl->ddc_host;
 
-	return 1;
+	return cl->ddc_valid;
+}
+
+int
+fosphor_cl_register_host_buffer(struct fosphor *self, void *buf, size_t len)
+{
+	struct fosphor_cl_state *cl = self->cl;
+	cl_int err;
+
+	/* Drop any previous one */
+	fosphor_cl_unregister_host_buffer(self);
+
+	/* We need WRITE_INVALIDATE maps to keep this cheap */
+	if (!(cl->feat.flags & FLG_CL_OPENCL_12))
+		return -ENOTSUP;
+
+	cl->mem_host = clCreateBuffer(cl->ctx,
+		CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR,
+		len,
+		buf,
+		&err
+	);
+	CL_ERR_CHECK(err, "Unable to register host sample buffer");
+
+	cl->host_base = buf;
+	cl->host_len  = len;
+
+	return 0;
 
 error:
+	cl->mem_host = NULL;
 	return -EIO;
 }
 
-
 void
-fosphor_cl_load_fft_window(struct fosphor *self, float *win)
+fosphor_cl_unregister_host_buffer(struct fosphor *self)
 {
 	struct fosphor_cl_state *cl = self->cl;
 
-	cl->fft_win = win;
-	cl->fft_win_updated = 1;
+	if (!cl->mem_host)
+		return;
+
+	/* Nothing may still be referencing it */
+	clFinish(cl->cq_xfer);
+	clFinish(cl->cq);
+
+	clReleaseMemObject(cl->mem_host);
+
+	cl->mem_host  = NULL;
+	cl->host_base = NULL;
+	cl->host_len  = 0;
 }
 
 int
@@ -1085,7 +3845,156 @@ fosphor_cl_get_waterfall_position(struct fosphor *self)
 {
 	struct fosphor_cl_state *cl = self->cl;
 
-	return cl->waterfall_pos;
+	return cl->waterfall_pos_sync;
+}
+
+/* Adds the size of the instance objects (shared context & programs aside) */
+void
+fosphor_cl_get_memory(struct fosphor *self, size_t *host, size_t *device)
+{
+	struct fosphor_cl_state *cl = self->cl;
+	cl_mem mem[] = {
+		cl->mem_fft_in[0], cl->mem_fft_in[1], cl->mem_fft_in[2],
+		cl->mem_fft_out[0], cl->mem_fft_out[1], cl->mem_fft_out[2],
+		cl->mem_fft_win, cl->mem_fft_tmp,
+		cl->mem_fused_part, cl->mem_histo_cnt,
+		cl->mem_avg_acc, cl->mem_avg_out, cl->mem_wf_acc,
+		cl->mem_detect, cl->mem_trigger,
+		cl->mem_ddc_taps, cl->mem_ddc_hist[0], cl->mem_ddc_hist[1], cl->mem_ddc_out,
+		cl->mem_waterfall, cl->mem_histogram, cl->mem_spectrum,
+		cl->mem_waterfall_gl, cl->mem_histogram_gl, cl->mem_spectrum_gl,
+	};
+	size_t sz;
+	int i;
+
+	/* The registered host buffer (mem_host) is the caller's memory */
+	for (i=0; i<(int)(sizeof(mem)/sizeof(mem[0])); i++)
+		if (mem[i] && (clGetMemObjectInfo(mem[i], CL_MEM_SIZE, sizeof(sz), &sz, NULL) == CL_SUCCESS))
+			*device += sz;
+
+	*host += sizeof(struct fosphor_cl_state);
+
+	if (cl->detect_host)
+		*host += 2 * sizeof(cl_float) * (1 + FOSPHOR_DETECT_MAX);
+	if (cl->ddc_taps)
+		*host += 2 * sizeof(cl_float) * CL_DDC_TAPS_PER_DECIM * FOSPHOR_DDC_DECIM_MAX;
+	if (cl->ddc_host)
+		*host += 2 * sizeof(cl_float) * CL_DDC_RING;
+}
+
+int
+fosphor_cl_is_fused(struct fosphor *self)
+{
+	return self->cl->fused;
+}
+
+/* Waits for the commands queued so far, not publishing anything */
+int
+fosphor_cl_wait(struct fosphor *self)
+{
+	struct fosphor_cl_state *cl = self->cl;
+	cl_int err;
+
+	if (cl->cq_xfer != cl->cq) {
+		err = clFinish(cl->cq_xfer);
+		if (err != CL_SUCCESS)
+			return -EIO;
+	}
+
+	err = clFinish(cl->cq);
+	if (err != CL_SUCCESS)
+		return -EIO;
+
+	cl->in_flight = 0;
+
+	return 0;
+}
+
+/* Whether this device could run a chan_len FFT with disp_len columns,
+ * before building an instance for it */
+int
+fosphor_cl_fft_len_check(struct fosphor *self, int chan_len, int disp_len)
+{
+	struct fosphor_cl_state *cl = self->cl;
+
+	if ((size_t)disp_len > cl->feat.img_max_width) {
+		fprintf(stderr, "[!] Display width %d exceeds the device image width limit (%d)\n",
+			disp_len, (int)cl->feat.img_max_width);
+		return -EINVAL;
+	}
+
+	/* Up to 4096 the FFT runs in one work group, from local memory */
+	if ((chan_len <= 4096) &&
+	    ((cl->feat.max_wg < (size_t)(chan_len / 8)) ||
+	     (cl->feat.local_mem < 2 * sizeof(cl_float) * chan_len))) {
+		fprintf(stderr, "[!] FFT length %d exceeds the device work group limits\n",
+			chan_len);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/* Marker behind everything queued so far, waited on without the instance */
+void *
+fosphor_cl_get_marker(struct fosphor *self)
+{
+	struct fosphor_cl_state *cl = self->cl;
+	cl_event ev = NULL;
+
+	if (clEnqueueMarker(cl->cq, &ev) != CL_SUCCESS)
+		return NULL;
+
+	clFlush(cl->cq);
+
+	return ev;
+}
+
+int
+fosphor_cl_wait_marker(void *marker)
+{
+	cl_event ev = marker;
+	cl_int err;
+
+	err = clWaitForEvents(1, &ev);
+	clReleaseEvent(ev);
+
+	return (err == CL_SUCCESS) ? 0 : -EIO;
+}
+
+/* Calls whose samples may still be read : at most one per set, older ones
+ * retired when their set got reused (see fosphor_cl_process()) */
+int
+fosphor_cl_pending(struct fosphor *self)
+{
+	return self->cl->in_flight;
+}
+
+const void *
+fosphor_cl_get_device(struct fosphor *self)
+{
+	return self->cl->dev_id;
+}
+
+int
+fosphor_cl_get_profile(struct fosphor *self, struct fosphor_profile *prof)
+{
+	struct fosphor_cl_state *cl = self->cl;
+
+	if (!cl->prof.enabled)
+		return -ENODEV;
+
+	memcpy(prof, &cl->prof.stats, sizeof(struct fosphor_profile));
+
+	return 0;
+}
+
+void
+fosphor_cl_reset_profile(struct fosphor *self)
+{
+	struct fosphor_cl_state *cl = self->cl;
+
+	memset(&cl->prof.stats, 0x00, sizeof(struct fosphor_profile));
 }
 
 void
@@ -1094,7 +4003,7 @@ fosphor_cl_set_histogram_range(struct fosphor *self,
 {
 	struct fosphor_cl_state *cl = self->cl;
 
-	cl->histo_scale  = scale * 128.0f;
+	cl->histo_scale  = scale * self->histo_bins;
 	cl->histo_offset = offset;
 }
 
@@ -17,17 +17,51 @@
  *  \brief OpenCL base routines
  */
 
+#include <stddef.h>
+
 struct fosphor;
 
+struct fosphor_device_info;
+struct fosphor_profile;
+
+int  fosphor_cl_list_devices(struct fosphor_device_info *list, int max);
+int  fosphor_cl_pool_warmup(const char *device, int headless);
+void fosphor_cl_pool_flush(void);
+
 int  fosphor_cl_init(struct fosphor *self);
 void fosphor_cl_release(struct fosphor *self);
 
 int fosphor_cl_process(struct fosphor *self,
                        void *samples, int len);
 int fosphor_cl_finish(struct fosphor *self);
+int fosphor_cl_wait(struct fosphor *self);
+int fosphor_cl_pending(struct fosphor *self);
+void *fosphor_cl_get_marker(struct fosphor *self);
+int fosphor_cl_wait_marker(void *marker);
+int fosphor_cl_fft_len_check(struct fosphor *self, int chan_len, int disp_len);
+const void *fosphor_cl_get_device(struct fosphor *self);
+
+int  fosphor_cl_register_host_buffer(struct fosphor *self, void *buf, size_t len);
+void fosphor_cl_unregister_host_buffer(struct fosphor *self);
 
 void fosphor_cl_load_fft_window(struct fosphor *self, float *win);
+int  fosphor_cl_set_averaging(struct fosphor *self, int count, int mode);
+int  fosphor_cl_set_waterfall_decimation(struct fosphor *self, int decim);
+int  fosphor_cl_set_detection(struct fosphor *self, int enable, float threshold);
+int  fosphor_cl_get_detections(struct fosphor *self, const float **det);
+int  fosphor_cl_set_trigger(struct fosphor *self, int enable,
+                            int bin_lo, int bin_hi, float threshold);
+int  fosphor_cl_get_trigger(struct fosphor *self, int *age, float *power);
+int  fosphor_cl_set_ddc(struct fosphor *self, int decim, double center);
+int  fosphor_cl_get_ddc(struct fosphor *self, const float **samples);
+int  fosphor_cl_set_max_hold(struct fosphor *self, int mode);
+int  fosphor_cl_set_persistence(struct fosphor *self,
+                                float histo_rise, float histo_decay, float live_alpha);
 int  fosphor_cl_get_waterfall_position(struct fosphor *self);
+void fosphor_cl_get_memory(struct fosphor *self, size_t *host, size_t *device);
+int  fosphor_cl_is_fused(struct fosphor *self);
+int  fosphor_cl_get_profile(struct fosphor *self, struct fosphor_profile *prof);
+void fosphor_cl_reset_profile(struct fosphor *self);
 void fosphor_cl_set_histogram_range(struct fosphor *self,
                                     float scale, float offset);
 
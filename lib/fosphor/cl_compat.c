@@ -31,6 +31,7 @@
 #define CL_USE_DEPRECATED_OPENCL_1_1_APIS
 
 #include "cl_compat.h"
+#include "private.h"
 
 
 /* -------------------------------------------------------------------------- */
@@ -199,8 +200,9 @@ ALT_WRAP(cl_int,
 {
 	cl_int err;
 	cl_image_format fmt;
-	float *buf, *color = (float *)fill_color;
-	int i;
+	const float *color = (const float *)fill_color;
+	void *buf;
+	int i, half;
 
 	/* Grab a bunch of infos about the image */
 	err = clGetImageInfo(image, CL_IMAGE_FORMAT, sizeof(fmt), &fmt, NULL);
@@ -209,19 +211,26 @@ ALT_WRAP(cl_int,
 
 	/* Very limited replacement :p */
 	if ((fmt.image_channel_order != CL_R) ||
-	    (fmt.image_channel_data_type != CL_FLOAT))
+	    ((fmt.image_channel_data_type != CL_FLOAT) &&
+	     (fmt.image_channel_data_type != CL_HALF_FLOAT)))
 		return CL_IMAGE_FORMAT_NOT_SUPPORTED;
 
+	half = (fmt.image_channel_data_type == CL_HALF_FLOAT);
+
 	if ((origin[2] != 0) || (region[2] != 1))
 		return CL_IMAGE_FORMAT_NOT_SUPPORTED;
 
 	/* Fill a buffer manually */
-	buf = malloc(region[0] * region[1] * sizeof(float));
+	buf = malloc(region[0] * region[1] * (half ? sizeof(uint16_t) : sizeof(float)));
 	if (!buf)
 		return CL_OUT_OF_RESOURCES;
 
-	for (i=0; i<(region[0] * region[1]); i++)
-		buf[i] = color[0];
+	for (i=0; i<(region[0] * region[1]); i++) {
+		if (half)
+			((uint16_t *)buf)[i] = fosphor_float_to_half(color[0]);
+		else
+			((float *)buf)[i] = color[0];
+	}
 
 	/* Do a blocking write */
 	err = clEnqueueWriteImage(
@@ -27,6 +27,20 @@
 # define CL_DEVICE_COMPUTE_CAPABILITY_MINOR_NV	0x4001
 #endif
 
+/* PCI location queries (KHR / NVidia / AMD) */
+#ifndef CL_DEVICE_PCI_BUS_INFO_KHR
+# define CL_DEVICE_PCI_BUS_INFO_KHR		0x410F
+#endif
+
+#ifndef CL_DEVICE_PCI_BUS_ID_NV
+# define CL_DEVICE_PCI_BUS_ID_NV		0x4008
+# define CL_DEVICE_PCI_SLOT_ID_NV		0x4009
+#endif
+
+#ifndef CL_DEVICE_TOPOLOGY_AMD
+# define CL_DEVICE_TOPOLOGY_AMD			0x4037
+#endif
+
 
 /* If OpenCL 1.2 isn't supported in the header, add our prototypes */
 #ifndef CL_VERSION_1_2
@@ -11,14 +11,11 @@
  * a derivative work (i.e. "a work based on the program").
  */
 
-/* Require GLSL 1.5 compatibility profile to build without warning
- * But we use 1.3 since some cards don't allow 1.5 compatibility but
- * will work with 1.3
+/* The #version line and TEX_COORD are provided by gl_cmap.c, as either
+ * GLSL 1.3 (gl_TexCoord[0], some cards don't allow 1.5 compatibility) or
+ * GLSL 3.3 core (v_uv from core_vert.glsl)
  */
 
-/* #version 150 compatibility */
-#version 130
-
 
 /* ------------------------------------------------------------------------ */
 /* Cubic interpolation functions                                            */
@@ -178,7 +175,7 @@ out vec4 out_FragColor;
 
 void main()
 {
-	float intensity = bicubic(tex, gl_TexCoord[0].st).x;
+	float intensity = bicubic(tex, TEX_COORD).x;
 	float map = (intensity + range.y) * range.x;
 	vec4 color = texture(palette, map);
 	out_FragColor = color;
@@ -0,0 +1,46 @@
+/*
+ * core_prim.glsl
+ *
+ * Core profile fragment shader for flat / text / palette primitives
+ *
+ * Copyright (C) 2013-2021 Sylvain Munaut
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Note (to make it clear): for the purpose of this license, any software
+ * making use of this shader (or derivative thereof) is considered to be
+ * a derivative work (i.e. "a work based on the program").
+ */
+
+#version 330 core
+
+
+/* Uniforms */
+
+uniform int mode;		/* See enum glc_mode */
+uniform sampler2D tex;		/* Font texture */
+uniform sampler1D palette;	/* 1D texture with the color scale */
+
+
+/* In/Out */
+
+in vec4 v_color;
+in vec2 v_uv;
+
+out vec4 out_FragColor;
+
+
+/* Shader main */
+
+void main()
+{
+	if (mode == 1)
+		out_FragColor = texture(palette, v_uv.y) * v_color;
+	else if (mode == 2)
+		out_FragColor = vec4(v_color.rgb, texture(tex, v_uv).r);
+	else if (mode == 3)
+		out_FragColor = vec4(texture(tex, v_uv).rgb * v_color.rgb, 1.0);
+	else
+		out_FragColor = v_color;
+}
+
+/* vim: set syntax=c: */
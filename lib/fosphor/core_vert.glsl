@@ -0,0 +1,41 @@
+/*
+ * core_vert.glsl
+ *
+ * Core profile vertex shader, shared by all the programs
+ *
+ * Copyright (C) 2013-2021 Sylvain Munaut
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Note (to make it clear): for the purpose of this license, any software
+ * making use of this shader (or derivative thereof) is considered to be
+ * a derivative work (i.e. "a work based on the program").
+ */
+
+#version 330 core
+
+
+/* Uniforms */
+
+uniform mat4 mvp;		/* Model / view / projection transform */
+
+
+/* In/Out */
+
+in vec4 in_color;
+in vec2 in_pos;
+in vec2 in_uv;
+
+out vec4 v_color;
+out vec2 v_uv;
+
+
+/* Shader main */
+
+void main()
+{
+	v_color = in_color;
+	v_uv = in_uv;
+	gl_Position = mvp * vec4(in_pos, 0.0, 1.0);
+}
+
+/* vim: set syntax=c: */
@@ -0,0 +1,1150 @@
+/*
+ * cpu.c
+ *
+ * CPU compute engine, when no OpenCL device is usable
+ *
+ * Copyright (C) 2013-2021 Sylvain Munaut
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/*! \addtogroup cpu
+ *  @{
+ */
+
+/*! \file cpu.c
+ *  \brief CPU compute engine, when no OpenCL device is usable
+ *
+ * Same processing as the OpenCL FFT / average / display kernels, results
+ * go to the host copies (img_waterfall, img_histogram, buf_spectrum) that
+ * fosphor_gl_refresh() uploads. The batch is split across worker threads:
+ * by spectra for the FFTs, by blocks of bins for the display. Inner loops
+ * work on contiguous runs of bins so the compiler can vectorize them.
+ */
+
+#if defined(__unix__) || defined(__APPLE__)
+# define CPU_HAVE_THREADS
+# include <pthread.h>
+# include <unistd.h>
+#endif
+
+#include <errno.h>
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "private.h"
+
+#ifndef M_PI
+# define M_PI 3.14159265358979323846
+#endif
+
+
+#define CPU_MAX_THREADS		8
+#define CPU_BLOCK		16	/* Bins per display work unit */
+
+/* Same defaults as the OpenCL display */
+#define CPU_HISTO_T0R		16.0f
+#define CPU_HISTO_T0D		1024.0f
+#define CPU_LIVE_ALPHA		0.002f
+
+struct fosphor_cpu_state;
+
+struct cpu_worker
+{
+	struct fosphor *self;
+	int idx;
+#ifdef CPU_HAVE_THREADS
+	pthread_t thread;
+#endif
+
+	float *fft_buf;		/* chan_len complex */
+	unsigned int *hc;	/* Histogram hits, histo_bins x CPU_BLOCK */
+};
+
+typedef void (*cpu_job_fn)(struct fosphor *self, struct cpu_worker *w, int n);
+
+struct fosphor_cpu_state
+{
+	/* Workers, the calling thread is worker 0 */
+	int n_workers;
+	struct cpu_worker workers[CPU_MAX_THREADS];
+
+#ifdef CPU_HAVE_THREADS
+	pthread_mutex_t lock;
+	pthread_cond_t cond_start;
+	pthread_cond_t cond_done;
+	unsigned int gen;	/* Bumped for each job */
+	int running;		/* Workers still busy with it */
+	int stop;
+#endif
+	cpu_job_fn job;
+
+	/* FFT */
+	const float *twiddle;	/* Per stage, (chan_len - 1) complex total */
+	unsigned int *bitrev;
+	int fft_max_batch;
+
+	/* Current batch */
+	const void *samples;
+	int n_spectra;
+	int n_rows;		/* Displayed spectra */
+	float *pwr;		/* |X|^2, n_spectra x fft_len */
+	float *live_w;		/* Live spectrum weight of each displayed row */
+
+	/* Averaging */
+	int avg_count;
+	int avg_mode;
+	int avg_phase;
+	float *avg_acc;		/* Partial sum (or max), sum of squares */
+
+	/* Waterfall decimation */
+	int wf_decim;
+	int wf_phase;
+	float *wf_acc;		/* Partial peak */
+
+	/* Max hold & persistence */
+	int max_hold;		/* FOSPHOR_MAX_HOLD_xxx */
+	float histo_t0r;	/* Histogram rise / decay time constants */
+	float histo_t0d;
+	float live_alpha;	/* Live spectrum smoothing */
+
+	/* Display state, published to the host copies at finish */
+	float *waterfall;
+	float *histogram;
+	float *spectrum;
+
+	int waterfall_pos;
+	int waterfall_pos_sync;	/* As of last sync */
+	int waterfall_dirty;	/* Rows written since last sync */
+
+	int booted;
+	int pending;		/* Processed since last finish */
+
+	/* Peak detection */
+	int detect_enabled;
+	int detect_valid;
+	float detect_thr;
+	float *detect;		/* (count, floor) then (bin, power) pairs */
+
+	/* Burst trigger, on the powers of each batch */
+	int trigger_enabled;
+	int trigger_valid;
+	int trigger_lo, trigger_hi;	/* Band, bins in frequency order */
+	float trigger_thr;
+	int trigger_base;	/* Spectra since last sync */
+	int trigger_first;	/* Of those, first over (-1: none) */
+	float trigger_peak;
+	int trigger_age;	/* As of last sync (-1: didn't fire) */
+	float trigger_power;
+};
+
+
+/* ------------------------------------------------------------------------ */
+/* Workers                                                                  */
+/* ------------------------------------------------------------------------ */
+
+#ifdef CPU_HAVE_THREADS
+static void *
+cpu_worker_main(void *arg)
+{
+	struct cpu_worker *w = arg;
+	struct fosphor_cpu_state *cpu = w->self->cpu;
+	unsigned int gen = 0;
+
+	pthread_mutex_lock(&cpu->lock);
+
+	while (1)
+	{
+		while ((cpu->gen == gen) && !cpu->stop)
+			pthread_cond_wait(&cpu->cond_start, &cpu->lock);
+
+		if (cpu->stop)
+			break;
+
+		gen = cpu->gen;
+		pthread_mutex_unlock(&cpu->lock);
+
+		cpu->job(w->self, w, cpu->n_workers);
+
+		pthread_mutex_lock(&cpu->lock);
+		if (!--cpu->running)
+			pthread_cond_signal(&cpu->cond_done);
+	}
+
+	pthread_mutex_unlock(&cpu->lock);
+
+	return NULL;
+}
+#endif
+
+/* Runs job on all workers and waits for them */
+static void
+cpu_run(struct fosphor *self, cpu_job_fn job)
+{
+	struct fosphor_cpu_state *cpu = self->cpu;
+
+	cpu->job = job;
+
+	if (cpu->n_workers == 1) {
+		job(self, &cpu->workers[0], 1);
+		return;
+	}
+
+#ifdef CPU_HAVE_THREADS
+	pthread_mutex_lock(&cpu->lock);
+	cpu->running = cpu->n_workers - 1;
+	cpu->gen++;
+	pthread_cond_broadcast(&cpu->cond_start);
+	pthread_mutex_unlock(&cpu->lock);
+
+	job(self, &cpu->workers[0], cpu->n_workers);
+
+	pthread_mutex_lock(&cpu->lock);
+	while (cpu->running)
+		pthread_cond_wait(&cpu->cond_done, &cpu->lock);
+	pthread_mutex_unlock(&cpu->lock);
+#endif
+}
+
+static int
+cpu_workers_count(void)
+{
+#ifdef CPU_HAVE_THREADS
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	/* Leave a core to the rest of the flow graph */
+	n = (n > 1) ? (n - 1) : 1;
+	return (n > CPU_MAX_THREADS) ? CPU_MAX_THREADS : (int)n;
+#else
+	return 1;
+#endif
+}
+
+
+/* ------------------------------------------------------------------------ */
+/* FFT                                                                      */
+/* ------------------------------------------------------------------------ */
+
+/* Iterative radix-2, inputs loaded in bit reversed order. Each stage has
+ * its twiddles contiguous so the butterflies run over plain arrays */
+static void
+cpu_fft_exec(struct fosphor *self, float *buf)
+{
+	struct fosphor_cpu_state *cpu = self->cpu;
+	const int len = self->chan_len;
+	const float *tw = cpu->twiddle;
+	int half, i, j;
+
+	for (half=1; half<len; half<<=1)
+	{
+		for (i=0; i<len; i+=2*half)
+		{
+			float *a = &buf[2*i];
+			float *b = &buf[2*(i+half)];
+
+			for (j=0; j<half; j++)
+			{
+				float br = b[2*j] * tw[2*j]   - b[2*j+1] * tw[2*j+1];
+				float bi = b[2*j] * tw[2*j+1] + b[2*j+1] * tw[2*j];
+				float ar = a[2*j], ai = a[2*j+1];
+
+				a[2*j]   = ar + br;
+				a[2*j+1] = ai + bi;
+				b[2*j]   = ar - br;
+				b[2*j+1] = ai - bi;
+			}
+		}
+
+		tw += 2 * half;
+	}
+}
+
+/* Windowed chan_len samples from ofs, in bit reversed order */
+static void
+cpu_fft_load(struct fosphor *self, float *buf, size_t ofs)
+{
+	struct fosphor_cpu_state *cpu = self->cpu;
+	const unsigned int *br = cpu->bitrev;
+	const float *win = self->fft_win;
+	int i;
+
+	switch (self->opts.input_format)
+	{
+	case FOSPHOR_INPUT_CS16: {
+		const int16_t *s = (const int16_t *)cpu->samples + 2 * ofs;
+		for (i=0; i<self->chan_len; i++) {
+			buf[2*br[i]]   = (float)s[2*i]   * win[i];
+			buf[2*br[i]+1] = (float)s[2*i+1] * win[i];
+		}
+		break;
+	}
+
+	case FOSPHOR_INPUT_CS8: {
+		const int8_t *s = (const int8_t *)cpu->samples + 2 * ofs;
+		for (i=0; i<self->chan_len; i++) {
+			buf[2*br[i]]   = (float)s[2*i]   * win[i];
+			buf[2*br[i]+1] = (float)s[2*i+1] * win[i];
+		}
+		break;
+	}
+
+	default: {
+		const float *s = (const float *)cpu->samples + 2 * ofs;
+		for (i=0; i<self->chan_len; i++) {
+			buf[2*br[i]]   = s[2*i]   * win[i];
+			buf[2*br[i]+1] = s[2*i+1] * win[i];
+		}
+		break;
+	}
+	}
+}
+
+/* Worker share of the batch FFTs, channels side by side in each row */
+static void
+cpu_job_fft(struct fosphor *self, struct cpu_worker *w, int n)
+{
+	struct fosphor_cpu_state *cpu = self->cpu;
+	const int win_hop = self->fft_hop / self->channels;
+	const int total = cpu->n_spectra * self->channels;
+	int k0 = (int)((int64_t)total *  w->idx      / n);
+	int k1 = (int)((int64_t)total * (w->idx + 1) / n);
+	int k, i;
+
+	for (k=k0; k<k1; k++)
+	{
+		float *out = &cpu->pwr[(size_t)k * self->chan_len];
+		const float *buf = w->fft_buf;
+
+		cpu_fft_load(self, w->fft_buf, (size_t)k * win_hop);
+		cpu_fft_exec(self, w->fft_buf);
+
+		for (i=0; i<self->chan_len; i++)
+			out[i] = buf[2*i] * buf[2*i] + buf[2*i+1] * buf[2*i+1];
+	}
+}
+
+
+/* ------------------------------------------------------------------------ */
+/* Display                                                                  */
+/* ------------------------------------------------------------------------ */
+
+/* Histogram rise / decay of value v for hc hits over a batch */
+static inline float
+cpu_histo_rise_decay(const struct fosphor_cpu_state *cpu,
+                     float v, unsigned int hc, int batch)
+{
+	float a = (float)hc / (float)batch;
+	float b = a / cpu->histo_t0r;
+	float c = b + (1.0f / cpu->histo_t0d);
+	float d = b / c;
+	float e = powf(1.0f - c, (float)batch);
+
+	v = (v - d) * e + d;
+
+	return (v < 0.0f) ? 0.0f : ((v > 1.0f) ? 1.0f : v);
+}
+
+/* Power of a display column from the powers p of its n bins, in the
+ * averaging domain & statistic of mode (as reduce_pwr() in display.cl) */
+static inline float
+cpu_reduce(const float *p, int n, int mode)
+{
+	const int stat = mode & 0xf;
+	float s0 = 0.0f, s1 = 0.0f;
+	int i;
+
+	for (i=0; i<n; i++) {
+		float v = (mode & FOSPHOR_AVG_LOG) ? p[i] : powf(10.0f, 2.0f * p[i]);
+
+		s0  = (stat == FOSPHOR_AVG_PEAK) ? (i ? fmaxf(s0, v) : v) : (s0 + v);
+		s1 += v * v;
+	}
+
+	if (stat == FOSPHOR_AVG_MEAN)
+		s0 = s0 / (float)n;
+	else if (stat == FOSPHOR_AVG_RMS)
+		s0 = copysignf(sqrtf(s1 / (float)n), s0);
+
+	return (mode & FOSPHOR_AVG_LOG) ? s0 : (0.5f * log10f(s0));
+}
+
+/* Averaging, waterfall, histogram and live / max hold spectra for the
+ * CPU_BLOCK bins from x0 (their CPU_BLOCK >> img_red display columns).
+ * Same math as display.cl */
+static void
+cpu_display_block(struct fosphor *self, struct cpu_worker *w, int x0)
+{
+	struct fosphor_cpu_state *cpu = self->cpu;
+	const int len = self->fft_len;
+	const int ilen = self->img_len;
+	const int red = self->img_red;
+	const int cols = CPU_BLOCK >> red;
+	const int d0 = x0 >> red;
+	const int bins = self->histo_bins;
+	const int mask = self->wf_depth - 1;
+	const int stat = cpu->avg_mode & 0xf;
+	const int in_log = cpu->avg_mode & FOSPHOR_AVG_LOG;
+	const float histo_scale = self->power.scale * bins;
+	const float histo_ofs = self->power.offset;
+	float s0[CPU_BLOCK], s1[CPU_BLOCK], wm[CPU_BLOCK];
+	float live[CPU_BLOCK], bmax[CPU_BLOCK], p[CPU_BLOCK], q[CPU_BLOCK];
+	unsigned int *hc = w->hc;
+	int aphase = cpu->avg_phase;
+	int wphase = cpu->wf_phase;
+	int k, c, b, o = 0, wo = 0;
+
+	memset(hc, 0x00, bins * CPU_BLOCK * sizeof(unsigned int));
+
+	for (c=0; c<CPU_BLOCK; c++) {
+		s0[c]   = cpu->avg_acc[2*(x0+c)];
+		s1[c]   = cpu->avg_acc[2*(x0+c)+1];
+		wm[c]   = (c < cols) ? cpu->wf_acc[d0+c] : 0.0f;
+		live[c] = 0.0f;
+		bmax[c] = -1000.0f;
+	}
+
+	for (k=0; k<cpu->n_spectra; k++)
+	{
+		const float *pw = &cpu->pwr[(size_t)k * len + x0];
+
+		/* Displayed power (log10 magnitude) */
+		if (cpu->avg_count > 1)
+		{
+			for (c=0; c<CPU_BLOCK; c++) {
+				float v = in_log ? (0.5f * log10f(pw[c])) : pw[c];
+
+				if (!aphase) {
+					s0[c] = v;
+					s1[c] = v * v;
+				} else {
+					s0[c]  = (stat == FOSPHOR_AVG_PEAK) ? fmaxf(s0[c], v) : (s0[c] + v);
+					s1[c] += v * v;
+				}
+			}
+
+			if (++aphase < cpu->avg_count)
+				continue;
+
+			aphase = 0;
+
+			for (c=0; c<CPU_BLOCK; c++) {
+				float r;
+
+				if (stat == FOSPHOR_AVG_MEAN)
+					r = s0[c] / (float)cpu->avg_count;
+				else if (stat == FOSPHOR_AVG_RMS)
+					r = copysignf(sqrtf(s1[c] / (float)cpu->avg_count), s0[c]);
+				else
+					r = s0[c];
+
+				p[c] = in_log ? r : (0.5f * log10f(r));
+			}
+		}
+		else
+		{
+			for (c=0; c<CPU_BLOCK; c++)
+				p[c] = 0.5f * log10f(pw[c]);
+		}
+
+		/* Live spectrum & batch max */
+		for (c=0; c<CPU_BLOCK; c++) {
+			bmax[c]  = fmaxf(bmax[c], p[c]);
+			live[c] += p[c] * cpu->live_w[o];
+		}
+
+		/* Display columns */
+		if (red) {
+			for (c=0; c<cols; c++)
+				q[c] = cpu_reduce(&p[c << red], 1 << red, self->opts.disp_mode);
+		} else {
+			memcpy(q, p, CPU_BLOCK * sizeof(float));
+		}
+
+		/* Histogram hits */
+		for (c=0; c<cols; c++) {
+			if (isnan(q[c]))
+				continue;
+
+			b = (int)roundf(histo_scale * (q[c] + histo_ofs));
+			b = (b < 0) ? 0 : ((b > bins - 1) ? (bins - 1) : b);
+
+			hc[b * CPU_BLOCK + c]++;
+		}
+
+		/* Waterfall, directly or the peak of every wf_decim */
+		if (cpu->wf_decim <= 1)
+		{
+			memcpy(&cpu->waterfall[(size_t)((cpu->waterfall_pos + o) & mask) * ilen + d0],
+				q, cols * sizeof(float));
+		}
+		else
+		{
+			for (c=0; c<cols; c++)
+				wm[c] = wphase ? fmaxf(wm[c], q[c]) : q[c];
+
+			if (++wphase >= cpu->wf_decim) {
+				memcpy(&cpu->waterfall[(size_t)((cpu->waterfall_pos + wo++) & mask) * ilen + d0],
+					wm, cols * sizeof(float));
+				wphase = 0;
+			}
+		}
+
+		o++;
+	}
+
+	/* Carry partials to the next batch */
+	for (c=0; c<CPU_BLOCK; c++) {
+		cpu->avg_acc[2*(x0+c)]   = s0[c];
+		cpu->avg_acc[2*(x0+c)+1] = s1[c];
+	}
+
+	for (c=0; c<cols; c++)
+		cpu->wf_acc[d0+c] = wm[c];
+
+	if (!o)
+		return;
+
+	/* Histogram rise / decay */
+	for (b=0; b<bins; b++)
+	{
+		float *h = &cpu->histogram[(size_t)b * ilen + d0];
+
+		for (c=0; c<cols; c++) {
+			unsigned int n = hc[b * CPU_BLOCK + c];
+
+			if ((h[c] <= 0.01f) && !n)
+				continue;
+
+			h[c] = cpu_histo_rise_decay(cpu, h[c], n, o);
+		}
+	}
+
+	/* Live spectrum & max hold (as max_hold() in display.cl) */
+	for (c=0; c<CPU_BLOCK; c++)
+	{
+		const int n = len >> 1;
+		const int i = (x0 + c) ^ n;
+		float *lv = &cpu->spectrum[2*i];
+		float *mv = &cpu->spectrum[2*(len+i)];
+		float v;
+
+		v = lv[1];
+		if (!isfinite(v))
+			v = live[c] / o;
+
+		lv[0] = ((float)i / (float)n) - 1.0f;
+		lv[1] = v * powf(1.0f - cpu->live_alpha, (float)o) + live[c] * cpu->live_alpha;
+
+		mv[0] = lv[0];
+
+		if (cpu->max_hold == FOSPHOR_MAX_HOLD_HISTO)
+		{
+			/* Top of the persistence, above the noise of the histogram */
+			v = - histo_ofs;
+
+			for (b=0; b<bins; b++)
+				if (cpu->histogram[(size_t)b * ilen + d0 + (c >> red)] > 0.1f)
+					v = ((float)b / histo_scale) - histo_ofs;
+
+			mv[1] = v;
+			continue;
+		}
+
+		v = mv[1];
+		if (!isfinite(v))
+			v = -FLT_MAX;
+
+		if (cpu->max_hold == FOSPHOR_MAX_HOLD_LIVE)
+			v = fmaxf(v, lv[1]);
+		else if (cpu->max_hold == FOSPHOR_MAX_HOLD_NORMAL)
+			v = fmaxf(v, bmax[c]);
+		else
+			v = fmaxf(v * 0.999f + 0.001f * lv[1], bmax[c]);
+
+		mv[1] = v;
+	}
+}
+
+/* Band power of each spectrum of the batch (as trigger() in display.cl) */
+static void
+cpu_trigger(struct fosphor *self, int n_spectra)
+{
+	struct fosphor_cpu_state *cpu = self->cpu;
+	const int len = self->fft_len;
+	const int half = len >> 1;
+	int k, i;
+
+	for (k=0; k<n_spectra; k++)
+	{
+		const float *pw = &cpu->pwr[(size_t)k * len];
+		float s = 0.0f;
+
+		for (i=cpu->trigger_lo; i<cpu->trigger_hi; i++)
+			s += pw[i ^ half];
+
+		if (!(s > cpu->trigger_thr))
+			continue;
+
+		if (cpu->trigger_first < 0)
+			cpu->trigger_first = cpu->trigger_base + k;
+
+		cpu->trigger_peak = fmaxf(cpu->trigger_peak, s);
+	}
+
+	cpu->trigger_base += n_spectra;
+}
+
+static void
+cpu_job_display(struct fosphor *self, struct cpu_worker *w, int n)
+{
+	int x;
+
+	for (x=w->idx*CPU_BLOCK; x<self->fft_len; x+=n*CPU_BLOCK)
+		cpu_display_block(self, w, x);
+}
+
+static inline int
+cpu_detect_is_peak(const float *spec, int len, int i, float thr)
+{
+	float v = spec[2*i+1];
+
+	if (!isfinite(v) || (v < thr))
+		return 0;
+
+	/* Plateaus count once, at their first bin */
+	if ((i > 0) && !(v > spec[2*(i-1)+1]))
+		return 0;
+	if ((i < len-1) && !(v >= spec[2*(i+1)+1]))
+		return 0;
+
+	return 1;
+}
+
+/* Peaks of the live spectrum, as the OpenCL detect kernel */
+static void
+cpu_detect(struct fosphor *self)
+{
+	struct fosphor_cpu_state *cpu = self->cpu;
+	const float *spec = cpu->spectrum;
+	const int len = self->fft_len;
+	float s, n, mean, floor_pwr, thr, lo, hi;
+	int i, it, cnt;
+
+	s = n = 0.0f;
+	for (i=0; i<len; i++) {
+		if (isfinite(spec[2*i+1])) {
+			s += spec[2*i+1];
+			n += 1.0f;
+		}
+	}
+	mean = (n > 0.0f) ? (s / n) : 0.0f;
+
+	s = n = 0.0f;
+	for (i=0; i<len; i++) {
+		if (isfinite(spec[2*i+1]) && (spec[2*i+1] < mean)) {
+			s += spec[2*i+1];
+			n += 1.0f;
+		}
+	}
+	floor_pwr = (n > 0.0f) ? (s / n) : mean;
+	thr = floor_pwr + cpu->detect_thr;
+
+	/* Too many, keep the strongest (same bisection as the kernel) */
+	for (i=0, cnt=0, hi=thr; i<len; i++) {
+		if (cpu_detect_is_peak(spec, len, i, thr)) {
+			cnt++;
+			hi = fmaxf(hi, spec[2*i+1]);
+		}
+	}
+
+	if (cnt > FOSPHOR_DETECT_MAX) {
+		lo = thr;
+
+		for (it=0; it<16; it++) {
+			float mid = 0.5f * (lo + hi);
+
+			for (i=0, cnt=0; i<len; i++)
+				cnt += cpu_detect_is_peak(spec, len, i, mid);
+
+			if (cnt > FOSPHOR_DETECT_MAX)
+				lo = mid;
+			else
+				hi = mid;
+		}
+
+		thr = hi;
+	}
+
+	for (i=0, cnt=0; (i<len) && (cnt<FOSPHOR_DETECT_MAX); i++) {
+		if (!cpu_detect_is_peak(spec, len, i, thr))
+			continue;
+
+		cpu->detect[2*(1+cnt)]   = (float)i;
+		cpu->detect[2*(1+cnt)+1] = spec[2*i+1];
+
+		cnt++;
+	}
+
+	cpu->detect[0] = (float)cnt;
+	cpu->detect[1] = floor_pwr;
+}
+
+
+/* ------------------------------------------------------------------------ */
+/* Exposed API                                                              */
+/* ------------------------------------------------------------------------ */
+
+int
+fosphor_cpu_init(struct fosphor *self)
+{
+	struct fosphor_cpu_state *cpu;
+	float *tw;
+	int len = self->chan_len;
+	int half, i, j, n;
+
+	/* Allocate structure */
+	cpu = calloc(1, sizeof(struct fosphor_cpu_state));
+	if (!cpu)
+		return -ENOMEM;
+
+	self->cpu = cpu;
+
+	cpu->fft_max_batch = self->fft_max_batch;
+	cpu->avg_count = 1;
+	cpu->wf_decim  = 1;
+
+	cpu->max_hold   = FOSPHOR_MAX_HOLD_DECAY;
+	cpu->histo_t0r  = CPU_HISTO_T0R;
+	cpu->histo_t0d  = CPU_HISTO_T0D;
+	cpu->live_alpha = CPU_LIVE_ALPHA;
+
+	/* FFT tables */
+	tw = malloc(2 * sizeof(float) * len);
+	cpu->bitrev = malloc(sizeof(unsigned int) * len);
+	if (!tw || !cpu->bitrev) {
+		free(tw);
+		goto error;
+	}
+
+	cpu->twiddle = tw;
+
+	for (half=1; half<len; half<<=1) {
+		for (j=0; j<half; j++) {
+			tw[2*j]   = (float)cos(-M_PI * j / half);
+			tw[2*j+1] = (float)sin(-M_PI * j / half);
+		}
+		tw += 2 * half;
+	}
+
+	for (i=0; i<len; i++) {
+		unsigned int r = 0;
+		for (j=0; j<self->chan_len_log; j++)
+			r |= ((i >> j) & 1) << (self->chan_len_log - 1 - j);
+		cpu->bitrev[i] = r;
+	}
+
+	/* Batch & display state */
+	cpu->pwr       = malloc((size_t)cpu->fft_max_batch * self->fft_len * sizeof(float));
+	cpu->live_w    = malloc(cpu->fft_max_batch * sizeof(float));
+	cpu->avg_acc   = calloc(2 * self->fft_len, sizeof(float));
+	cpu->wf_acc    = calloc(self->fft_len, sizeof(float));
+	cpu->waterfall = malloc((size_t)self->img_len * self->wf_depth * sizeof(float));
+	cpu->histogram = malloc((size_t)self->img_len * self->histo_bins * sizeof(float));
+	cpu->spectrum  = malloc(2 * 2 * self->fft_len * sizeof(float));
+
+	if (!cpu->pwr || !cpu->live_w || !cpu->avg_acc || !cpu->wf_acc ||
+	    !cpu->waterfall || !cpu->histogram || !cpu->spectrum)
+		goto error;
+
+	/* Workers */
+	n = cpu_workers_count();
+
+	for (i=0; i<n; i++) {
+		struct cpu_worker *w = &cpu->workers[i];
+
+		w->self    = self;
+		w->idx     = i;
+		w->fft_buf = malloc(2 * sizeof(float) * len);
+		w->hc      = malloc(self->histo_bins * CPU_BLOCK * sizeof(unsigned int));
+
+		if (!w->fft_buf || !w->hc)
+			goto error;
+	}
+
+	cpu->n_workers = 1;
+
+#ifdef CPU_HAVE_THREADS
+	pthread_mutex_init(&cpu->lock, NULL);
+	pthread_cond_init(&cpu->cond_start, NULL);
+	pthread_cond_init(&cpu->cond_done, NULL);
+
+	for (i=1; i<n; i++) {
+		if (pthread_create(&cpu->workers[i].thread, NULL,
+		                   cpu_worker_main, &cpu->workers[i])) {
+			fprintf(stderr, "[!] Unable to start all CPU engine threads\n");
+			break;
+		}
+		cpu->n_workers = i + 1;
+	}
+#endif
+
+	fprintf(stderr, "[+] Using the CPU engine (%d threads)\n", cpu->n_workers);
+
+	return 0;
+
+error:
+	fosphor_cpu_release(self);
+	return -ENOMEM;
+}
+
+void
+fosphor_cpu_release(struct fosphor *self)
+{
+	struct fosphor_cpu_state *cpu = self->cpu;
+	int i;
+
+	if (!cpu)
+		return;
+
+#ifdef CPU_HAVE_THREADS
+	if (cpu->n_workers > 1) {
+		pthread_mutex_lock(&cpu->lock);
+		cpu->stop = 1;
+		pthread_cond_broadcast(&cpu->cond_start);
+		pthread_mutex_unlock(&cpu->lock);
+
+		for (i=1; i<cpu->n_workers; i++)
+			pthread_join(cpu->workers[i].thread, NULL);
+	}
+
+	if (cpu->n_workers) {
+		pthread_cond_destroy(&cpu->cond_done);
+		pthread_cond_destroy(&cpu->cond_start);
+		pthread_mutex_destroy(&cpu->lock);
+	}
+#endif
+
+	for (i=0; i<CPU_MAX_THREADS; i++) {
+		free(cpu->workers[i].fft_buf);
+		free(cpu->workers[i].hc);
+	}
+
+	free((void *)cpu->twiddle);
+	free(cpu->bitrev);
+	free(cpu->pwr);
+	free(cpu->live_w);
+	free(cpu->avg_acc);
+	free(cpu->wf_acc);
+	free(cpu->waterfall);
+	free(cpu->histogram);
+	free(cpu->spectrum);
+	free(cpu->detect);
+
+	free(cpu);
+	self->cpu = NULL;
+}
+
+int
+fosphor_cpu_process(struct fosphor *self,
+                    void *samples, int len)
+{
+	struct fosphor_cpu_state *cpu = self->cpu;
+	const int hop = self->fft_hop;
+	int n_spectra, n_rows, n_wf, i;
+
+	/* Validate batch size (see fosphor_cl_process) */
+	len -= self->fft_len - hop;
+	if ((len <= 0) || (len % (FOSPHOR_FFT_MULT_BATCH * hop)))
+		return -EINVAL;
+
+	n_spectra = len / hop;
+	if (n_spectra > cpu->fft_max_batch)
+		return -EINVAL;
+
+	/* First run, start from the bottom of the scale */
+	if (!cpu->booted) {
+		const float noise_floor = - self->power.offset;
+		size_t n = (size_t)self->img_len * self->wf_depth;
+
+		for (i=0; i<2*2*self->fft_len; i++)
+			cpu->spectrum[i] = noise_floor;
+
+		while (n--)
+			cpu->waterfall[n] = noise_floor;
+
+		memset(cpu->histogram, 0x00, (size_t)self->img_len * self->histo_bins * sizeof(float));
+
+		cpu->waterfall_dirty = self->wf_depth;
+		cpu->booted = 1;
+	}
+
+	/* Rows out of this batch */
+	n_rows = (cpu->avg_phase + n_spectra) / cpu->avg_count;
+	n_wf   = (cpu->wf_decim > 1) ? ((cpu->wf_phase + n_rows) / cpu->wf_decim) : n_rows;
+
+	for (i=0; i<n_rows; i++)
+		cpu->live_w[i] = powf(1.0f - cpu->live_alpha, (float)(n_rows - i - 1));
+
+	cpu->samples   = samples;
+	cpu->n_spectra = n_spectra;
+	cpu->n_rows    = n_rows;
+
+	/* Go */
+	cpu_run(self, cpu_job_fft);
+
+	if (cpu->trigger_enabled)
+		cpu_trigger(self, n_spectra);
+	cpu_run(self, cpu_job_display);
+
+	cpu->samples = NULL;
+
+	/* Advance partials & waterfall, the new rows are from the current range */
+	cpu->avg_phase = (cpu->avg_phase + n_spectra) % cpu->avg_count;
+
+	if (cpu->wf_decim > 1)
+		cpu->wf_phase = (cpu->wf_phase + n_rows) % cpu->wf_decim;
+
+	for (i=0; (i<n_wf) && (i<self->wf_depth); i++) {
+		struct fosphor_wf_freq *wff =
+			&self->wf_freq[(cpu->waterfall_pos + n_wf - 1 - i) & (self->wf_depth - 1)];
+		wff->center = self->frequency.center;
+		wff->span   = self->frequency.span;
+	}
+
+	cpu->waterfall_pos = (cpu->waterfall_pos + n_wf) & (self->wf_depth - 1);
+
+	cpu->waterfall_dirty += n_wf;
+	if (cpu->waterfall_dirty > self->wf_depth)
+		cpu->waterfall_dirty = self->wf_depth;
+
+	cpu->pending = 1;
+
+	return 0;
+}
+
+/* Private float state to the host image, converting if it's in half */
+static void
+cpu_img_copy(struct fosphor *self, void *dst, const float *src, size_t ofs, size_t n)
+{
+	size_t i;
+
+	if (!(self->flags & FLG_FOSPHOR_HALF)) {
+		memcpy((float *)dst + ofs, src + ofs, n * sizeof(float));
+		return;
+	}
+
+	for (i=ofs; i<ofs+n; i++)
+		fosphor_img_set(self, dst, i, src[i]);
+}
+
+int
+fosphor_cpu_finish(struct fosphor *self)
+{
+	struct fosphor_cpu_state *cpu = self->cpu;
+	const size_t row = (size_t)self->fft_len * sizeof(float);
+	int pos, rem;
+
+	if (!cpu->pending) {
+		cpu->trigger_valid = 0;
+		return 0;
+	}
+
+	/* Host copies, only the waterfall rows written since last time */
+	memcpy(self->buf_spectrum, cpu->spectrum, 2 * 2 * row);
+	cpu_img_copy(self, self->img_histogram, cpu->histogram, 0,
+	             (size_t)self->histo_bins * self->img_len);
+
+	pos = cpu->waterfall_pos_sync;
+	rem = cpu->waterfall_dirty;
+
+	while (rem) {
+		int n = self->wf_depth - pos;
+		if (n > rem)
+			n = rem;
+
+		cpu_img_copy(self, self->img_waterfall, cpu->waterfall,
+		             (size_t)pos * self->img_len, (size_t)n * self->img_len);
+
+		pos = (pos + n) & (self->wf_depth - 1);
+		rem -= n;
+	}
+
+	self->wf_dirty.start = cpu->waterfall_pos_sync;
+	self->wf_dirty.len   = cpu->waterfall_dirty;
+
+	cpu->waterfall_pos_sync = cpu->waterfall_pos;
+	cpu->waterfall_dirty    = 0;
+
+	/* Detection on what's displayed */
+	if (cpu->detect_enabled) {
+		cpu_detect(self);
+		cpu->detect_valid = 1;
+	}
+
+	if (cpu->trigger_enabled) {
+		cpu->trigger_age   = (cpu->trigger_first < 0) ? -1 :
+		                     (cpu->trigger_base - cpu->trigger_first - 1);
+		cpu->trigger_power = cpu->trigger_peak;
+		cpu->trigger_valid = 1;
+
+		cpu->trigger_base  = 0;
+		cpu->trigger_first = -1;
+		cpu->trigger_peak  = 0.0f;
+	}
+
+	cpu->pending = 0;
+
+	return 1;
+}
+
+int
+fosphor_cpu_set_averaging(struct fosphor *self, int count, int mode)
+{
+	struct fosphor_cpu_state *cpu = self->cpu;
+
+	cpu->avg_count = count;
+	cpu->avg_mode  = mode;
+	cpu->avg_phase = 0;
+
+	return 0;
+}
+
+int
+fosphor_cpu_set_waterfall_decimation(struct fosphor *self, int decim)
+{
+	struct fosphor_cpu_state *cpu = self->cpu;
+
+	cpu->wf_decim = decim;
+	cpu->wf_phase = 0;
+
+	return 0;
+}
+
+int
+fosphor_cpu_set_max_hold(struct fosphor *self, int mode)
+{
+	self->cpu->max_hold = mode;
+	return 0;
+}
+
+int
+fosphor_cpu_set_persistence(struct fosphor *self,
+                            float histo_rise, float histo_decay, float live_alpha)
+{
+	struct fosphor_cpu_state *cpu = self->cpu;
+
+	cpu->histo_t0r  = histo_rise;
+	cpu->histo_t0d  = histo_decay;
+	cpu->live_alpha = live_alpha;
+
+	return 0;
+}
+
+int
+fosphor_cpu_set_trigger(struct fosphor *self, int enable,
+                        int bin_lo, int bin_hi, float threshold)
+{
+	struct fosphor_cpu_state *cpu = self->cpu;
+
+	cpu->trigger_lo  = bin_lo;
+	cpu->trigger_hi  = bin_hi;
+	cpu->trigger_thr = threshold;
+
+	if (!enable || !cpu->trigger_enabled) {
+		cpu->trigger_valid = 0;
+		cpu->trigger_base  = 0;
+		cpu->trigger_first = -1;
+		cpu->trigger_peak  = 0.0f;
+	}
+
+	cpu->trigger_enabled = enable;
+
+	return 0;
+}
+
+/* Same as fosphor_cl_get_trigger() */
+int
+fosphor_cpu_get_trigger(struct fosphor *self, int *age, float *power)
+{
+	struct fosphor_cpu_state *cpu = self->cpu;
+
+	if (!cpu->trigger_valid)
+		return -ENODATA;
+
+	if (cpu->trigger_age < 0)
+		return 0;
+
+	*age   = cpu->trigger_age;
+	*power = cpu->trigger_power;
+
+	return 1;
+}
+
+/* Threshold is in the spectrum units (log10 magnitude) */
+int
+fosphor_cpu_set_detection(struct fosphor *self, int enable, float threshold)
+{
+	struct fosphor_cpu_state *cpu = self->cpu;
+
+	if (enable && !cpu->detect) {
+		cpu->detect = malloc(2 * sizeof(float) * (1 + FOSPHOR_DETECT_MAX));
+		if (!cpu->detect)
+			return -ENOMEM;
+	}
+
+	cpu->detect_enabled = enable;
+	cpu->detect_thr     = threshold;
+	cpu->detect_valid   = 0;
+
+	return 0;
+}
+
+/* Raw results as of the last sync, same layout as the OpenCL ones */
+int
+fosphor_cpu_get_detections(struct fosphor *self, const float **det)
+{
+	struct fosphor_cpu_state *cpu = self->cpu;
+
+	if (!cpu->detect_valid)
+		return -ENODATA;
+
+	*det = cpu->detect;
+
+	return 0;
+}
+
+int
+fosphor_cpu_get_waterfall_position(struct fosphor *self)
+{
+	struct fosphor_cpu_state *cpu = self->cpu;
+	return cpu->waterfall_pos_sync;
+}
+
+/* Adds the engine allocations */
+void
+fosphor_cpu_get_memory(struct fosphor *self, size_t *host)
+{
+	struct fosphor_cpu_state *cpu = self->cpu;
+	const int len = self->chan_len;
+	int i;
+
+	*host += sizeof(struct fosphor_cpu_state);
+	*host += len * (2 * sizeof(float) + sizeof(unsigned int));
+	*host += (size_t)cpu->fft_max_batch * (self->fft_len + 1) * sizeof(float);
+	*host += (2 + 1 + 4) * self->fft_len * sizeof(float);
+	*host += (size_t)self->img_len * (self->wf_depth + self->histo_bins) * sizeof(float);
+
+	for (i=0; i<CPU_MAX_THREADS; i++)
+		if (cpu->workers[i].fft_buf)
+			*host += 2 * sizeof(float) * len +
+			         self->histo_bins * CPU_BLOCK * sizeof(unsigned int);
+
+	if (cpu->detect)
+		*host += 2 * sizeof(float) * (1 + FOSPHOR_DETECT_MAX);
+}
+
+/*! @} */
@@ -0,0 +1,44 @@
+/*
+ * cpu.h
+ *
+ * CPU compute engine, when no OpenCL device is usable
+ *
+ * Copyright (C) 2013-2021 Sylvain Munaut
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+/*! \defgroup cpu
+ *  @{
+ */
+
+/*! \file cpu.h
+ *  \brief CPU compute engine, when no OpenCL device is usable
+ */
+
+#include <stddef.h>
+
+struct fosphor;
+
+int  fosphor_cpu_init(struct fosphor *self);
+void fosphor_cpu_release(struct fosphor *self);
+
+int fosphor_cpu_process(struct fosphor *self,
+                        void *samples, int len);
+int fosphor_cpu_finish(struct fosphor *self);
+
+int  fosphor_cpu_set_averaging(struct fosphor *self, int count, int mode);
+int  fosphor_cpu_set_waterfall_decimation(struct fosphor *self, int decim);
+int  fosphor_cpu_set_detection(struct fosphor *self, int enable, float threshold);
+int  fosphor_cpu_get_detections(struct fosphor *self, const float **det);
+int  fosphor_cpu_set_trigger(struct fosphor *self, int enable,
+                             int bin_lo, int bin_hi, float threshold);
+int  fosphor_cpu_get_trigger(struct fosphor *self, int *age, float *power);
+int  fosphor_cpu_set_max_hold(struct fosphor *self, int mode);
+int  fosphor_cpu_set_persistence(struct fosphor *self,
+                                 float histo_rise, float histo_decay, float live_alpha);
+int  fosphor_cpu_get_waterfall_position(struct fosphor *self);
+void fosphor_cpu_get_memory(struct fosphor *self, size_t *host);
+
+/*! @} */
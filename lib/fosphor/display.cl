@@ -35,12 +35,23 @@
 #pragma OPENCL EXTENSION cl_khr_local_int32_base_atomics : enable
 #endif
 
+/* Histogram bins (power of 2, 64 to 512), and how many of them fit in
+ * local memory at once (set automatically) */
+#ifndef HISTO_BINS
+#define HISTO_BINS 128
+#endif
+#ifndef HISTO_LOCAL
+#define HISTO_LOCAL HISTO_BINS
+#endif
+
 #define CLAMP
 
-//#define MAX_HOLD_LIVE
-//#define MAX_HOLD_HISTO
-//#define MAX_HOLD_NORMAL
+/* Max hold variant, one of MAX_HOLD_{LIVE,HISTO,NORMAL,DECAY}, picked by
+ * the host build options (each is its own program) */
+#if !defined(MAX_HOLD_LIVE) && !defined(MAX_HOLD_HISTO) && \
+    !defined(MAX_HOLD_NORMAL) && !defined(MAX_HOLD_DECAY)
 #define MAX_HOLD_DECAY
+#endif
 
 
 #ifdef USE_NV_SM11_ATOMICS
@@ -64,6 +75,99 @@ inline void nv_sm11_atomic_inc(volatile __local uint *p, uint tag)
 #endif /* USE_NV_SM11_ATOMICS */
 
 
+/* Histogram rise / decay of value v for hc hits over a batch */
+inline float histo_rise_decay(float v, uint hc, uint fft_batch,
+                              float histo_t0r, float histo_t0d)
+{
+	float a = (float)hc / (float)fft_batch;
+	float b = a * native_recip(histo_t0r);
+	float c = b + native_recip(histo_t0d);
+	float d = b * native_recip(c);
+	float e = native_powr(1.0f - c, (float)fft_batch);
+
+	v = (v - d) * e + d;
+
+	/* Clamp value (we don't clear the texture so we get crap) */
+	return clamp(v, 0.0f, 1.0f);
+}
+
+/* Spectrum averaging statistic & domain (see fosphor.h), also used to
+ * reduce bins into the display columns */
+#define AVG_MEAN	0
+#define AVG_RMS		1
+#define AVG_PEAK	2
+#define AVG_LOG		(1 << 4)
+
+/* Power (log10 magnitude) of the display column made of the n bins of the
+ * spectrum from fft, combined like the averaging does over time */
+inline float reduce_pwr(__global const float2 *fft, uint n, uint mode)
+{
+	const uint stat = mode & 0xf;
+	float s0 = 0.0f, s1 = 0.0f;
+	uint i;
+
+	for (i=0; i<n; i++)
+	{
+		float2 f = fft[i];
+		float v = (mode & AVG_LOG) ? log10(hypot(f.x, f.y)) : dot(f, f);
+
+		s0  = (stat == AVG_PEAK) ? (i ? max(s0, v) : v) : (s0 + v);
+		s1 += v * v;
+	}
+
+	if (stat == AVG_MEAN)
+		s0 = s0 / (float)n;
+	else if (stat == AVG_RMS)
+		s0 = copysign(sqrt(s1 / (float)n), s0);
+
+	return (mode & AVG_LOG) ? s0 : (0.5f * log10(s0));
+}
+
+/* New max hold value for FFT bin x / spectrum position i, given the
+ * maximum power of the current batch */
+inline float max_hold_update(
+	__global const float2 *live_vbo, __global const float2 *max_vbo,
+	__read_only image2d_t histo_tex_r, int x, int i, float batch_max,
+	const float histo_scale, const float histo_ofs)
+{
+	float max_pwr;
+
+#ifdef MAX_HOLD_HISTO
+	const sampler_t direct_sample = CLK_NORMALIZED_COORDS_FALSE | CLK_FILTER_NEAREST | CLK_ADDRESS_CLAMP_TO_EDGE;
+	int y;
+
+	max_pwr = - histo_ofs;
+
+	for (y=0; y<HISTO_BINS; y++)
+	{
+		/* Fetch histogram value */
+		float4 hv = read_imagef(histo_tex_r, direct_sample, (int2)(x, y));
+
+		/* Set vertex position */
+		if (hv.x > 0.1f)
+			max_pwr = ((float)y / histo_scale) - histo_ofs;
+	}
+#else
+	max_pwr = max_vbo[i].y;
+	if (!isfinite(max_pwr))
+		max_pwr = - MAXFLOAT; /* Will be replaced by max() below */
+
+#ifdef MAX_HOLD_LIVE
+	max_pwr = max(live_vbo[i].y, max_pwr);
+#endif
+#ifdef MAX_HOLD_NORMAL
+	max_pwr = max(max_pwr, batch_max);
+#endif
+#ifdef MAX_HOLD_DECAY
+	max_pwr = max_pwr * 0.999f + 0.001f * live_vbo[i].y;
+	max_pwr = max(max_pwr, batch_max);
+#endif
+#endif
+
+	return max_pwr;
+}
+
+
 __attribute__((reqd_work_group_size(16, 16, 1)))
 __kernel void display(
 	/* FFT Input */
@@ -85,15 +189,25 @@ __kernel void display(
 
 	/* Live spectrum */
 	__global float2 *spectrum_vbo,		/* [11] Vertex Buffer Object    */
-	const float live_alpha)			/* [12] Averaging time constant */
+	const float live_alpha,			/* [12] Averaging time constant */
+
+	const uint wf_write,			/* [13] Waterfall done here (not decimated) */
+
+	/* Display width */
+	const uint disp_red,			/* [14] log2(bins per column) */
+	const uint disp_mode)			/* [15] Bins reduction (AVG_xxx) */
 {
-	int gidx;
+	/* The first work item of each column does its waterfall & histogram,
+	 * the others only their bin of the spectra */
+	const uint red_lead = !(get_global_id(0) & ((1 << disp_red) - 1));
+	const int  disp_x   = get_global_id(0) >> disp_red;
+	int gidx, tile, i;
 	float max_pwr = - 1000.0f;
 
 	/* Local memory */
 	__local float live_buf[16 * 16];	/* get_local_size(0) * get_local_size(1) */
 	__local float max_buf[16 * 16];		/* get_local_size(0) * get_local_size(1) */
-	__local uint  histo_buf[16 * 128];
+	__local uint  histo_buf[16 * HISTO_LOCAL];
 
 	/* Local shortcuts */
 	const float live_one_minus_alpha = 1.0f - live_alpha;
@@ -114,67 +228,138 @@ __kernel void display(
 
 	__local uint *h = &histo_buf[get_local_id(1) * get_local_size(0) + get_local_id(0)];
 
-	h[   0] = 0;
-	h[ 256] = 0;
-	h[ 512] = 0;
-	h[ 768] = 0;
-	h[1024] = 0;
-	h[1280] = 0;
-	h[1536] = 0;
-	h[1792] = 0;
-
-	/* Wait for all clears to be done by everyone */
-	barrier(CLK_LOCAL_MEM_FENCE);
-
-	/* Main loop */
-	for (gidx=0; gidx<fft_batch; gidx+=get_local_size(1))
+	/* Histogram tiles. Only one unless the bins don't all fit in local
+	 * memory, the batch is then read again for each, but every hit is
+	 * still a single increment */
+	for (tile=0; tile<HISTO_BINS; tile+=HISTO_LOCAL)
 	{
-		/* Read fft & compute power */
-		int fft_idx = ((gidx + get_local_id(1)) << fft_log2_len) + get_global_id(0);
-		float2 fft_value = fft[fft_idx];
-
-		float pwr = log10(hypot(fft_value.x,fft_value.y));
-
-		/* Maximum pwr */
-		max_pwr = max(max_pwr, pwr);
-
-		/* Write to Waterfall texture */
-		int2 coord;
-		coord.x = get_global_id(0);
-		coord.y = (get_local_id(1) + wf_offset + gidx) & (get_image_height(wf_tex) - 1);
+		for (i=0; i<16*HISTO_LOCAL; i+=256)
+			h[i] = 0;
 
-		write_imagef(wf_tex, coord, (float4)(pwr, 0.0f, 0.0f, 0.0f));
+		/* Wait for all clears to be done by everyone */
+		barrier(CLK_LOCAL_MEM_FENCE);
 
-		/* Add to Live Spectrum buffer */
-		live_buf[get_local_id(1) * get_local_size(0) + get_local_id(0)] +=
-			pwr * native_powr(live_one_minus_alpha, (float)(fft_batch - gidx - get_local_id(1) - 1));
+		/* Main loop */
+		for (gidx=0; gidx<fft_batch; gidx+=get_local_size(1))
+		{
+			int row = gidx + get_local_id(1);
+			float pwr = NAN, disp_pwr = NAN;
+
+			/* Averaged batches aren't always a multiple of the work
+			 * group height, rows past the end only take part in the
+			 * barriers */
+			if (row < fft_batch)
+			{
+				/* Read fft & compute power */
+				int fft_idx = (row << fft_log2_len) + get_global_id(0);
+				float2 fft_value = fft[fft_idx];
+
+				pwr = log10(hypot(fft_value.x,fft_value.y));
+
+				/* Column value (all the bins read again, cached) */
+				if (!disp_red)
+					disp_pwr = pwr;
+				else if (red_lead)
+					disp_pwr = reduce_pwr(&fft[fft_idx], 1 << disp_red, disp_mode);
+			}
+
+			if ((row < fft_batch) && !tile)
+			{
+				/* Maximum pwr */
+				max_pwr = max(max_pwr, pwr);
+
+				/* Write to Waterfall texture */
+				if (wf_write && red_lead) {
+					int2 coord;
+					coord.x = disp_x;
+					coord.y = (row + wf_offset) & (get_image_height(wf_tex) - 1);
+
+					write_imagef(wf_tex, coord, (float4)(disp_pwr, 0.0f, 0.0f, 0.0f));
+				}
+
+				/* Add to Live Spectrum buffer */
+				live_buf[get_local_id(1) * get_local_size(0) + get_local_id(0)] +=
+					pwr * native_powr(live_one_minus_alpha, (float)(fft_batch - row - 1));
+			}
+
+			/* The histogram counts the columns */
+			pwr = disp_pwr;
 
 #ifdef USE_NV_SM11_ATOMICS
-		/* Transposition */
-		barrier(CLK_LOCAL_MEM_FENCE);	/* Sync */
-		pwr_buf[ti0] = pwr;		/* Store power */
-		barrier(CLK_LOCAL_MEM_FENCE);	/* Sync */
-		pwr = pwr_buf[ti1];		/* Read power */
+			/* Transposition */
+			barrier(CLK_LOCAL_MEM_FENCE);	/* Sync */
+			pwr_buf[ti0] = pwr;		/* Store power */
+			barrier(CLK_LOCAL_MEM_FENCE);	/* Sync */
+			pwr = pwr_buf[ti1];		/* Read power */
 #endif
 
-		/* Map to bin */
-		int bin = (int)round(histo_scale * (pwr + histo_ofs));
+			if (isnan(pwr))
+				continue;
 
-		if (bin < 0 || bin > 127)
+			/* Map to bin */
+			int bin = (int)round(histo_scale * (pwr + histo_ofs));
+
+			if (bin < 0 || bin > (HISTO_BINS - 1))
 #ifdef CLAMP
-			bin = (bin < 0) ? 0 : 127;
+				bin = (bin < 0) ? 0 : (HISTO_BINS - 1);
 #else
-			continue;
+				continue;
 #endif
 
-		/* Atomic Bin increment */
+			/* In this tile ? */
+			bin -= tile;
+			if ((uint)bin >= HISTO_LOCAL)
+				continue;
+
+			/* Atomic Bin increment */
 #if defined(USE_NV_SM11_ATOMICS)
-		nv_sm11_atomic_inc(&histo_buf[(bin << 4) + get_local_id(1)], tag);
+			nv_sm11_atomic_inc(&histo_buf[(bin << 4) + get_local_id(1)], tag);
 #elif defined(USE_EXT_ATOMICS)
-		atom_inc(&histo_buf[(bin << 4) + get_local_id(0)]);
+			atom_inc(&histo_buf[(bin << 4) + get_local_id(0)]);
 #else
-		atomic_inc(&histo_buf[(bin << 4) + get_local_id(0)]);
+			atomic_inc(&histo_buf[(bin << 4) + get_local_id(0)]);
+#endif
+		}
+
+		/* Wait for everyone before merging */
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		/* Histogram merging */
+		for (gidx=0; gidx<HISTO_LOCAL; gidx+=get_local_size(1))
+		{
+			const sampler_t direct_sample = CLK_NORMALIZED_COORDS_FALSE | CLK_FILTER_NEAREST | CLK_ADDRESS_CLAMP_TO_EDGE;
+
+			/* Histogram coordinates */
+			int2 coord;
+			coord.x = disp_x;
+			coord.y = tile + gidx + get_local_id(1);
+
+			if (!red_lead)
+				continue;
+
+			/* Fetch previous histogram value */
+			float4 hv = read_imagef(histo_tex_r, direct_sample, coord);
+
+			/* Fetch hit count */
+			uint hc = histo_buf[(gidx + get_local_id(1)) * get_local_size(0) + get_local_id(0)]
+#ifdef USE_NV_SM11_ATOMICS
+				& TAG_MASK
 #endif
+			;
+
+			/* Fast exit if possible ... */
+			if ((hv.x <= 0.01f) && (hc == 0))
+				continue;
+
+			/* Apply the rise / decay */
+			hv.x = histo_rise_decay(hv.x, hc, fft_batch, histo_t0r, histo_t0d);
+
+			/* Write new histogram value */
+			write_imagef(histo_tex_w, coord, hv);
+		}
+
+		/* Done with the counts before the next tile clears them */
+		barrier(CLK_LOCAL_MEM_FENCE);
 	}
 
 	max_buf[get_local_id(1) * get_local_size(0) + get_local_id(0)] = max_pwr;
@@ -187,7 +372,7 @@ __kernel void display(
 
 	if (get_global_id(1) == 0)
 	{
-		int i,n;
+		int n;
 		float sum;
 		float2 vertex;
 
@@ -213,100 +398,432 @@ __kernel void display(
 		live_vbo[i] = vertex;
 	}
 
-	/* Histogram merging */
-	for (gidx=0; gidx<128; gidx+=get_local_size(1))
+	/* Max hold */
+	__global float2 *max_vbo = &spectrum_vbo[1 << fft_log2_len];
+
+	if (get_global_id(1) == 0)
+	{
+		int i, j, n;
+		float2 vertex;
+
+		/* Max of the batch */
+		for (j=0; j<get_local_size(1); j++)
+			max_pwr = max(max_pwr, max_buf[j * get_local_size(0) + get_local_id(0)]);
+
+		/* Position in spectrum */
+		n = get_global_size(0) >> 1;
+		i = get_global_id(0) ^ n;
+
+		vertex.x = ((float)i / (float)n) - 1.0f;
+		vertex.y = max_hold_update(live_vbo, max_vbo, histo_tex_r,
+			disp_x, i, max_pwr, histo_scale, histo_ofs);
+
+		max_vbo[i] = vertex;
+	}
+}
+
+/* Spectrum averaging, between the FFT and display kernels. One work item
+ * per FFT bin, the partial result is carried in acc across calls and one
+ * spectrum is output every avg_count inputs. Outputs are magnitudes so the
+ * display kernel can take them as any FFT output */
+__kernel void average(
+	__global const float2 *fft,		/* [ 0] Input FFT (complex)       */
+	const uint fft_log2_len,		/* [ 1] log2(FFT length)          */
+	const uint fft_batch,			/* [ 2] # spectrums in the input  */
+	__global float2 *acc,			/* [ 3] Partial sum (or max), sum of squares */
+	const uint avg_count,			/* [ 4] # spectrums per output    */
+	const uint avg_phase,			/* [ 5] # spectrums already in acc */
+	const uint avg_mode,			/* [ 6] Statistic | domain        */
+	__global float2 *out)			/* [ 7] Output spectrums          */
+{
+	const int x = get_global_id(0);
+	const uint stat = avg_mode & 0xf;
+	float2 s = acc[x];
+	uint phase = avg_phase;
+	int i, o = 0;
+
+	for (i=0; i<fft_batch; i++)
+	{
+		float2 f = fft[(i << fft_log2_len) + x];
+		float v, r;
+
+		/* Value in the averaging domain */
+		v = (avg_mode & AVG_LOG) ? log10(hypot(f.x, f.y)) : dot(f, f);
+
+		if (!phase) {
+			s = (float2)(v, v * v);
+		} else {
+			s.x  = (stat == AVG_PEAK) ? max(s.x, v) : (s.x + v);
+			s.y += v * v;
+		}
+
+		if (++phase < avg_count)
+			continue;
+
+		/* Statistic (RMS keeps the sign, log values can be < 0) */
+		if (stat == AVG_MEAN)
+			r = s.x / (float)avg_count;
+		else if (stat == AVG_RMS)
+			r = copysign(sqrt(s.y / (float)avg_count), s.x);
+		else
+			r = s.x;
+
+		/* Back to a magnitude */
+		r = (avg_mode & AVG_LOG) ? exp10(r) : sqrt(r);
+
+		out[(o++ << fft_log2_len) + x] = (float2)(r, 0.0f);
+		phase = 0;
+	}
+
+	acc[x] = s;
+}
+
+
+/* Decimated waterfall, writes the peak power of every wf_decim spectra.
+ * One work item per display column, the partial peak is carried in acc
+ * across calls (like for averaging) */
+__kernel void waterfall(
+	__global const float2 *fft,		/* [ 0] Input FFT (complex)       */
+	const uint fft_log2_len,		/* [ 1] log2(FFT length)          */
+	const uint fft_batch,			/* [ 2] # spectrums in the input  */
+	__global float *acc,			/* [ 3] Partial peak, per column  */
+	const uint wf_decim,			/* [ 4] # spectrums per row       */
+	const uint wf_phase,			/* [ 5] # spectrums already in acc */
+	__write_only image2d_t wf_tex,		/* [ 6] Texture handle            */
+	const uint wf_offset,			/* [ 7] Y Offset in the texture   */
+	const uint disp_red,			/* [ 8] log2(bins per column)     */
+	const uint disp_mode)			/* [ 9] Bins reduction (AVG_xxx)  */
+{
+	const int x = get_global_id(0);
+	float m = acc[x];
+	uint phase = wf_phase;
+	int i, o = 0;
+
+	for (i=0; i<fft_batch; i++)
 	{
-		const sampler_t direct_sample = CLK_NORMALIZED_COORDS_FALSE | CLK_FILTER_NEAREST | CLK_ADDRESS_CLAMP_TO_EDGE;
+		__global const float2 *f = &fft[(i << fft_log2_len) + (x << disp_red)];
+		float pwr = disp_red ?
+			reduce_pwr(f, 1 << disp_red, disp_mode) :
+			log10(hypot(f->x, f->y));
+
+		m = phase ? max(m, pwr) : pwr;
+
+		if (++phase < wf_decim)
+			continue;
 
-		/* Histogram coordinates */
 		int2 coord;
-		coord.x = get_global_id(0);
-		coord.y = gidx + get_local_id(1);
+		coord.x = x;
+		coord.y = (wf_offset + o++) & (get_image_height(wf_tex) - 1);
 
-		/* Fetch previous histogram value */
-		float4 hv = read_imagef(histo_tex_r, direct_sample, coord);
+		write_imagef(wf_tex, coord, (float4)(m, 0.0f, 0.0f, 0.0f));
+		phase = 0;
+	}
 
-		/* Fetch hit count */
-		uint hc = histo_buf[coord.y * get_local_size(0) + get_local_id(0)]
-#ifdef USE_NV_SM11_ATOMICS
-			& TAG_MASK
-#endif
-		;
+	acc[x] = m;
+}
+
+
+/* Display merge for the fused FFT kernels (see fft.cl). One work item per
+ * FFT bin, combines the per group partials and the histogram hit counts
+ * (which it resets for the next batch) */
+__kernel void display_merge(
+	/* Fused FFT results */
+	__global const float *part,		/* [ 0] Per group live sum & max */
+	const uint part_groups,			/* [ 1] # groups in part         */
+	const uint fft_log2_len,		/* [ 2] log2(FFT length)         */
+	const uint fft_batch,			/* [ 3] # spectrums in the input */
+
+	/* Histogram */
+	__global uint *histo_cnt,		/* [ 4] Hit counts (reset here) */
+	__read_only  image2d_t histo_tex_r,	/* [ 5] Texture read handle  */
+	__write_only image2d_t histo_tex_w,	/* [ 6] Texture write handle */
+	const float histo_t0r,			/* [ 7] Rise time constant   */
+	const float histo_t0d,			/* [ 8] Decay time constant  */
+	const float histo_scale,		/* [ 9] Val->Bin: scaling    */
+	const float histo_ofs,			/* [10] Val->Bin: offset     */
+
+	/* Live spectrum */
+	__global float2 *spectrum_vbo,		/* [11] Vertex Buffer Object    */
+	const float live_alpha)			/* [12] Averaging time constant */
+{
+	const sampler_t direct_sample = CLK_NORMALIZED_COORDS_FALSE | CLK_FILTER_NEAREST | CLK_ADDRESS_CLAMP_TO_EDGE;
+	const int len = 1 << fft_log2_len;
+	const float live_one_minus_alpha = 1.0f - live_alpha;
+
+	__global float2 *live_vbo = &spectrum_vbo[0];
+	__global float2 *max_vbo  = &spectrum_vbo[len];
+
+	int x = get_global_id(0);
+	int g, i, n;
+	float sum, max_pwr;
+	float2 vertex;
+
+	/* Merge partials */
+	sum = 0.0f;
+	max_pwr = - 1000.0f;
+
+	for (g=0; g<part_groups; g++) {
+		sum     += part[g * len + x];
+		max_pwr  = max(max_pwr, part[(part_groups + g) * len + x]);
+	}
+
+	/* Position in spectrum */
+	n = len >> 1;
+	i = x ^ n;
+
+	/* Live spectrum */
+	vertex = live_vbo[i];
+
+	if (!isfinite(vertex.y)) /* Safety if previous val is weird */
+		vertex.y = sum / fft_batch;
+
+	vertex.x = ((float)i / (float)n) - 1.0f;
+	vertex.y = vertex.y * native_powr(live_one_minus_alpha, (float)fft_batch) +
+	           sum      * live_alpha;
+
+	live_vbo[i] = vertex;
+
+	/* Histogram */
+	for (g=0; g<HISTO_BINS; g++)
+	{
+		int2 coord = (int2)(x, g);
+
+		/* Fetch previous histogram value & hit count */
+		float4 hv = read_imagef(histo_tex_r, direct_sample, coord);
+		uint hc = histo_cnt[g * len + x];
 
 		/* Fast exit if possible ... */
 		if ((hv.x <= 0.01f) && (hc == 0))
 			continue;
 
-		/* Apply the rise / decay */
-		float a = (float)hc / (float)fft_batch;
-		float b = a * native_recip(histo_t0r);
-		float c = b + native_recip(histo_t0d);
-		float d = b * native_recip(c);
-		float e = native_powr(1.0f - c, (float)fft_batch);
-
-		hv.x = (hv.x - d) * e + d;
+		if (hc)
+			histo_cnt[g * len + x] = 0;
 
-		/* Clamp value (we don't clear the texture so we get crap) */
-		hv.x = clamp(hv.x, 0.0f, 1.0f);
+		/* Apply the rise / decay & write new value */
+		hv.x = histo_rise_decay(hv.x, hc, fft_batch, histo_t0r, histo_t0d);
 
-		/* Write new histogram value */
 		write_imagef(histo_tex_w, coord, hv);
 	}
 
 	/* Max hold */
-	__global float2 *max_vbo = &spectrum_vbo[1 << fft_log2_len];
+	vertex.y = max_hold_update(live_vbo, max_vbo, histo_tex_r,
+		x, i, max_pwr, histo_scale, histo_ofs);
 
-	if (get_global_id(1) == 0)
-	{
-		int i, j, n;
-		float2 vertex;
+	max_vbo[i] = vertex;
+}
 
-#ifdef MAX_HOLD_HISTO
-		vertex.y = - histo_ofs;
 
-		for (gidx=0; gidx<128; gidx++)
-		{
-			const sampler_t direct_sample = CLK_NORMALIZED_COORDS_FALSE | CLK_FILTER_NEAREST | CLK_ADDRESS_CLAMP_TO_EDGE;
+/* Peak detection on the live spectrum, a single work group looping over
+ * the bins. The noise floor estimate is the mean of the bins below the
+ * mean, peaks are the local maxima at least threshold above it. Outputs
+ * out[0] = (# written, floor) then up to max_det (bin, power) in frequency
+ * order, all in the spectrum units (log10 magnitude). If there are more,
+ * the strongest are kept */
+#define DETECT_WG	256
+#define DETECT_ITER	16
 
-			/* Histogram coordinates */
-			int2 coord;
-			coord.x = get_global_id(0);
-			coord.y = gidx;
+inline float detect_sum(__local float *buf, float v)
+{
+	const int l = get_local_id(0);
+	int k;
 
-			/* Fetch histogram value */
-			float4 hv = read_imagef(histo_tex_r, direct_sample, coord);
+	buf[l] = v;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (k=DETECT_WG>>1; k>0; k>>=1) {
+		if (l < k)
+			buf[l] += buf[l + k];
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	v = buf[0];
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	return v;
+}
+
+inline float detect_max(__local float *buf, float v)
+{
+	const int l = get_local_id(0);
+	int k;
+
+	buf[l] = v;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (k=DETECT_WG>>1; k>0; k>>=1) {
+		if (l < k)
+			buf[l] = fmax(buf[l], buf[l + k]);
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
 
-			/* Set vertex position */
-			if (hv.x > 0.1f)
-				vertex.y = ((float)gidx / histo_scale)- histo_ofs;
+	v = buf[0];
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	return v;
+}
+
+inline int detect_is_peak(__global const float2 *live, int len, int i, float thr)
+{
+	float v = live[i].y;
+
+	if (!isfinite(v) || (v < thr))
+		return 0;
+
+	/* Plateaus count once, at their first bin */
+	if ((i > 0) && !(v > live[i-1].y))
+		return 0;
+	if ((i < len-1) && !(v >= live[i+1].y))
+		return 0;
+
+	return 1;
+}
+
+__attribute__((reqd_work_group_size(DETECT_WG, 1, 1)))
+__kernel void detect(
+	__global const float2 *spectrum_vbo,	/* [0] Vertex Buffer Object (live part used) */
+	const uint fft_log2_len,		/* [1] log2(FFT length)          */
+	const float threshold,			/* [2] Peak threshold above floor */
+	const uint max_det,			/* [3] Max peaks in out          */
+	__global float2 *out)			/* [4] Count & floor, then peaks */
+{
+	__local float sum_buf[DETECT_WG];
+	__local uint  ofs_buf[DETECT_WG];
+
+	const int len = 1 << fft_log2_len;
+	const int chunk = len / DETECT_WG;
+	const int l = get_local_id(0);
+
+	float s, n, mean, floor_pwr, thr, lo, hi;
+	uint cnt, ofs;
+	int i, it;
+
+	/* Mean of the valid bins */
+	s = 0.0f;
+	n = 0.0f;
+
+	for (i=l; i<len; i+=DETECT_WG) {
+		float v = spectrum_vbo[i].y;
+		if (isfinite(v)) {
+			s += v;
+			n += 1.0f;
 		}
-#endif
+	}
 
-		/* Position in spectrum */
-		n = get_global_size(0) >> 1;
-		i = get_global_id(0) ^ n;
+	n = detect_sum(sum_buf, n);
+	mean = (n > 0.0f) ? (detect_sum(sum_buf, s) / n) : 0.0f;
 
-		max_pwr = max_vbo[i].y;
-		if (!isfinite(max_pwr))
-			max_pwr = - MAXFLOAT; /* Will be replaced by max() below */
+	/* Floor: mean of what's below, mostly noise if the band isn't full */
+	s = 0.0f;
+	n = 0.0f;
 
-		vertex.x = ((float)i / (float)n) - 1.0f;
-#ifdef MAX_HOLD_LIVE
-		vertex.y = max(live_vbo[i].y, max_pwr);
-#endif
-#ifdef MAX_HOLD_NORMAL
-		for (i=0; i<get_local_size(1); i++)
-			max_pwr = max(max_pwr, max_buf[i * get_local_size(0) + get_local_id(0)]);
-		vertex.y = max_pwr;
-#endif
-#ifdef MAX_HOLD_DECAY
-		max_pwr = max_pwr * 0.999f + 0.001f * live_vbo[i].y;
-		for (j=0; j<get_local_size(1); j++)
-			max_pwr = max(max_pwr, max_buf[j * get_local_size(0) + get_local_id(0)]);
-		vertex.y = max_pwr;
-#endif
+	for (i=l; i<len; i+=DETECT_WG) {
+		float v = spectrum_vbo[i].y;
+		if (isfinite(v) && (v < mean)) {
+			s += v;
+			n += 1.0f;
+		}
+	}
 
-		max_vbo[i] = vertex;
+	n = detect_sum(sum_buf, n);
+	floor_pwr = (n > 0.0f) ? (detect_sum(sum_buf, s) / n) : mean;
+	thr = floor_pwr + threshold;
+
+	/* Too many, raise the threshold until the strongest max_det remain
+	 * (bisection between it and the strongest peak) */
+	s = 0.0f;
+	hi = thr;
+
+	for (i=l*chunk; i<(l+1)*chunk; i++) {
+		if (detect_is_peak(spectrum_vbo, len, i, thr)) {
+			s += 1.0f;
+			hi = fmax(hi, spectrum_vbo[i].y);
+		}
+	}
+
+	if (detect_sum(sum_buf, s) > (float)max_det) {
+		hi = detect_max(sum_buf, hi);
+		lo = thr;
+
+		for (it=0; it<DETECT_ITER; it++) {
+			float mid = 0.5f * (lo + hi);
+
+			s = 0.0f;
+			for (i=l*chunk; i<(l+1)*chunk; i++)
+				s += (float)detect_is_peak(spectrum_vbo, len, i, mid);
+
+			if (detect_sum(sum_buf, s) > (float)max_det)
+				lo = mid;
+			else
+				hi = mid;
+		}
+
+		thr = hi;
+	}
+
+	/* Count the peaks of our chunk, and get our output offset */
+	cnt = 0;
+	for (i=l*chunk; i<(l+1)*chunk; i++)
+		cnt += detect_is_peak(spectrum_vbo, len, i, thr);
+
+	ofs_buf[l] = cnt;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (l == 0) {
+		uint acc = 0;
+		for (i=0; i<DETECT_WG; i++) {
+			uint c = ofs_buf[i];
+			ofs_buf[i] = acc;
+			acc += c;
+		}
+		out[0] = (float2)((float)min(acc, max_det), floor_pwr);
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	/* Write them out */
+	ofs = ofs_buf[l];
+
+	for (i=l*chunk; (i<(l+1)*chunk) && (ofs<max_det); i++)
+		if (detect_is_peak(spectrum_vbo, len, i, thr))
+			out[1 + ofs++] = (float2)((float)i, spectrum_vbo[i].y);
+}
+
+
+/* Burst trigger on the raw spectra of a batch, one work group per spectrum
+ * summing its power over the band (bins in frequency order). Keeps the
+ * index of the first spectrum over the threshold in out[0] and the peak
+ * band power of those in out[1] (float bits, positive so they compare as
+ * uints), both across calls until the host resets them */
+__attribute__((reqd_work_group_size(DETECT_WG, 1, 1)))
+__kernel void trigger(
+	__global const float2 *fft,		/* [0] Input FFT (complex)       */
+	const uint fft_log2_len,		/* [1] log2(FFT length)          */
+	const uint bin_lo,			/* [2] Band first bin            */
+	const uint bin_hi,			/* [3] Band end bin (excluded)   */
+	const float threshold,			/* [4] Band power (sum of |X|^2) */
+	const uint base,			/* [5] Index of the first spectrum */
+	__global volatile uint *out)		/* [6] First index, peak power   */
+{
+	__local float sum_buf[DETECT_WG];
+
+	const uint half = 1 << (fft_log2_len - 1);
+	const int l = get_local_id(0);
+	const uint k = get_group_id(0);
+	__global const float2 *row = &fft[k << fft_log2_len];
+
+	float s = 0.0f;
+	uint i;
+
+	for (i=bin_lo+l; i<bin_hi; i+=DETECT_WG) {
+		float2 f = row[i ^ half];
+		s += dot(f, f);
+	}
+
+	s = detect_sum(sum_buf, s);
+
+	if ((l == 0) && (s > threshold)) {
+		atomic_min(&out[0], base + k);
+		atomic_max(&out[1], as_uint(s));
 	}
 }
 
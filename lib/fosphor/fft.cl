@@ -23,6 +23,30 @@
  * a derivative work (i.e. "a work based on the Program").
  */
 
+/* Enable or not the fused FFT + display kernels, they need global
+ * atomics (set automatically) */
+/* #define USE_FUSED */
+
+/* Histogram bins of the fused kernels (set automatically) */
+#ifndef HISTO_BINS
+#define HISTO_BINS 128
+#endif
+
+/* Input sample format, complex float by default (set automatically).
+ * Integer samples are converted on load, scaling is in the window */
+/* #define INPUT_SC16 */
+/* #define INPUT_SC8 */
+
+#if defined(INPUT_SC16)
+typedef short2 input_t;
+#elif defined(INPUT_SC8)
+typedef char2 input_t;
+#else
+typedef float2 input_t;
+#endif
+
+#define INPUT_LOAD(p, i) convert_float2((p)[i])
+
 #define M_PIf (3.141592653589f)
 
 /* ------------------------------------------------------------------------ */
@@ -351,30 +375,17 @@ fft_radix8(
 
 
 /* ------------------------------------------------------------------------ */
-/* FFT kernels                                                              */
+/* FFT passes                                                               */
 /* ------------------------------------------------------------------------ */
 
-__kernel void fft1D_512(
-	__global   const float2 *input,
-	__global         float2 *output,
-	__constant const float  *win)
-{
-#define N 512
-#define WG_SIZE (N / 8)
-
-	__local float2 buf[N];
+/* FFT passes for the local memory sizes, shared by the plain and
+ * fused kernels. Data is expected in buf[], result is left there in
+ * natural order */
 
-	float2 r[8];
-	int lid = get_local_id(0);
-	int i;
-
-	/* Adjust ptr for batch */
-	input  += N * get_global_id(1);
-	output += N * get_global_id(1);
-
-	/* Global load & window apply */
-	for (i=lid; i<N; i+=WG_SIZE)
-		buf[i] = input[i] * win[i];
+__attribute__((always_inline)) void
+fft512_passes(__local float2 *buf, float2 *r, int lid)
+{
+#define WG_SIZE (512 / 8)
 
 	/* 1st pass: 1 * Radix-8 */
 	fft_radix8(buf, r,  1, lid, WG_SIZE, 0);
@@ -385,36 +396,13 @@ __kernel void fft1D_512(
 	/* 3rd pass: 1 * Radix-8 */
 	fft_radix8(buf, r, 64, lid, WG_SIZE, 1);
 
-	/* Global store */
-	for (i=0; i<8; i++)
-		output[i*WG_SIZE+lid] = buf[i*WG_SIZE+lid];
-
 #undef WG_SIZE
-#undef N
 }
 
-
-__kernel void fft1D_1024(
-	__global   const float2 *input,
-	__global         float2 *output,
-	__constant const float  *win)
+__attribute__((always_inline)) void
+fft1024_passes(__local float2 *buf, float2 *r, int lid)
 {
-#define N 1024
-#define WG_SIZE (N / 8)
-
-	__local float2 buf[N];
-
-	float2 r[8];
-	int lid = get_local_id(0);
-	int i;
-
-	/* Adjust ptr for batch */
-	input  += N * get_global_id(1);
-	output += N * get_global_id(1);
-
-	/* Global load & window apply */
-	for (i=lid; i<N; i+=WG_SIZE)
-		buf[i] = input[i] * win[i];
+#define WG_SIZE (1024 / 8)
 
 	/* 1st pass: 1 * Radix-8 */
 	fft_radix8(buf, r,  1, lid, WG_SIZE, 0);
@@ -457,36 +445,13 @@ __kernel void fft1D_1024(
 		barrier(CLK_LOCAL_MEM_FENCE);
 	}
 
-	/* Global store */
-	for (i=0; i<8; i++)
-		output[i*WG_SIZE+lid] = buf[i*WG_SIZE+lid];
-
 #undef WG_SIZE
-#undef N
 }
 
-
-__kernel void fft1D_2048(
-	__global   const float2 *input,
-	__global         float2 *output,
-	__constant const float  *win)
+__attribute__((always_inline)) void
+fft2048_passes(__local float2 *buf, float2 *r, int lid)
 {
-#define N 2048
-#define WG_SIZE (N / 8)
-
-	__local float2 buf[N];
-
-	float2 r[8];
-	int lid = get_local_id(0);
-	int i;
-
-	/* Adjust ptr for batch */
-	input  += N * get_global_id(1);
-	output += N * get_global_id(1);
-
-	/* Global load & window apply */
-	for (i=lid; i<N; i+=WG_SIZE)
-		buf[i] = input[i] * win[i];
+#define WG_SIZE (2048 / 8)
 
 	/* 1st pass: 1 * Radix-8 */
 	fft_radix8(buf, r,  1, lid, WG_SIZE, 0);
@@ -545,6 +510,60 @@ __kernel void fft1D_2048(
 		barrier(CLK_LOCAL_MEM_FENCE);
 	}
 
+#undef WG_SIZE
+}
+
+__attribute__((always_inline)) void
+fft4096_passes(__local float2 *buf, float2 *r, int lid)
+{
+#define WG_SIZE (4096 / 8)
+
+	/* 1st pass: 1 * Radix-8 */
+	fft_radix8(buf, r,   1, lid, WG_SIZE, 0);
+
+	/* 2nd pass: 1 * Radix-8 */
+	fft_radix8(buf, r,   8, lid, WG_SIZE, 1);
+
+	/* 3rd pass: 1 * Radix-8 */
+	fft_radix8(buf, r,  64, lid, WG_SIZE, 1);
+
+	/* 4th pass: 1 * Radix-8 */
+	fft_radix8(buf, r, 512, lid, WG_SIZE, 1);
+
+#undef WG_SIZE
+}
+
+
+/* ------------------------------------------------------------------------ */
+/* FFT kernels                                                              */
+/* ------------------------------------------------------------------------ */
+
+__kernel void fft1D_512(
+	__global   const input_t *input,
+	__global         float2  *output,
+	__constant const float  *win,
+	const uint               hop)		/* Input stride between windows */
+{
+#define N 512
+#define WG_SIZE (N / 8)
+
+	__local float2 buf[N];
+
+	float2 r[8];
+	int lid = get_local_id(0);
+	int i;
+
+	/* Adjust ptr for batch */
+	input  += hop * get_global_id(1);
+	output += N * get_global_id(1);
+
+	/* Global load & window apply */
+	for (i=lid; i<N; i+=WG_SIZE)
+		buf[i] = INPUT_LOAD(input, i) * win[i];
+
+	/* All passes */
+	fft512_passes(buf, r, lid);
+
 	/* Global store */
 	for (i=0; i<8; i++)
 		output[i*WG_SIZE+lid] = buf[i*WG_SIZE+lid];
@@ -554,12 +573,13 @@ __kernel void fft1D_2048(
 }
 
 
-__kernel void fft1D_4096(
-	__global   const float2 *input,
-	__global         float2 *output,
-	__constant const float  *win)
+__kernel void fft1D_1024(
+	__global   const input_t *input,
+	__global         float2  *output,
+	__constant const float  *win,
+	const uint               hop)		/* Input stride between windows */
 {
-#define N 4096
+#define N 1024
 #define WG_SIZE (N / 8)
 
 	__local float2 buf[N];
@@ -569,24 +589,15 @@ __kernel void fft1D_4096(
 	int i;
 
 	/* Adjust ptr for batch */
-	input  += N * get_global_id(1);
+	input  += hop * get_global_id(1);
 	output += N * get_global_id(1);
 
 	/* Global load & window apply */
 	for (i=lid; i<N; i+=WG_SIZE)
-		buf[i] = input[i] * win[i];
-
-	/* 1st pass: 1 * Radix-8 */
-	fft_radix8(buf, r,   1, lid, WG_SIZE, 0);
+		buf[i] = INPUT_LOAD(input, i) * win[i];
 
-	/* 2nd pass: 1 * Radix-8 */
-	fft_radix8(buf, r,   8, lid, WG_SIZE, 1);
-
-	/* 3rd pass: 1 * Radix-8 */
-	fft_radix8(buf, r,  64, lid, WG_SIZE, 1);
-
-	/* 4th pass: 1 * Radix-8 */
-	fft_radix8(buf, r, 512, lid, WG_SIZE, 1);
+	/* All passes */
+	fft1024_passes(buf, r, lid);
 
 	/* Global store */
 	for (i=0; i<8; i++)
@@ -597,208 +608,401 @@ __kernel void fft1D_4096(
 }
 
 
-__kernel void fft1D_8192(
-	__global   const float2 *input,
-	__global         float2 *output,
-	__constant const float  *win)
+__kernel void fft1D_2048(
+	__global   const input_t *input,
+	__global         float2  *output,
+	__constant const float  *win,
+	const uint               hop)		/* Input stride between windows */
 {
-#define N 8192
-#define WG_SIZE 64
-#define LOCAL_SIZE 4096
+#define N 2048
+#define WG_SIZE (N / 8)
 
-	__local float2 buf[LOCAL_SIZE];
+	__local float2 buf[N];
 
 	float2 r[8];
 	int lid = get_local_id(0);
-	int gid = get_global_id(0);
-	int batch = get_global_id(1);
 	int i;
 
 	/* Adjust ptr for batch */
-	input  += N * batch;
-	output += N * batch;
-
-	/* Process in chunks due to memory constraints */
-	for (int chunk = 0; chunk < 2; chunk++) {
-		int offset = chunk * LOCAL_SIZE;
-		
-		/* Global load & window apply for this chunk */
-		for (i = lid; i < LOCAL_SIZE && (offset + i) < N; i += WG_SIZE) {
-			int idx = offset + i;
-			buf[i] = input[idx] * win[idx];
-		}
-		barrier(CLK_LOCAL_MEM_FENCE);
+	input  += hop * get_global_id(1);
+	output += N * get_global_id(1);
 
-		/* Process chunk with reduced radix operations */
-		if (lid < LOCAL_SIZE / 8) {
-			/* Load data for this thread */
-			for (i = 0; i < 8; i++) {
-				int idx = lid * 8 + i;
-				if (idx < LOCAL_SIZE)
-					r[i] = buf[idx];
-				else
-					r[i] = (float2)(0.0f, 0.0f);
-			}
-
-			/* Simple 8-point FFT in registers */
-			dft8(&r[0], &r[1], &r[2], &r[3], &r[4], &r[5], &r[6], &r[7]);
-
-			/* Store back */
-			for (i = 0; i < 8; i++) {
-				int idx = lid * 8 + i;
-				if (idx < LOCAL_SIZE)
-					buf[idx] = r[i];
-			}
-		}
-		barrier(CLK_LOCAL_MEM_FENCE);
+	/* Global load & window apply */
+	for (i=lid; i<N; i+=WG_SIZE)
+		buf[i] = INPUT_LOAD(input, i) * win[i];
 
-		/* Store chunk back to global memory */
-		for (i = lid; i < LOCAL_SIZE && (offset + i) < N; i += WG_SIZE) {
-			int idx = offset + i;
-			output[idx] = buf[i];
-		}
-		barrier(CLK_LOCAL_MEM_FENCE);
-	}
+	/* All passes */
+	fft2048_passes(buf, r, lid);
+
+	/* Global store */
+	for (i=0; i<8; i++)
+		output[i*WG_SIZE+lid] = buf[i*WG_SIZE+lid];
 
-#undef LOCAL_SIZE
 #undef WG_SIZE
 #undef N
 }
 
 
-__kernel void fft1D_16384(
-	__global   const float2 *input,
-	__global         float2 *output,
-	__constant const float  *win)
+__kernel void fft1D_4096(
+	__global   const input_t *input,
+	__global         float2  *output,
+	__constant const float  *win,
+	const uint               hop)		/* Input stride between windows */
 {
-#define N 16384
-#define WG_SIZE 64
-#define LOCAL_SIZE 4096
+#define N 4096
+#define WG_SIZE (N / 8)
 
-	__local float2 buf[LOCAL_SIZE];
+	__local float2 buf[N];
 
 	float2 r[8];
 	int lid = get_local_id(0);
-	int batch = get_global_id(1);
 	int i;
 
 	/* Adjust ptr for batch */
-	input  += N * batch;
-	output += N * batch;
-
-	/* Process in 4 chunks due to memory constraints */
-	for (int chunk = 0; chunk < 4; chunk++) {
-		int offset = chunk * LOCAL_SIZE;
-		
-		/* Global load & window apply for this chunk */
-		for (i = lid; i < LOCAL_SIZE && (offset + i) < N; i += WG_SIZE) {
-			int idx = offset + i;
-			buf[i] = input[idx] * win[idx];
-		}
-		barrier(CLK_LOCAL_MEM_FENCE);
+	input  += hop * get_global_id(1);
+	output += N * get_global_id(1);
 
-		/* Process chunk with simple FFT */
-		if (lid < LOCAL_SIZE / 8) {
-			/* Load 8 elements per thread */
-			for (i = 0; i < 8; i++) {
-				int idx = lid * 8 + i;
-				if (idx < LOCAL_SIZE)
-					r[i] = buf[idx];
-				else
-					r[i] = (float2)(0.0f, 0.0f);
-			}
-
-			/* 8-point FFT in registers */
-			dft8(&r[0], &r[1], &r[2], &r[3], &r[4], &r[5], &r[6], &r[7]);
-
-			/* Store back */
-			for (i = 0; i < 8; i++) {
-				int idx = lid * 8 + i;
-				if (idx < LOCAL_SIZE)
-					buf[idx] = r[i];
-			}
-		}
-		barrier(CLK_LOCAL_MEM_FENCE);
+	/* Global load & window apply */
+	for (i=lid; i<N; i+=WG_SIZE)
+		buf[i] = INPUT_LOAD(input, i) * win[i];
 
-		/* Store chunk back to global memory */
-		for (i = lid; i < LOCAL_SIZE && (offset + i) < N; i += WG_SIZE) {
-			int idx = offset + i;
-			output[idx] = buf[i];
-		}
-		barrier(CLK_LOCAL_MEM_FENCE);
-	}
+	/* All passes */
+	fft4096_passes(buf, r, lid);
+
+	/* Global store */
+	for (i=0; i<8; i++)
+		output[i*WG_SIZE+lid] = buf[i*WG_SIZE+lid];
 
-#undef LOCAL_SIZE
 #undef WG_SIZE
 #undef N
 }
 
 
-__kernel void fft1D_32768(
-	__global   const float2 *input,
-	__global         float2 *output,
-	__constant const float  *win)
+/* ------------------------------------------------------------------------ */
+/* Multi-pass global memory FFT                                             */
+/* ------------------------------------------------------------------------ */
+
+/*
+ * For the sizes that don't fit in local memory (> 4096). Each pass is a
+ * radix-R Stockham step, one launch per pass with N/R work items per
+ * spectrum going out of place between two global buffers, so it runs at
+ * full occupancy whatever the size. Passes are enqueued with p = 1, R0,
+ * R0*R1, ... up to N, which leaves the result in natural order.
+ *
+ * The first pass has its own kernels that read the samples directly (with
+ * 'hop' between spectra) and apply the window, which lives in global
+ * memory since it's too large for __constant.
+ */
+
+__attribute__((always_inline)) void
+fft_radix2_gstore(__global float2 *buf, float2 *r, int i, int k, int p)
+{
+	int j = ((i-k)<<1) + k;
+
+	buf += j;
+
+	buf[  0] = r[0];
+	buf[  p] = r[1];
+}
+
+__attribute__((always_inline)) void
+fft_radix4_gstore(__global float2 *buf, float2 *r, int i, int k, int p)
+{
+	int j = ((i-k)<<2) + k;
+
+	buf += j;
+
+	buf[  0] = r[0];
+	buf[  p] = r[2];
+	buf[2*p] = r[1];
+	buf[3*p] = r[3];
+}
+
+__attribute__((always_inline)) void
+fft_radix8_gstore(__global float2 *buf, float2 *r, int i, int k, int p)
+{
+	int j = ((i-k)<<3) + k;
+
+	buf += j;
+
+	buf[  0] = r[0];
+	buf[  p] = r[4];
+	buf[2*p] = r[2];
+	buf[3*p] = r[6];
+	buf[4*p] = r[1];
+	buf[5*p] = r[5];
+	buf[6*p] = r[3];
+	buf[7*p] = r[7];
+}
+
+#define FFT_GLOBAL_PASS(R)						\
+__kernel void fft_global_r##R(						\
+	__global const float2 *input,	/* [0] Previous pass            */	\
+	__global       float2 *output,	/* [1] Pass output              */	\
+	const uint p,			/* [2] Sub-FFT size done so far */	\
+	const uint log2_len)		/* [3] log2(FFT length)         */	\
+{									\
+	const int t = (1 << log2_len) / R;				\
+	float2 r[R];							\
+	int i = get_global_id(0);					\
+	int k = i & (p-1);						\
+	int j;								\
+									\
+	/* Adjust ptr for batch */					\
+	input  += get_global_id(1) << log2_len;				\
+	output += get_global_id(1) << log2_len;				\
+									\
+	/* Global load & twiddle */					\
+	for (j=0; j<R; j++)						\
+		r[j] = input[i + j*t];					\
+									\
+	fft_radix##R##_twiddle(r, k, p);				\
+									\
+	/* DFT & global store */					\
+	fft_radix##R##_exec(r);						\
+	fft_radix##R##_gstore(output, r, i, k, p);			\
+}									\
+									\
+__kernel void fft_global_first_r##R(					\
+	__global const input_t *input,	/* [0] Input samples            */	\
+	__global       float2  *output,	/* [1] Pass output              */	\
+	__global const float   *win,	/* [2] Window                   */	\
+	const uint hop,			/* [3] Input stride (spectra)   */	\
+	const uint log2_len)		/* [4] log2(FFT length)         */	\
+{									\
+	const int t = (1 << log2_len) / R;				\
+	float2 r[R];							\
+	int i = get_global_id(0);					\
+	int j;								\
+									\
+	/* Adjust ptr for batch */					\
+	input  += hop * get_global_id(1);				\
+	output += get_global_id(1) << log2_len;				\
+									\
+	/* Global load & window apply (p = 1, no twiddle) */		\
+	for (j=0; j<R; j++)						\
+		r[j] = INPUT_LOAD(input, i + j*t) * win[i + j*t];	\
+									\
+	/* DFT & global store */					\
+	fft_radix##R##_exec(r);						\
+	fft_radix##R##_gstore(output, r, i, 0, 1);			\
+}
+
+FFT_GLOBAL_PASS(2)
+FFT_GLOBAL_PASS(4)
+FFT_GLOBAL_PASS(8)
+
+#undef FFT_GLOBAL_PASS
+
+
+/* Window only, for the FFT libraries (in place transform of the output) */
+__kernel void fft_window(
+	__global const input_t *input,	/* [0] Input samples            */
+	__global       float2  *output,	/* [1] Windowed samples         */
+	__global const float   *win,	/* [2] Window                   */
+	const uint hop,			/* [3] Input stride (spectra)   */
+	const uint log2_len)		/* [4] log2(FFT length)         */
 {
-#define N 32768
-#define WG_SIZE 64
-#define LOCAL_SIZE 4096
+	int i = get_global_id(0);
+
+	/* Adjust ptr for batch */
+	input  += hop * get_global_id(1);
+	output += get_global_id(1) << log2_len;
+
+	output[i] = INPUT_LOAD(input, i) * win[i];
+}
+
+
+/* ------------------------------------------------------------------------ */
+/* Zoom band down conversion                                                */
+/* ------------------------------------------------------------------------ */
+
+/*
+ * Brings the band at the NCO frequency to baseband, low pass filters it and
+ * keeps one sample every decim. Rather than mixing every input, the taps
+ * are the low pass ones shifted to the band (by the host) and only the
+ * outputs are rotated back by the NCO phase at their position:
+ *
+ *   y(p) = e^(-j.phi(p)) * sum_k ( h(k).e^(j.w.k) * x(p - k) )
+ *
+ * Output i is at input position first + i * decim and uses the n_taps
+ * samples up to it, the ones before this call input come from the last
+ * n_taps - 1 of the previous call (hist_in). The n_taps - 1 work items past
+ * the outputs save ours for the next call (hist_out)
+ */
+
+float2
+ddc_load(__global const input_t *input, const float scale,
+         __global const float2 *hist, const int n_hist, int i)
+{
+	return (i >= 0) ? (INPUT_LOAD(input, i) * scale) : hist[n_hist + i];
+}
+
+__kernel void ddc(
+	__global const input_t *input,	/* [ 0] Input samples (new ones)  */
+	const uint n_in,		/* [ 1] # input samples           */
+	const float scale,		/* [ 2] Input to full scale       */
+	__global const float2 *hist_in,	/* [ 3] Previous call history     */
+	__global       float2 *hist_out,/* [ 4] This call history         */
+	__global const float2 *taps,	/* [ 5] Band pass taps            */
+	const uint n_taps,		/* [ 6] # taps                    */
+	const uint decim,		/* [ 7] Decimation                */
+	const uint first,		/* [ 8] Position of output 0      */
+	const uint n_out,		/* [ 9] # output samples          */
+	const uint nco_phase,		/* [10] NCO phase at input 0      */
+	const uint nco_inc,		/* [11] NCO phase increment       */
+	__global       float2 *out,	/* [12] Output ring               */
+	const uint out_pos,		/* [13] Ring position of output 0 */
+	const uint out_mask)		/* [14] Ring size - 1             */
+{
+	const int n_hist = n_taps - 1;
+	uint gid = get_global_id(0);
+	float2 acc = (float2)(0.0f, 0.0f);
+	float s, c;
+	uint ph;
+	int p, k;
+
+	/* History for the next call */
+	if (gid >= n_out) {
+		k = gid - n_out;
+		if (k < n_hist)
+			hist_out[k] = ddc_load(input, scale, hist_in, n_hist, (int)n_in - n_hist + k);
+		return;
+	}
+
+	/* Filter */
+	p = first + gid * decim;
+
+	for (k=0; k<n_taps; k++)
+		acc += cmul_1(taps[k], ddc_load(input, scale, hist_in, n_hist, p - k));
+
+	/* Back to baseband (phase is 32 bits fixed point, wraps as it should) */
+	ph = nco_phase + nco_inc * (uint)p;
+	s = sincos((float)(int)ph * (-M_PIf / 2147483648.0f), &c);
+
+	out[(out_pos + gid) & out_mask] = cmul_1(acc, (float2)(c, s));
+}
+
+
+#ifdef USE_FUSED
 
-	__local float2 buf[LOCAL_SIZE];
+/* ------------------------------------------------------------------------ */
+/* Fused FFT + display kernels                                              */
+/* ------------------------------------------------------------------------ */
+
+/*
+ * Variants for the sizes fitting in local memory that compute the power
+ * straight out of the last pass and write the waterfall directly instead
+ * of storing the complex output for the display kernel.
+ *
+ * Work group g handles spectra g, g + n_groups, ... and keeps the live
+ * spectrum (weighted) sum and the max for the bins it owns in registers.
+ * Those partials are stored in part[] ( [n_groups] sums then [n_groups]
+ * maxima, N each ) and merged with the histogram hit counts (always
+ * clamped) by display_merge in display.cl
+ */
+
+__attribute__((always_inline)) void
+fft_fused(
+	__local float2 *buf, const int N,
+	__global const input_t *input, __global float *part,
+	__constant const float *win, const uint hop, const uint batch,
+	__write_only image2d_t wf_tex, const uint wf_offset,
+	__global uint *histo_cnt, const float histo_scale, const float histo_ofs,
+	const float live_alpha)
+{
+	const int wg_size = N / 8;
+	const int n_groups = get_num_groups(1);
+	const float live_one_minus_alpha = 1.0f - live_alpha;
 
 	float2 r[8];
+	float live[8], max_pwr[8];
 	int lid = get_local_id(0);
-	int batch = get_global_id(1);
-	int i;
+	int s, i;
 
-	/* Adjust ptr for batch */
-	input  += N * batch;
-	output += N * batch;
-
-	/* Process in 8 chunks due to memory constraints */
-	for (int chunk = 0; chunk < 8; chunk++) {
-		int offset = chunk * LOCAL_SIZE;
-		
-		/* Global load & window apply for this chunk */
-		for (i = lid; i < LOCAL_SIZE && (offset + i) < N; i += WG_SIZE) {
-			int idx = offset + i;
-			buf[i] = input[idx] * win[idx];
-		}
-		barrier(CLK_LOCAL_MEM_FENCE);
+	for (i=0; i<8; i++) {
+		live[i] = 0.0f;
+		max_pwr[i] = - 1000.0f;
+	}
 
-		/* Process chunk with simple FFT */
-		if (lid < LOCAL_SIZE / 8) {
-			/* Load 8 elements per thread */
-			for (i = 0; i < 8; i++) {
-				int idx = lid * 8 + i;
-				if (idx < LOCAL_SIZE)
-					r[i] = buf[idx];
-				else
-					r[i] = (float2)(0.0f, 0.0f);
-			}
-
-			/* 8-point FFT in registers */
-			dft8(&r[0], &r[1], &r[2], &r[3], &r[4], &r[5], &r[6], &r[7]);
-
-			/* Store back */
-			for (i = 0; i < 8; i++) {
-				int idx = lid * 8 + i;
-				if (idx < LOCAL_SIZE)
-					buf[idx] = r[i];
-			}
+	/* Same spectra count for the whole group, barriers are fine */
+	for (s=get_group_id(1); s<batch; s+=n_groups)
+	{
+		__global const input_t *in = input + hop * s;
+		float w;
+		int y;
+
+		/* Global load & window apply */
+		for (i=lid; i<N; i+=wg_size)
+			buf[i] = INPUT_LOAD(in, i) * win[i];
+
+		/* All passes */
+		switch (N) {
+		case  512: fft512_passes(buf, r, lid);  break;
+		case 1024: fft1024_passes(buf, r, lid); break;
+		case 2048: fft2048_passes(buf, r, lid); break;
+		case 4096: fft4096_passes(buf, r, lid); break;
 		}
-		barrier(CLK_LOCAL_MEM_FENCE);
 
-		/* Store chunk back to global memory */
-		for (i = lid; i < LOCAL_SIZE && (offset + i) < N; i += WG_SIZE) {
-			int idx = offset + i;
-			output[idx] = buf[i];
+		/* Power and accumulation. Each item only reads back the bins it
+		 * loads next round, so no barrier needed before the next load */
+		w = native_powr(live_one_minus_alpha, (float)(batch - s - 1));
+		y = (wf_offset + s) & (get_image_height(wf_tex) - 1);
+
+		for (i=0; i<8; i++)
+		{
+			int x = i * wg_size + lid;
+			float2 v = buf[x];
+			float pwr = log10(hypot(v.x, v.y));
+			int bin;
+
+			max_pwr[i] = max(max_pwr[i], pwr);
+			live[i] += pwr * w;
+
+			write_imagef(wf_tex, (int2)(x, y), (float4)(pwr, 0.0f, 0.0f, 0.0f));
+
+			bin = clamp((int)round(histo_scale * (pwr + histo_ofs)), 0, HISTO_BINS - 1);
+			atomic_inc(&histo_cnt[bin * N + x]);
 		}
-		barrier(CLK_LOCAL_MEM_FENCE);
 	}
 
-#undef LOCAL_SIZE
-#undef WG_SIZE
-#undef N
+	/* Partial results */
+	part += get_group_id(1) * N;
+
+	for (i=0; i<8; i++) {
+		part[i * wg_size + lid] = live[i];
+		part[n_groups * N + i * wg_size + lid] = max_pwr[i];
+	}
+}
+
+#define FFT_FUSED_KERNEL(N)						\
+__kernel void fft1D_##N##_fused(					\
+	__global   const input_t *input,	/* [ 0] Input samples       */	\
+	__global         float  *part,		/* [ 1] Per group partials  */	\
+	__constant const float  *win,		/* [ 2] Window              */	\
+	const uint               hop,		/* [ 3] Input stride        */	\
+	const uint               batch,		/* [ 4] # spectrums         */	\
+	__write_only image2d_t   wf_tex,	/* [ 5] Waterfall texture   */	\
+	const uint               wf_offset,	/* [ 6] Y Offset in texture */	\
+	__global         uint   *histo_cnt,	/* [ 7] Histogram hits      */	\
+	const float              histo_scale,	/* [ 8] Val->Bin: scaling   */	\
+	const float              histo_ofs,	/* [ 9] Val->Bin: offset    */	\
+	const float              live_alpha)	/* [10] Averaging constant  */	\
+{									\
+	__local float2 buf[N];						\
+									\
+	fft_fused(buf, N, input, part, win, hop, batch,			\
+		wf_tex, wf_offset, histo_cnt, histo_scale, histo_ofs,	\
+		live_alpha);						\
 }
 
+FFT_FUSED_KERNEL(512)
+FFT_FUSED_KERNEL(1024)
+FFT_FUSED_KERNEL(2048)
+FFT_FUSED_KERNEL(4096)
+
+#undef FFT_FUSED_KERNEL
+
+#endif /* USE_FUSED */
+
 /* vim: set syntax=c: */
@@ -0,0 +1,438 @@
+/*
+ * fftcheck.c
+ *
+ * FFT / display kernels verification against a reference FFT
+ *
+ * Copyright (C) 2013-2021 Sylvain Munaut
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fosphor.h"
+#include "private.h"
+
+#ifndef M_PI
+# define M_PI 3.14159265358979323846
+#endif
+
+
+/* ------------------------------------------------------------------------ */
+/* Reference FFT (double precision, radix-2, forward)                       */
+/* ------------------------------------------------------------------------ */
+
+static void
+ref_fft(double *x, int log2_len)
+{
+	const int n = 1 << log2_len;
+	int i, j, k, m;
+
+	/* Bit reversal */
+	for (i=0, j=0; i<n; i++)
+	{
+		if (i < j) {
+			double tr = x[2*i], ti = x[2*i+1];
+			x[2*i]   = x[2*j];   x[2*i+1] = x[2*j+1];
+			x[2*j]   = tr;       x[2*j+1] = ti;
+		}
+
+		for (k=n>>1; k && (j & k); k>>=1)
+			j ^= k;
+		j |= k;
+	}
+
+	/* Butterflies */
+	for (m=2; m<=n; m<<=1)
+	{
+		const double a = -2.0 * M_PI / m;
+
+		for (k=0; k<m/2; k++)
+		{
+			double wr = cos(a * k), wi = sin(a * k);
+
+			for (i=k; i<n; i+=m)
+			{
+				double *p = &x[2*i], *q = &x[2*(i+m/2)];
+				double tr = q[0] * wr - q[1] * wi;
+				double ti = q[0] * wi + q[1] * wr;
+
+				q[0] = p[0] - tr;  q[1] = p[1] - ti;
+				p[0] = p[0] + tr;  p[1] = p[1] + ti;
+			}
+		}
+	}
+}
+
+
+/* ------------------------------------------------------------------------ */
+/* Test signals                                                             */
+/* ------------------------------------------------------------------------ */
+
+#define N_ROWS		FOSPHOR_FFT_MULT_BATCH	/* Spectra per check */
+
+enum signal
+{
+	SIG_IMPULSE,	/* Flat spectrum */
+	SIG_TONE,	/* On a bin */
+	SIG_OFFTONE,	/* Between two bins, leaks everywhere */
+	SIG_NOISE,	/* Different for every row */
+	N_SIGNALS,
+};
+
+static const char *k_signals[N_SIGNALS] = {
+	"impulse", "tone", "offtone", "noise",
+};
+
+static void
+signal_gen(enum signal sig, float *s, int fft_len, int row)
+{
+	const double f0 = (double)(fft_len / 8 + 3 + row) / fft_len;
+	int i;
+
+	for (i=0; i<fft_len; i++)
+	{
+		double ph;
+
+		switch (sig) {
+		case SIG_IMPULSE:
+			s[2*i+0] = (i == row) ? 1.0f : 0.0f;
+			s[2*i+1] = 0.0f;
+			break;
+
+		case SIG_TONE:
+		case SIG_OFFTONE:
+			ph = 2.0 * M_PI * i * (f0 + ((sig == SIG_OFFTONE) ? 0.5 / fft_len : 0.0));
+			s[2*i+0] = 0.5f * (float)cos(ph);
+			s[2*i+1] = 0.5f * (float)sin(ph);
+			break;
+
+		default:
+			s[2*i+0] = (float)rand() / RAND_MAX - 0.5f;
+			s[2*i+1] = (float)rand() / RAND_MAX - 0.5f;
+			break;
+		}
+	}
+}
+
+
+/* ------------------------------------------------------------------------ */
+/* Checks                                                                   */
+/* ------------------------------------------------------------------------ */
+
+struct check_opts
+{
+	const char *device;	/* NULL = all usable */
+	int fft_len;		/* 0 = all */
+	double tolerance;	/* Max error, dB relative to the peak */
+	int perf_iter;		/* Timed batches for the throughput */
+};
+
+struct check_result
+{
+	const char *path;
+	double err[N_SIGNALS];	/* dB relative to the peak */
+	double fft_gflops;
+	double display_gbins;	/* Display kernel, 1e9 bins / s */
+};
+
+static const char *
+kernel_path(struct fosphor *fosphor, int fft_len)
+{
+	if (fosphor_is_fused(fosphor))
+		return "fused";
+	return (fft_len <= 4096) ? "local" : "multipass";
+}
+
+/* Feed one batch of a test signal, compare the waterfall rows (the power
+ * computed by the display kernel from the FFT output) to the reference */
+static double
+check_signal(struct fosphor *fosphor, int log2_len, enum signal sig,
+             float *in, double *ref)
+{
+	const int fft_len = 1 << log2_len;
+	double worst = 0.0;
+	int row, wf_row, i;
+
+	/* Input & Reference */
+	for (row=0; row<N_ROWS; row++)
+		signal_gen(sig, &in[2 * row * fft_len], fft_len, row);
+
+	/* Process */
+	if (fosphor_process(fosphor, in, N_ROWS * fft_len) ||
+	    (fosphor_sync(fosphor) <= 0) ||
+	    (fosphor->wf_dirty.len != N_ROWS))
+		return NAN;
+
+	/* Compare magnitudes, relative to each row peak */
+	for (row=0; row<N_ROWS; row++)
+	{
+		size_t wf;
+		double peak = 0.0, err = 0.0;
+
+		for (i=0; i<fft_len; i++) {
+			ref[2*i+0] = in[2 * (row * fft_len + i) + 0];
+			ref[2*i+1] = in[2 * (row * fft_len + i) + 1];
+		}
+
+		ref_fft(ref, log2_len);
+
+		wf_row = (fosphor->wf_dirty.start + row) & (fosphor->wf_depth - 1);
+		wf = (size_t)wf_row * fft_len;
+
+		for (i=0; i<fft_len; i++)
+		{
+			double m_ref = hypot(ref[2*i], ref[2*i+1]);
+			double m_dev = pow(10.0, fosphor_img_get(fosphor, fosphor->img_waterfall, wf + i));	/* log10(|X|) */
+			double e = fabs(m_dev - m_ref);
+
+			if (isnan(e))
+				return NAN;
+
+			if (m_ref > peak)
+				peak = m_ref;
+			if (e > err)
+				err = e;
+		}
+
+		if (err / peak > worst)
+			worst = err / peak;
+	}
+
+	return 20.0 * log10(worst + 1e-30);
+}
+
+/* FFT and display kernels throughput, from the profiling events */
+static void
+check_perf(const struct check_opts *co, struct fosphor *fosphor,
+           int log2_len, float *in, int max_batch, struct check_result *res)
+{
+	const int fft_len = 1 << log2_len;
+	struct fosphor_profile prof;
+	double t_fft = 0.0, t_disp = 0.0;
+	int i;
+
+	for (i=0; i<max_batch * fft_len; i++) {
+		in[2*i+0] = (float)rand() / RAND_MAX - 0.5f;
+		in[2*i+1] = (float)rand() / RAND_MAX - 0.5f;
+	}
+
+	for (i=0; i<co->perf_iter; i++)
+	{
+		if (fosphor_process(fosphor, in, max_batch * fft_len))
+			return;
+
+		fosphor_sync(fosphor);
+
+		if (fosphor_get_profile(fosphor, &prof))
+			return;
+
+		t_fft  += prof.last[FOSPHOR_PROF_FFT];
+		t_disp += prof.last[FOSPHOR_PROF_DISPLAY];
+	}
+
+	/* 5 N log2(N) flops per complex FFT, the usual convention */
+	if (t_fft > 0.0)
+		res->fft_gflops = 5.0 * fft_len * log2_len * max_batch * co->perf_iter / t_fft / 1e9;
+
+	if (t_disp > 0.0)
+		res->display_gbins = (double)fft_len * max_batch * co->perf_iter / t_disp / 1e9;
+}
+
+static int
+check_run(const struct check_opts *co, const char *device,
+          int fft_len, int fused, struct check_result *res)
+{
+	struct fosphor_options opts;
+	struct fosphor *fosphor;
+	float *in = NULL, *win = NULL;
+	double *ref = NULL;
+	int log2_len, max_batch, i, rv = 0;
+
+	for (log2_len=0; (1 << log2_len) < fft_len; log2_len++);
+
+	max_batch = fosphor_fft_max_batch(fft_len);
+
+	/* Instance */
+	fosphor_options_defaults(&opts);
+	opts.device    = device;
+	opts.fft_len   = fft_len;
+	opts.headless  = 1;
+	opts.fused     = fused;
+	opts.profiling = 1;
+
+	fosphor = fosphor_init(&opts);
+	if (!fosphor)
+		return -EIO;
+
+	res->path = kernel_path(fosphor, fft_len);
+
+	/* Buffers */
+	in  = malloc(2 * sizeof(float) * fft_len * max_batch);
+	ref = malloc(2 * sizeof(double) * fft_len);
+	win = malloc(sizeof(float) * fft_len);
+	if (!in || !ref || !win) {
+		rv = -ENOMEM;
+		goto done;
+	}
+
+	/* Rectangular window, so the device FFT compares directly */
+	for (i=0; i<fft_len; i++)
+		win[i] = 1.0f;
+
+	fosphor_set_fft_window(fosphor, win);
+
+	/* Numerical checks */
+	for (i=0; i<N_SIGNALS; i++)
+		res->err[i] = check_signal(fosphor, log2_len, i, in, ref);
+
+	/* Throughput */
+	check_perf(co, fosphor, log2_len, in, max_batch, res);
+
+done:
+	free(win);
+	free(ref);
+	free(in);
+	fosphor_release(fosphor);
+
+	return rv;
+}
+
+
+/* ------------------------------------------------------------------------ */
+/* Main                                                                     */
+/* ------------------------------------------------------------------------ */
+
+#define MAX_DEVICES	32
+
+static void
+usage(const char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [-d device] [-s fft_len] [-e tolerance_db] [-n iterations]\n"
+		"\n"
+		"  -d  Only this OpenCL device (\"P:D\", see fosphor_list_devices)\n"
+		"  -s  Only this FFT length (default: all supported)\n"
+		"  -e  Max error, dB relative to the spectrum peak (default: -60)\n"
+		"  -n  Timed batches for the throughput (default: 16)\n"
+		"\n"
+		"Each FFT length is checked with the fused kernels (where the device\n"
+		"allows) and the separate FFT / display ones. Output is CSV, exit\n"
+		"status is non zero if any check failed\n",
+		argv0);
+}
+
+int main(int argc, char *argv[])
+{
+	struct fosphor_device_info devs[MAX_DEVICES];
+	struct check_opts co;
+	int n_devs, d, fft_len, fused, i, n_fail = 0;
+
+	/* Options */
+	memset(&co, 0x00, sizeof(co));
+	co.tolerance = -60.0;
+	co.perf_iter = 16;
+
+	for (i=1; i<argc; i+=2)
+	{
+		const char *arg = argv[i];
+		const char *val = (i + 1 < argc) ? argv[i+1] : NULL;
+
+		if (!val || (arg[0] != '-') || arg[2]) {
+			usage(argv[0]);
+			return -EINVAL;
+		}
+
+		switch (arg[1]) {
+		case 'd': co.device    = val;       break;
+		case 's': co.fft_len   = atoi(val); break;
+		case 'e': co.tolerance = atof(val); break;
+		case 'n': co.perf_iter = atoi(val); break;
+		default:
+			usage(argv[0]);
+			return -EINVAL;
+		}
+	}
+
+	if ((co.fft_len && !fosphor_fft_len_validate(co.fft_len)) ||
+	    (co.perf_iter < 1)) {
+		usage(argv[0]);
+		return -EINVAL;
+	}
+
+	/* Devices */
+	n_devs = fosphor_list_devices(devs, MAX_DEVICES);
+	if (n_devs <= 0) {
+		fprintf(stderr, "[!] No OpenCL device found\n");
+		return -ENODEV;
+	}
+
+	if (n_devs > MAX_DEVICES)
+		n_devs = MAX_DEVICES;
+
+	/* Run */
+	printf("device,name,fft_len,kernels");
+	for (i=0; i<N_SIGNALS; i++)
+		printf(",%s_err_db", k_signals[i]);
+	printf(",fft_gflops,display_gbins,result\n");
+
+	for (d=0; d<n_devs; d++)
+	{
+		char sel[16];
+
+		snprintf(sel, sizeof(sel), "%d:%d", devs[d].platform, devs[d].device);
+
+		if (co.device ? strcmp(co.device, sel) : (devs[d].score < 0))
+			continue;
+
+		for (fft_len=FOSPHOR_FFT_LEN_MIN; fft_len<=FOSPHOR_FFT_LEN_MAX; fft_len<<=1)
+		{
+			const char *prev_path = NULL;
+
+			if (co.fft_len && (fft_len != co.fft_len))
+				continue;
+
+			for (fused=1; fused>=0; fused--)
+			{
+				struct check_result res;
+				int ok = 1;
+
+				memset(&res, 0x00, sizeof(res));
+
+				if (check_run(&co, sel, fft_len, fused, &res)) {
+					fprintf(stderr, "[w] %s, FFT %d: init failed\n", sel, fft_len);
+					n_fail++;
+					break;
+				}
+
+				/* Fused not available, already checked that path */
+				if (prev_path && !strcmp(prev_path, res.path))
+					continue;
+
+				prev_path = res.path;
+
+				printf("%s,\"%s\",%d,%s", sel, devs[d].name, fft_len, res.path);
+
+				for (i=0; i<N_SIGNALS; i++) {
+					printf(",%.1f", res.err[i]);
+					if (!(res.err[i] <= co.tolerance))	/* NaN fails */
+						ok = 0;
+				}
+
+				printf(",%.2f,%.3f,%s\n", res.fft_gflops, res.display_gbins,
+					ok ? "pass" : "FAIL");
+				fflush(stdout);
+
+				if (!ok)
+					n_fail++;
+			}
+		}
+	}
+
+	fosphor_pool_flush();
+
+	return n_fail ? 1 : 0;
+}
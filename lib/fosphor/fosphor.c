@@ -15,22 +15,61 @@
  *  \brief Main fosphor entry point
  */
 
+#include <errno.h>
 #include <math.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#ifdef _WIN32
+# define strcasecmp  _stricmp
+#else
+# include <strings.h>
+#endif
 
 #include "cl.h"
+#include "cpu.h"
 #include "gl.h"
 #include "fosphor.h"
+#include "frame.h"
 #include "private.h"
 
-static int g_fosphor_fft_len = FOSPHOR_FFT_LEN_DEFAULT;
-static int g_fosphor_fft_len_log = FOSPHOR_FFT_LEN_LOG_DEFAULT;
 
+void
+fosphor_options_defaults(struct fosphor_options *opts)
+{
+	memset(opts, 0x00, sizeof(struct fosphor_options));
+
+	opts->fft_len        = FOSPHOR_FFT_LEN_DEFAULT;
+	opts->pipeline_depth = 2;
+	opts->fused          = 1;
+	opts->gl_core        = -1;
+	opts->disp_mode      = FOSPHOR_AVG_PEAK;
+}
+
+/* "host" selects the CPU engine, never any OpenCL device */
+static int
+_device_is_host(const char *sel)
+{
+	if (!sel || !sel[0])
+		sel = getenv("FOSPHOR_CL_DEV");
+
+	return sel && !strcasecmp(sel, "host");
+}
+
+static int
+_waterfall_position(struct fosphor *self)
+{
+	if (self->cl)
+		return fosphor_cl_get_waterfall_position(self);
+	else if (self->cpu)
+		return fosphor_cpu_get_waterfall_position(self);
+	else
+		return fosphor_frame_remote_wf_pos(self);
+}
 
 struct fosphor *
-fosphor_init(void)
+fosphor_init(const struct fosphor_options *opts)
 {
 	struct fosphor *self;
 	int rv;
@@ -42,28 +81,159 @@ fosphor_init(void)
 
 	memset(self, 0, sizeof(struct fosphor));
 
-	/* Set default FFT length */
-	self->fft_len = g_fosphor_fft_len;
+	/* Options */
+	if (opts)
+		memcpy(&self->opts, opts, sizeof(struct fosphor_options));
+	else
+		fosphor_options_defaults(&self->opts);
 
-	/* Init GL/CL sub-states */
-	rv = fosphor_gl_init(self);
-	if (rv)
+	/* FFT length */
+	if (!self->opts.fft_len)
+		self->opts.fft_len = FOSPHOR_FFT_LEN_DEFAULT;
+
+	if (!fosphor_fft_len_validate(self->opts.fft_len)) {
+		fprintf(stderr, "[!] Invalid FFT length %d\n", self->opts.fft_len);
+		goto error;
+	}
+
+	/* Channels, one row of channels * fft_len bins */
+	if (!self->opts.channels || self->opts.remote)
+		self->opts.channels = 1;
+
+	if ((self->opts.channels > FOSPHOR_MAX_CHANNELS) ||
+	    (self->opts.channels & (self->opts.channels - 1)) ||
+	    !fosphor_fft_len_validate(self->opts.fft_len * self->opts.channels)) {
+		fprintf(stderr, "[!] Invalid channels count %d\n", self->opts.channels);
+		goto error;
+	}
+
+	self->channels = self->opts.channels;
+	self->chan_len = self->opts.fft_len;
+
+	for (self->chan_len_log=0; (1 << self->chan_len_log) < self->chan_len; self->chan_len_log++);
+
+	self->fft_len = self->chan_len * self->channels;
+	self->fft_hop = self->fft_len;
+
+	for (self->fft_len_log=0; (1 << self->fft_len_log) < self->fft_len; self->fft_len_log++);
+
+	/* Batch limit, sizes the engine buffers */
+	self->fft_max_batch = fosphor_fft_max_batch(self->fft_len);
+
+	if ((self->opts.max_batch > 0) && (self->opts.max_batch < self->fft_max_batch)) {
+		self->fft_max_batch = self->opts.max_batch & ~(FOSPHOR_FFT_MULT_BATCH - 1);
+		if (self->fft_max_batch < FOSPHOR_FFT_MULT_BATCH)
+			self->fft_max_batch = FOSPHOR_FFT_MULT_BATCH;
+	}
+
+	/* Waterfall & histogram width, the spectra keep all the bins */
+	if (!self->opts.disp_len || self->opts.remote)
+		self->opts.disp_len = self->fft_len;
+
+	if ((self->opts.disp_len > self->fft_len) ||
+	    (self->opts.disp_len * FOSPHOR_DISP_REDUCE_MAX < self->fft_len) ||
+	    (self->opts.disp_len & (self->opts.disp_len - 1)) ||
+	    (self->opts.disp_mode < 0) ||
+	    ((self->opts.disp_mode & ~FOSPHOR_AVG_LOG) > FOSPHOR_AVG_PEAK)) {
+		fprintf(stderr, "[!] Invalid display width %d (mode %d)\n",
+			self->opts.disp_len, self->opts.disp_mode);
+		goto error;
+	}
+
+	self->img_len = self->opts.disp_len;
+
+	for (self->img_red=0; (self->img_len << self->img_red) < self->fft_len; self->img_red++);
+
+	/* The fused kernels accumulate the display per FFT, at full width */
+	if ((self->channels > 1) || self->img_red)
+		self->opts.fused = 0;
+
+	/* Waterfall */
+	if (!self->opts.wf_depth)
+		self->opts.wf_depth = FOSPHOR_WF_DEPTH_DEFAULT;
+
+	if (!fosphor_wf_depth_validate(self->opts.wf_depth)) {
+		fprintf(stderr, "[!] Invalid waterfall depth %d\n", self->opts.wf_depth);
+		goto error;
+	}
+
+	self->wf_depth  = self->opts.wf_depth;
+	self->avg_count = 1;
+	self->wf_decim  = 1;
+
+	/* Histogram */
+	if (!self->opts.histo_bins)
+		self->opts.histo_bins = FOSPHOR_HISTO_BINS_DEFAULT;
+
+	if (!fosphor_histo_bins_validate(self->opts.histo_bins)) {
+		fprintf(stderr, "[!] Invalid histogram bins count %d\n", self->opts.histo_bins);
+		goto error;
+	}
+
+	self->histo_bins = self->opts.histo_bins;
+
+	/* Input format */
+	switch (self->opts.input_format) {
+	case FOSPHOR_INPUT_CF32:
+		self->sample_size  = 2 * sizeof(float);
+		self->sample_scale = 1.0f;
+		break;
+	case FOSPHOR_INPUT_CS16:
+		self->sample_size  = 2 * sizeof(int16_t);
+		self->sample_scale = 1.0f / 32768.0f;
+		break;
+	case FOSPHOR_INPUT_CS8:
+		self->sample_size  = 2 * sizeof(int8_t);
+		self->sample_scale = 1.0f / 128.0f;
+		break;
+	default:
+		fprintf(stderr, "[!] Invalid input format %d\n", self->opts.input_format);
 		goto error;
+	}
+
+	/* Waterfall & histogram storage (GL/CL may not support half) */
+	if (self->opts.half) {
+		self->flags |= FLG_FOSPHOR_HALF;
+		self->img_size = sizeof(uint16_t);
+	} else {
+		self->img_size = sizeof(float);
+	}
 
-	rv = fosphor_cl_init(self);
+	/* Init GL/CL sub-states */
+	if (!self->opts.headless) {
+		rv = fosphor_gl_init(self);
+		if (rv)
+			goto error;
+	}
+
+	if (self->opts.remote)
+		rv = fosphor_frame_remote_init(self);
+	else if (_device_is_host(self->opts.device))
+		rv = fosphor_cpu_init(self);
+	else if ((rv = fosphor_cl_init(self)) != 0) {
+		fprintf(stderr, "[!] Falling back to the (much slower) CPU engine\n");
+		self->flags &= ~FLG_FOSPHOR_USE_CLGL_SHARING;
+		rv = fosphor_cpu_init(self);
+	}
 	if (rv)
 		goto error;
 
 	/* Allocate FFT window */
-	self->fft_win = malloc(self->fft_len * sizeof(float));
+	self->fft_win = malloc(self->chan_len * sizeof(float));
 	if (!self->fft_win)
 		goto error;
 
-	/* Buffers (if needed) */
-	if (!(self->flags & FLG_FOSPHOR_USE_CLGL_SHARING))
+	/* Waterfall rows frequency ranges */
+	self->wf_freq = calloc(self->wf_depth, sizeof(struct fosphor_wf_freq));
+	if (!self->wf_freq)
+		goto error;
+
+	/* Buffers (if needed, and if GL can't provide mapped ones) */
+	if (!(self->flags & FLG_FOSPHOR_USE_CLGL_SHARING) &&
+	    (!self->gl || fosphor_gl_stream_init(self)))
 	{
-		self->img_waterfall = malloc(self->fft_len * 1024 * sizeof(float));
-		self->img_histogram = malloc(self->fft_len *  128 * sizeof(float));
+		self->img_waterfall = malloc((size_t)self->img_len * self->wf_depth * self->img_size);
+		self->img_histogram = malloc(self->img_len * self->histo_bins * self->img_size);
 		self->buf_spectrum  = malloc(2 * 2 * self->fft_len * sizeof(float));
 
 		if (!self->img_waterfall ||
@@ -91,31 +261,499 @@ fosphor_release(struct fosphor *self)
 		return;
 
 	free(self->fft_win);
-	free(self->img_waterfall);
-	free(self->img_histogram);
-	free(self->buf_spectrum);
+	free(self->wf_freq);
+
+	if (!fosphor_gl_stream_active(self)) {
+		free(self->img_waterfall);
+		free(self->img_histogram);
+		free(self->buf_spectrum);
+	}
 
+	fosphor_frame_remote_release(self);
+	fosphor_cpu_release(self);
 	fosphor_cl_release(self);
 	fosphor_gl_release(self);
 
 	free(self);
 }
 
+/* Instances without CL/GL sharing on the same device share one OpenCL
+ * context and the programs built in it. Warming up creates those ahead of
+ * the first init (which waits for a warmup in progress rather than doing
+ * it again), or only builds the programs if instances with that headless
+ * option would use CL/GL sharing. Flushing releases the ones no instance
+ * uses anymore */
+int
+fosphor_pool_warmup(const char *device, int headless)
+{
+	if (_device_is_host(device))
+		return 0;
+
+	return fosphor_cl_pool_warmup(device, headless);
+}
+
+void
+fosphor_pool_flush(void)
+{
+	fosphor_cl_pool_flush();
+}
+
+/* Whether _init, _release and the pool calls may run concurrently from
+ * several threads (on different instances). Else they must be serialized
+ * by the caller, as the shared state is then not locked */
+int
+fosphor_init_parallel(void)
+{
+#ifdef FOSPHOR_HAVE_THREADS
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+/* Device selectors (fosphor_options.device, $FOSPHOR_CL_DEV) are either
+ * "P:D" (platform:device index as listed here), "pci:[dddd:]bb:dd.f" or a
+ * case insensitive name substring. "host" uses the CPU engine instead,
+ * which is also the fallback when no device is usable. Returns the device
+ * count, list gets the first max ones */
+int
+fosphor_list_devices(struct fosphor_device_info *list, int max)
+{
+	return fosphor_cl_list_devices(list, max);
+}
+
 int
 fosphor_process(struct fosphor *self, void *samples, int len)
 {
+	if (self->cpu)
+		return fosphor_cpu_process(self, samples, len);
+
+	if (!self->cl)
+		return -ENODEV;
+
 	return fosphor_cl_process(self, samples, len);
 }
 
+/* Samples passed to fosphor_process() from inside a registered area are
+ * DMA'd (or read in place) by the device instead of being staged. The area
+ * must stay valid until unregistered or released */
+int
+fosphor_register_host_buffer(struct fosphor *self, void *buf, size_t len)
+{
+	/* The CPU engine always reads in place */
+	if (self->cpu)
+		return 0;
+
+	if (!self->cl)
+		return -ENODEV;
+
+	return fosphor_cl_register_host_buffer(self, buf, len);
+}
+
 void
-fosphor_draw(struct fosphor *self, struct fosphor_render *render)
+fosphor_unregister_host_buffer(struct fosphor *self)
 {
-	if (fosphor_cl_finish(self) > 0)
+	if (self->cl)
+		fosphor_cl_unregister_host_buffer(self);
+}
+
+/* Publish the latest processed state to the GL objects used by the draw
+ * (or to the host copies when headless). Needs the GL context, and must not
+ * run concurrently with _process(). Returns 0 if nothing new was processed */
+int
+fosphor_sync(struct fosphor *self)
+{
+	int rv;
+
+	/* Remote instances are updated by fosphor_load_frame() */
+	if (!self->cl && !self->cpu)
+		return 0;
+
+	/* Readback may land directly in GL buffers */
+	if (self->gl)
+		fosphor_gl_stream_prepare(self);
+
+	rv = self->cl ? fosphor_cl_finish(self) : fosphor_cpu_finish(self);
+	if ((rv > 0) && self->gl)
 		fosphor_gl_refresh(self);
-	render->_wf_pos = fosphor_cl_get_waterfall_position(self);
+	else if (self->gl)
+		fosphor_gl_stream_cancel(self);
+
+	return rv;
+}
+
+/* Blocks until the device is done with everything _process() queued, for
+ * callers timing or pacing the device use. Nothing is published */
+int
+fosphor_wait(struct fosphor *self)
+{
+	return self->cl ? fosphor_cl_wait(self) : 0;
+}
+
+/* How many of the latest _process() calls the device may still be reading
+ * the samples of, those must stay valid until then. 0 after a _wait() or
+ * _sync(), and always for the CPU engine (done on return) */
+int
+fosphor_pending(struct fosphor *self)
+{
+	return self->cl ? fosphor_cl_pending(self) : 0;
+}
+
+/* Like _wait() in two steps: the marker is taken with the instance (same
+ * rules as _process()), the wait for it doesn't touch the instance and can
+ * be done without the caller's lock. NULL (CPU engine, error) means
+ * nothing to wait for. _wait_marker() releases it */
+void *
+fosphor_get_marker(struct fosphor *self)
+{
+	return self->cl ? fosphor_cl_get_marker(self) : NULL;
+}
+
+int
+fosphor_wait_marker(void *marker)
+{
+	return marker ? fosphor_cl_wait_marker(marker) : 0;
+}
+
+/* Opaque identity of the compute device, the same for all the instances on
+ * it. NULL for the CPU engine and remote instances */
+const void *
+fosphor_get_device(struct fosphor *self)
+{
+	return self->cl ? fosphor_cl_get_device(self) : NULL;
+}
+
+void
+fosphor_draw(struct fosphor *self, struct fosphor_render *render)
+{
+	if (!self->gl)
+		return;
+
+	render->_wf_pos = _waterfall_position(self);
 	fosphor_gl_draw(self, render);
 }
 
+/* Without fixed function (core profile renderer), the caller must not rely
+ * on the GL matrices: the projection comes from the current viewport */
+int
+fosphor_is_gl_core(struct fosphor *self)
+{
+	return fosphor_gl_is_core(self);
+}
+
+/* Instance uses the fused FFT / display kernels */
+int
+fosphor_is_fused(struct fosphor *self)
+{
+	return self->cl ? fosphor_cl_is_fused(self) : 0;
+}
+
+/* Waterfall & histogram are stored as half floats (opts.half, and both
+ * GL and CL support it) */
+int
+fosphor_is_half(struct fosphor *self)
+{
+	return !!(self->flags & FLG_FOSPHOR_HALF);
+}
+
+/* Bytes used by the instance: host allocations (state, engine buffers and
+ * host copies, but not the mapped GL buffers) and compute device objects
+ * (including the ones shared with GL, not the GL only ones). Either
+ * pointer may be NULL */
+void
+fosphor_get_memory(struct fosphor *self, size_t *host, size_t *device)
+{
+	size_t h, d = 0;
+
+	h  = sizeof(struct fosphor);
+	h += self->chan_len * sizeof(float);
+	h += self->wf_depth * sizeof(struct fosphor_wf_freq);
+
+	if (!fosphor_gl_stream_active(self)) {
+		if (self->img_waterfall)
+			h += (size_t)self->img_len * self->wf_depth * self->img_size;
+		if (self->img_histogram)
+			h += (size_t)self->img_len * self->histo_bins * self->img_size;
+		if (self->buf_spectrum)
+			h += 2 * 2 * self->fft_len * sizeof(float);
+	}
+
+	if (self->cl)
+		fosphor_cl_get_memory(self, &h, &d);
+	else if (self->cpu)
+		fosphor_cpu_get_memory(self, &h);
+
+	if (host)
+		*host = h;
+	if (device)
+		*device = d;
+}
+
+/* Results as of the last _sync(), only available when the host holds a copy
+ * of them (headless or no CL/GL sharing). Spectra are len (== fft_len)
+ * values in dBFS from -fs/2 to +fs/2. Either pointer may be NULL */
+int
+fosphor_get_spectrum(struct fosphor *self, float *live, float *max_hold, int len)
+{
+	const float k = log10f((float)self->fft_len);
+	int i;
+
+	if (!self->buf_spectrum)
+		return -ENODATA;
+
+	if (len != self->fft_len)
+		return -EINVAL;
+
+	for (i=0; i<self->fft_len; i++) {
+		if (live)
+			live[i] = 20.0f * (self->buf_spectrum[2*i+1] - k);
+		if (max_hold)
+			max_hold[i] = 20.0f * (self->buf_spectrum[2*(self->fft_len+i)+1] - k);
+	}
+
+	return 0;
+}
+
+/* With CL/GL sharing the results normally stay on the device, this has the
+ * spectra read back as well at each _sync() for fosphor_get_spectrum().
+ * Without, they always are */
+int
+fosphor_set_spectrum_readback(struct fosphor *self, int enable)
+{
+	if (!(self->flags & FLG_FOSPHOR_USE_CLGL_SHARING))
+		return 0;
+
+	if (enable && !self->buf_spectrum) {
+		self->buf_spectrum = malloc(2 * 2 * self->fft_len * sizeof(float));
+		if (!self->buf_spectrum)
+			return -ENOMEM;
+	} else if (!enable) {
+		free(self->buf_spectrum);
+		self->buf_spectrum = NULL;
+	}
+
+	return 0;
+}
+
+/* Histogram as fosphor_get_histogram_bins() rows (lowest power bin first)
+ * of fft_len intensities in [0,1], same frequency order as the spectra. The
+ * bins span the current power range, i.e. [db_ref - 10 * db_per_div, db_ref].
+ * With a reduced display width, each column is repeated for its bins */
+int
+fosphor_get_histogram(struct fosphor *self, float *histo, int len)
+{
+	const int n = self->fft_len >> 1;
+	int i, j;
+
+	if (!self->img_histogram)
+		return -ENODATA;
+
+	if (len != self->fft_len)
+		return -EINVAL;
+
+	for (j=0; j<self->histo_bins; j++)
+		for (i=0; i<self->fft_len; i++)
+			histo[j * self->fft_len + i] = fosphor_img_get(self,
+				self->img_histogram, j * self->img_len + ((i ^ n) >> self->img_red));
+
+	return 0;
+}
+
+/* Peaks of the live spectrum at least threshold_db above the noise floor
+ * estimate, found on the device at each _sync() */
+int
+fosphor_set_detection(struct fosphor *self, int enable, float threshold_db)
+{
+	if (self->cpu)
+		return fosphor_cpu_set_detection(self, enable, threshold_db / 20.0f);
+
+	if (!self->cl)
+		return -ENODEV;
+
+	return fosphor_cl_set_detection(self, enable, threshold_db / 20.0f);
+}
+
+static int
+_detection_cmp(const void *a, const void *b)
+{
+	const struct fosphor_detection *da = a, *db = b;
+
+	return (da->power < db->power) - (da->power > db->power);
+}
+
+/* Detections as of the last _sync(), the max strongest first. Returns how
+ * many were written, floor_db (may be NULL) gets the noise floor */
+int
+fosphor_get_detections(struct fosphor *self, struct fosphor_detection *det,
+                       int max, float *floor_db)
+{
+	const float k = log10f((float)self->fft_len);
+	const int n = self->fft_len >> 1;
+	struct fosphor_detection *all;
+	const float *raw;
+	int i, cnt, rv;
+
+	if (self->cpu)
+		rv = fosphor_cpu_get_detections(self, &raw);
+	else if (self->cl)
+		rv = fosphor_cl_get_detections(self, &raw);
+	else
+		rv = -ENODEV;
+	if (rv)
+		return rv;
+
+	cnt = (int)raw[0];
+	if (cnt > FOSPHOR_DETECT_MAX)
+		cnt = FOSPHOR_DETECT_MAX;
+
+	if (floor_db)
+		*floor_db = 20.0f * (raw[1] - k);
+
+	if (cnt <= 0)
+		return 0;
+
+	all = malloc(cnt * sizeof(struct fosphor_detection));
+	if (!all)
+		return -ENOMEM;
+
+	for (i=0; i<cnt; i++) {
+		all[i].bin   = (int)raw[2*(i+1)];
+		all[i].freq  = self->frequency.center +
+			self->frequency.span * (double)(all[i].bin - n) / (double)self->fft_len;
+		all[i].power = 20.0f * (raw[2*(i+1)+1] - k);
+	}
+
+	qsort(all, cnt, sizeof(struct fosphor_detection), _detection_cmp);
+
+	if (cnt > max)
+		cnt = max;
+
+	memcpy(det, all, cnt * sizeof(struct fosphor_detection));
+	free(all);
+
+	return cnt;
+}
+
+/* Fires on the first spectrum whose power over the band [f_lo, f_hi]
+ * (normalized, relative to the center, in [-0.5,0.5]) exceeds threshold_db
+ * (dBFS, the band total). Evaluated on every FFT, before averaging, so
+ * instances using the fused kernels can't (-ENOTSUP) */
+int
+fosphor_set_trigger(struct fosphor *self, int enable,
+                    double f_lo, double f_hi, float threshold_db)
+{
+	const int len = self->fft_len;
+	int bin_lo, bin_hi;
+	float thr;
+
+	if (enable && !(f_lo < f_hi))
+		return -EINVAL;
+
+	bin_lo = (int)floor((f_lo + 0.5) * len);
+	bin_hi = (int)ceil((f_hi + 0.5) * len);
+	bin_lo = (bin_lo < 0) ? 0 : ((bin_lo > len - 1) ? (len - 1) : bin_lo);
+	bin_hi = (bin_hi <= bin_lo) ? (bin_lo + 1) : ((bin_hi > len) ? len : bin_hi);
+
+	/* Sum of |X|^2, full scale being len^2 per bin */
+	thr = powf(10.0f, threshold_db / 10.0f) * (float)len * (float)len;
+
+	if (self->cpu)
+		return fosphor_cpu_set_trigger(self, enable, bin_lo, bin_hi, thr);
+
+	/* (-ENOTSUP would have the sink re-init for nothing) */
+	if (!self->cl)
+		return -ENODEV;
+
+	return fosphor_cl_set_trigger(self, enable, bin_lo, bin_hi, thr);
+}
+
+/* As of the last _sync(): 1 if the trigger fired in the spectra processed
+ * since the previous one, age is then the number of spectra processed
+ * after the first one over (its window starting (age + 1) * hop samples
+ * before the end of the last batch) and power_db the peak band power.
+ * 0 if it didn't, -ENODATA if not armed or nothing was processed */
+int
+fosphor_get_trigger(struct fosphor *self, int *age, float *power_db)
+{
+	float p;
+	int rv;
+
+	if (self->cpu)
+		rv = fosphor_cpu_get_trigger(self, age, &p);
+	else if (self->cl)
+		rv = fosphor_cl_get_trigger(self, age, &p);
+	else
+		rv = -ENODEV;
+	if (rv <= 0)
+		return rv;
+
+	if (power_db)
+		*power_db = 10.0f * log10f(p) - 20.0f * log10f((float)self->fft_len);
+
+	return 1;
+}
+
+/* Down conversion of the input to a zoom band, to feed another instance:
+ * center is relative to the input center (normalized, [-0.5,0.5]), decim a
+ * power of 2 (0 or 1 to stop). Single input, GPU instances only */
+int
+fosphor_set_ddc(struct fosphor *self, int decim, double center)
+{
+	if (!self->cl)
+		return (self->cpu || self->remote) ? -ENOTSUP : -ENODEV;
+
+	if (self->channels > 1)
+		return -ENOTSUP;
+
+	if (decim <= 1)
+		return fosphor_cl_set_ddc(self, 0, 0.0);
+
+	if ((decim > FOSPHOR_DDC_DECIM_MAX) || (decim & (decim - 1)) ||
+	    (center < -0.5) || (center > 0.5))
+		return -EINVAL;
+
+	return fosphor_cl_set_ddc(self, decim, center);
+}
+
+/* Zoom band samples produced up to the last _sync() (and since the one
+ * before), as complex float pairs. Returns their count, the buffer is
+ * valid until the next _sync() */
+int
+fosphor_get_ddc(struct fosphor *self, const float **samples)
+{
+	if (!self->cl)
+		return -ENODEV;
+
+	return fosphor_cl_get_ddc(self, samples);
+}
+
+int
+fosphor_get_histogram_bins(struct fosphor *self)
+{
+	return self->histo_bins;
+}
+
+int
+fosphor_histo_bins_validate(int bins)
+{
+	if ((bins < FOSPHOR_HISTO_BINS_MIN) || (bins > FOSPHOR_HISTO_BINS_MAX))
+		return 0;
+
+	return !(bins & (bins - 1));
+}
+
+
+/* Scaling folded in the window: integer inputs to full scale and, with
+ * channels, the same dBFS as a single FFT of the whole row and each
+ * spectrum centered in its part of it (x[n] * (-1)^n) */
+static float
+_fft_window_scale(struct fosphor *self, int i)
+{
+	if (self->channels == 1)
+		return self->sample_scale;
+
+	return self->sample_scale * self->channels * ((i & 1) ? -1.0f : 1.0f);
+}
 
 void
 fosphor_set_fft_window_default(struct fosphor *self)
@@ -123,20 +761,28 @@ fosphor_set_fft_window_default(struct fosphor *self)
 	int i;
 
 	/* Default Hamming window (periodic) */
-	for (i=0; i<self->fft_len; i++) {
-		float ft = (float)self->fft_len;
+	for (i=0; i<self->chan_len; i++) {
+		float ft = (float)self->chan_len;
 		float fp = (float)i;
 		self->fft_win[i] = (0.54f - 0.46f * cosf((2.0f * 3.141592f * fp) / ft)) * 1.855f;
+		self->fft_win[i] *= _fft_window_scale(self, i);
 	}
 
-	fosphor_cl_load_fft_window(self, self->fft_win);
+	if (self->cl)
+		fosphor_cl_load_fft_window(self, self->fft_win);
 }
 
+/* win holds fft_len / channels values (the FFT of each channel) */
 void
 fosphor_set_fft_window(struct fosphor *self, float *win)
 {
-	memcpy(self->fft_win, win, sizeof(float) * self->fft_len);
-	fosphor_cl_load_fft_window(self, self->fft_win);
+	int i;
+
+	for (i=0; i<self->chan_len; i++)
+		self->fft_win[i] = win[i] * _fft_window_scale(self, i);
+
+	if (self->cl)
+		fosphor_cl_load_fft_window(self, self->fft_win);
 }
 
 
@@ -160,7 +806,8 @@ fosphor_set_power_range(struct fosphor *self, int db_ref, int db_per_div)
 	self->power.scale      = scale;
 	self->power.offset     = offset;
 
-	fosphor_cl_set_histogram_range(self, scale, offset);
+	if (self->cl)
+		fosphor_cl_set_histogram_range(self, scale, offset);
 }
 
 void
@@ -305,6 +952,13 @@ fosphor_render_refresh(struct fosphor_render *render)
  *    best we can do)
  */
 
+/* Input samples covered by the full waterfall height */
+static float
+fosphor_wf_samples(struct fosphor *self)
+{
+	return (float)self->fft_hop * self->avg_count * self->wf_decim * self->wf_depth;
+}
+
 double
 fosphor_pos2freq(struct fosphor *self, struct fosphor_render *render, int x)
 {
@@ -335,7 +989,7 @@ fosphor_pos2samp(struct fosphor *self, struct fosphor_render *render, int y)
 	float ys = render->_y_wf[1] - render->_y_wf[0] - 1.0f;
 	float yr = (yf - render->_y_wf[0]) / ys;
 
-	return (int)((1.0f - yr) * (float)(self->fft_len * 1024)) * render->wf_span;
+	return (int)((1.0f - yr) * fosphor_wf_samples(self)) * render->wf_span;
 }
 
 int
@@ -363,7 +1017,7 @@ int
 fosphor_samp2pos(struct fosphor *self, struct fosphor_render *render, int time)
 {
 	float tf = (float)time;
-	float tr = tf / ((float)(self->fft_len * 1024) * render->wf_span);
+	float tr = tf / (fosphor_wf_samples(self) * render->wf_span);
 	float ys = render->_y_wf[1] - render->_y_wf[0] - 1.0f;
 
 	return (int)roundf(render->_y_wf[0] + (1.0f - tr) * ys);
@@ -398,49 +1052,277 @@ fosphor_render_pos_inside(struct fosphor_render *render, int x, int y)
 	return in;
 }
 
+/* Displayed bins, i.e. channels * fosphor_options.fft_len */
+int
+fosphor_get_fft_len(struct fosphor *self)
+{
+	return self->fft_len;
+}
+
+/* With several channels, the samples passed to fosphor_process() are
+ * blocks of fft_len / channels samples of each channel in turn, and their
+ * spectra are shown side by side in that order. Overlap isn't possible */
+int
+fosphor_get_channels(struct fosphor *self)
+{
+	return self->channels;
+}
+
+/* Overlap ratio between consecutive windows (power of 2, up to 16), the
+ * FFT then reads a new window every fft_len / overlap input samples.
+ * A _process() call of n spectra (n multiple of 16) hence takes
+ * n * hop + (fft_len - hop) samples, the caller should only advance its
+ * input by n * hop so the windows stay contiguous over calls */
+int
+fosphor_set_fft_overlap(struct fosphor *self, int overlap)
+{
+	if ((overlap < 1) || (overlap > 16) || (overlap & (overlap - 1)))
+		return -EINVAL;
+
+	if ((self->channels > 1) && (overlap != 1))
+		return -ENOTSUP;
+
+	self->fft_hop = self->fft_len / overlap;
+
+	return 0;
+}
+
 int
-fosphor_fft_len_log_get(void)
+fosphor_get_fft_hop(struct fosphor *self)
 {
-	return g_fosphor_fft_len_log;
+	return self->fft_hop;
 }
 
+/* Average count consecutive spectra (1 = off) into each displayed one, mode
+ * is one of FOSPHOR_AVG_{MEAN,RMS,PEAK}, optionally | FOSPHOR_AVG_LOG.
+ * Instances using the fused kernels can't average (-ENOTSUP), those must be
+ * created with fosphor_options.fused = 0 */
 int
-fosphor_fft_len_get(void)
+fosphor_set_averaging(struct fosphor *self, int count, int mode)
 {
-	return g_fosphor_fft_len;
+	int rv;
+
+	if ((count < 1) || (count > FOSPHOR_AVG_MAX))
+		return -EINVAL;
+
+	if ((mode < 0) || ((mode & ~FOSPHOR_AVG_LOG) > FOSPHOR_AVG_PEAK))
+		return -EINVAL;
+
+	if (self->cpu)
+		rv = fosphor_cpu_set_averaging(self, count, mode);
+	else if (self->cl)
+		rv = fosphor_cl_set_averaging(self, count, mode);
+	else
+		rv = -ENODEV;
+	if (!rv)
+		self->avg_count = count;
+
+	return rv;
+}
+
+/* What the max hold trace follows, one of FOSPHOR_MAX_HOLD_xxx. On the GPU,
+ * the first switch to a mode builds its display program */
+int
+fosphor_set_max_hold(struct fosphor *self, int mode)
+{
+	if ((mode < FOSPHOR_MAX_HOLD_DECAY) || (mode > FOSPHOR_MAX_HOLD_HISTO))
+		return -EINVAL;
+
+	if (self->cpu)
+		return fosphor_cpu_set_max_hold(self, mode);
+
+	if (!self->cl)
+		return self->remote ? -ENOTSUP : -ENODEV;
+
+	return fosphor_cl_set_max_hold(self, mode);
+}
+
+/* Histogram rise & decay time constants (in spectra, defaults 16 & 1024)
+ * and live spectrum smoothing factor (in ]0,1], default 0.002) */
+int
+fosphor_set_persistence(struct fosphor *self,
+                        float histo_rise, float histo_decay, float live_alpha)
+{
+	if (!(histo_rise > 0.0f) || !(histo_decay > 0.0f))
+		return -EINVAL;
+
+	if (!(live_alpha > 0.0f) || (live_alpha > 1.0f))
+		return -EINVAL;
+
+	if (self->cpu)
+		return fosphor_cpu_set_persistence(self, histo_rise, histo_decay, live_alpha);
+
+	if (!self->cl)
+		return self->remote ? -ENOTSUP : -ENODEV;
+
+	return fosphor_cl_set_persistence(self, histo_rise, histo_decay, live_alpha);
+}
+
+/* Waterfall & histogram columns, each the reduction (fosphor_options.disp_mode)
+ * of fft_len / that many bins */
+int
+fosphor_get_display_len(struct fosphor *self)
+{
+	return self->img_len;
+}
+
+/* Display width for a render width pixels wide, showing span (as in
+ * fosphor_render.freq_span) of the spectrum: at least one column per pixel,
+ * at most FOSPHOR_DISP_REDUCE_MAX bins per column */
+int
+fosphor_display_len_select(int fft_len, int width, float span)
+{
+	int len = fft_len / FOSPHOR_DISP_REDUCE_MAX;
+
+	if ((span <= 0.0f) || (span > 1.0f))
+		span = 1.0f;
+
+	while ((len < fft_len) && ((float)len * span < (float)width))
+		len <<= 1;
+
+	return len;
+}
+
+int
+fosphor_get_waterfall_depth(struct fosphor *self)
+{
+	return self->wf_depth;
+}
+
+/* Only write one waterfall row (the peak, so short bursts remain visible)
+ * every decim displayed spectra, for a longer history. As for averaging,
+ * instances using the fused kernels can't (-ENOTSUP) */
+int
+fosphor_set_waterfall_decimation(struct fosphor *self, int decim)
+{
+	int rv;
+
+	if ((decim < 1) || (decim > FOSPHOR_AVG_MAX))
+		return -EINVAL;
+
+	if (self->cpu)
+		rv = fosphor_cpu_set_waterfall_decimation(self, decim);
+	else if (self->cl)
+		rv = fosphor_cl_set_waterfall_decimation(self, decim);
+	else
+		rv = -ENODEV;
+	if (!rv)
+		self->wf_decim = decim;
+
+	return rv;
+}
+
+/* Frequency range the waterfall row age rows before the newest displayed
+ * one was computed with, as of the last sync. Rows follow the frequency
+ * range changes made between fosphor_process() calls, so they stay right
+ * across a retune. -ENOENT for rows not written yet */
+int
+fosphor_get_waterfall_frequency(struct fosphor *self, int age,
+                                double *center, double *span)
+{
+	struct fosphor_wf_freq *wff;
+	int pos;
+
+	if ((age < 0) || (age >= self->wf_depth))
+		return -EINVAL;
+
+	pos = _waterfall_position(self);
+
+	wff = &self->wf_freq[(pos - 1 - age) & (self->wf_depth - 1)];
+	if (wff->span == 0.0)
+		return -ENOENT;
+
+	*center = wff->center;
+	*span   = wff->span;
+
+	return 0;
+}
+
+int
+fosphor_wf_depth_validate(int depth)
+{
+	/* Power of 2, rows are addressed modulo the depth */
+	if ((depth < FOSPHOR_WF_DEPTH_MIN) || (depth > FOSPHOR_WF_DEPTH_MAX))
+		return 0;
+
+	return !(depth & (depth - 1));
+}
+
+/* Only available if the instance was created with opts.profiling, -ENODEV
+ * otherwise. Readback / GL stages count the wait for the results at sync */
+int
+fosphor_get_profile(struct fosphor *self, struct fosphor_profile *prof)
+{
+	if (!self->cl)
+		return -ENODEV;
+
+	return fosphor_cl_get_profile(self, prof);
 }
 
 void
-fosphor_fft_len_set(int len)
-{
-	if (fosphor_fft_len_validate(len)) {
-		g_fosphor_fft_len = len;
-		g_fosphor_fft_len_log = 0;
-		int temp = len;
-		while (temp > 1) {
-			temp >>= 1;
-			g_fosphor_fft_len_log++;
-		}
-	}
+fosphor_reset_profile(struct fosphor *self)
+{
+	if (self->cl)
+		fosphor_cl_reset_profile(self);
 }
 
 int
 fosphor_fft_len_validate(int len)
 {
-	/* Basic size validation */
-	if (!(len == 512 || len == 1024 || len == 2048 || 
-	      len == 4096 || len == 8192 || len == 16384 || len == 32768))
+	/* Power of 2. Up to 4096 the FFT is done in local memory, above
+	 * that with the multi-pass global memory kernels */
+	if ((len < FOSPHOR_FFT_LEN_MIN) || (len > FOSPHOR_FFT_LEN_MAX))
 		return 0;
-	
-	/* GPU memory constraint check - sizes > 4096 require too much local memory
-	 * for many GPUs (like NVIDIA GTX 1660 Ti with 48KB limit) */
-	if (len > 4096) {
-		fprintf(stderr, "[w] FFT size %d may not work on all GPUs (memory limit)\n", len);
-		fprintf(stderr, "[w] Consider using 4096 or smaller for better compatibility\n");
-		/* Still allow it - let OpenCL compiler decide */
+
+	return !(len & (len - 1));
+}
+
+/* Whether an instance like this one (same device, channels) would take
+ * that FFT length per channel and display width (0 = all the bins). Lets
+ * the caller refuse a change before building the new instance */
+int
+fosphor_fft_len_check(struct fosphor *self, int len, int disp_len)
+{
+	int row = len * self->channels;
+
+	if (!fosphor_fft_len_validate(len) || !fosphor_fft_len_validate(row)) {
+		fprintf(stderr, "[!] Invalid FFT length %d for %d channel(s)\n",
+			len, self->channels);
+		return -EINVAL;
 	}
-	
-	return 1;
+
+	if (!disp_len)
+		disp_len = row;
+
+	if (self->cl && fosphor_cl_fft_len_check(self, len, disp_len))
+		return -EINVAL;
+
+	if (self->gl && fosphor_gl_disp_len_check(self, disp_len))
+		return -EINVAL;
+
+	return 0;
+}
+
+int
+fosphor_fft_max_batch(int len)
+{
+	int n = FOSPHOR_FFT_MAX_SAMPLES / len;
+
+	/* Limit memory use, but always allow a minimal batch */
+	if (n > FOSPHOR_FFT_MAX_BATCH)
+		n = FOSPHOR_FFT_MAX_BATCH;
+
+	n &= ~(FOSPHOR_FFT_MULT_BATCH - 1);
+
+	return (n > FOSPHOR_FFT_MULT_BATCH) ? n : FOSPHOR_FFT_MULT_BATCH;
+}
+
+/* That instance's limit, fosphor_options.max_batch rounded down to a
+ * multiple of 16 (at least 16) and never above fosphor_fft_max_batch() */
+int
+fosphor_get_max_batch(struct fosphor *self)
+{
+	return self->fft_max_batch;
 }
 
 
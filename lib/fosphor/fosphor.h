@@ -17,31 +17,224 @@
  *  \brief Main fosphor entry point
  */
 
+#include <stddef.h>
+
 struct fosphor;
 struct fosphor_render;
 
 
 /* Main API */
 
-struct fosphor *fosphor_init(void);
+#define FOSPHOR_INPUT_CF32	0	/*!< \brief Complex float (I/Q interleaved) */
+#define FOSPHOR_INPUT_CS16	1	/*!< \brief Complex signed 16 bits integer */
+#define FOSPHOR_INPUT_CS8	2	/*!< \brief Complex signed 8 bits integer */
+
+/*! \brief fosphor init options */
+struct fosphor_options
+{
+	const char *device;	/*!< \brief OpenCL device selector, see fosphor_list_devices() (NULL = auto) */
+	int fft_len;		/*!< \brief FFT length, fixed for the instance (0 = default) */
+	int pipeline_depth;	/*!< \brief Batch buffer sets in flight [1,3] (1 = not pipelined) */
+	int headless;		/*!< \brief No GL at all, results only read back to host */
+	int fused;		/*!< \brief Use fused FFT + display kernels when the device allows */
+	int input_format;	/*!< \brief Samples format (See FOSPHOR_INPUT_??? constants) */
+	int wf_depth;		/*!< \brief Waterfall history rows, power of 2 (0 = default) */
+	int histo_bins;		/*!< \brief Histogram power bins, 64/128/256/512 (0 = default) */
+	int gl_core;		/*!< \brief Core profile GL renderer: 1 = on, 0 = legacy, -1 = auto (GL 3.3+) */
+	int profiling;		/*!< \brief Time the device commands, see fosphor_get_profile() */
+	int remote;		/*!< \brief No processing, displays frames, see fosphor_load_frame() */
+	int channels;		/*!< \brief Inputs tiled side by side, 1/2/4/8 (0 = 1), see fosphor_get_channels() */
+	int half;		/*!< \brief Half float waterfall & histogram storage (falls back to float if unsupported) */
+	int disp_len;		/*!< \brief Waterfall & histogram columns, see fosphor_display_len_select() (0 = fft_len) */
+	int disp_mode;		/*!< \brief Reduction of the bins into those columns (See FOSPHOR_AVG_??? constants) */
+	int max_batch;		/*!< \brief Spectra per fosphor_process() at most, bounds the buffers (0 = fosphor_fft_max_batch()) */
+};
+
+void fosphor_options_defaults(struct fosphor_options *opts);
+
+struct fosphor *fosphor_init(const struct fosphor_options *opts);
 void fosphor_release(struct fosphor *self);
 
+int  fosphor_pool_warmup(const char *device, int headless);
+void fosphor_pool_flush(void);
+int  fosphor_init_parallel(void);
+
+
+/* Devices */
+
+#define FDI_GL_SHARING	(1<<0)	/*!< \brief CL/GL sharing extension */
+#define FDI_IMAGE	(1<<1)	/*!< \brief Image support */
+#define FDI_OPENCL_11	(1<<2)	/*!< \brief OpenCL 1.1 or later */
+#define FDI_OPENCL_12	(1<<3)	/*!< \brief OpenCL 1.2 or later */
+#define FDI_HOST_UNIFIED (1<<4)	/*!< \brief Memory unified with the host */
+
+/*! \brief OpenCL device description */
+struct fosphor_device_info
+{
+	int  platform;		/*!< \brief Platform index */
+	int  device;		/*!< \brief Device index in the platform */
+	char name[128];		/*!< \brief Device name */
+	char vendor[128];	/*!< \brief Device vendor */
+	char pci_id[16];	/*!< \brief PCI bus ID (dddd:bb:dd.f), empty if unknown */
+	int  gpu;		/*!< \brief Device is a GPU */
+	unsigned long local_mem;/*!< \brief Local memory size (bytes) */
+	unsigned long global_mem;/*!< \brief Global memory size (bytes) */
+	int  flags;		/*!< \brief Capabilities (See FDI_??? constants) */
+	int  score;		/*!< \brief Automatic selection score, < 0 if unusable */
+};
+
+int fosphor_list_devices(struct fosphor_device_info *list, int max);
+
 int  fosphor_process(struct fosphor *self, void *samples, int len);
+int  fosphor_sync(struct fosphor *self);
+int  fosphor_wait(struct fosphor *self);
+int  fosphor_pending(struct fosphor *self);
+void *fosphor_get_marker(struct fosphor *self);
+int  fosphor_wait_marker(void *marker);
+const void *fosphor_get_device(struct fosphor *self);
+int  fosphor_register_host_buffer(struct fosphor *self, void *buf, size_t len);
+void fosphor_unregister_host_buffer(struct fosphor *self);
 void fosphor_draw(struct fosphor *self, struct fosphor_render *render);
+int  fosphor_is_gl_core(struct fosphor *self);
+int  fosphor_is_fused(struct fosphor *self);
+int  fosphor_is_half(struct fosphor *self);
+void fosphor_get_memory(struct fosphor *self, size_t *host, size_t *device);
+
+int  fosphor_get_spectrum(struct fosphor *self, float *live, float *max_hold, int len);
+int  fosphor_set_spectrum_readback(struct fosphor *self, int enable);
+int  fosphor_get_histogram(struct fosphor *self, float *histo, int len);
+int  fosphor_get_histogram_bins(struct fosphor *self);
+int  fosphor_histo_bins_validate(int bins);
 
 void fosphor_set_fft_window_default(struct fosphor *self);
 void fosphor_set_fft_window(struct fosphor *self, float *win);
 
 void fosphor_set_power_range(struct fosphor *self, int db_ref, int db_per_div);
 
-/* FFT Length Management */
-int  fosphor_fft_len_log_get(void);
-int  fosphor_fft_len_get(void);
-void fosphor_fft_len_set(int len);
-int  fosphor_fft_len_validate(int len);
 void fosphor_set_frequency_range(struct fosphor *self,
                                  double center, double span);
 
+/* FFT Length */
+int  fosphor_get_fft_len(struct fosphor *self);
+int  fosphor_get_channels(struct fosphor *self);
+int  fosphor_set_fft_overlap(struct fosphor *self, int overlap);
+int  fosphor_get_fft_hop(struct fosphor *self);
+int  fosphor_fft_len_validate(int len);
+int  fosphor_fft_len_check(struct fosphor *self, int len, int disp_len);
+int  fosphor_fft_max_batch(int len);
+int  fosphor_get_max_batch(struct fosphor *self);
+
+/* Spectrum averaging */
+#define FOSPHOR_AVG_MEAN	0	/*!< \brief Mean of the values */
+#define FOSPHOR_AVG_RMS		1	/*!< \brief Root mean square of the values */
+#define FOSPHOR_AVG_PEAK	2	/*!< \brief Maximum of the values */
+#define FOSPHOR_AVG_LOG		(1<<4)	/*!< \brief Values are log power (else linear power) */
+
+#define FOSPHOR_AVG_MAX		1024
+
+int  fosphor_set_averaging(struct fosphor *self, int count, int mode);
+
+/* Max hold & persistence */
+#define FOSPHOR_MAX_HOLD_DECAY	0	/*!< \brief Peaks, slowly decaying toward the live spectrum */
+#define FOSPHOR_MAX_HOLD_NORMAL	1	/*!< \brief Peaks, held */
+#define FOSPHOR_MAX_HOLD_LIVE	2	/*!< \brief Peaks of the (averaged) live spectrum, held */
+#define FOSPHOR_MAX_HOLD_HISTO	3	/*!< \brief Highest lit histogram bin */
+
+int  fosphor_set_max_hold(struct fosphor *self, int mode);
+int  fosphor_set_persistence(struct fosphor *self,
+                             float histo_rise, float histo_decay, float live_alpha);
+
+/* Display width */
+#define FOSPHOR_DISP_REDUCE_MAX	16	/*!< \brief Max bins per waterfall / histogram column */
+
+int  fosphor_get_display_len(struct fosphor *self);
+int  fosphor_display_len_select(int fft_len, int width, float span);
+
+/* Waterfall */
+int  fosphor_get_waterfall_depth(struct fosphor *self);
+int  fosphor_set_waterfall_decimation(struct fosphor *self, int decim);
+int  fosphor_get_waterfall_frequency(struct fosphor *self, int age,
+                                     double *center, double *span);
+int  fosphor_wf_depth_validate(int depth);
+
+/* Peak detection */
+#define FOSPHOR_DETECT_MAX	1024	/*!< \brief Max peaks found per sync */
+
+/*! \brief Detected spectrum peak */
+struct fosphor_detection
+{
+	int    bin;	/*!< \brief Spectrum bin, from -fs/2 (as fosphor_get_spectrum()) */
+	double freq;	/*!< \brief Frequency (Hz, from the frequency range) */
+	float  power;	/*!< \brief Power (dBFS) */
+};
+
+int  fosphor_set_detection(struct fosphor *self, int enable, float threshold_db);
+int  fosphor_get_detections(struct fosphor *self, struct fosphor_detection *det,
+                            int max, float *floor_db);
+
+/* Burst trigger */
+int  fosphor_set_trigger(struct fosphor *self, int enable,
+                         double f_lo, double f_hi, float threshold_db);
+int  fosphor_get_trigger(struct fosphor *self, int *age, float *power_db);
+
+/* Zoom band */
+#define FOSPHOR_DDC_DECIM_MAX	1024	/*!< \brief Max decimation of the zoom band */
+
+int  fosphor_set_ddc(struct fosphor *self, int decim, double center);
+int  fosphor_get_ddc(struct fosphor *self, const float **samples);
+
+
+/* Remote display frames */
+#define FOSPHOR_FRAME_WF_ROWS_MAX	256	/*!< \brief Waterfall rows per frame */
+
+struct fosphor_frame_enc;
+
+/*! \brief Display frame header */
+struct fosphor_frame_info
+{
+	unsigned int seq;	/*!< \brief Sequence number */
+	int    width;		/*!< \brief Spectrum bins */
+	int    histo_rows;	/*!< \brief Histogram power bins */
+	int    wf_rows;		/*!< \brief Waterfall rows carried */
+	int    key;		/*!< \brief Doesn't depend on the previous frames */
+	double center;		/*!< \brief Frequency range (Hz) */
+	double span;
+	int    db_ref;		/*!< \brief Power range */
+	int    db_per_div;
+	int    fft_len;		/*!< \brief FFT length of the source instance */
+};
+
+struct fosphor_frame_enc *fosphor_frame_enc_alloc(int width);
+void fosphor_frame_enc_free(struct fosphor_frame_enc *enc);
+void fosphor_frame_enc_reset(struct fosphor_frame_enc *enc);
+int  fosphor_frame_max_len(struct fosphor *self, struct fosphor_frame_enc *enc);
+int  fosphor_frame_encode(struct fosphor *self, struct fosphor_frame_enc *enc,
+                          void *buf, int len);
+int  fosphor_frame_info(const void *buf, int len, struct fosphor_frame_info *info);
+int  fosphor_load_frame(struct fosphor *self, const void *buf, int len);
+
+
+/* Profiling */
+#define FOSPHOR_PROF_UPLOAD	0	/*!< \brief Samples and window upload */
+#define FOSPHOR_PROF_FFT	1	/*!< \brief FFT kernels (with the fused display accumulation) */
+#define FOSPHOR_PROF_DISPLAY	2	/*!< \brief Averaging, display and waterfall kernels */
+#define FOSPHOR_PROF_READBACK	3	/*!< \brief Results copy to the GL objects or to the host */
+#define FOSPHOR_PROF_GL		4	/*!< \brief GL objects acquire / release */
+#define FOSPHOR_PROF_STAGES	5
+
+/*! \brief Device time spent per sync, by stage (seconds) */
+struct fosphor_profile
+{
+	double last[FOSPHOR_PROF_STAGES];	/*!< \brief Last sync */
+	double avg[FOSPHOR_PROF_STAGES];	/*!< \brief Rolling average */
+	double max[FOSPHOR_PROF_STAGES];	/*!< \brief Peak since reset */
+	unsigned long syncs;			/*!< \brief Syncs accounted for */
+	unsigned long lost;			/*!< \brief Commands not timed (too many in flight) */
+};
+
+int  fosphor_get_profile(struct fosphor *self, struct fosphor_profile *prof);
+void fosphor_reset_profile(struct fosphor *self);
+
 
 /* Render */
 
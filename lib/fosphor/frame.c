@@ -0,0 +1,652 @@
+/*
+ * frame.c
+ *
+ * Compact display frames, for remote displays
+ *
+ * Copyright (C) 2013-2021 Sylvain Munaut
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/*! \addtogroup frame
+ *  @{
+ */
+
+/*! \file frame.c
+ *  \brief Compact display frames, for remote displays
+ *
+ * A frame carries what a display needs for one update: the live and
+ * max-hold spectra, the histogram and the waterfall rows written since the
+ * previous frame, all reduced to the frame width (peak of the merged bins)
+ * and quantized to 8 bits over the power range. Each array is coded as the
+ * difference with what the previous frame sent (waterfall rows with the
+ * row before) and zero runs are collapsed, so a steady display costs next
+ * to nothing. Key frames, periodically or on any parameter change, don't
+ * depend on what came before.
+ *
+ * Layout (little endian), frames are self delimited and can be streamed
+ * back to back over any byte transport:
+ *
+ *   0  u32  magic ('FSF1')          20  f64  center frequency
+ *   4  u32  total length             28  f64  span
+ *   8  u32  sequence number          36  i16  db_ref
+ *  12  u16  width (bins)             38  i16  db_per_div
+ *  14  u16  histogram rows           40  u32  source FFT length
+ *  16  u16  waterfall rows           44  u32  reserved
+ *  18  u8   flags                    48  sections
+ *  19  u8   reserved
+ *
+ * then 4 sections (live, max-hold, histogram rows, waterfall rows), each a
+ * u32 length and the coded bytes. Bins go from -fs/2 to +fs/2, histogram
+ * rows from the lowest power up. Coding: a 0x00 byte is followed by a count
+ * of zero deltas (1-255), any other byte is a delta (mod 256).
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cl.h"
+#include "gl.h"
+#include "fosphor.h"
+#include "frame.h"
+#include "private.h"
+
+
+#define FRAME_MAGIC		0x31465346	/* 'FSF1' */
+#define FRAME_HDR_LEN		48
+#define FRAME_SECTIONS		4
+#define FRAME_FLG_KEY		(1 << 0)
+
+#define FRAME_KEY_INTERVAL	100
+
+struct fosphor_frame_enc
+{
+	int width;		/* Requested, clamped to the FFT length */
+	uint32_t seq;
+	int since_key;
+
+	/* Parameters of the last frame (a change forces a key frame) */
+	int w, h;
+	int db_ref, db_per_div;
+
+	/* Last sent values: live (w), max-hold (w), histogram (w*h), last
+	 * waterfall row (w). And the quantized current frame */
+	uint8_t *prev;
+	uint8_t *cur;
+};
+
+struct fosphor_frame_dec
+{
+	int valid;		/* Holds a state to apply deltas to */
+	uint32_t seq;
+	int wf_pos;		/* Next waterfall row */
+
+	/* Same layout as the encoder prev */
+	uint8_t *state;
+	uint8_t *rows;		/* Waterfall rows of the frame */
+};
+
+
+/* -------------------------------------------------------------------------- */
+/* Helpers / Internal API                                                     */
+/* -------------------------------------------------------------------------- */
+
+static void
+put_u16(uint8_t *p, unsigned int v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void
+put_u32(uint8_t *p, uint32_t v)
+{
+	put_u16(p, v & 0xffff);
+	put_u16(p + 2, v >> 16);
+}
+
+static void
+put_f64(uint8_t *p, double v)
+{
+	uint64_t u;
+
+	memcpy(&u, &v, sizeof(u));
+	put_u32(p, u & 0xffffffff);
+	put_u32(p + 4, u >> 32);
+}
+
+static unsigned int
+get_u16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t
+get_u32(const uint8_t *p)
+{
+	return get_u16(p) | ((uint32_t)get_u16(p + 2) << 16);
+}
+
+static double
+get_f64(const uint8_t *p)
+{
+	uint64_t u = get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+	double v;
+
+	memcpy(&v, &u, sizeof(v));
+	return v;
+}
+
+
+/* Quantization over the power range (8 bits, ~0.4 dB at 10 dB/div) */
+static inline uint8_t
+q_pwr(float db, float db_min, float q_scale)
+{
+	float q = (db - db_min) * q_scale;
+
+	if (!(q > 0.0f))	/* Also NaN */
+		return 0;
+	if (q > 255.0f)
+		return 255;
+	return (uint8_t)(q + 0.5f);
+}
+
+static inline uint8_t
+q_histo(float v)
+{
+	if (!(v > 0.0f))
+		return 0;
+	if (v > 1.0f)
+		return 255;
+	return (uint8_t)(v * 255.0f + 0.5f);
+}
+
+
+/* Delta (with ref, NULL = zeros) and zero run coding of n values, returns
+ * the coded length. dst needs room for 2*n bytes */
+static int
+rle_encode(uint8_t *dst, const uint8_t *src, const uint8_t *ref, int n)
+{
+	int i = 0, o = 0;
+
+	while (i < n)
+	{
+		uint8_t d = src[i] - (ref ? ref[i] : 0);
+
+		if (d) {
+			dst[o++] = d;
+			i++;
+			continue;
+		}
+
+		/* Zero run */
+		int r = 1;
+		while ((i + r < n) && (r < 255) && (src[i+r] == (ref ? ref[i+r] : 0)))
+			r++;
+
+		dst[o++] = 0x00;
+		dst[o++] = r;
+		i += r;
+	}
+
+	return o;
+}
+
+/* Inverse of rle_encode(), in place over the reference values in dst.
+ * Returns 0 if src was exactly n values */
+static int
+rle_decode(uint8_t *dst, const uint8_t *ref, int n, const uint8_t *src, int len)
+{
+	int i = 0, o = 0;
+
+	while ((i < len) && (o < n))
+	{
+		uint8_t b = src[i++];
+
+		if (b) {
+			dst[o] = (ref ? ref[o] : 0) + b;
+			o++;
+			continue;
+		}
+
+		if (i == len || !src[i] || (o + src[i] > n))
+			return -EINVAL;
+
+		for (b=src[i++]; b; b--, o++)
+			dst[o] = ref ? ref[o] : 0;
+	}
+
+	return ((i == len) && (o == n)) ? 0 : -EINVAL;
+}
+
+
+/* Results of the last sync reduced to w bins (peak of the merged ones) and
+ * quantized. Host layout is as read back: spectra shifted (x, log10 mag)
+ * pairs, histogram / waterfall rows in FFT order, img_len columns */
+static void
+frame_quantize(struct fosphor *self, uint8_t *cur, int w, int h,
+               int wf_row, int wf_rows)
+{
+	const int n   = self->fft_len;
+	const int f   = n / w;
+	const int il  = self->img_len;
+	const int red = self->img_red;
+	const int db_min = self->power.db_ref - 10 * self->power.db_per_div;
+	const float qs = 255.0f / (10 * self->power.db_per_div);
+	const float k  = log10f((float)n);
+	uint8_t *live = cur, *max_hold = cur + w, *histo = cur + 2 * w;
+	uint8_t *rows = cur + 2 * w + w * h + w;
+	int i, j, x, r;
+
+	for (i=0; i<w; i++)
+	{
+		float l = -INFINITY, m = -INFINITY;
+
+		for (x=i*f; x<(i+1)*f; x++) {
+			l = fmaxf(l, self->buf_spectrum[2*x+1]);
+			m = fmaxf(m, self->buf_spectrum[2*(n+x)+1]);
+		}
+
+		live[i]     = q_pwr(20.0f * (l - k), db_min, qs);
+		max_hold[i] = q_pwr(20.0f * (m - k), db_min, qs);
+
+		for (j=0; j<h; j++) {
+			float v = 0.0f;
+			for (x=i*f; x<(i+1)*f; x++)
+				v = fmaxf(v, fosphor_img_get(self, self->img_histogram, j * il + ((x ^ (n >> 1)) >> red)));
+			histo[j * w + i] = q_histo(v);
+		}
+
+		for (r=0; r<wf_rows; r++) {
+			const size_t row = (size_t)((wf_row + r) & (self->wf_depth - 1)) * il;
+			float v = -INFINITY;
+			for (x=i*f; x<(i+1)*f; x++)
+				v = fmaxf(v, fosphor_img_get(self, self->img_waterfall, row + ((x ^ (n >> 1)) >> red)));
+			rows[r * w + i] = q_pwr(20.0f * (v - k), db_min, qs);
+		}
+	}
+}
+
+
+/* -------------------------------------------------------------------------- */
+/* Exposed API                                                                */
+/* -------------------------------------------------------------------------- */
+
+/* Encoder state, one per stream (each frame depends on the previous ones).
+ * width is the bins per frame (power of 2, >= 512), at most the FFT length
+ * of the instances encoded */
+struct fosphor_frame_enc *
+fosphor_frame_enc_alloc(int width)
+{
+	struct fosphor_frame_enc *enc;
+
+	if (!fosphor_fft_len_validate(width))
+		return NULL;
+
+	enc = calloc(1, sizeof(struct fosphor_frame_enc));
+	if (!enc)
+		return NULL;
+
+	enc->width = width;
+
+	return enc;
+}
+
+void
+fosphor_frame_enc_free(struct fosphor_frame_enc *enc)
+{
+	if (!enc)
+		return;
+
+	free(enc->prev);
+	free(enc->cur);
+	free(enc);
+}
+
+/* Force the next frame to be a key frame (e.g. for a new viewer) */
+void
+fosphor_frame_enc_reset(struct fosphor_frame_enc *enc)
+{
+	enc->w = 0;
+}
+
+/* Room needed in the buffer passed to fosphor_frame_encode() */
+int
+fosphor_frame_max_len(struct fosphor *self, struct fosphor_frame_enc *enc)
+{
+	int w = (enc->width < self->fft_len) ? enc->width : self->fft_len;
+
+	return FRAME_HDR_LEN + 4 * FRAME_SECTIONS +
+		2 * w * (2 + self->histo_bins + FOSPHOR_FRAME_WF_ROWS_MAX);
+}
+
+/* Frame of the results of the last _sync(), to be called after each
+ * productive one (the waterfall rows are those it wrote, at most
+ * FOSPHOR_FRAME_WF_ROWS_MAX). Needs the host copies of the results
+ * (headless, or no CL/GL sharing). Returns the frame length */
+int
+fosphor_frame_encode(struct fosphor *self, struct fosphor_frame_enc *enc,
+                     void *buf, int len)
+{
+	const int w = (enc->width < self->fft_len) ? enc->width : self->fft_len;
+	const int h = self->histo_bins;
+	const int state_len = w * (3 + h);
+	uint8_t *p = buf, *o;
+	int wf_rows, wf_row, key, i, l;
+
+	if (!self->buf_spectrum || !self->img_histogram || !self->img_waterfall)
+		return -ENODATA;
+
+	if (len < fosphor_frame_max_len(self, enc))
+		return -ENOSPC;
+
+	/* New parameters: new state, and a key frame */
+	key = (w != enc->w) || (h != enc->h) ||
+	      (self->power.db_ref != enc->db_ref) ||
+	      (self->power.db_per_div != enc->db_per_div) ||
+	      (enc->since_key >= FRAME_KEY_INTERVAL);
+
+	if ((w != enc->w) || (h != enc->h))
+	{
+		free(enc->prev);
+		free(enc->cur);
+
+		enc->prev = calloc(state_len, 1);
+		enc->cur  = malloc(state_len + w * FOSPHOR_FRAME_WF_ROWS_MAX);
+		if (!enc->prev || !enc->cur) {
+			enc->w = 0;
+			return -ENOMEM;
+		}
+
+		enc->w = w;
+		enc->h = h;
+	}
+
+	enc->db_ref     = self->power.db_ref;
+	enc->db_per_div = self->power.db_per_div;
+	enc->since_key  = key ? 0 : (enc->since_key + 1);
+
+	/* Newest waterfall rows */
+	wf_rows = self->wf_dirty.len;
+	if (wf_rows > FOSPHOR_FRAME_WF_ROWS_MAX)
+		wf_rows = FOSPHOR_FRAME_WF_ROWS_MAX;
+
+	wf_row = (self->wf_dirty.start + self->wf_dirty.len - wf_rows) & (self->wf_depth - 1);
+
+	frame_quantize(self, enc->cur, w, h, wf_row, wf_rows);
+
+	/* Header */
+	put_u32(p +  0, FRAME_MAGIC);
+	put_u32(p +  8, enc->seq++);
+	put_u16(p + 12, w);
+	put_u16(p + 14, h);
+	put_u16(p + 16, wf_rows);
+	p[18] = key ? FRAME_FLG_KEY : 0;
+	p[19] = 0;
+	put_f64(p + 20, self->frequency.center);
+	put_f64(p + 28, self->frequency.span);
+	put_u16(p + 36, (uint16_t)self->power.db_ref);
+	put_u16(p + 38, (uint16_t)self->power.db_per_div);
+	put_u32(p + 40, self->fft_len);
+	put_u32(p + 44, 0);
+
+	o = p + FRAME_HDR_LEN;
+
+	/* Live, max-hold & histogram, against what was sent last */
+	for (i=0; i<2; i++) {
+		l = rle_encode(o + 4, enc->cur + i * w, key ? NULL : enc->prev + i * w, w);
+		put_u32(o, l);
+		o += 4 + l;
+	}
+
+	l = rle_encode(o + 4, enc->cur + 2 * w, key ? NULL : enc->prev + 2 * w, w * h);
+	put_u32(o, l);
+	o += 4 + l;
+
+	/* Waterfall rows, each against the one before */
+	l = 0;
+	for (i=0; i<wf_rows; i++) {
+		const uint8_t *row = enc->cur + state_len + i * w;
+		const uint8_t *ref = i ? (row - w) : (key ? NULL : enc->prev + state_len - w);
+		l += rle_encode(o + 4 + l, row, ref, w);
+	}
+	put_u32(o, l);
+	o += 4 + l;
+
+	/* Keep what the viewers now have */
+	memcpy(enc->prev, enc->cur, state_len - w);
+	if (wf_rows)
+		memcpy(enc->prev + state_len - w, enc->cur + state_len + (wf_rows - 1) * w, w);
+
+	put_u32(p + 4, o - p);
+
+	return o - p;
+}
+
+/* Header of the frame at buf into info (may be NULL). Returns the frame
+ * length, 0 if more data is needed to know, < 0 if it's not a frame */
+int
+fosphor_frame_info(const void *buf, int len, struct fosphor_frame_info *info)
+{
+	const uint8_t *p = buf;
+	int flen;
+
+	if (len < 8)
+		return 0;
+
+	if (get_u32(p) != FRAME_MAGIC)
+		return -EINVAL;
+
+	flen = get_u32(p + 4);
+	if (flen < FRAME_HDR_LEN + 4 * FRAME_SECTIONS)
+		return -EINVAL;
+
+	if (len < FRAME_HDR_LEN)
+		return 0;
+
+	if (info) {
+		info->seq        = get_u32(p + 8);
+		info->width      = get_u16(p + 12);
+		info->histo_rows = get_u16(p + 14);
+		info->wf_rows    = get_u16(p + 16);
+		info->key        = !!(p[18] & FRAME_FLG_KEY);
+		info->center     = get_f64(p + 20);
+		info->span       = get_f64(p + 28);
+		info->db_ref     = (int16_t)get_u16(p + 36);
+		info->db_per_div = (int16_t)get_u16(p + 38);
+		info->fft_len    = get_u32(p + 40);
+	}
+
+	return flen;
+}
+
+
+int
+fosphor_frame_remote_init(struct fosphor *self)
+{
+	struct fosphor_frame_dec *dec;
+	const int w = self->fft_len;
+
+	dec = calloc(1, sizeof(struct fosphor_frame_dec));
+	if (!dec)
+		return -ENOMEM;
+
+	dec->state = malloc(w * (3 + self->histo_bins));
+	dec->rows  = malloc(w * FOSPHOR_FRAME_WF_ROWS_MAX);
+
+	self->remote = dec;
+
+	if (!dec->state || !dec->rows)
+		return -ENOMEM;
+
+	return 0;
+}
+
+void
+fosphor_frame_remote_release(struct fosphor *self)
+{
+	struct fosphor_frame_dec *dec = self->remote;
+
+	if (!dec)
+		return;
+
+	free(dec->rows);
+	free(dec->state);
+	free(dec);
+
+	self->remote = NULL;
+}
+
+int
+fosphor_frame_remote_wf_pos(struct fosphor *self)
+{
+	return self->remote ? self->remote->wf_pos : 0;
+}
+
+/* Display a frame, remote instances only (fosphor_options.remote). Their
+ * FFT length and histogram bins must match the frame width / rows (see
+ * fosphor_frame_info()), the power and frequency ranges follow the frames.
+ * Needs the GL context. Returns 1 if displayed, 0 if skipped waiting for a
+ * key frame (lost frames), < 0 on error */
+int
+fosphor_load_frame(struct fosphor *self, const void *buf, int len)
+{
+	struct fosphor_frame_dec *dec = self->remote;
+	struct fosphor_frame_info fi;
+	const uint8_t *p = buf, *s[FRAME_SECTIONS];
+	int sl[FRAME_SECTIONS];
+	int flen, w, h, state_len, i, j, r, o, rv;
+	float k, db_min, dq;
+
+	if (!dec)
+		return -ENODEV;
+
+	/* Frame & parameters */
+	flen = fosphor_frame_info(buf, len, &fi);
+	if ((flen <= 0) || (flen > len))
+		return -EINVAL;
+
+	w = self->fft_len;
+	h = self->histo_bins;
+	state_len = w * (3 + h);
+
+	if ((fi.width != w) || (fi.histo_rows != h) ||
+	    (fi.wf_rows > FOSPHOR_FRAME_WF_ROWS_MAX) || (fi.wf_rows > self->wf_depth) ||
+	    (fi.db_per_div <= 0))
+		return -EINVAL;
+
+	/* Sections */
+	o = FRAME_HDR_LEN;
+	for (i=0; i<FRAME_SECTIONS; i++) {
+		if (o + 4 > flen)
+			return -EINVAL;
+		sl[i] = get_u32(p + o);
+		s[i]  = p + o + 4;
+		if ((sl[i] < 0) || (sl[i] > flen - o - 4))	/* No overflow of o */
+			return -EINVAL;
+		o += 4 + sl[i];
+	}
+
+	/* Deltas need the previous frame */
+	if (!fi.key && (!dec->valid || (fi.seq != dec->seq + 1))) {
+		dec->valid = 0;
+		return 0;
+	}
+
+	dec->valid = 0;
+
+	rv  = rle_decode(dec->state,         fi.key ? NULL : dec->state,         w,     s[0], sl[0]);
+	rv |= rle_decode(dec->state + w,     fi.key ? NULL : dec->state + w,     w,     s[1], sl[1]);
+	rv |= rle_decode(dec->state + 2 * w, fi.key ? NULL : dec->state + 2 * w, w * h, s[2], sl[2]);
+	if (rv)
+		return -EINVAL;
+
+	/* Waterfall rows are concatenated, decode one row at a time */
+	for (r=0, o=0; r<fi.wf_rows; r++)
+	{
+		uint8_t *row = dec->rows + r * w;
+		const uint8_t *ref = r ? (row - w) : (fi.key ? NULL : dec->state + state_len - w);
+		int n = 0, l = 0;
+
+		/* Length of the coded row */
+		while ((n < w) && (o + l < sl[3])) {
+			if (s[3][o + l]) {
+				n++;
+				l++;
+			} else {
+				if (o + l + 1 >= sl[3])
+					return -EINVAL;
+				n += s[3][o + l + 1];
+				l += 2;
+			}
+		}
+
+		if (rle_decode(row, ref, w, s[3] + o, l))
+			return -EINVAL;
+
+		o += l;
+	}
+
+	if (o != sl[3])
+		return -EINVAL;
+
+	if (fi.wf_rows)
+		memcpy(dec->state + state_len - w, dec->rows + (fi.wf_rows - 1) * w, w);
+
+	dec->valid = 1;
+	dec->seq   = fi.seq;
+
+	/* Follow the source ranges */
+	if ((fi.db_ref != self->power.db_ref) || (fi.db_per_div != self->power.db_per_div))
+		fosphor_set_power_range(self, fi.db_ref, fi.db_per_div);
+
+	fosphor_set_frequency_range(self, fi.center, fi.span);
+
+	/* Back to what the readback would have produced */
+	if (self->gl)
+		fosphor_gl_stream_prepare(self);
+
+	k      = log10f((float)w);
+	db_min = self->power.db_ref - 10 * self->power.db_per_div;
+	dq     = (10 * self->power.db_per_div) / 255.0f;
+
+	for (i=0; i<w; i++)
+	{
+		const int n = w >> 1;
+		const int x = i ^ n;
+
+		self->buf_spectrum[2*i]       = ((float)i / (float)n) - 1.0f;
+		self->buf_spectrum[2*i+1]     = (db_min + dec->state[i] * dq) / 20.0f + k;
+		self->buf_spectrum[2*(w+i)]   = self->buf_spectrum[2*i];
+		self->buf_spectrum[2*(w+i)+1] = (db_min + dec->state[w+i] * dq) / 20.0f + k;
+
+		for (j=0; j<h; j++)
+			fosphor_img_set(self, self->img_histogram, j * w + x, dec->state[2 * w + j * w + i] / 255.0f);
+
+		for (r=0; r<fi.wf_rows; r++) {
+			int row = (dec->wf_pos + r) & (self->wf_depth - 1);
+			fosphor_img_set(self, self->img_waterfall, (size_t)row * w + x,
+				(db_min + dec->rows[r * w + i] * dq) / 20.0f + k);
+		}
+	}
+
+	for (r=0; r<fi.wf_rows; r++) {
+		struct fosphor_wf_freq *wff = &self->wf_freq[(dec->wf_pos + r) & (self->wf_depth - 1)];
+		wff->center = fi.center;
+		wff->span   = fi.span;
+	}
+
+	self->wf_dirty.start = dec->wf_pos;
+	self->wf_dirty.len   = fi.wf_rows;
+
+	dec->wf_pos = (dec->wf_pos + fi.wf_rows) & (self->wf_depth - 1);
+
+	if (self->gl)
+		fosphor_gl_refresh(self);
+
+	return 1;
+}
+
+/*! @} */
@@ -0,0 +1,26 @@
+/*
+ * frame.h
+ *
+ * Compact display frames, for remote displays
+ *
+ * Copyright (C) 2013-2021 Sylvain Munaut
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+/*! \defgroup frame
+ *  @{
+ */
+
+/*! \file frame.h
+ *  \brief Compact display frames, for remote displays
+ */
+
+struct fosphor;
+
+int  fosphor_frame_remote_init(struct fosphor *self);
+void fosphor_frame_remote_release(struct fosphor *self);
+int  fosphor_frame_remote_wf_pos(struct fosphor *self);
+
+/*! @} */
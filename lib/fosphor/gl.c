@@ -28,15 +28,50 @@
 #include "gl.h"
 #include "gl_cmap.h"
 #include "gl_cmap_gen.h"
+#include "gl_core.h"
 #include "gl_font.h"
 #include "private.h"
 #include "resource.h"
 
 
+/* Streamed uploads need ARB_buffer_storage (and ARB_sync) entry points */
+#ifdef GL_MAP_PERSISTENT_BIT
+# define GL_HAVE_STREAM
+#endif
+
+#define GL_STREAM_SLOTS	3
+
+/* Axis labels layouts, one per render (the sinks have two) */
+#define GL_LABEL_CACHE_SIZE	4
+
+struct gl_label_key
+{
+	int    options;
+	int    freq_n_div;
+	float  freq_center;
+	float  freq_span;
+	float  x[2], x_div, x_label;
+	float  y_histo[2], y_histo_div, y_label;
+	double frequency[2];
+	int    power[2];
+};
+
+struct gl_label_cache
+{
+	const struct fosphor_render *render;
+	struct gl_label_key key;	/* Everything the layout depends on */
+	unsigned int used;		/* LRU stamp */
+	GLuint vbo;
+	int n_vtx;
+};
+
 struct fosphor_gl_state
 {
 	int init_complete;
+	int core;		/* Core profile renderer (no fixed function) */
+	int max_tex;		/* GL_MAX_TEXTURE_SIZE */
 
+	struct gl_core *glc;
 	struct gl_font *font;
 
 	struct fosphor_gl_cmap_ctx *cmap_ctx;
@@ -47,6 +82,27 @@ struct fosphor_gl_state
 	GLuint tex_histogram;
 
 	GLuint vbo_spectrum;
+
+	struct gl_label_cache labels[GL_LABEL_CACHE_SIZE];
+	unsigned int labels_stamp;
+
+#ifdef GL_HAVE_STREAM
+	/* Streamed uploads (no CL/GL sharing): the CL readback lands straight
+	 * in persistently mapped buffers, the spectrum VBO and histogram PBO
+	 * being rings of GL_STREAM_SLOTS results */
+	int stream;
+
+	GLuint pbo_waterfall;
+	GLuint pbo_histogram;
+
+	char *map_waterfall;		/* img_size per value */
+	char *map_histogram;
+	float *map_spectrum;
+
+	GLsync fence[GL_STREAM_SLOTS];	/* Slot no longer in use by GL */
+	int slot_write;			/* Next readback destination */
+	int slot_disp;			/* Last uploaded, drawn from */
+#endif
 };
 
 
@@ -63,7 +119,21 @@ gl_check_extension(const char *ext_name)
 
 	ext_str = (const char *)glGetString(GL_EXTENSIONS);
 	if (!ext_str) {
-		fprintf(stderr, "[w] Failed to retrieve GL extension list.\n");
+		GLint i, n = 0;
+
+		/* Core profile only has the indexed list */
+		glGetError();
+		glGetIntegerv(GL_NUM_EXTENSIONS, &n);
+
+		for (i=0; i<n; i++) {
+			p = (const char *)glGetStringi(GL_EXTENSIONS, i);
+			if (p && !strcmp(p, ext_name))
+				return 1;
+		}
+
+		if (!n)
+			fprintf(stderr, "[w] Failed to retrieve GL extension list.\n");
+
 		return 0;
 	}
 
@@ -79,6 +149,36 @@ gl_check_extension(const char *ext_name)
 	return 0;
 }
 
+static int
+gl_select_core(int opt)
+{
+	GLint major = 0, minor = 0, mask = 0;
+
+	if (!opt)
+		return 0;
+
+	/* Version queries only exist from 3.0, older contexts leave 0 */
+	glGetIntegerv(GL_MAJOR_VERSION, &major);
+	glGetIntegerv(GL_MINOR_VERSION, &minor);
+	while (glGetError() != GL_NO_ERROR);
+
+	if ((major > 3) || ((major == 3) && (minor >= 2)))
+		glGetIntegerv(GL_CONTEXT_PROFILE_MASK, &mask);
+
+	/* A core profile context leaves no choice */
+	if (mask & GL_CONTEXT_CORE_PROFILE_BIT)
+		return 1;
+
+	/* Else we need GLSL 3.30 */
+	if ((major < 3) || ((major == 3) && (minor < 3))) {
+		if (opt > 0)
+			fprintf(stderr, "[w] Core profile renderer needs OpenGL 3.3, using the legacy one\n");
+		return 0;
+	}
+
+	return 1;
+}
+
 #if 0
 static void
 gl_tex2d_float_clear(GLuint tex_id, int width, int height)
@@ -100,16 +200,23 @@ gl_tex2d_float_clear(GLuint tex_id, int width, int height)
 }
 #endif
 
+/* Host type of the waterfall / histogram values */
+static GLenum
+gl_img_type(struct fosphor *self)
+{
+	return (self->flags & FLG_FOSPHOR_HALF) ? GL_HALF_FLOAT : GL_FLOAT;
+}
+
 static void
-gl_tex2d_write(GLuint tex_id, float *src, int width, int height)
+gl_tex2d_write(struct fosphor *self, GLuint tex_id, const void *src, int y, int height)
 {
 	glBindTexture(GL_TEXTURE_2D, tex_id);
 
 	glTexSubImage2D(
 		GL_TEXTURE_2D, 0,
-		0, 0, width, height,
-		GL_RED, GL_FLOAT,
-		src
+		0, y, self->img_len, height,
+		GL_RED, gl_img_type(self),
+		(const char *)src + (size_t)y * self->img_len * self->img_size
 	);
 }
 
@@ -150,24 +257,126 @@ gl_vbo_read(GLuint vbo_id, void *dst, int size)
 static void
 gl_vbo_write(GLuint vbo_id, void *src, int size)
 {
-#if 0
+	/* Storage is allocated once, don't re-specify it */
+	glBindBuffer(GL_ARRAY_BUFFER, vbo_id);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, size, src);
+}
+
+/* First vertex of the spectra to draw (ring slot when streaming) */
+static int
+gl_spectrum_base(struct fosphor *self)
+{
+#ifdef GL_HAVE_STREAM
+	if (self->gl->stream)
+		return self->gl->slot_disp * 2 * self->fft_len;
+#endif
+	return 0;
+}
+
+#ifdef GL_HAVE_STREAM
+static void
+gl_tex2d_write_pbo(struct fosphor *self, GLuint tex_id, GLuint pbo_id, size_t ofs, int y, int height)
+{
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo_id);
+	glBindTexture(GL_TEXTURE_2D, tex_id);
+
+	glTexSubImage2D(
+		GL_TEXTURE_2D, 0,
+		0, y, self->img_len, height,
+		GL_RED, gl_img_type(self),
+		(const void *)(ofs + (size_t)y * self->img_len * self->img_size)
+	);
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+static void *
+gl_buffer_persistent(GLenum target, GLuint *id, size_t size)
+{
+	const GLbitfield flags =
+		GL_MAP_READ_BIT | GL_MAP_WRITE_BIT |
+		GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
 	void *ptr;
 
-	glBindBuffer(GL_ARRAY_BUFFER, vbo_id);
+	glGenBuffers(1, id);
+	glBindBuffer(target, *id);
+	glBufferStorage(target, size, NULL, flags);
 
-	ptr = glMapBuffer(GL_ARRAY_BUFFER, GL_READ_ONLY);
-	if (!ptr)
-		abort();
+	ptr = glMapBufferRange(target, 0, size, flags);
+	if (ptr)
+		memset(ptr, 0x00, size);
 
-	memcpy(ptr, src, size);
+	glBindBuffer(target, 0);
 
-	glUnmapBuffer(GL_ARRAY_BUFFER);
-#else
-	glBindBuffer(GL_ARRAY_BUFFER, vbo_id);
-	glBufferData(GL_ARRAY_BUFFER, size, src, GL_DYNAMIC_DRAW);
-#endif
+	return ptr;
+}
+
+static void
+gl_stream_release(struct fosphor_gl_state *gl)
+{
+	int i;
+
+	for (i=0; i<GL_STREAM_SLOTS; i++) {
+		if (gl->fence[i])
+			glDeleteSync(gl->fence[i]);
+		gl->fence[i] = NULL;
+	}
+
+	/* Deleting implicitly unmaps */
+	glDeleteBuffers(1, &gl->pbo_histogram);
+	glDeleteBuffers(1, &gl->pbo_waterfall);
+
+	gl->pbo_waterfall = gl->pbo_histogram = 0;
+	gl->map_waterfall = gl->map_histogram = NULL;
+	gl->map_spectrum  = NULL;
+	gl->stream = 0;
+}
+
+static void
+gl_stream_point(struct fosphor *self, int slot)
+{
+	struct fosphor_gl_state *gl = self->gl;
+
+	self->img_waterfall = gl->map_waterfall;
+	self->img_histogram = gl->map_histogram + (size_t)slot * self->img_len * self->histo_bins * self->img_size;
+	self->buf_spectrum  = gl->map_spectrum  + (size_t)slot * 2 * 2 * self->fft_len;
 }
 
+static void
+gl_stream_refresh(struct fosphor *self)
+{
+	struct fosphor_gl_state *gl = self->gl;
+	int s = gl->slot_write;
+
+	/* Waterfall rows, same layout as the texture. No fence on those, CL
+	 * only rewrites a row still being uploaded when wrapping around within
+	 * two syncs, and then re-uploads it anyway */
+	if (self->wf_dirty.start + self->wf_dirty.len > self->wf_depth) {
+		gl_tex2d_write_pbo(self, gl->tex_waterfall, gl->pbo_waterfall, 0,
+			self->wf_dirty.start, self->wf_depth - self->wf_dirty.start);
+		gl_tex2d_write_pbo(self, gl->tex_waterfall, gl->pbo_waterfall, 0,
+			0, self->wf_dirty.start + self->wf_dirty.len - self->wf_depth);
+	} else if (self->wf_dirty.len) {
+		gl_tex2d_write_pbo(self, gl->tex_waterfall, gl->pbo_waterfall, 0,
+			self->wf_dirty.start, self->wf_dirty.len);
+	}
+
+	/* Histogram from its slot, the spectrum is drawn from its slot directly */
+	gl_tex2d_write_pbo(self, gl->tex_histogram, gl->pbo_histogram,
+		(size_t)s * self->img_len * self->histo_bins * self->img_size,
+		0, self->histo_bins);
+
+	/* The previous slot is done once what's queued so far is (draws
+	 * included) */
+	if (gl->fence[gl->slot_disp])
+		glDeleteSync(gl->fence[gl->slot_disp]);
+	gl->fence[gl->slot_disp] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+	gl->slot_disp  = s;
+	gl->slot_write = (s + 1) % GL_STREAM_SLOTS;
+}
+#endif
+
 static void
 gl_deferred_init(struct fosphor *self)
 {
@@ -181,12 +390,13 @@ gl_deferred_init(struct fosphor *self)
 
 	gl->init_complete = 1;
 
-	/* Select texture format */
-	tex_fmt = gl_check_extension("GL_ARB_texture_rg") ?
-		GL_R32F :
-		GL_LUMINANCE32F_ARB;
+	/* Select texture format (texture_rg is part of any core profile) */
+	if (gl->core || gl_check_extension("GL_ARB_texture_rg"))
+		tex_fmt = (self->flags & FLG_FOSPHOR_HALF) ? GL_R16F : GL_R32F;
+	else
+		tex_fmt = (self->flags & FLG_FOSPHOR_HALF) ? GL_LUMINANCE16F_ARB : GL_LUMINANCE32F_ARB;
 
-	/* Waterfall texture (FFT_LEN * 1024) */
+	/* Waterfall texture (FFT_LEN * WF_DEPTH) */
 	glGenTextures(1, &gl->tex_waterfall);
 
 	glBindTexture(GL_TEXTURE_2D, gl->tex_waterfall);
@@ -196,9 +406,9 @@ gl_deferred_init(struct fosphor *self)
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 
-	glTexImage2D(GL_TEXTURE_2D, 0, tex_fmt, self->fft_len, 1024, 0, GL_RED, GL_FLOAT, NULL);
+	glTexImage2D(GL_TEXTURE_2D, 0, tex_fmt, self->img_len, self->wf_depth, 0, GL_RED, gl_img_type(self), NULL);
 
-	/* Histogram texture (FFT_LEN * 128) */
+	/* Histogram texture (FFT_LEN * HISTO_BINS) */
 	glGenTextures(1, &gl->tex_histogram);
 
 	glBindTexture(GL_TEXTURE_2D, gl->tex_histogram);
@@ -208,7 +418,7 @@ gl_deferred_init(struct fosphor *self)
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 
-	glTexImage2D(GL_TEXTURE_2D, 0, tex_fmt, self->fft_len, 128, 0, GL_RED, GL_FLOAT, NULL);
+	glTexImage2D(GL_TEXTURE_2D, 0, tex_fmt, self->img_len, self->histo_bins, 0, GL_RED, gl_img_type(self), NULL);
 
 	/* Spectrum VBO (2 * FFT_LEN, half for live, half for 'hold') */
 	glGenBuffers(1, &gl->vbo_spectrum);
@@ -229,8 +439,23 @@ fosphor_gl_init(struct fosphor *self)
 {
 	struct fosphor_gl_state *gl;
 	const void *font_data;
+	GLint max_tex;
 	int len, rv;
 
+	/* Textures are one texel per display column */
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_tex);
+	if (self->img_len > max_tex) {
+		fprintf(stderr, "[!] Display width %d exceeds the GL texture size limit (%d)\n",
+			self->img_len, max_tex);
+		return -EINVAL;
+	}
+
+	if (self->wf_depth > max_tex) {
+		fprintf(stderr, "[!] Waterfall depth %d exceeds the GL texture size limit (%d)\n",
+			self->wf_depth, max_tex);
+		return -EINVAL;
+	}
+
 	/* Allocate structure */
 	gl = malloc(sizeof(struct fosphor_gl_state));
 	if (!gl)
@@ -240,8 +465,28 @@ fosphor_gl_init(struct fosphor *self)
 
 	memset(gl, 0, sizeof(struct fosphor_gl_state));
 
+	gl->max_tex = max_tex;
+
+	/* Renderer */
+	gl->core = gl_select_core(self->opts.gl_core);
+
+	/* Half float uploads (core since 3.0) */
+	if ((self->flags & FLG_FOSPHOR_HALF) && !gl->core &&
+	    !gl_check_extension("GL_ARB_half_float_pixel")) {
+		fprintf(stderr, "[w] No half float textures, using full precision\n");
+		fosphor_img_full(self);
+	}
+
+	if (gl->core) {
+		gl->glc = glc_alloc();
+		if (!gl->glc) {
+			rv = -ENODEV;
+			goto error;
+		}
+	}
+
 	/* Font */
-	gl->font = glf_alloc(8, GLF_FLG_LCD);
+	gl->font = glf_alloc(8, GLF_FLG_LCD | (gl->core ? GLF_FLG_CORE : 0));
 	if (!gl->font) {
 		rv = -ENOMEM;
 		goto error;
@@ -258,7 +503,7 @@ fosphor_gl_init(struct fosphor *self)
 		goto error;
 
 	/* Color mapping */
-	gl->cmap_ctx = fosphor_gl_cmap_init();
+	gl->cmap_ctx = fosphor_gl_cmap_init(gl->core);
 
 	rv  = (gl->cmap_ctx == NULL);
 
@@ -283,12 +528,19 @@ void
 fosphor_gl_release(struct fosphor *self)
 {
 	struct fosphor_gl_state *gl = self->gl;
+	int i;
 
 	/* Safety */
 	if (!gl)
 		return;
 
 	/* Release all */
+	for (i=0; i<GL_LABEL_CACHE_SIZE; i++)
+		glDeleteBuffers(1, &gl->labels[i].vbo);
+
+#ifdef GL_HAVE_STREAM
+	gl_stream_release(gl);
+#endif
 	glDeleteBuffers(1, &gl->vbo_spectrum);
 
 	glDeleteTextures(1, &gl->tex_histogram);
@@ -300,6 +552,8 @@ fosphor_gl_release(struct fosphor *self)
 
 	glf_free(gl->font);
 
+	glc_free(gl->glc);
+
 	/* Release structure */
 	free(gl);
 
@@ -308,6 +562,26 @@ fosphor_gl_release(struct fosphor *self)
 }
 
 
+int
+fosphor_gl_is_core(struct fosphor *self)
+{
+	return self->gl ? self->gl->core : 0;
+}
+
+/* Textures are one texel per display column */
+int
+fosphor_gl_disp_len_check(struct fosphor *self, int disp_len)
+{
+	if (disp_len > self->gl->max_tex) {
+		fprintf(stderr, "[!] Display width %d exceeds the GL texture size limit (%d)\n",
+			disp_len, self->gl->max_tex);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+
 GLuint
 fosphor_gl_get_shared_id(struct fosphor *self,
                          enum fosphor_gl_id id)
@@ -334,6 +608,107 @@ fosphor_gl_get_shared_id(struct fosphor *self,
 }
 
 
+/* Without CL/GL sharing, try to have the results read back straight into
+ * GL buffers (self->img_* / buf_spectrum then point in them). Returns 0 if
+ * so, else the caller needs to provide host buffers */
+int
+fosphor_gl_stream_init(struct fosphor *self)
+{
+#ifdef GL_HAVE_STREAM
+	struct fosphor_gl_state *gl = self->gl;
+	size_t len;
+
+	gl_deferred_init(self);
+
+	/* Core in 4.4, but always listed then */
+	if (!gl_check_extension("GL_ARB_buffer_storage"))
+		return -ENOTSUP;
+
+	/* Waterfall (one image), Histogram (a ring of them) */
+	len = (size_t)self->img_len * self->wf_depth * self->img_size;
+	gl->map_waterfall = gl_buffer_persistent(GL_PIXEL_UNPACK_BUFFER, &gl->pbo_waterfall, len);
+
+	len = (size_t)self->img_len * self->histo_bins * self->img_size * GL_STREAM_SLOTS;
+	gl->map_histogram = gl_buffer_persistent(GL_PIXEL_UNPACK_BUFFER, &gl->pbo_histogram, len);
+
+	/* Spectrum VBO, re-created as an immutable ring */
+	glDeleteBuffers(1, &gl->vbo_spectrum);
+
+	len = 2 * sizeof(float) * 2 * self->fft_len * GL_STREAM_SLOTS;
+	gl->map_spectrum = gl_buffer_persistent(GL_ARRAY_BUFFER, &gl->vbo_spectrum, len);
+
+	if (!gl->map_waterfall || !gl->map_histogram || !gl->map_spectrum)
+	{
+		fprintf(stderr, "[w] Unable to map GL buffers, using host copies\n");
+
+		gl_stream_release(gl);
+
+		/* Back to a plain VBO */
+		glDeleteBuffers(1, &gl->vbo_spectrum);
+		glGenBuffers(1, &gl->vbo_spectrum);
+		glBindBuffer(GL_ARRAY_BUFFER, gl->vbo_spectrum);
+		glBufferData(GL_ARRAY_BUFFER, 2 * sizeof(float) * 2 * self->fft_len, NULL, GL_DYNAMIC_DRAW);
+
+		return -ENOMEM;
+	}
+
+	gl->stream     = 1;
+	gl->slot_disp  = 0;
+	gl->slot_write = 1;
+
+	gl_stream_point(self, gl->slot_disp);
+
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+/* Before a sync: select where the readback lands, waiting for GL to be
+ * done with that slot */
+void
+fosphor_gl_stream_prepare(struct fosphor *self)
+{
+#ifdef GL_HAVE_STREAM
+	struct fosphor_gl_state *gl = self->gl;
+	int s = gl->slot_write;
+
+	if (!gl->stream)
+		return;
+
+	if (gl->fence[s]) {
+		glClientWaitSync(gl->fence[s], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+		glDeleteSync(gl->fence[s]);
+		gl->fence[s] = NULL;
+	}
+
+	gl_stream_point(self, s);
+#endif
+}
+
+/* After a sync without new results: back to what is displayed */
+void
+fosphor_gl_stream_cancel(struct fosphor *self)
+{
+#ifdef GL_HAVE_STREAM
+	struct fosphor_gl_state *gl = self->gl;
+
+	if (gl->stream)
+		gl_stream_point(self, gl->slot_disp);
+#endif
+}
+
+int
+fosphor_gl_stream_active(struct fosphor *self)
+{
+#ifdef GL_HAVE_STREAM
+	return self->gl ? self->gl->stream : 0;
+#else
+	return 0;
+#endif
+}
+
+
 void
 fosphor_gl_refresh(struct fosphor *self)
 {
@@ -344,23 +719,271 @@ fosphor_gl_refresh(struct fosphor *self)
 
 	gl_deferred_init(self);
 
-	gl_tex2d_write(gl->tex_waterfall, self->img_waterfall, self->fft_len, 1024);
-	gl_tex2d_write(gl->tex_histogram, self->img_histogram, self->fft_len,  128);
+#ifdef GL_HAVE_STREAM
+	if (gl->stream) {
+		gl_stream_refresh(self);
+		return;
+	}
+#endif
+
+	/* Only the new waterfall rows (they may wrap around) */
+	if (self->wf_dirty.start + self->wf_dirty.len > self->wf_depth) {
+		gl_tex2d_write(self, gl->tex_waterfall, self->img_waterfall,
+			self->wf_dirty.start, self->wf_depth - self->wf_dirty.start);
+		gl_tex2d_write(self, gl->tex_waterfall, self->img_waterfall,
+			0, self->wf_dirty.start + self->wf_dirty.len - self->wf_depth);
+	} else if (self->wf_dirty.len) {
+		gl_tex2d_write(self, gl->tex_waterfall, self->img_waterfall,
+			self->wf_dirty.start, self->wf_dirty.len);
+	}
+
+	gl_tex2d_write(self, gl->tex_histogram, self->img_histogram, 0, self->histo_bins);
 	gl_vbo_write(gl->vbo_spectrum, self->buf_spectrum, 2 * 2 * sizeof(float) * self->fft_len);
 }
 
 
-void
-fosphor_gl_draw(struct fosphor *self, struct fosphor_render *render)
+struct gl_chan_seg
+{
+	float pos[2];	/* Normalized start / end */
+	int   level;	/* < 0 outside of any channel, else overlap count */
+};
+
+static void
+gl_freq_axis_build(struct fosphor *self, struct fosphor_render *render,
+                   struct freq_axis *freq_axis)
+{
+	if (render->freq_center != 0.5f || render->freq_span != 1.0f)
+	{
+		double view_center = self->frequency.center + self->frequency.span * (double)(render->freq_center - 0.5f);
+		double view_span   = self->frequency.span * (double)render->freq_span;
+
+		freq_axis_build(freq_axis,
+				view_center,
+				view_span,
+				render->freq_n_div
+		);
+	}
+	else
+	{
+		/* Use the straight number we were provider without math to
+		 * avoid any imprecisions */
+		freq_axis_build(freq_axis,
+				self->frequency.center,
+				self->frequency.span,
+				render->freq_n_div
+		);
+	}
+}
+
+static int
+gl_channels_segments(struct fosphor_render *render, struct gl_chan_seg *seg)
+{
+	struct {
+		int   dir;
+		float pos;
+	} pt[2*FOSPHOR_MAX_CHANNELS+2], tpt;
+
+	int i, j, l, n, ns;
+
+	/* Generate the points from the channels */
+	n = 2;
+
+	pt[0].dir = -1; pt[0].pos = 0.0f;
+	pt[1].dir =  1; pt[1].pos = 1.0f;
+
+	for (i=0; i<FOSPHOR_MAX_CHANNELS; i++)
+	{
+		float f;
+
+		if (!render->channels[i].enabled)
+			continue;
+
+		f = render->channels[i].center
+			- render->channels[i].width / 2.0f;
+		pt[n].dir = 1;
+		pt[n].pos = (f > 0.0f) ? (f < 1.0f ? f : 1.0f) : 0.0f;
+		n++;
+
+		f = render->channels[i].center
+			+ render->channels[i].width / 2.0f;
+
+		pt[n].dir = -1;
+		pt[n].pos = (f > 0.0f) ? (f < 1.0f ? f : 1.0f) : 0.0f;
+		n++;
+	}
+
+	/* Only if there is something to do ... */
+	if (n == 2)
+		return 0;
+
+	/* Sort and emit segments at the same time */
+	l  = pt[0].dir;
+	ns = 0;
+
+	for (i=1; i<n; i++)
+	{
+		int mi = i;
+
+		/* Find min index */
+		for (j=i+1; j<n; j++) {
+			if (pt[j].pos < pt[mi].pos)
+				mi = j;
+		}
+
+		/* Swap */
+		tpt    = pt[i];
+		pt[i]  = pt[mi];
+		pt[mi] = tpt;
+
+		/* Emit */
+		if ((pt[i-1].pos != pt[i].pos) && (l != 0))
+		{
+			seg[ns].pos[0] = pt[i-1].pos;
+			seg[ns].pos[1] = pt[i].pos;
+			seg[ns].level  = l;
+			ns++;
+		}
+
+		l += pt[i].dir;
+	}
+
+	return ns;
+}
+
+static int
+gl_labels_build(struct fosphor *self, struct fosphor_render *render, float *data)
 {
 	struct fosphor_gl_state *gl = self->gl;
 	struct freq_axis freq_axis;
+	float xv_ofs_total;
+	char buf[32];
+	int i, n = 0;
+
+	if (render->options & FRO_LABEL_PWR)
+	{
+		for (i=0; i<11; i++)
+		{
+			snprintf(buf, sizeof(buf), "%d",
+			         self->power.db_ref - (10-i) * self->power.db_per_div);
+
+			n += glf_build_str(gl->font,
+			                   render->_x_label, GLF_RIGHT,
+			                   render->_y_histo[0] + i * render->_y_histo_div, GLF_CENTER,
+			                   buf, &data[n * GLF_CHR_FLOATS], sizeof(buf));
+		}
+	}
+
+	if (render->options & FRO_LABEL_FREQ)
+	{
+		gl_freq_axis_build(self, render, &freq_axis);
+
+		freq_axis_render(&freq_axis, buf,  (render->freq_n_div / 2));
+		xv_ofs_total  = glf_width_str(gl->font, buf);
+		freq_axis_render(&freq_axis, buf, -(render->freq_n_div / 2));
+		xv_ofs_total += glf_width_str(gl->font, buf);
+		xv_ofs_total /= 2.0f;
+
+		for (i=0; i<=render->freq_n_div; i++)
+		{
+			int ib = i - (render->freq_n_div / 2);
+			float xv = render->_x[0] + i * render->_x_div;
+
+			freq_axis_render(&freq_axis, buf, ib);
+
+			n += glf_build_str(gl->font,
+			                   xv + floor((- xv_ofs_total * ib) / render->freq_n_div), GLF_CENTER,
+			                   render->_y_label, GLF_CENTER,
+			                   buf, &data[n * GLF_CHR_FLOATS], sizeof(buf));
+		}
+	}
+
+	return n;
+}
+
+/* Labels only change with the frequency / power ranges or the render
+ * geometry, their vertices are kept in a VBO until then */
+static struct gl_label_cache *
+gl_labels_get(struct fosphor *self, struct fosphor_render *render)
+{
+	struct fosphor_gl_state *gl = self->gl;
+	struct gl_label_cache *lc = NULL;
+	struct gl_label_key key;
+	float *data;
+	int i, n;
+
+	/* Current key (memset for memcmp, padding included) */
+	memset(&key, 0x00, sizeof(key));
+
+	key.options        = render->options & (FRO_LABEL_PWR | FRO_LABEL_FREQ);
+	key.freq_n_div     = render->freq_n_div;
+	key.freq_center    = render->freq_center;
+	key.freq_span      = render->freq_span;
+	key.x[0]           = render->_x[0];
+	key.x[1]           = render->_x[1];
+	key.x_div          = render->_x_div;
+	key.x_label        = render->_x_label;
+	key.y_histo[0]     = render->_y_histo[0];
+	key.y_histo[1]     = render->_y_histo[1];
+	key.y_histo_div    = render->_y_histo_div;
+	key.y_label        = render->_y_label;
+	key.frequency[0]   = self->frequency.center;
+	key.frequency[1]   = self->frequency.span;
+	key.power[0]       = self->power.db_ref;
+	key.power[1]       = self->power.db_per_div;
+
+	/* Lookup this render's entry, else take the least recently used */
+	for (i=0; i<GL_LABEL_CACHE_SIZE; i++) {
+		if (gl->labels[i].render == render) {
+			lc = &gl->labels[i];
+			break;
+		}
+		if (!lc || (gl->labels[i].used < lc->used))
+			lc = &gl->labels[i];
+	}
+
+	lc->used = ++gl->labels_stamp;
+
+	if ((lc->render == render) && !memcmp(&lc->key, &key, sizeof(key)))
+		return lc;
+
+	/* Rebuild */
+	lc->render = render;
+	lc->key    = key;
+	lc->n_vtx  = 0;
+
+	data = malloc((11 + render->freq_n_div + 1) * 32 * GLF_CHR_FLOATS * sizeof(float));
+	if (!data) {
+		lc->render = NULL;
+		return lc;
+	}
+
+	n = gl_labels_build(self, render, data);
+
+	if (!lc->vbo)
+		glGenBuffers(1, &lc->vbo);
+
+	glBindBuffer(GL_ARRAY_BUFFER, lc->vbo);
+	glBufferData(GL_ARRAY_BUFFER, n * GLF_CHR_FLOATS * sizeof(float), data, GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	lc->n_vtx = n * GLF_CHR_VTX;
+
+	free(data);
+
+	return lc;
+}
+
+static void
+gl_draw_legacy(struct fosphor *self, struct fosphor_render *render)
+{
+	struct fosphor_gl_state *gl = self->gl;
+	struct gl_chan_seg seg[2*FOSPHOR_MAX_CHANNELS+1];
 	float x[2], y[2], u[2], v[2];
 	float tw;
 	int i;
 
 	/* Utils */
-	tw = 1.0f / (float)(self->fft_len);	/* Texel width */
+	tw = 1.0f / (float)(self->fft_len);	/* Bin width (a texel, at full display width) */
 
 	/* Texture mapping notes:
 	 *
@@ -396,7 +1019,7 @@ fosphor_gl_draw(struct fosphor *self, struct fosphor_render *render)
 		u[0] = 0.5f + (tw / 2.0f) + render->freq_center - (render->freq_span / 2.0f);
 		u[1] = 0.5f + (tw / 2.0f) + render->freq_center + (render->freq_span / 2.0f);
 
-		v[1] = (float)render->_wf_pos / 1024.0f;
+		v[1] = (float)render->_wf_pos / (float)self->wf_depth;
 		v[0] = v[1] - render->wf_span;
 
 		fosphor_gl_cmap_enable(gl->cmap_ctx,
@@ -471,7 +1094,7 @@ fosphor_gl_draw(struct fosphor *self, struct fosphor_render *render)
 	/* Draw spectrum */
 	if (render->options & (FRO_LIVE | FRO_MAX_HOLD))
 	{
-		int idx[2], len;
+		int idx[2], len, base;
 
 		/* Select end-points */
 		idx[0] = ceilf ((float)(self->fft_len) * (render->freq_center - (render->freq_span / 2.0f)));
@@ -484,6 +1107,8 @@ fosphor_gl_draw(struct fosphor *self, struct fosphor_render *render)
 
 		len = idx[1] - idx[0] + 1;
 
+		base = gl_spectrum_base(self);
+
 		/* Setup */
 		glPushMatrix();
 
@@ -531,7 +1156,7 @@ fosphor_gl_draw(struct fosphor *self, struct fosphor_render *render)
 			glColor4f(1.0f, 1.0f, 1.0f, 0.75f);
 
 			glEnableClientState(GL_VERTEX_ARRAY);
-			glDrawArrays(GL_LINE_STRIP, idx[0], len);
+			glDrawArrays(GL_LINE_STRIP, base + idx[0], len);
 			glDisableClientState(GL_VERTEX_ARRAY);
 		}
 
@@ -541,7 +1166,7 @@ fosphor_gl_draw(struct fosphor *self, struct fosphor_render *render)
 			glColor4f(1.0f, 0.0f, 0.0f, 0.75f);
 
 			glEnableClientState(GL_VERTEX_ARRAY);
-			glDrawArrays(GL_LINE_STRIP, idx[0] + self->fft_len, len);
+			glDrawArrays(GL_LINE_STRIP, base + idx[0] + self->fft_len, len);
 			glDisableClientState(GL_VERTEX_ARRAY);
 		}
 
@@ -551,152 +1176,57 @@ fosphor_gl_draw(struct fosphor *self, struct fosphor_render *render)
 		glPopMatrix();
 	}
 
-	/* Setup frequency axis */
-	if (render->freq_center != 0.5f || render->freq_span != 1.0f)
-	{
-		double view_center = self->frequency.center + self->frequency.span * (double)(render->freq_center - 0.5f);
-		double view_span   = self->frequency.span * (double)render->freq_span;
-
-		freq_axis_build(&freq_axis,
-				view_center,
-				view_span,
-				render->freq_n_div
-		);
-	}
-	else
-	{
-		/* Use the straight number we were provider without math to
-		 * avoid any imprecisions */
-		freq_axis_build(&freq_axis,
-				self->frequency.center,
-				self->frequency.span,
-				render->freq_n_div
-		);
-	}
-
 	/* Draw grid */
 	if (render->options & (FRO_LIVE | FRO_MAX_HOLD | FRO_HISTO))
 	{
-		for (i=0; i<11; i++)
-		{
-			float fg_color[3] = { 1.00f, 1.00f, 0.33f };
-			float yv;
+		float fg_color[3] = { 1.00f, 1.00f, 0.33f };
+		struct gl_label_cache *lc;
 
-			yv = render->_y_histo[0] + i * render->_y_histo_div;
+		glEnable(GL_BLEND);
+		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		glColor4f(0.0f, 0.0f, 0.0f, 0.5f);
 
-			glEnable(GL_BLEND);
-			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-			glColor4f(0.0f, 0.0f, 0.0f, 0.5f);
+		glBegin(GL_LINES);
+
+		for (i=0; i<11; i++)
+		{
+			float yv = render->_y_histo[0] + i * render->_y_histo_div;
 
-			glBegin(GL_LINES);
 			glVertex2f(render->_x[0] + 0.5f, yv + 0.5f);
 			glVertex2f(render->_x[1] - 0.5f, yv + 0.5f);
-			glEnd();
-
-			glDisable(GL_BLEND);
-
-			if (render->options & FRO_LABEL_PWR)
-			{
-				glf_begin(gl->font, fg_color);
-
-				glf_printf(gl->font,
-				           render->_x_label, GLF_RIGHT,
-				           yv, GLF_CENTER,
-				           "%d", self->power.db_ref - (10-i) * self->power.db_per_div
-				);
-
-				glf_end();
-			}
 		}
 
 		for (i=0; i<=render->freq_n_div; i++)
 		{
-			float fg_color[3] = { 1.00f, 1.00f, 0.33f };
-			float xv, xv_ofs, xv_ofs_total;
-			char buf[32];
-
-			xv = render->_x[0] + i * render->_x_div;
-
-			glEnable(GL_BLEND);
-			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-			glColor4f(0.0f, 0.0f, 0.0f, 0.5f);
+			float xv = render->_x[0] + i * render->_x_div;
 
-			glBegin(GL_LINES);
 			glVertex2f(xv + 0.5f, render->_y_histo[0]+0.5f);
 			glVertex2f(xv + 0.5f, render->_y_histo[1]-0.5f);
-			glEnd();
-
-			glDisable(GL_BLEND);
-
-			freq_axis_render(&freq_axis, buf,  (render->freq_n_div / 2));
-			xv_ofs_total  = glf_width_str(gl->font, buf);
-			freq_axis_render(&freq_axis, buf, -(render->freq_n_div / 2));
-			xv_ofs_total += glf_width_str(gl->font, buf);
-			xv_ofs_total /= 2.0f;
-
-			if (render->options & FRO_LABEL_FREQ)
-			{
-				int ib = i - (render->freq_n_div / 2);
-
-				glf_begin(gl->font, fg_color);
+		}
 
-				freq_axis_render(&freq_axis, buf, ib);
+		glEnd();
 
-				xv_ofs = floor((- xv_ofs_total * ib) / render->freq_n_div);
+		glDisable(GL_BLEND);
 
-				glf_printf(gl->font,
-				           xv + xv_ofs, GLF_CENTER,
-				           render->_y_label, GLF_CENTER,
-				           "%s", buf
-				);
+		/* All labels at once */
+		lc = gl_labels_get(self, render);
 
-				glf_end();
-			}
+		if (lc->n_vtx)
+		{
+			glf_begin(gl->font, fg_color);
+			glf_draw_buffer(gl->font, lc->vbo, lc->n_vtx);
+			glf_end();
 		}
 	}
 
 	/* Draw channels */
 	if (render->options & FRO_CHANNELS)
 	{
-		struct {
-			int   dir;
-			float pos;
-		} pt[2*FOSPHOR_MAX_CHANNELS+2], tpt;
-
-		int i, j, n;
-
-		/* Generate the points from the channels */
-		n = 2;
-
-		pt[0].dir = -1; pt[0].pos = 0.0f;
-		pt[1].dir =  1; pt[1].pos = 1.0f;
-
-		for (i=0; i<FOSPHOR_MAX_CHANNELS; i++)
-		{
-			float f;
-
-			if (!render->channels[i].enabled)
-				continue;
-
-			f = render->channels[i].center
-				- render->channels[i].width / 2.0f;
-			pt[n].dir = 1;
-			pt[n].pos = (f > 0.0f) ? (f < 1.0f ? f : 1.0f) : 0.0f;
-			n++;
-
-			f = render->channels[i].center
-				+ render->channels[i].width / 2.0f;
-
-			pt[n].dir = -1;
-			pt[n].pos = (f > 0.0f) ? (f < 1.0f ? f : 1.0f) : 0.0f;
-			n++;
-		}
+		int n = gl_channels_segments(render, seg);
 
 		/* Only if there is something to do ... */
-		if (n > 2)
+		if (n)
 		{
-			int l = pt[0].dir;
-
 			/* GL setup */
 			glEnable(GL_BLEND);
 			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
@@ -706,50 +1236,30 @@ fosphor_gl_draw(struct fosphor *self, struct fosphor_render *render)
 			glTranslatef(render->_x[0], 0.0f, 0.0f);
 			glScalef(render->_x[1] - render->_x[0], 1.0f, 1.0f);
 
-			/* Sort and draw at the same time */
-			for (i=1; i<n; i++)
+			for (i=0; i<n; i++)
 			{
-				int mi = i;
-
-				/* Find min index */
-				for (j=i+1; j<n; j++) {
-					if (pt[j].pos < pt[mi].pos)
-						mi = j;
+				if (seg[i].level < 0)
+					glColor4f(0.0f, 0.0f, 0.0f, 0.5f);
+				else
+					glColor4f(1.0f, 1.0f, 1.0f, 0.2f - 0.2f / (1 + seg[i].level));
+
+				if (render->options & FRO_WATERFALL) {
+					glBegin( GL_QUADS );
+					glVertex2f(seg[i].pos[1], render->_y_histo[0]);
+					glVertex2f(seg[i].pos[0], render->_y_histo[0]);
+					glVertex2f(seg[i].pos[0], render->_y_histo[1]);
+					glVertex2f(seg[i].pos[1], render->_y_histo[1]);
+					glEnd();
 				}
 
-				/* Swap */
-				tpt    = pt[i];
-				pt[i]  = pt[mi];
-				pt[mi] = tpt;
-
-				/* Draw */
-				if ((pt[i-1].pos != pt[i].pos) && (l != 0))
-				{
-					if (l < 0)
-						glColor4f(0.0f, 0.0f, 0.0f, 0.5f);
-					else
-						glColor4f(1.0f, 1.0f, 1.0f, 0.2f - 0.2f / (1 + l));
-
-					if (render->options & FRO_WATERFALL) {
-						glBegin( GL_QUADS );
-						glVertex2f(pt[i  ].pos, render->_y_histo[0]);
-						glVertex2f(pt[i-1].pos, render->_y_histo[0]);
-						glVertex2f(pt[i-1].pos, render->_y_histo[1]);
-						glVertex2f(pt[i  ].pos, render->_y_histo[1]);
-						glEnd();
-					}
-
-					if (render->options & (FRO_LIVE | FRO_MAX_HOLD | FRO_HISTO)) {
-						glBegin( GL_QUADS );
-						glVertex2f(pt[i  ].pos, render->_y_wf[0]);
-						glVertex2f(pt[i-1].pos, render->_y_wf[0]);
-						glVertex2f(pt[i-1].pos, render->_y_wf[1]);
-						glVertex2f(pt[i  ].pos, render->_y_wf[1]);
-						glEnd();
-					}
+				if (render->options & (FRO_LIVE | FRO_MAX_HOLD | FRO_HISTO)) {
+					glBegin( GL_QUADS );
+					glVertex2f(seg[i].pos[1], render->_y_wf[0]);
+					glVertex2f(seg[i].pos[0], render->_y_wf[0]);
+					glVertex2f(seg[i].pos[0], render->_y_wf[1]);
+					glVertex2f(seg[i].pos[1], render->_y_wf[1]);
+					glEnd();
 				}
-
-				l += pt[i].dir;
 			}
 
 			/* GL cleanup */
@@ -767,4 +1277,288 @@ fosphor_gl_draw(struct fosphor *self, struct fosphor_render *render)
 	/* glFinish(); */
 }
 
+/* Geometry batches of the core profile path, in emit order */
+enum gl_core_batch
+{
+	GL_CORE_WATERFALL,
+	GL_CORE_HISTOGRAM,
+	GL_CORE_BACKGROUND,
+	GL_CORE_SCALE_WATERFALL,
+	GL_CORE_SCALE_HISTOGRAM,
+	GL_CORE_GRID,
+	GL_CORE_CHANNELS,
+	_GL_CORE_BATCH_NUM
+};
+
+static void
+gl_draw_core(struct fosphor *self, struct fosphor_render *render)
+{
+	static const float white[4]    = { 1.00f, 1.00f, 1.00f, 1.00f };
+	static const float bg_color[4] = { 0.00f, 0.00f, 0.10f, 1.00f };
+	static const float grid_color[4] = { 0.00f, 0.00f, 0.00f, 0.50f };
+	static const float fg_color[3] = { 1.00f, 1.00f, 0.33f };
+
+	struct fosphor_gl_state *gl = self->gl;
+	struct gl_core *glc = gl->glc;
+	struct gl_label_cache *lc;
+	struct gl_chan_seg seg[2*FOSPHOR_MAX_CHANNELS+1];
+	int mark[_GL_CORE_BATCH_NUM + 1];
+	float mvp[16], mvp_spectrum[16];
+	float u[2], v[2];
+	float tw;
+	GLint vp[4];
+	int i, n;
+
+	#define BATCH_BEGIN(b)	mark[b] = glc_count(glc)
+	#define BATCH_FIRST(b)	mark[b]
+	#define BATCH_COUNT(b)	(mark[(b)+1] - mark[b])
+
+	/* Utils */
+	tw = 1.0f / (float)(self->fft_len);	/* Bin width (a texel, at full display width) */
+
+	/* Same projection as the sinks fixed function setup */
+	glGetIntegerv(GL_VIEWPORT, vp);
+	glc_mvp_ortho(mvp, (float)vp[2], (float)vp[3]);
+
+	/* Build the frame geometry (see gl_draw_legacy for the mapping notes) */
+	glc_reset(glc);
+
+	u[0] = 0.5f + (tw / 2.0f) + render->freq_center - (render->freq_span / 2.0f);
+	u[1] = 0.5f + (tw / 2.0f) + render->freq_center + (render->freq_span / 2.0f);
+
+	BATCH_BEGIN(GL_CORE_WATERFALL);
+	if (render->options & FRO_WATERFALL)
+	{
+		v[1] = (float)render->_wf_pos / (float)self->wf_depth;
+		v[0] = v[1] - render->wf_span;
+
+		glc_quad(glc, white,
+		         render->_x[0], render->_y_wf[0], render->_x[1], render->_y_wf[1],
+		         u[0], v[0], u[1], v[1]);
+	}
+
+	BATCH_BEGIN(GL_CORE_HISTOGRAM);
+	if (render->options & FRO_HISTO)
+	{
+		glc_quad(glc, white,
+		         render->_x[0], render->_y_histo[0], render->_x[1], render->_y_histo[1],
+		         u[0], 0.0f, u[1], 1.0f);
+	}
+
+	BATCH_BEGIN(GL_CORE_BACKGROUND);
+	if (!(render->options & FRO_HISTO) && (render->options & (FRO_LIVE | FRO_MAX_HOLD)))
+	{
+		glc_quad(glc, bg_color,
+		         render->_x[0], render->_y_histo[0], render->_x[1], render->_y_histo[1],
+		         0.0f, 0.0f, 0.0f, 0.0f);
+	}
+
+	BATCH_BEGIN(GL_CORE_SCALE_WATERFALL);
+	if ((render->options & (FRO_WATERFALL | FRO_COLOR_SCALE)) == (FRO_WATERFALL | FRO_COLOR_SCALE))
+	{
+		glc_quad(glc, white,
+		         render->_x[1] + 2.0f, render->_y_wf[0], render->_x[1] + 10.0f, render->_y_wf[1],
+		         0.0f, 0.0f, 0.0f, 1.0f);
+	}
+
+	BATCH_BEGIN(GL_CORE_SCALE_HISTOGRAM);
+	if ((render->options & (FRO_HISTO | FRO_COLOR_SCALE)) == (FRO_HISTO | FRO_COLOR_SCALE))
+	{
+		glc_quad(glc, white,
+		         render->_x[1] + 2.0f, render->_y_histo[0], render->_x[1] + 10.0f, render->_y_histo[1],
+		         0.0f, 0.0f, 0.0f, 1.0f);
+	}
+
+	BATCH_BEGIN(GL_CORE_GRID);
+	if (render->options & (FRO_LIVE | FRO_MAX_HOLD | FRO_HISTO))
+	{
+		for (i=0; i<11; i++)
+		{
+			float yv = render->_y_histo[0] + i * render->_y_histo_div;
+
+			glc_line(glc, grid_color,
+			         render->_x[0] + 0.5f, yv + 0.5f,
+			         render->_x[1] - 0.5f, yv + 0.5f);
+		}
+
+		for (i=0; i<=render->freq_n_div; i++)
+		{
+			float xv = render->_x[0] + i * render->_x_div;
+
+			glc_line(glc, grid_color,
+			         xv + 0.5f, render->_y_histo[0] + 0.5f,
+			         xv + 0.5f, render->_y_histo[1] - 0.5f);
+		}
+	}
+
+	BATCH_BEGIN(GL_CORE_CHANNELS);
+	if (render->options & FRO_CHANNELS)
+	{
+		float w = render->_x[1] - render->_x[0];
+
+		n = gl_channels_segments(render, seg);
+
+		for (i=0; i<n; i++)
+		{
+			float color[4] = { 1.0f, 1.0f, 1.0f, 0.2f - 0.2f / (1 + seg[i].level) };
+			float x0 = render->_x[0] + w * seg[i].pos[0];
+			float x1 = render->_x[0] + w * seg[i].pos[1];
+
+			if (seg[i].level < 0) {
+				color[0] = color[1] = color[2] = 0.0f;
+				color[3] = 0.5f;
+			}
+
+			if (render->options & FRO_WATERFALL)
+				glc_quad(glc, color, x0, render->_y_histo[0], x1, render->_y_histo[1],
+				         0.0f, 0.0f, 0.0f, 0.0f);
+
+			if (render->options & (FRO_LIVE | FRO_MAX_HOLD | FRO_HISTO))
+				glc_quad(glc, color, x0, render->_y_wf[0], x1, render->_y_wf[1],
+				         0.0f, 0.0f, 0.0f, 0.0f);
+		}
+	}
+
+	BATCH_BEGIN(_GL_CORE_BATCH_NUM);
+
+	/* Single upload for all of it */
+	glc_upload(glc);
+
+	/* Waterfall & Histogram */
+	if (BATCH_COUNT(GL_CORE_WATERFALL))
+	{
+		fosphor_gl_cmap_enable(gl->cmap_ctx,
+		                       gl->tex_waterfall, gl->cmap_waterfall,
+		                       self->power.scale, self->power.offset,
+		                       GL_CMAP_MODE_BILINEAR);
+		fosphor_gl_cmap_set_mvp(gl->cmap_ctx, mvp);
+
+		glc_draw(glc, GL_TRIANGLES, BATCH_FIRST(GL_CORE_WATERFALL), BATCH_COUNT(GL_CORE_WATERFALL));
+	}
+
+	if (BATCH_COUNT(GL_CORE_HISTOGRAM))
+	{
+		fosphor_gl_cmap_enable(gl->cmap_ctx,
+		                       gl->tex_histogram, gl->cmap_histogram,
+		                       1.1f, 0.0f, GL_CMAP_MODE_BILINEAR);
+		fosphor_gl_cmap_set_mvp(gl->cmap_ctx, mvp);
+
+		glc_draw(glc, GL_TRIANGLES, BATCH_FIRST(GL_CORE_HISTOGRAM), BATCH_COUNT(GL_CORE_HISTOGRAM));
+	}
+
+	fosphor_gl_cmap_disable();
+
+	/* Background & color scales */
+	glc_use(glc, GLC_MODE_FLAT, 0, mvp);
+	glc_draw(glc, GL_TRIANGLES, BATCH_FIRST(GL_CORE_BACKGROUND), BATCH_COUNT(GL_CORE_BACKGROUND));
+
+	if (BATCH_COUNT(GL_CORE_SCALE_WATERFALL)) {
+		glc_use(glc, GLC_MODE_PALETTE, gl->cmap_waterfall, mvp);
+		glc_draw(glc, GL_TRIANGLES, BATCH_FIRST(GL_CORE_SCALE_WATERFALL), BATCH_COUNT(GL_CORE_SCALE_WATERFALL));
+	}
+
+	if (BATCH_COUNT(GL_CORE_SCALE_HISTOGRAM)) {
+		glc_use(glc, GLC_MODE_PALETTE, gl->cmap_histogram, mvp);
+		glc_draw(glc, GL_TRIANGLES, BATCH_FIRST(GL_CORE_SCALE_HISTOGRAM), BATCH_COUNT(GL_CORE_SCALE_HISTOGRAM));
+	}
+
+	/* Everything else is blended */
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+	/* Spectrum, straight from the shared VBO */
+	if (render->options & (FRO_LIVE | FRO_MAX_HOLD))
+	{
+		static const float live_color[4] = { 1.0f, 1.0f, 1.0f, 0.75f };
+		static const float hold_color[4] = { 1.0f, 0.0f, 0.0f, 0.75f };
+		float sx, ox, sy, oy;
+		int idx[2], len, base;
+
+		/* Select end-points */
+		idx[0] = ceilf ((float)(self->fft_len) * (render->freq_center - (render->freq_span / 2.0f)));
+		idx[1] = floorf((float)(self->fft_len) * (render->freq_center + (render->freq_span / 2.0f)));
+
+		if (idx[0] < 1)
+			idx[0] = 1;
+		if (idx[1] >= self->fft_len)
+			idx[1] = self->fft_len - 1;
+
+		len = idx[1] - idx[0] + 1;
+
+		base = gl_spectrum_base(self);
+
+		/* The legacy matrix stack, folded in a single x/y affine map */
+		sx = 0.5f / (1.0f - 2.0f * tw);
+		ox = 0.5f;
+
+		sx *= 1.0f - 2.0f * tw;
+		ox *= 1.0f - 2.0f * tw;
+		ox += tw;
+
+		ox += - render->freq_center + render->freq_span / 2.0f;
+		sx /= render->freq_span;
+		ox /= render->freq_span;
+
+		sx *= render->_x[1] - render->_x[0];
+		ox  = ox * (render->_x[1] - render->_x[0]) + render->_x[0];
+
+		sy  = self->power.scale * (render->_y_histo[1] - render->_y_histo[0]);
+		oy  = self->power.offset * sy + render->_y_histo[0];
+
+		glc_mvp_affine(mvp_spectrum, mvp, sx, ox, sy, oy);
+
+		glEnable(GL_LINE_SMOOTH);
+		glLineWidth(1.0f);
+
+		glc_use(glc, GLC_MODE_FLAT, 0, mvp_spectrum);
+
+		if (render->options & FRO_LIVE)
+			glc_draw_vbo(glc, gl->vbo_spectrum, GL_LINE_STRIP, base + idx[0], len, live_color);
+
+		if (render->options & FRO_MAX_HOLD)
+			glc_draw_vbo(glc, gl->vbo_spectrum, GL_LINE_STRIP, base + idx[0] + self->fft_len, len, hold_color);
+	}
+
+	/* Grid */
+	glc_use(glc, GLC_MODE_FLAT, 0, mvp);
+	glc_draw(glc, GL_LINES, BATCH_FIRST(GL_CORE_GRID), BATCH_COUNT(GL_CORE_GRID));
+
+	/* Labels (sub-pixel coverage, see glf_begin), cached layout */
+	lc = (render->options & (FRO_LIVE | FRO_MAX_HOLD | FRO_HISTO)) ?
+		gl_labels_get(self, render) : NULL;
+
+	if (lc && lc->n_vtx)
+	{
+		glBlendColor(fg_color[0], fg_color[1], fg_color[2], 0.0f);
+		glBlendFunc(GL_CONSTANT_COLOR, GL_ONE_MINUS_SRC_COLOR);
+
+		glc_use(glc, GLC_MODE_TEXT_LCD, glf_texture(gl->font), mvp);
+		glc_draw_vtx(glc, lc->vbo, GL_TRIANGLES, 0, lc->n_vtx);
+
+		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	}
+
+	/* Channels */
+	glc_use(glc, GLC_MODE_FLAT, 0, mvp);
+	glc_draw(glc, GL_TRIANGLES, BATCH_FIRST(GL_CORE_CHANNELS), BATCH_COUNT(GL_CORE_CHANNELS));
+
+	/* Cleanup */
+	glDisable(GL_BLEND);
+	glUseProgram(0);
+
+	#undef BATCH_COUNT
+	#undef BATCH_FIRST
+	#undef BATCH_BEGIN
+}
+
+
+void
+fosphor_gl_draw(struct fosphor *self, struct fosphor_render *render)
+{
+	if (self->gl->core)
+		gl_draw_core(self, render);
+	else
+		gl_draw_legacy(self, render);
+}
+
 /*! @} */
@@ -25,6 +25,9 @@ struct fosphor_render;
 int  fosphor_gl_init(struct fosphor *self);
 void fosphor_gl_release(struct fosphor *self);
 
+int  fosphor_gl_is_core(struct fosphor *self);
+int  fosphor_gl_disp_len_check(struct fosphor *self, int disp_len);
+
 
 enum fosphor_gl_id {
 	GL_ID_TEX_WATERFALL,
@@ -35,6 +38,11 @@ enum fosphor_gl_id {
 GLuint fosphor_gl_get_shared_id(struct fosphor *self,
                                 enum fosphor_gl_id id);
 
+int  fosphor_gl_stream_init(struct fosphor *self);
+void fosphor_gl_stream_prepare(struct fosphor *self);
+void fosphor_gl_stream_cancel(struct fosphor *self);
+int  fosphor_gl_stream_active(struct fosphor *self);
+
 void fosphor_gl_refresh(struct fosphor *self);
 void fosphor_gl_draw(struct fosphor *self, struct fosphor_render *render);
 
@@ -25,7 +25,7 @@
 #include "gl_platform.h"
 
 #include "gl_cmap.h"
-#include "resource.h"
+#include "gl_core.h"
 
 
 struct gl_cmap_shader
@@ -36,11 +36,13 @@ struct gl_cmap_shader
 	/* Shader handles */
 	GLuint prog;
 	GLuint shader;
+	GLuint vert;		/* Core profile only */
 
 	/* Uniforms */
 	GLint u_tex;
 	GLint u_palette;
 	GLint u_range;
+	GLint u_mvp;
 };
 
 enum gl_cmap_shader_type
@@ -52,66 +54,61 @@ enum gl_cmap_shader_type
 };
 
 struct fosphor_gl_cmap_ctx {
+	int core;
 	struct gl_cmap_shader shaders[_GL_CMAP_SHADER_NUM];
+	struct gl_cmap_shader *cur;
 };
 
+/* Shaders sources preludes (version and texture coordinates) */
+static const char *gl_cmap_prelude_legacy =
+	"#version 130\n"
+	"#define TEX_COORD gl_TexCoord[0].st\n";
+
+static const char *gl_cmap_prelude_core =
+	"#version 330 core\n"
+	"in vec2 v_uv;\n"
+	"#define TEX_COORD v_uv\n";
+
 
 /* -------------------------------------------------------------------------- */
 /* Helpers / Internal API                                                     */
 /* -------------------------------------------------------------------------- */
 
 static int
-gl_cmap_init_shader(struct gl_cmap_shader *shader, const char *name)
+gl_cmap_init_shader(struct gl_cmap_shader *shader, const char *name,
+                    const char *prelude, int core)
 {
-	const char *shader_src;
-	GLint buf_len, orv;
+	/* Compile */
+	shader->shader = glc_load_shader(GL_FRAGMENT_SHADER, prelude, name);
+	if (!shader->shader)
+		return -EINVAL;
 
-	/* Load shader sources */
-	shader_src = resource_get(name, NULL);
-	if (!shader_src)
-		return -ENOENT;
+	if (core) {
+		shader->vert = glc_load_shader(GL_VERTEX_SHADER, NULL, "core_vert.glsl");
+		if (!shader->vert) {
+			glDeleteShader(shader->shader);
+			return -EINVAL;
+		}
+	}
 
-	/* Allocate shader */
+	/* Attach to program */
 	shader->prog = glCreateProgram();
-	shader->shader = glCreateShader(GL_FRAGMENT_SHADER);
-
-	/* Compile / Link / Attach */
-	glShaderSource(shader->shader, 1, (const char **)&shader_src, NULL);
-	glCompileShader(shader->shader);
-
-	/* Check success and compile log */
-	glGetShaderiv(shader->shader, GL_COMPILE_STATUS, &orv);
-	glGetShaderiv(shader->shader, GL_INFO_LOG_LENGTH, &buf_len);
-
-#if 1
-	if ((buf_len > 0) && (orv != GL_TRUE))
-#else
-	if (buf_len > 0)
-#endif
-	{
-		char *buf = malloc(buf_len+1);
-
-		glGetShaderInfoLog(shader->shader, buf_len, 0, buf);
-		buf[buf_len] = '\0';
-
-		fprintf(stderr, "[!] gl_cmap shader compile log :\n%s\n", buf);
-
-		free(buf);
-	}
+	glAttachShader(shader->prog, shader->shader);
 
-	if (orv != GL_TRUE) {
-		fprintf(stderr, "[!] gl_cmap shader compilation failed (%s)\n", name);
-		return -EINVAL;
+	if (core) {
+		glAttachShader(shader->prog, shader->vert);
+		glBindAttribLocation(shader->prog, GLC_ATTR_COLOR, "in_color");
+		glBindAttribLocation(shader->prog, GLC_ATTR_POS,   "in_pos");
+		glBindAttribLocation(shader->prog, GLC_ATTR_UV,    "in_uv");
 	}
 
-	/* Attach to program */
-	glAttachShader(shader->prog, shader->shader);
 	glLinkProgram(shader->prog);
 
 	/* Grab the uniform locations */
 	shader->u_tex     = glGetUniformLocation(shader->prog, "tex");
 	shader->u_palette = glGetUniformLocation(shader->prog, "palette");
 	shader->u_range   = glGetUniformLocation(shader->prog, "range");
+	shader->u_mvp     = glGetUniformLocation(shader->prog, "mvp");
 
 	/* Success */
 	shader->loaded = 1;
@@ -127,6 +124,12 @@ gl_cmap_release_shader(struct gl_cmap_shader *shader)
 
 	glDetachShader(shader->prog, shader->shader);
 	glDeleteShader(shader->shader);
+
+	if (shader->vert) {
+		glDetachShader(shader->prog, shader->vert);
+		glDeleteShader(shader->vert);
+	}
+
 	glDeleteProgram(shader->prog);
 
 	memset(shader, 0x00, sizeof(struct gl_cmap_shader));
@@ -138,9 +141,10 @@ gl_cmap_release_shader(struct gl_cmap_shader *shader)
 /* -------------------------------------------------------------------------- */
 
 struct fosphor_gl_cmap_ctx *
-fosphor_gl_cmap_init(void)
+fosphor_gl_cmap_init(int core)
 {
 	struct fosphor_gl_cmap_ctx *cmap_ctx;
+	const char *prelude;
 	int rv;
 	int need_fallback = 0;
 
@@ -151,10 +155,14 @@ fosphor_gl_cmap_init(void)
 
 	memset(cmap_ctx, 0, sizeof(struct fosphor_gl_cmap_ctx));
 
+	cmap_ctx->core = core;
+
+	prelude = core ? gl_cmap_prelude_core : gl_cmap_prelude_legacy;
+
 	/* Init shaders */
 	rv = gl_cmap_init_shader(
 		&cmap_ctx->shaders[GL_CMAP_SHADER_SIMPLE],
-		"cmap_simple.glsl"
+		"cmap_simple.glsl", prelude, core
 	);
 	if (rv) {
 		fprintf(stderr, "[w] Color map shader 'simple' failed to load, will use fallback\n");
@@ -163,17 +171,23 @@ fosphor_gl_cmap_init(void)
 
 	rv = gl_cmap_init_shader(
 		&cmap_ctx->shaders[GL_CMAP_SHADER_BICUBIC],
-		"cmap_bicubic.glsl"
+		"cmap_bicubic.glsl", prelude, core
 	);
 	if (rv) {
 		fprintf(stderr, "[w] Color map shader 'bicubic' failed to load, will use fallback\n");
 		need_fallback = 1;
 	}
 
+	if (need_fallback && core) {
+		/* GLSL 1.0 can't run in a core profile */
+		fprintf(stderr, "[!] No color map shader fallback in core profile, aborting\n");
+		goto error;
+	}
+
 	if (need_fallback) {
 		rv = gl_cmap_init_shader(
 			&cmap_ctx->shaders[GL_CMAP_SHADER_FALLBACK],
-			"cmap_fallback.glsl"
+			"cmap_fallback.glsl", NULL, 0
 		);
 		if (rv) {
 			fprintf(stderr, "[!] Color map shader 'fallback' failed, aborting\n");
@@ -233,6 +247,8 @@ fosphor_gl_cmap_enable(struct fosphor_gl_cmap_ctx *cmap_ctx,
 	/* Enable program */
 	glUseProgram(shader->prog);
 
+	cmap_ctx->cur = shader;
+
 	/* Texture unit 0: Main texture */
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D, tex_id);
@@ -253,6 +269,14 @@ fosphor_gl_cmap_enable(struct fosphor_gl_cmap_ctx *cmap_ctx,
 	glUniform2fv(shader->u_range, 1, range);
 }
 
+void
+fosphor_gl_cmap_set_mvp(struct fosphor_gl_cmap_ctx *cmap_ctx, const float *mvp)
+{
+	/* Core profile only, for the shader last enabled */
+	if (cmap_ctx->cur)
+		glUniformMatrix4fv(cmap_ctx->cur->u_mvp, 1, GL_FALSE, mvp);
+}
+
 void
 fosphor_gl_cmap_disable(void)
 {
@@ -31,15 +31,18 @@ enum fosphor_gl_cmap_mode {
 };
 
 
-struct fosphor_gl_cmap_ctx *fosphor_gl_cmap_init(void);
+struct fosphor_gl_cmap_ctx *fosphor_gl_cmap_init(int core);
 void fosphor_gl_cmap_release(struct fosphor_gl_cmap_ctx *cmap_ctx);
 
 void fosphor_gl_cmap_enable(struct fosphor_gl_cmap_ctx *cmap_ctx,
                             GLuint tex_id, GLuint cmap_id,
                             float scale, float offset,
                             enum fosphor_gl_cmap_mode mode);
+void fosphor_gl_cmap_set_mvp(struct fosphor_gl_cmap_ctx *cmap_ctx,
+                             const float *mvp);
 void fosphor_gl_cmap_disable(void);
 
+/* Fixed function only, the core profile draws scales with gl_core */
 void fosphor_gl_cmap_draw_scale(GLuint cmap_id,
                                 float x0, float x1, float y0, float y1);
 
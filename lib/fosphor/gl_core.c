@@ -0,0 +1,417 @@
+/*
+ * gl_core.c
+ *
+ * Core profile OpenGL primitives batching
+ *
+ * Copyright (C) 2013-2021 Sylvain Munaut
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/*! \addtogroup gl/core
+ *  @{
+ */
+
+/*! \file gl_core.c
+ *  \brief Core profile OpenGL primitives batching
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "gl_platform.h"
+
+#include "gl_core.h"
+#include "resource.h"
+
+
+struct gl_core
+{
+	/* Program */
+	GLuint prog;
+	GLuint vert;
+	GLuint frag;
+
+	GLint u_mvp;
+	GLint u_mode;
+	GLint u_tex;
+	GLint u_palette;
+
+	/* Frame geometry */
+	GLuint vao;
+	GLuint vbo;
+
+	float *vtx;
+	int n_vtx;
+	int max_vtx;
+
+	/* External buffers (positions only / full vertices) */
+	GLuint vao_ext;
+	GLuint vao_vtx;
+};
+
+
+/* -------------------------------------------------------------------------- */
+/* Helpers / Internal API                                                     */
+/* -------------------------------------------------------------------------- */
+
+static float *
+glc_alloc_vtx(struct gl_core *glc, int n)
+{
+	float *p;
+
+	if (glc->n_vtx + n > glc->max_vtx)
+	{
+		int max_vtx = glc->max_vtx ? glc->max_vtx : 256;
+
+		while (glc->n_vtx + n > max_vtx)
+			max_vtx <<= 1;
+
+		p = realloc(glc->vtx, max_vtx * GLC_VTX_FLOATS * sizeof(float));
+		if (!p)
+			return NULL;
+
+		glc->vtx = p;
+		glc->max_vtx = max_vtx;
+	}
+
+	p = &glc->vtx[glc->n_vtx * GLC_VTX_FLOATS];
+	glc->n_vtx += n;
+
+	return p;
+}
+
+static void
+glc_vtx_pointers(GLuint vbo)
+{
+	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+
+	glVertexAttribPointer(GLC_ATTR_COLOR, 4, GL_FLOAT, GL_FALSE,
+		GLC_VTX_FLOATS * sizeof(float), (void*)(0 * sizeof(float)));
+	glVertexAttribPointer(GLC_ATTR_POS,   2, GL_FLOAT, GL_FALSE,
+		GLC_VTX_FLOATS * sizeof(float), (void*)(4 * sizeof(float)));
+	glVertexAttribPointer(GLC_ATTR_UV,    2, GL_FLOAT, GL_FALSE,
+		GLC_VTX_FLOATS * sizeof(float), (void*)(6 * sizeof(float)));
+}
+
+static float *
+glc_vtx(float *p, const float color[4], float x, float y, float u, float v)
+{
+	p[0] = color[0];
+	p[1] = color[1];
+	p[2] = color[2];
+	p[3] = color[3];
+	p[4] = x;
+	p[5] = y;
+	p[6] = u;
+	p[7] = v;
+
+	return p + GLC_VTX_FLOATS;
+}
+
+
+/* -------------------------------------------------------------------------- */
+/* Exposed API                                                                */
+/* -------------------------------------------------------------------------- */
+
+GLuint
+glc_load_shader(GLenum type, const char *prelude, const char *name)
+{
+	const char *src[2];
+	GLuint shader;
+	GLint buf_len, orv;
+	int n = 0;
+
+	/* Load shader sources */
+	if (prelude)
+		src[n++] = prelude;
+
+	src[n] = resource_get(name, NULL);
+	if (!src[n++])
+		return 0;
+
+	/* Compile */
+	shader = glCreateShader(type);
+
+	glShaderSource(shader, n, src, NULL);
+	glCompileShader(shader);
+
+	/* Check success and compile log */
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &orv);
+	glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &buf_len);
+
+	if ((buf_len > 0) && (orv != GL_TRUE))
+	{
+		char *buf = malloc(buf_len+1);
+
+		glGetShaderInfoLog(shader, buf_len, 0, buf);
+		buf[buf_len] = '\0';
+
+		fprintf(stderr, "[!] %s compile log :\n%s\n", name, buf);
+
+		free(buf);
+	}
+
+	if (orv != GL_TRUE) {
+		fprintf(stderr, "[!] Shader compilation failed (%s)\n", name);
+		glDeleteShader(shader);
+		return 0;
+	}
+
+	return shader;
+}
+
+
+struct gl_core *
+glc_alloc(void)
+{
+	struct gl_core *glc;
+	GLint orv;
+
+	/* Allocate structure */
+	glc = calloc(1, sizeof(struct gl_core));
+	if (!glc)
+		return NULL;
+
+	/* Program */
+	glc->vert = glc_load_shader(GL_VERTEX_SHADER,   NULL, "core_vert.glsl");
+	glc->frag = glc_load_shader(GL_FRAGMENT_SHADER, NULL, "core_prim.glsl");
+	if (!glc->vert || !glc->frag)
+		goto error;
+
+	glc->prog = glCreateProgram();
+
+	glAttachShader(glc->prog, glc->vert);
+	glAttachShader(glc->prog, glc->frag);
+
+	glBindAttribLocation(glc->prog, GLC_ATTR_COLOR, "in_color");
+	glBindAttribLocation(glc->prog, GLC_ATTR_POS,   "in_pos");
+	glBindAttribLocation(glc->prog, GLC_ATTR_UV,    "in_uv");
+
+	glLinkProgram(glc->prog);
+
+	glGetProgramiv(glc->prog, GL_LINK_STATUS, &orv);
+	if (orv != GL_TRUE) {
+		fprintf(stderr, "[!] Core profile primitives program link failed\n");
+		goto error;
+	}
+
+	glc->u_mvp     = glGetUniformLocation(glc->prog, "mvp");
+	glc->u_mode    = glGetUniformLocation(glc->prog, "mode");
+	glc->u_tex     = glGetUniformLocation(glc->prog, "tex");
+	glc->u_palette = glGetUniformLocation(glc->prog, "palette");
+
+	/* Frame geometry VAO */
+	glGenVertexArrays(1, &glc->vao);
+	glGenBuffers(1, &glc->vbo);
+
+	glBindVertexArray(glc->vao);
+	glc_vtx_pointers(glc->vbo);
+
+	glEnableVertexAttribArray(GLC_ATTR_COLOR);
+	glEnableVertexAttribArray(GLC_ATTR_POS);
+	glEnableVertexAttribArray(GLC_ATTR_UV);
+
+	/* External buffers VAOs, pointers are set at each draw */
+	glGenVertexArrays(1, &glc->vao_ext);
+
+	glBindVertexArray(glc->vao_ext);
+	glEnableVertexAttribArray(GLC_ATTR_POS);
+
+	glGenVertexArrays(1, &glc->vao_vtx);
+
+	glBindVertexArray(glc->vao_vtx);
+	glEnableVertexAttribArray(GLC_ATTR_COLOR);
+	glEnableVertexAttribArray(GLC_ATTR_POS);
+	glEnableVertexAttribArray(GLC_ATTR_UV);
+
+	glBindVertexArray(0);
+
+	return glc;
+
+error:
+	glc_free(glc);
+	return NULL;
+}
+
+void
+glc_free(struct gl_core *glc)
+{
+	/* Safety */
+	if (!glc)
+		return;
+
+	/* Release GL objects (0 is silently ignored) */
+	glDeleteVertexArrays(1, &glc->vao_vtx);
+	glDeleteVertexArrays(1, &glc->vao_ext);
+	glDeleteVertexArrays(1, &glc->vao);
+	glDeleteBuffers(1, &glc->vbo);
+
+	if (glc->prog)
+		glDeleteProgram(glc->prog);
+	if (glc->frag)
+		glDeleteShader(glc->frag);
+	if (glc->vert)
+		glDeleteShader(glc->vert);
+
+	/* Release structure */
+	free(glc->vtx);
+	free(glc);
+}
+
+
+void
+glc_reset(struct gl_core *glc)
+{
+	glc->n_vtx = 0;
+}
+
+int
+glc_count(const struct gl_core *glc)
+{
+	return glc->n_vtx;
+}
+
+void
+glc_quad(struct gl_core *glc, const float color[4],
+         float x0, float y0, float x1, float y1,
+         float u0, float v0, float u1, float v1)
+{
+	float *p = glc_alloc_vtx(glc, 6);
+	if (!p)
+		return;
+
+	p = glc_vtx(p, color, x0, y0, u0, v0);
+	p = glc_vtx(p, color, x1, y0, u1, v0);
+	p = glc_vtx(p, color, x1, y1, u1, v1);
+
+	p = glc_vtx(p, color, x0, y0, u0, v0);
+	p = glc_vtx(p, color, x1, y1, u1, v1);
+	p = glc_vtx(p, color, x0, y1, u0, v1);
+}
+
+void
+glc_line(struct gl_core *glc, const float color[4],
+         float x0, float y0, float x1, float y1)
+{
+	float *p = glc_alloc_vtx(glc, 2);
+	if (!p)
+		return;
+
+	p = glc_vtx(p, color, x0, y0, 0.0f, 0.0f);
+	p = glc_vtx(p, color, x1, y1, 0.0f, 0.0f);
+}
+
+void
+glc_upload(struct gl_core *glc)
+{
+	/* Orphan the previous frame data */
+	glBindBuffer(GL_ARRAY_BUFFER, glc->vbo);
+	glBufferData(GL_ARRAY_BUFFER,
+		glc->n_vtx * GLC_VTX_FLOATS * sizeof(float),
+		glc->vtx, GL_STREAM_DRAW);
+}
+
+
+void
+glc_use(struct gl_core *glc, enum glc_mode mode,
+        GLuint tex, const float *mvp)
+{
+	glUseProgram(glc->prog);
+
+	glUniformMatrix4fv(glc->u_mvp, 1, GL_FALSE, mvp);
+	glUniform1i(glc->u_mode, mode);
+
+	/* Texture unit 0: Font, Texture unit 1: Palette */
+	glUniform1i(glc->u_tex, 0);
+	glUniform1i(glc->u_palette, 1);
+
+	if (mode == GLC_MODE_PALETTE) {
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_1D, tex);
+		glActiveTexture(GL_TEXTURE0);
+	} else if (mode != GLC_MODE_FLAT) {
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, tex);
+	}
+}
+
+void
+glc_draw(struct gl_core *glc, GLenum prim, int first, int count)
+{
+	if (count <= 0)
+		return;
+
+	glBindVertexArray(glc->vao);
+	glDrawArrays(prim, first, count);
+	glBindVertexArray(0);
+}
+
+void
+glc_draw_vbo(struct gl_core *glc, GLuint vbo, GLenum prim,
+             int first, int count, const float color[4])
+{
+	if (count <= 0)
+		return;
+
+	glBindVertexArray(glc->vao_ext);
+
+	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+	glVertexAttribPointer(GLC_ATTR_POS, 2, GL_FLOAT, GL_FALSE, 0, 0);
+
+	/* Color and texture coordinates aren't arrays, use constant values */
+	glVertexAttrib4fv(GLC_ATTR_COLOR, color);
+	glVertexAttrib2f(GLC_ATTR_UV, 0.0f, 0.0f);
+
+	glDrawArrays(prim, first, count);
+
+	glBindVertexArray(0);
+}
+
+void
+glc_draw_vtx(struct gl_core *glc, GLuint vbo, GLenum prim,
+             int first, int count)
+{
+	if (count <= 0)
+		return;
+
+	glBindVertexArray(glc->vao_vtx);
+	glc_vtx_pointers(vbo);
+
+	glDrawArrays(prim, first, count);
+
+	glBindVertexArray(0);
+}
+
+
+void
+glc_mvp_ortho(float *mvp, float width, float height)
+{
+	/* Same as glOrtho(0, width, 0, height, -1, 1) */
+	memset(mvp, 0x00, 16 * sizeof(float));
+
+	mvp[ 0] =  2.0f / width;
+	mvp[ 5] =  2.0f / height;
+	mvp[10] = -1.0f;
+	mvp[12] = -1.0f;
+	mvp[13] = -1.0f;
+	mvp[15] =  1.0f;
+}
+
+void
+glc_mvp_affine(float *dst, const float *mvp,
+               float sx, float ox, float sy, float oy)
+{
+	int i;
+
+	/* dst = mvp * [ sx 0 0 ox ; 0 sy 0 oy ; 0 0 1 0 ; 0 0 0 1 ] */
+	for (i=0; i<4; i++) {
+		dst[ 0 + i] = mvp[0 + i] * sx;
+		dst[ 4 + i] = mvp[4 + i] * sy;
+		dst[ 8 + i] = mvp[8 + i];
+		dst[12 + i] = mvp[0 + i] * ox + mvp[4 + i] * oy + mvp[12 + i];
+	}
+}
+
+/*! @} */
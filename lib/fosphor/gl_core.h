@@ -0,0 +1,74 @@
+/*
+ * gl_core.h
+ *
+ * Core profile OpenGL primitives batching
+ *
+ * Copyright (C) 2013-2021 Sylvain Munaut
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+/*! \defgroup gl/core
+ *  @{
+ */
+
+/*! \file gl_core.h
+ *  \brief Core profile OpenGL primitives batching
+ */
+
+#include "gl_platform.h"
+
+
+/* Vertex attributes locations, shared by all the core profile programs.
+ * Vertices are 8 floats: color (4), position (2), texture coordinates (2),
+ * the same layout gl_font.c produces */
+#define GLC_ATTR_COLOR	0
+#define GLC_ATTR_POS	1
+#define GLC_ATTR_UV	2
+
+#define GLC_VTX_FLOATS	8
+
+struct gl_core;
+
+enum glc_mode
+{
+	GLC_MODE_FLAT,		/*!< Vertex color */
+	GLC_MODE_PALETTE,	/*!< 1D palette lookup at the v coordinate */
+	GLC_MODE_TEXT,		/*!< Font coverage texture (red channel) */
+	GLC_MODE_TEXT_LCD,	/*!< Font sub-pixel coverage texture (RGB) */
+};
+
+struct gl_core *glc_alloc(void);
+void glc_free(struct gl_core *glc);
+
+GLuint glc_load_shader(GLenum type, const char *prelude, const char *name);
+
+/* Geometry: collected for a whole frame and uploaded once */
+void glc_reset(struct gl_core *glc);
+int  glc_count(const struct gl_core *glc);
+
+void glc_quad(struct gl_core *glc, const float color[4],
+              float x0, float y0, float x1, float y1,
+              float u0, float v0, float u1, float v1);
+void glc_line(struct gl_core *glc, const float color[4],
+              float x0, float y0, float x1, float y1);
+
+void glc_upload(struct gl_core *glc);
+
+/* Drawing */
+void glc_use(struct gl_core *glc, enum glc_mode mode,
+             GLuint tex, const float *mvp);
+void glc_draw(struct gl_core *glc, GLenum prim, int first, int count);
+void glc_draw_vbo(struct gl_core *glc, GLuint vbo, GLenum prim,
+                  int first, int count, const float color[4]);
+void glc_draw_vtx(struct gl_core *glc, GLuint vbo, GLenum prim,
+                  int first, int count);
+
+/* Transforms (4x4 column major) */
+void glc_mvp_ortho(float *mvp, float width, float height);
+void glc_mvp_affine(float *dst, const float *mvp,
+                    float sx, float ox, float sy, float oy);
+
+
+/*! @} */
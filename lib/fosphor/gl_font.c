@@ -243,6 +243,9 @@ _glf_init_face(struct gl_font *glf)
 	if (glf->flags & GLF_FLG_LCD) {
 		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB,   glf->tex.width, glf->tex.height, 0,
 				GL_RGB,  GL_UNSIGNED_BYTE,  data);
+	} else if (glf->flags & GLF_FLG_CORE) {
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_R8,    glf->tex.width, glf->tex.height, 0,
+				GL_RED,  GL_UNSIGNED_BYTE,  data);
 	} else {
 		glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, glf->tex.width, glf->tex.height, 0,
 				GL_ALPHA, GL_UNSIGNED_BYTE, data);
@@ -313,6 +316,9 @@ _glf_add_char(const struct gl_font *glf, float *data, char c, float x)
 	VTX(x,      0.0f, u0, v1);
 	VTX(x + cw, 0.0f, u1, v1);
 	VTX(x + cw, ch,   u1, v0);
+
+	VTX(x,      0.0f, u0, v1);
+	VTX(x + cw, ch,   u1, v0);
 	VTX(x,      ch,   u0, v0);
 
 	#undef VTX
@@ -331,27 +337,25 @@ glf_width_str(const struct gl_font *glf, const char *str)
 	return xb;
 }
 
-void
-glf_draw_str(const struct gl_font *glf,
-             float x, enum glf_align x_align,
-	     float y, enum glf_align y_align,
-	     const char *str)
+int
+glf_build_str(const struct gl_font *glf,
+              float x, enum glf_align x_align,
+              float y, enum glf_align y_align,
+              const char *str, float *data, int max_chars)
 {
-	float *data;
 	float xb, xofs, yofs;
-	int i;
-
-	/* Temporary buffer for vertex data */
-	data = malloc(8 * sizeof(float) * 4 * strlen(str));
+	int i, n;
 
 	/* Add chars to the buffer */
 	xb = 0.0f;
 
-	for (i=0; str[i]; i++) {
-		_glf_add_char(glf, &data[32*i], str[i], xb);
+	for (i=0; str[i] && (i < max_chars); i++) {
+		_glf_add_char(glf, &data[GLF_CHR_FLOATS*i], str[i], xb);
 		xb += (float)glf->glyphs[str[i] - GLF_MIN_CHR].advance_x;
 	}
 
+	n = i;
+
 	/* Align */
 	if (x_align == GLF_CENTER) {
 		xofs = x - roundf(xb / 2.0f);
@@ -373,11 +377,35 @@ glf_draw_str(const struct gl_font *glf,
 
 	yofs += (float) glf->glyph_bb.ofs_y;
 
-	for (i=0; i<4*strlen(str); i++) {
+	for (i=0; i<GLF_CHR_VTX*n; i++) {
 		data[8*i + 4] += xofs;
 		data[8*i + 5] += yofs;
 	}
 
+	return n;
+}
+
+GLuint
+glf_texture(const struct gl_font *glf)
+{
+	return glf->tex.id;
+}
+
+void
+glf_draw_str(const struct gl_font *glf,
+             float x, enum glf_align x_align,
+	     float y, enum glf_align y_align,
+	     const char *str)
+{
+	float *data;
+	int n;
+
+	/* Temporary buffer for vertex data */
+	data = malloc(GLF_CHR_FLOATS * sizeof(float) * strlen(str));
+
+	/* Add chars to the buffer */
+	n = glf_build_str(glf, x, x_align, y, y_align, str, data, strlen(str));
+
 	/* Draw */
 #if 1
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
@@ -390,14 +418,14 @@ glf_draw_str(const struct gl_font *glf,
 	glEnableClientState(GL_VERTEX_ARRAY);
 	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
 
-	glDrawArrays(GL_QUADS, 0,  4*strlen(str));
+	glDrawArrays(GL_TRIANGLES, 0, GLF_CHR_VTX*n);
 
 	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
 	glDisableClientState(GL_VERTEX_ARRAY);
 	glDisableClientState(GL_COLOR_ARRAY);
 #else
-        glBegin( GL_QUADS );
-	for (i=0; i<4*strlen(str); i++) {
+        glBegin( GL_TRIANGLES );
+	for (int i=0; i<GLF_CHR_VTX*n; i++) {
 		glColor4f(data[8*i + 0], data[8*i + 1], data[8*i + 2], data[8*i + 3]);
 		glTexCoord2f(data[8*i + 6], data[8*i + 7]);
 		glVertex2f(data[8*i + 4], data[8*i + 5]);
@@ -449,6 +477,29 @@ error:
 		free(buf);
 }
 
+void
+glf_draw_buffer(const struct gl_font *glf, GLuint vbo, int n_vtx)
+{
+	/* Vertices from glf_build_str() calls, already in a VBO */
+	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+
+	glColorPointer   (4, GL_FLOAT, 8 * sizeof(float), (void*)(0 * sizeof(float)));
+	glVertexPointer  (2, GL_FLOAT, 8 * sizeof(float), (void*)(4 * sizeof(float)));
+	glTexCoordPointer(2, GL_FLOAT, 8 * sizeof(float), (void*)(6 * sizeof(float)));
+
+	glEnableClientState(GL_COLOR_ARRAY);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+
+	glDrawArrays(GL_TRIANGLES, 0, n_vtx);
+
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glDisableClientState(GL_COLOR_ARRAY);
+
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
 void
 glf_begin(const struct gl_font *glf, float fg_color[3])
 {
@@ -17,6 +17,8 @@
  *  \brief Basic OpenGL font rendering
  */
 
+#include "gl_platform.h"
+
 #ifdef _MSC_VER
 # define ATTR_FORMAT(a,b,c)
 #else
@@ -27,6 +29,12 @@
 struct gl_font;
 
 #define GLF_FLG_LCD	(1 << 0)
+#define GLF_FLG_CORE	(1 << 1)	/* No GL_ALPHA texture (core profile) */
+
+/* glf_build_str() output: 2 triangles per char, vertices of 8 floats
+ * (color, position, texture coordinates) */
+#define GLF_CHR_VTX	6
+#define GLF_CHR_FLOATS	(GLF_CHR_VTX * 8)
 
 enum glf_align
 {
@@ -45,6 +53,13 @@ int glf_load_face_mem(struct gl_font *glf, const void *data, size_t len);
 
 float glf_width_str(const struct gl_font *glf, const char *str);
 
+int glf_build_str(const struct gl_font *glf,
+                  float x, enum glf_align x_align,
+                  float y, enum glf_align y_align,
+                  const char *str, float *data, int max_chars);
+GLuint glf_texture(const struct gl_font *glf);
+void glf_draw_buffer(const struct gl_font *glf, GLuint vbo, int n_vtx);
+
 void glf_draw_str(const struct gl_font *glf,
                   float x, enum glf_align x_align,
                   float y, enum glf_align y_align,
@@ -17,7 +17,9 @@
 
 #if defined(__APPLE__) || defined(MACOSX)
 # define GL_GLEXT_PROTOTYPES
+# define GL_DO_NOT_WARN_IF_MULTI_GL_VERSION_HEADERS_INCLUDED
 # include <OpenGL/gl.h>
+# include <OpenGL/gl3.h>	/* Core profile entry points (VAOs) */
 #elif defined(_WIN32)
 # include <GL/glew.h>
 #else
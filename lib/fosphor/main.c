@@ -28,6 +28,10 @@ struct app_state
 	FILE *src_fh;
 	void *src_buf;
 
+	int remote;		/* Source is display frames (-r) */
+	int frame_len;		/* Pending frame in src_buf */
+	int frame_max;
+
 	int w, h;
 
 	int db_ref, db_per_div_idx;
@@ -128,6 +132,86 @@ time_toc(const char *str)
 }
 
 
+static void
+time_profile(void)
+{
+	static const char *names[FOSPHOR_PROF_STAGES] = {
+		"upload", "fft", "display", "readback", "gl",
+	};
+	struct fosphor_profile prof;
+	int i;
+
+	if (fosphor_get_profile(g_as->fosphor, &prof))
+		return;
+
+	for (i=0; i<FOSPHOR_PROF_STAGES; i++)
+		fprintf(stderr, "  %-8s: %6d us avg, %6d us max\n", names[i],
+			(int)(prof.avg[i] * 1e6), (int)(prof.max[i] * 1e6));
+
+	fosphor_reset_profile(g_as->fosphor);
+}
+
+
+/* ------------------------------------------------------------------------ */
+/* Remote frames                                                            */
+/* ------------------------------------------------------------------------ */
+
+static int
+src_read(void *buf, int len)
+{
+	int o = 0;
+
+	while (o < len) {
+		int rc = fread((char*)buf + o, 1, len - o, g_as->src_fh);
+		if (rc <= 0) {
+			/* Files loop, streams end */
+			if (o || fseek(g_as->src_fh, 0, SEEK_SET))
+				return -EIO;
+			continue;
+		}
+		o += rc;
+	}
+
+	return 0;
+}
+
+/* Next frame of the stream into src_buf, allocated on the first one */
+static int
+remote_read_frame(struct fosphor_frame_info *fi)
+{
+	uint8_t hdr[48];
+	int len;
+
+	if (src_read(hdr, sizeof(hdr)))
+		return -EIO;
+
+	len = fosphor_frame_info(hdr, sizeof(hdr), fi);
+	if (len <= 0) {
+		fprintf(stderr, "[!] Invalid frame stream\n");
+		return -EINVAL;
+	}
+
+	if (!g_as->src_buf) {
+		g_as->frame_max = 48 + 16 + 2 * fi->width * (2 + fi->histo_rows + FOSPHOR_FRAME_WF_ROWS_MAX);
+		g_as->src_buf = malloc(g_as->frame_max);
+		if (!g_as->src_buf)
+			return -ENOMEM;
+	}
+
+	if (len > g_as->frame_max)
+		return -EINVAL;
+
+	memcpy(g_as->src_buf, hdr, sizeof(hdr));
+
+	if (src_read((char*)g_as->src_buf + sizeof(hdr), len - sizeof(hdr)))
+		return -EIO;
+
+	g_as->frame_len = len;
+
+	return 0;
+}
+
+
 /* ------------------------------------------------------------------------ */
 /* GLFW                                                                     */
 /* ------------------------------------------------------------------------ */
@@ -150,8 +234,12 @@ glfw_render(GLFWwindow *wnd)
 
 		t = time_toc("100 Frames time");
 
-		bw = (1e6f * FOSPHOR_FFT_LEN * BATCH_LEN * BATCH_COUNT) / ((float)t / 100.0f);
-		fprintf(stderr, "BW estimated: %f Msps\n", bw / 1e6);
+		if (!g_as->remote) {
+			bw = (1e6f * fosphor_get_fft_len(g_as->fosphor) * BATCH_LEN * BATCH_COUNT) / ((float)t / 100.0f);
+			fprintf(stderr, "BW estimated: %f Msps\n", bw / 1e6);
+		}
+
+		time_profile();
 	}
 
 	fc = (fc+1) % 100;
@@ -160,9 +248,20 @@ glfw_render(GLFWwindow *wnd)
 	glClearColor( 0.0f, 0.0f, 0.0f, 0.0f );
 	glClear(GL_COLOR_BUFFER_BIT);
 
+	/* Remote: display the next frame (paced by the source) */
+	if (g_as->remote) {
+		struct fosphor_frame_info fi;
+
+		if (g_as->frame_len || !remote_read_frame(&fi))
+			fosphor_load_frame(g_as->fosphor, g_as->src_buf, g_as->frame_len);
+		g_as->frame_len = 0;
+
+		goto draw;
+	}
+
 	/* Process some samples */
 	for (c=0; c<BATCH_COUNT; c++) {
-		r = sizeof(float) * 2 * FOSPHOR_FFT_LEN * BATCH_LEN;
+		r = sizeof(float) * 2 * fosphor_get_fft_len(g_as->fosphor) * BATCH_LEN;
 		o = 0;
 
 		while (r) {
@@ -179,10 +278,13 @@ glfw_render(GLFWwindow *wnd)
 			o += rc;
 		}
 
-		fosphor_process(g_as->fosphor, g_as->src_buf, FOSPHOR_FFT_LEN * BATCH_LEN);
+		fosphor_process(g_as->fosphor, g_as->src_buf, fosphor_get_fft_len(g_as->fosphor) * BATCH_LEN);
 	}
 
 	/* Draw fosphor */
+	fosphor_sync(g_as->fosphor);
+
+draw:
 	fosphor_draw(g_as->fosphor, &g_as->render_main);
 
 	if (g_as->zoom_enable)
@@ -344,7 +446,9 @@ glfw_init(void)
 
 #ifdef _WIN32
 	/* Init GLEW (on win32) */
+	glewExperimental = GL_TRUE;
 	glewInit();
+	glGetError();	/* Spurious GL_INVALID_ENUM from its GL_EXTENSIONS query */
 #endif
 
 	/* Disable VSync to test speed */
@@ -374,9 +478,18 @@ glfw_cleanup(GLFWwindow *wnd)
 
 int main(int argc, char *argv[])
 {
+	struct fosphor_options opts;
+	struct fosphor_frame_info fi;
 	GLFWwindow *wnd = NULL;
 	int rv;
 
+	/* Remote display of a frames stream (e.g. "nc host port | main -r") */
+	if ((argc > 1) && !strcmp(argv[1], "-r")) {
+		g_as->remote = 1;
+		argc--;
+		argv++;
+	}
+
 	/* Open source file */
 	if (argc == 2) {
 		g_as->src_fh = fopen(argv[1], "rb");
@@ -387,16 +500,21 @@ int main(int argc, char *argv[])
 	} else if (argc == 1) {
 		g_as->src_fh = stdin;
 	} else {
-		fprintf(stderr, "Usage: %s filename.cfile\n", argv[0]);
+		fprintf(stderr, "Usage: %s [-r] filename.cfile|frames\n", argv[0]);
 		return -EINVAL;;
 	}
 
-	g_as->src_buf = malloc(2 * sizeof(float) * FOSPHOR_FFT_LEN * FOSPHOR_FFT_MAX_BATCH);
-	if (!g_as->src_buf) {
-		rv = -ENOMEM;
-		goto error;
+	/* Remote instances are sized after the first frame */
+	if (g_as->remote)
+		rv = remote_read_frame(&fi);
+	else {
+		g_as->src_buf = malloc(2 * sizeof(float) * FOSPHOR_FFT_LEN_DEFAULT * FOSPHOR_FFT_MAX_BATCH);
+		rv = g_as->src_buf ? 0 : -ENOMEM;
 	}
 
+	if (rv)
+		goto error;
+
 	/* Init our state */
 	g_as->db_per_div_idx = 3;
 	g_as->db_ref = 0;
@@ -420,8 +538,17 @@ int main(int argc, char *argv[])
 		goto error;
 	}
 
-	/* Init fosphor */
-	g_as->fosphor = fosphor_init();
+	/* Init fosphor ($FOSPHOR_PROFILE for per stage device timings) */
+	fosphor_options_defaults(&opts);
+	opts.profiling = !!getenv("FOSPHOR_PROFILE");
+
+	if (g_as->remote) {
+		opts.remote     = 1;
+		opts.fft_len    = fi.width;
+		opts.histo_bins = fi.histo_rows;
+	}
+
+	g_as->fosphor = fosphor_init(&opts);
 	if (!g_as->fosphor) {
 		fprintf(stderr, "[!] Failed to initialize fosphor\n");
 		rv = -EIO;
@@ -430,6 +557,9 @@ int main(int argc, char *argv[])
 
 	fosphor_set_power_range(g_as->fosphor, g_as->db_ref, k_db_per_div[g_as->db_per_div_idx]);
 
+	if (g_as->remote)
+		fosphor_set_frequency_range(g_as->fosphor, fi.center, fi.span);
+
 	/* Run ! */
 	while (!glfwWindowShouldClose(wnd))
 	{
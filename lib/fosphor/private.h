@@ -17,39 +17,98 @@
  *  \brief Private fosphor definitions
  */
 
+#include <stdint.h>
+#include <string.h>
+
+#include "fosphor.h"
+
+/* Process wide state (context pool, resources) is under these locks where
+ * threads are available, else _init / _release must be serialized by the
+ * caller (see fosphor_init_parallel()) */
+#if defined(__unix__) || defined(__APPLE__)
+# include <pthread.h>
+# define FOSPHOR_HAVE_THREADS
+# define FOSPHOR_LOCK_DEFINE(l)	static pthread_mutex_t l = PTHREAD_MUTEX_INITIALIZER
+# define fosphor_lock(l)	pthread_mutex_lock(&(l))
+# define fosphor_unlock(l)	pthread_mutex_unlock(&(l))
+#else
+# define FOSPHOR_LOCK_DEFINE(l)	static int l
+# define fosphor_lock(l)	(void)(l)
+# define fosphor_unlock(l)	(void)(l)
+#endif
+
 
 #define FOSPHOR_FFT_LEN_LOG_DEFAULT	10
 #define FOSPHOR_FFT_LEN_DEFAULT		(1<<FOSPHOR_FFT_LEN_LOG_DEFAULT)
 
+#define FOSPHOR_FFT_LEN_MIN		512
+#define FOSPHOR_FFT_LEN_MAX		(1<<20)
+
 #define FOSPHOR_FFT_MULT_BATCH	16
 #define FOSPHOR_FFT_MAX_BATCH	1024
+#define FOSPHOR_FFT_MAX_SAMPLES	(1<<22)	/* Per batch, limits large FFTs */
 
-#define FOSPHOR_FFT_LEN_LOG	fosphor_fft_len_log_get()
-#define FOSPHOR_FFT_LEN		fosphor_fft_len_get()
+#define FOSPHOR_WF_DEPTH_DEFAULT	1024
+#define FOSPHOR_WF_DEPTH_MIN		128
+#define FOSPHOR_WF_DEPTH_MAX		(1<<16)
 
-int fosphor_fft_len_log_get(void);
-int fosphor_fft_len_get(void);
-void fosphor_fft_len_set(int len);
-int fosphor_fft_len_validate(int len);
+#define FOSPHOR_HISTO_BINS_DEFAULT	128
+#define FOSPHOR_HISTO_BINS_MIN		64
+#define FOSPHOR_HISTO_BINS_MAX		512
 
 struct fosphor_cl_state;
+struct fosphor_cpu_state;
 struct fosphor_gl_state;
+struct fosphor_frame_dec;
 
 struct fosphor
 {
 	struct fosphor_cl_state *cl;
+	struct fosphor_cpu_state *cpu;		/* Instead of cl, no usable device */
 	struct fosphor_gl_state *gl;
+	struct fosphor_frame_dec *remote;	/* Remote display (no CL) */
 
 #define FLG_FOSPHOR_USE_CLGL_SHARING	(1<<0)
+#define FLG_FOSPHOR_HALF		(1<<1)	/* Waterfall & histogram in half floats */
 	int flags;
 
-	float *fft_win;
-	int fft_len;
+	struct fosphor_options opts;
 
-	float *img_waterfall;
-	float *img_histogram;
+	float *fft_win;
+	int fft_len;		/* Displayed bins (all channels) */
+	int fft_len_log;
+	int fft_hop;		/* Samples between windows (fft_len / overlap) */
+	int fft_max_batch;	/* Spectra per process call at most */
+
+	int channels;		/* Inputs, each an FFT of chan_len in the row */
+	int chan_len;
+	int chan_len_log;
+
+	int wf_depth;		/* Waterfall rows (power of 2) */
+	int avg_count;		/* FFTs per displayed spectrum */
+	int wf_decim;		/* Displayed spectra per waterfall row */
+	int histo_bins;		/* Histogram power bins (power of 2) */
+
+	int sample_size;	/* Bytes per input sample */
+	float sample_scale;	/* Integer inputs to full scale, in the window */
+
+	void *img_waterfall;	/* float, or uint16_t half with FLG_FOSPHOR_HALF, */
+	void *img_histogram;	/* use fosphor_img_{get,set}() */
+	int img_size;		/* Bytes per value of those */
+	int img_len;		/* Their columns (fft_len >> img_red) */
+	int img_red;		/* log2(bins reduced into each column) */
 	float *buf_spectrum;
 
+	struct {
+		int start;	/* First waterfall row updated by last sync */
+		int len;	/* Number of rows (wraps around wf_depth) */
+	} wf_dirty;
+
+	struct fosphor_wf_freq {
+		double center;	/* Frequency range when the row was written */
+		double span;	/* (0 = never written) */
+	} *wf_freq;
+
 	struct {
 		int db_ref;
 		int db_per_div;
@@ -64,4 +123,94 @@ struct fosphor
 };
 
 
+/* IEEE half floats, round to nearest even */
+static inline uint16_t
+fosphor_float_to_half(float f)
+{
+	uint32_t x, sign, h, rem, s;
+
+	memcpy(&x, &f, sizeof(x));
+	sign = (x >> 16) & 0x8000;
+	x &= 0x7fffffff;
+
+	if (x >= 0x7f800000)		/* Inf / NaN */
+		return sign | 0x7c00 | ((x > 0x7f800000) ? 0x200 : 0);
+
+	if (x >= 0x477ff000)		/* Rounds above 65504 */
+		return sign | 0x7c00;
+
+	if (x < 0x38800000) {		/* Denormal, or zero */
+		if (x < 0x33000000)
+			return sign;
+
+		s = 126 - (x >> 23);
+		x = (x & 0x7fffff) | 0x800000;
+		h = x >> s;
+		rem = x & ((1u << s) - 1);
+
+		if ((rem > (1u << (s - 1))) || ((rem == (1u << (s - 1))) && (h & 1)))
+			h++;
+
+		return sign | h;
+	}
+
+	h = (x - 0x38000000) >> 13;
+	rem = x & 0x1fff;
+
+	if ((rem > 0x1000) || ((rem == 0x1000) && (h & 1)))
+		h++;
+
+	return sign | h;
+}
+
+static inline float
+fosphor_half_to_float(uint16_t h)
+{
+	uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+	uint32_t e = (h >> 10) & 0x1f;
+	uint32_t m = h & 0x3ff;
+	uint32_t x;
+	float f;
+
+	if (e == 0x1f)
+		x = sign | 0x7f800000 | (m << 13);
+	else if (e)
+		x = sign | ((e + 112) << 23) | (m << 13);
+	else if (m)
+		return sign ? -(m / 16777216.0f) : (m / 16777216.0f);
+	else
+		x = sign;
+
+	memcpy(&f, &x, sizeof(f));
+	return f;
+}
+
+/* Value i of a waterfall / histogram host copy */
+static inline float
+fosphor_img_get(const struct fosphor *self, const void *img, size_t i)
+{
+	if (self->flags & FLG_FOSPHOR_HALF)
+		return fosphor_half_to_float(((const uint16_t *)img)[i]);
+
+	return ((const float *)img)[i];
+}
+
+static inline void
+fosphor_img_set(const struct fosphor *self, void *img, size_t i, float v)
+{
+	if (self->flags & FLG_FOSPHOR_HALF)
+		((uint16_t *)img)[i] = fosphor_float_to_half(v);
+	else
+		((float *)img)[i] = v;
+}
+
+/* Back to full precision, when half floats aren't supported after all */
+static inline void
+fosphor_img_full(struct fosphor *self)
+{
+	self->flags &= ~FLG_FOSPHOR_HALF;
+	self->img_size = sizeof(float);
+}
+
+
 /*! @} */
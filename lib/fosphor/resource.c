@@ -22,6 +22,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "private.h"
 #include "resource.h"
 #include "resource_internal.h"
 
@@ -35,6 +36,7 @@ extern struct resource_pack __resources[];
 
 /*! \brief Loaded resources */
 static LLIST_HEAD(g_cache);
+FOSPHOR_LOCK_DEFINE(g_cache_lock);
 
 
 /* ------------------------------------------------------------------------ */
@@ -239,22 +241,30 @@ const void *
 resource_get(const char *name, int *len)
 {
 	struct resource_cache *rc;
+	const void *data = NULL;
 
-	/* Search the cache */
+	fosphor_lock(g_cache_lock);
+
+	/* Search the cache (each user holds a reference) */
 	rc = _rc_find_by_name(name);
-	if (rc)
+	if (rc) {
+		_rc_get(rc);
 		goto done;
+	}
 
 	/* No such luck ? Need a new entry */
 	rc = _rc_get_new(name);
-	if (!rc)
-		return NULL;
 
 done:
-	if (rc && len)
-		*len = rc->len;
+	if (rc) {
+		data = rc->data;
+		if (len)
+			*len = rc->len;
+	}
+
+	fosphor_unlock(g_cache_lock);
 
-	return rc ? rc->data : NULL;
+	return data;
 }
 
 void
@@ -262,13 +272,16 @@ resource_put(const void *r)
 {
 	struct resource_cache *rc;
 
+	fosphor_lock(g_cache_lock);
+
 	/* Search the cache */
 	rc = _rc_find_by_data(r);
-	if (!rc)
-		return;
 
 	/* We're done with it */
-	_rc_put(rc);
+	if (rc)
+		_rc_put(rc);
+
+	fosphor_unlock(g_cache_lock);
 }
 
 /*! @} */
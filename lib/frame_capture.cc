@@ -0,0 +1,358 @@
+/* -*- c++ -*- */
+/*
+ * Copyright 2013-2021 Sylvain Munaut <tnt@246tNt.com>
+ *
+ * This file is part of gr-fosphor
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gnuradio/thread/thread.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+# include <signal.h>
+# define CAP_HAVE_SIGMASK
+#endif
+
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+
+#include <stdexcept>
+
+#include "frame_capture.h"
+
+#ifdef ENABLE_GLEW
+# include <GL/glew.h>
+#endif
+
+extern "C" {
+#include "fosphor/gl_platform.h"
+}
+
+/* Asynchronous readback needs PBOs and fences, else read synchronously */
+#if defined(GL_PIXEL_PACK_BUFFER) && defined(GL_SYNC_GPU_COMMANDS_COMPLETE)
+# define CAP_HAVE_ASYNC
+#endif
+
+#ifdef _WIN32
+# define popen	_popen
+# define pclose	_pclose
+#endif
+
+namespace gr {
+  namespace fosphor {
+
+/* Reads in flight, and frames waiting to be written */
+#define CAP_SLOTS	3
+#define CAP_QUEUE	8
+
+
+frame_capture::frame_capture(const std::string &target, double fps) :
+	d_target(target), d_fps(fps),
+	d_slots(CAP_SLOTS), d_slot_rp(0), d_slot_wp(0),
+	d_tick_grab(-1), d_tick_queued(-1),
+	d_queue(CAP_QUEUE), d_rp(0), d_wp(0), d_used(0), d_stop(false),
+	d_fh(NULL), d_pipe(!target.empty() && (target[0] == '|')),
+	d_frames(0), d_dropped(0), d_failed(false)
+{
+	/* Output: file or encoder command */
+	if (this->d_pipe)
+		this->d_fh = popen(target.c_str() + 1, "w");
+	else
+		this->d_fh = fopen(target.c_str(), "wb");
+
+	if (!this->d_fh)
+		throw std::runtime_error("Unable to open capture " + target + ": " + strerror(errno));
+
+	/* Readback buffers (allocated at the first frame) */
+	for (auto &s : this->d_slots) {
+		s.pbo   = 0;
+		s.fence = NULL;
+		s.size  = 0;
+#ifdef CAP_HAVE_ASYNC
+		glGenBuffers(1, &s.pbo);
+#endif
+	}
+
+	/* Start writing */
+	this->d_thread = gr::thread::thread(_io_thread, this);
+}
+
+frame_capture::~frame_capture()
+{
+	/* Reads in flight still make it to the output */
+	this->collect(true);
+
+#ifdef CAP_HAVE_ASYNC
+	for (auto &s : this->d_slots)
+		glDeleteBuffers(1, &s.pbo);
+#endif
+
+	/* Let the writer thread empty the queue */
+	{
+		gr::thread::scoped_lock lock(this->d_mutex);
+		this->d_stop = true;
+	}
+	this->d_cond.notify_one();
+
+	this->d_thread.join();
+
+	/* Waits for the encoder to finish */
+	if (this->d_pipe)
+		pclose(this->d_fh);
+	else
+		fclose(this->d_fh);
+}
+
+
+void
+frame_capture::_io_thread(frame_capture *obj)
+{
+	obj->io_thread();
+}
+
+void
+frame_capture::io_thread()
+{
+	std::vector<uint8_t> line;
+
+#ifdef CAP_HAVE_SIGMASK
+	/* An encoder exiting is a write error, not a SIGPIPE for the process */
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+#endif
+
+	while (true)
+	{
+		const struct qframe *f;
+
+		{
+			gr::thread::scoped_lock lock(this->d_mutex);
+
+			while (!this->d_used && !this->d_stop)
+				this->d_cond.wait(lock);
+
+			if (!this->d_used)
+				break;
+
+			f = &this->d_queue[this->d_rp];
+		}
+
+		/* Out of the lock, the producer only touches free entries */
+		if (!this->d_failed && !this->write_frame(*f, line))
+			this->d_failed = true;
+
+		if (this->d_failed)
+			this->d_dropped++;
+
+		{
+			gr::thread::scoped_lock lock(this->d_mutex);
+
+			this->d_rp = (this->d_rp + 1) % this->d_queue.size();
+			this->d_used--;
+		}
+	}
+
+	fflush(this->d_fh);
+}
+
+bool
+frame_capture::write_frame(const struct qframe &f, std::vector<uint8_t> &line)
+{
+	line.resize(3 * f.width);
+
+	for (int n=0; n<f.repeat; n++)
+	{
+		/* PPM rows go top down, GL ones bottom up */
+		if (fprintf(this->d_fh, "P6\n%d %d\n255\n", f.width, f.height) < 0)
+			return false;
+
+		for (int y=f.height-1; y>=0; y--) {
+			const uint8_t *src = &f.data[(size_t)y * f.width * 4];
+
+			for (int x=0; x<f.width; x++) {
+				line[3*x+0] = src[4*x+0];
+				line[3*x+1] = src[4*x+1];
+				line[3*x+2] = src[4*x+2];
+			}
+
+			if (fwrite(line.data(), 1, line.size(), this->d_fh) != line.size())
+				return false;
+		}
+
+		this->d_frames++;
+	}
+
+	return true;
+}
+
+
+struct frame_capture::qframe *
+frame_capture::queue_prepare()
+{
+	gr::thread::scoped_lock lock(this->d_mutex);
+
+	if (this->d_used == (int)this->d_queue.size()) {
+		this->d_dropped++;
+		return NULL;
+	}
+
+	return &this->d_queue[this->d_wp];
+}
+
+void
+frame_capture::queue_commit(int64_t tick)
+{
+	struct qframe &f = this->d_queue[this->d_wp];
+
+	/* Covers the periods since the previous one */
+	f.repeat = (this->d_tick_queued < 0) ? 1 : (int)(tick - this->d_tick_queued);
+	this->d_tick_queued = tick;
+
+	{
+		gr::thread::scoped_lock lock(this->d_mutex);
+
+		this->d_wp = (this->d_wp + 1) % this->d_queue.size();
+		this->d_used++;
+	}
+
+	this->d_cond.notify_one();
+}
+
+/* Hand over the completed reads, in order. Only blocks if wait is set */
+void
+frame_capture::collect(bool wait)
+{
+#ifdef CAP_HAVE_ASYNC
+	while (true)
+	{
+		struct slot &s = this->d_slots[this->d_slot_rp];
+		struct qframe *f;
+		GLenum rv;
+
+		if (!s.fence)
+			break;
+
+		rv = glClientWaitSync((GLsync)s.fence,
+			wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0,
+			wait ? 1000000000 : 0);
+
+		if ((rv == GL_ALREADY_SIGNALED) || (rv == GL_CONDITION_SATISFIED))
+		{
+			f = this->queue_prepare();
+			if (f) {
+				const uint8_t *p;
+
+				glBindBuffer(GL_PIXEL_PACK_BUFFER, s.pbo);
+				p = (const uint8_t *) glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+				if (p) {
+					f->data.assign(p, p + (size_t)s.width * s.height * 4);
+					f->width  = s.width;
+					f->height = s.height;
+					glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+					this->queue_commit(s.tick);
+				} else {
+					this->d_dropped++;
+				}
+				glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			}
+		}
+		else if (!wait)
+		{
+			/* Not done yet, retry next frame */
+			break;
+		}
+		else
+		{
+			this->d_dropped++;
+		}
+
+		glDeleteSync((GLsync)s.fence);
+		s.fence = NULL;
+
+		this->d_slot_rp = (this->d_slot_rp + 1) % this->d_slots.size();
+	}
+#endif
+}
+
+
+void
+frame_capture::frame(int width, int height)
+{
+	typedef std::chrono::steady_clock clock;
+	clock::time_point now = clock::now();
+	int64_t tick;
+
+	if (this->d_failed || (width <= 0) || (height <= 0))
+		return;
+
+	/* Earlier reads the GPU is done with */
+	this->collect(false);
+
+	/* At most one frame per period */
+	if (this->d_fps > 0.0) {
+		if (this->d_tick_grab < 0)
+			this->d_t0 = now;
+
+		tick = (int64_t)floor(std::chrono::duration<double>(now - this->d_t0).count() * this->d_fps);
+		if (tick <= this->d_tick_grab)
+			return;
+	} else {
+		tick = this->d_tick_grab + 1;
+	}
+
+	this->d_tick_grab = tick;
+
+#ifdef CAP_HAVE_ASYNC
+	struct slot &s = this->d_slots[this->d_slot_wp];
+	const size_t size = (size_t)width * height * 4;
+
+	/* All reads still in flight */
+	if (s.fence) {
+		this->d_dropped++;
+		return;
+	}
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, s.pbo);
+
+	if (s.size != size) {
+		glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+		s.size = size;
+	}
+
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, (void *)0);
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	s.fence  = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	s.width  = width;
+	s.height = height;
+	s.tick   = tick;
+
+	this->d_slot_wp = (this->d_slot_wp + 1) % this->d_slots.size();
+#else
+	struct qframe *f = this->queue_prepare();
+	if (!f)
+		return;
+
+	f->data.resize((size_t)width * height * 4);
+	f->width  = width;
+	f->height = height;
+
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, f->data.data());
+
+	this->queue_commit(tick);
+#endif
+}
+
+  } /* namespace fosphor */
+} /* namespace gr */
@@ -0,0 +1,113 @@
+/* -*- c++ -*- */
+/*
+ * Copyright 2013-2021 Sylvain Munaut <tnt@246tNt.com>
+ *
+ * This file is part of gr-fosphor
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <gnuradio/fosphor/api.h>
+
+#include <gnuradio/thread/thread.h>
+
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+namespace gr {
+  namespace fosphor {
+
+   /*!
+    * \brief Rendered frames capture
+    *
+    * Each frame() (GL context current, after the draw and before the
+    * swap) starts an asynchronous read of the framebuffer into the next
+    * pixel buffer object of a small ring, and collects the previous reads
+    * the GPU has completed. Nothing waits on the GPU, a frame finding the
+    * ring or the queue full is dropped.
+    *
+    * A background thread writes the collected frames as a stream of
+    * binary PPM images to a file, or to an external encoder command when
+    * the target starts with '|' (e.g. "|ffmpeg -f image2pipe -c:v ppm
+    * -framerate 25 -i - out.mp4"). Frames are taken at most at the
+    * configured rate and repeated over the periods nothing was drawn
+    * (or dropped), so the stream plays back in real time at that rate.
+    */
+   class GR_FOSPHOR_API frame_capture
+   {
+    private:
+     const std::string d_target;
+     const double d_fps;		/* <= 0: every drawn frame */
+
+     /* Readback ring, in the GL context */
+     struct slot {
+       unsigned int pbo;
+       void *fence;			/* Read issued when set */
+       size_t size;			/* Buffer allocation */
+       int width, height;
+       int64_t tick;
+     };
+
+     std::vector<struct slot> d_slots;
+     int d_slot_rp;			/* Oldest read in flight */
+     int d_slot_wp;			/* Next free */
+
+     std::chrono::steady_clock::time_point d_t0;
+     int64_t d_tick_grab;		/* Last period taken */
+     int64_t d_tick_queued;		/* Last period queued */
+
+     /* Queue of frames to write (RGBA, bottom row first) */
+     struct qframe {
+       std::vector<uint8_t> data;
+       int width, height;
+       int repeat;
+     };
+
+     std::vector<struct qframe> d_queue;
+     int d_rp;			/* Writer thread */
+     int d_wp;			/* Producer */
+     int d_used;
+
+     gr::thread::mutex d_mutex;
+     gr::thread::condition_variable d_cond;
+     bool d_stop;
+
+     FILE *d_fh;
+     bool d_pipe;
+
+     std::atomic<uint64_t> d_frames;
+     std::atomic<uint64_t> d_dropped;
+     std::atomic<bool> d_failed;
+
+     gr::thread::thread d_thread;
+
+     void io_thread();
+     static void _io_thread(frame_capture *obj);
+     bool write_frame(const struct qframe &f, std::vector<uint8_t> &line);
+
+     struct qframe *queue_prepare();
+     void queue_commit(int64_t tick);
+     void collect(bool wait);
+
+    public:
+     frame_capture(const std::string &target, double fps);
+     ~frame_capture();			/* GL context current */
+
+     const std::string &target() const { return this->d_target; }
+     double fps() const { return this->d_fps; }
+
+     uint64_t frames() const { return this->d_frames.load(); }	/* Written, with repeats */
+     uint64_t dropped() const { return this->d_dropped.load(); }
+     bool failed() const { return this->d_failed.load(); }	/* Write error, stopped */
+
+     void frame(int width, int height);
+   };
+
+  } // namespace fosphor
+} // namespace gr
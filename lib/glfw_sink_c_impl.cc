@@ -21,13 +21,13 @@ namespace gr {
   namespace fosphor {
 
 glfw_sink_c::sptr
-glfw_sink_c::make()
+glfw_sink_c::make(input_format_t format, int channels)
 {
-	return gnuradio::get_initial_sptr(new glfw_sink_c_impl());
+	return gnuradio::get_initial_sptr(new glfw_sink_c_impl(format, channels));
 }
 
-glfw_sink_c_impl::glfw_sink_c_impl()
-  : base_sink_c("glfw_sink_c")
+glfw_sink_c_impl::glfw_sink_c_impl(input_format_t format, int channels)
+  : base_sink_c("glfw_sink_c", format, channels), base_sink_c_impl(false, format, channels)
 {
 	/* Nothing to do but super call */
 }
@@ -125,6 +125,13 @@ glfw_sink_c_impl::glfw_cb_mouse(int btn, int action, int mods)
 	this->execute_mouse_action(glfw_sink_c_impl::CLICK, x, y);
 }
 
+void
+glfw_sink_c_impl::glfw_cb_refresh()
+{
+	/* Damaged, the last frame needs to be drawn again */
+	this->cb_expose();
+}
+
 void
 glfw_sink_c_impl::_glfw_cb_reshape(GLFWwindow *wnd, int w, int h)
 {
@@ -146,19 +153,39 @@ glfw_sink_c_impl::_glfw_cb_mouse(GLFWwindow *wnd, int btn, int action, int mods)
 	sink->glfw_cb_mouse(btn, action, mods);
 }
 
-
 void
+glfw_sink_c_impl::_glfw_cb_refresh(GLFWwindow *wnd)
+{
+	glfw_sink_c_impl *sink = (glfw_sink_c_impl *) glfwGetWindowUserPointer(wnd);
+	sink->glfw_cb_refresh();
+}
+
+
+bool
 glfw_sink_c_impl::glctx_init()
 {
 	GLFWwindow *wnd;
 
+	this->d_window = NULL;
+
 	/* Init GLFW */
-	glfwInit();
+	if (!glfwInit())
+		return false;
+
+	/* Create window, prefer a core profile context (modern renderer)
+	 * but any will do */
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
 
-	/* Create window */
 	wnd = glfwCreateWindow(1024, 1024, "fosphor", NULL, NULL);
+	if (!wnd) {
+		glfwDefaultWindowHints();
+		wnd = glfwCreateWindow(1024, 1024, "fosphor", NULL, NULL);
+	}
 	if (!wnd)
-		return;
+		return false;
 
 	this->d_window = wnd;
 
@@ -169,9 +196,12 @@ glfw_sink_c_impl::glctx_init()
 	glfwSetFramebufferSizeCallback(wnd, _glfw_cb_reshape);
 	glfwSetKeyCallback(wnd, _glfw_cb_key);
 	glfwSetMouseButtonCallback(wnd, _glfw_cb_mouse);
+	glfwSetWindowRefreshCallback(wnd, _glfw_cb_refresh);
 
 	/* Force first reshape */
 	this->glfw_cb_reshape(-1, -1);
+
+	return true;
 }
 
 void
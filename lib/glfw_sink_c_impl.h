@@ -32,21 +32,23 @@ namespace gr {
       void glfw_cb_reshape(int w, int h);
       void glfw_cb_key(int key, int scancode, int action, int mods);
       void glfw_cb_mouse(int btn, int action, int mods);
+      void glfw_cb_refresh();
 
       static void _glfw_cb_reshape(GLFWwindow *wnd, int w, int h);
       static void _glfw_cb_key(GLFWwindow *wnd, int key, int scancode, int action, int mods);
       static void _glfw_cb_mouse(GLFWwindow *wnd, int btn, int action, int mods);
+      static void _glfw_cb_refresh(GLFWwindow *wnd);
 
      protected:
       /* Delegated implementation of GL context management */
-      void glctx_init();
+      bool glctx_init();
       void glctx_swap();
       void glctx_poll();
       void glctx_fini();
       void glctx_update();
 
      public:
-      glfw_sink_c_impl();
+      glfw_sink_c_impl(input_format_t format = INPUT_FC32, int channels = 1);
     };
 
   } // namespace fosphor
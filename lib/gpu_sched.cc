@@ -0,0 +1,174 @@
+/* -*- c++ -*- */
+/*
+ * Copyright 2013-2021 Sylvain Munaut <tnt@246tNt.com>
+ *
+ * This file is part of gr-fosphor
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <algorithm>
+
+#include "gpu_sched.h"
+
+namespace gr {
+  namespace fosphor {
+
+static std::mutex s_sched_mutex;
+static std::vector<std::weak_ptr<gpu_sched>> s_scheds;
+
+
+gpu_sched::gpu_sched(const void *device)
+  : d_device(device), d_owner(NULL), d_vtime(0.0)
+{
+}
+
+std::shared_ptr<gpu_sched>
+gpu_sched::get(const void *device)
+{
+	std::lock_guard<std::mutex> guard(s_sched_mutex);
+	std::shared_ptr<gpu_sched> sched;
+
+	s_scheds.erase(std::remove_if(s_scheds.begin(), s_scheds.end(),
+		[](const std::weak_ptr<gpu_sched> &w) { return w.expired(); }),
+		s_scheds.end());
+
+	for (auto &w : s_scheds) {
+		sched = w.lock();
+		if (sched && (sched->d_device == device))
+			return sched;
+	}
+
+	sched = std::make_shared<gpu_sched>(device);
+	s_scheds.push_back(sched);
+
+	return sched;
+}
+
+/* Next waiting client to serve (NULL if none) */
+const gpu_sched::client *
+gpu_sched::pick(clock::time_point now) const
+{
+	const client *best = NULL, *urgent = NULL;
+
+	for (const client *c : this->d_clients)
+	{
+		if (!c->d_waiting)
+			continue;
+
+		/* Would miss its deadline behind another batch */
+		if ((c->d_deadline > 0.0) &&
+		    (now + std::chrono::duration_cast<clock::duration>(
+				std::chrono::duration<double>(c->d_cost)) >= c->d_due) &&
+		    (!urgent || (c->d_due < urgent->d_due)))
+			urgent = c;
+
+		if (!best || (c->d_vtime < best->d_vtime))
+			best = c;
+	}
+
+	return urgent ? urgent : best;
+}
+
+
+gpu_sched::client::client(std::shared_ptr<gpu_sched> sched,
+                          double weight, double deadline)
+  : d_sched(sched),
+    d_weight((weight > 0.0) ? weight : 1.0),
+    d_deadline((deadline > 0.0) ? deadline : 0.0),
+    d_vtime(0.0), d_cost(0.0), d_gpu_time(0.0), d_batches(0),
+    d_waiting(false)
+{
+	std::lock_guard<std::mutex> guard(this->d_sched->d_mutex);
+
+	this->d_vtime = this->d_sched->d_vtime;
+	this->d_sched->d_clients.push_back(this);
+}
+
+gpu_sched::client::~client()
+{
+	std::lock_guard<std::mutex> guard(this->d_sched->d_mutex);
+	std::vector<client *> &clients = this->d_sched->d_clients;
+
+	clients.erase(std::remove(clients.begin(), clients.end(), this), clients.end());
+
+	if (this->d_sched->d_owner == this)
+		this->d_sched->d_owner = NULL;
+
+	this->d_sched->d_cond.notify_all();
+}
+
+void
+gpu_sched::client::acquire()
+{
+	gpu_sched *s = this->d_sched.get();
+	std::unique_lock<std::mutex> guard(s->d_mutex);
+	clock::time_point now = clock::now();
+	clock::time_point urgent_at;
+
+	/* No credit for the time spent idle */
+	this->d_vtime   = std::max(this->d_vtime, s->d_vtime);
+	this->d_due     = now + std::chrono::duration_cast<clock::duration>(
+				std::chrono::duration<double>(this->d_deadline));
+	this->d_waiting = true;
+
+	/* When our next batch would start missing the deadline (see pick()) */
+	urgent_at = this->d_due - std::chrono::duration_cast<clock::duration>(
+				std::chrono::duration<double>(this->d_cost));
+
+	/* Besides releases and departures, the only change with time alone
+	 * is becoming urgent ourselves: wake up for that too */
+	while (s->d_owner || (s->pick(now) != this)) {
+		if ((this->d_deadline > 0.0) && (now < urgent_at))
+			s->d_cond.wait_until(guard, urgent_at);
+		else
+			s->d_cond.wait(guard);
+		now = clock::now();
+	}
+
+	this->d_waiting = false;
+	s->d_owner = this;
+}
+
+void
+gpu_sched::client::release(double gpu_time)
+{
+	gpu_sched *s = this->d_sched.get();
+	std::lock_guard<std::mutex> guard(s->d_mutex);
+
+	this->d_cost = this->d_batches ?
+		(0.9 * this->d_cost + 0.1 * gpu_time) : gpu_time;
+	this->d_gpu_time += gpu_time;
+	this->d_batches++;
+
+	this->d_vtime += gpu_time / this->d_weight;
+	s->d_vtime = this->d_vtime;
+
+	if (s->d_owner == this)
+		s->d_owner = NULL;
+
+	s->d_cond.notify_all();
+}
+
+const void *
+gpu_sched::client::device() const
+{
+	return this->d_sched->device();
+}
+
+double
+gpu_sched::client::gpu_time() const
+{
+	std::lock_guard<std::mutex> guard(this->d_sched->d_mutex);
+	return this->d_gpu_time;
+}
+
+unsigned long
+gpu_sched::client::batches() const
+{
+	std::lock_guard<std::mutex> guard(this->d_sched->d_mutex);
+	return this->d_batches;
+}
+
+  } /* namespace fosphor */
+} /* namespace gr */
@@ -0,0 +1,97 @@
+/* -*- c++ -*- */
+/*
+ * Copyright 2013-2021 Sylvain Munaut <tnt@246tNt.com>
+ *
+ * This file is part of gr-fosphor
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <gnuradio/fosphor/api.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace gr {
+  namespace fosphor {
+
+   /*!
+    * \brief Fair share of a compute device between the sinks using it
+    *
+    * One per device, shared by the instances that joined it. Each batch
+    * holds the device from its submission until it completed, so at most
+    * one instance has work queued at a time and the hold time is that
+    * batch's device time.
+    *
+    * The device goes to the waiting client with the least device time
+    * over its weight (virtual time), except that a client with a deadline
+    * that its next batch would miss waiting any longer is served first,
+    * earliest deadline first. Clients coming back from idle start at the
+    * current virtual time, they don't get a credit for it.
+    */
+   class GR_FOSPHOR_API gpu_sched
+   {
+    public:
+     typedef std::chrono::steady_clock clock;
+
+     class GR_FOSPHOR_API client
+     {
+       friend class gpu_sched;
+
+       std::shared_ptr<gpu_sched> d_sched;
+       const double d_weight;
+       const double d_deadline;		/* s, 0 = none */
+
+       /* Under the scheduler mutex */
+       double d_vtime;
+       double d_cost;			/* Rolling average per batch (s) */
+       double d_gpu_time;		/* Total (s) */
+       unsigned long d_batches;
+       bool d_waiting;
+       clock::time_point d_due;
+
+      public:
+       client(std::shared_ptr<gpu_sched> sched, double weight, double deadline);
+       ~client();
+
+       /* Blocks until it's this client's turn, must be followed by a
+        * release() with the device time used */
+       void acquire();
+       void release(double gpu_time);
+
+       const void *device() const;
+       double weight() const { return this->d_weight; }
+       double deadline() const { return this->d_deadline; }
+
+       double gpu_time() const;
+       unsigned long batches() const;
+     };
+
+    private:
+     const void *d_device;
+
+     std::mutex d_mutex;
+     std::condition_variable d_cond;	/* Releases and departures */
+     std::vector<client *> d_clients;
+     client *d_owner;
+     double d_vtime;			/* Of the last served client */
+
+     const client *pick(clock::time_point now) const;
+
+    public:
+     gpu_sched(const void *device);
+
+     /* The scheduler of that device, created on first use and gone with
+      * its last client */
+     static std::shared_ptr<gpu_sched> get(const void *device);
+
+     const void *device() const { return this->d_device; }
+   };
+
+  } // namespace fosphor
+} // namespace gr
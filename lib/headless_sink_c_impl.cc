@@ -0,0 +1,189 @@
+/* -*- c++ -*- */
+/*
+ * Copyright 2013-2021 Sylvain Munaut <tnt@246tNt.com>
+ *
+ * This file is part of gr-fosphor
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gnuradio/thread/thread.h>
+
+#include "headless_sink_c_impl.h"
+
+extern "C" {
+#include "fosphor/fosphor.h"
+}
+
+
+namespace gr {
+  namespace fosphor {
+
+headless_sink_c::sptr
+headless_sink_c::make(double rate, input_format_t format, int channels)
+{
+	return gnuradio::get_initial_sptr(new headless_sink_c_impl(rate, format, channels));
+}
+
+headless_sink_c_impl::headless_sink_c_impl(double rate, input_format_t format, int channels)
+  : base_sink_c("headless_sink_c", format, channels), base_sink_c_impl(true, format, channels),
+    d_frame_width(0), d_frame_enc(NULL), d_frame_enc_width(0)
+{
+	this->set_update_rate(rate);
+
+	/* Results ports */
+	message_port_register_out(pmt::mp("spectrum"));
+	message_port_register_out(pmt::mp("max_hold"));
+	message_port_register_out(pmt::mp("histogram"));
+	message_port_register_out(pmt::mp("frames"));
+}
+
+headless_sink_c_impl::~headless_sink_c_impl()
+{
+	fosphor_frame_enc_free(this->d_frame_enc);
+}
+
+
+/* Publications happen at the display updates, paced by the worker like
+ * the GL sinks frames */
+void
+headless_sink_c_impl::set_update_rate(const double rate)
+{
+	this->set_max_fps((rate > 0.0) ? rate : 1.0);
+}
+
+double
+headless_sink_c_impl::update_rate() const
+{
+	return this->max_fps();
+}
+
+void
+headless_sink_c_impl::set_frame_width(const int width)
+{
+	if (width && !fosphor_fft_len_validate(width))
+		return;
+
+	this->d_frame_width = width;
+}
+
+int
+headless_sink_c_impl::frame_width() const
+{
+	return this->d_frame_width;
+}
+
+
+bool
+headless_sink_c_impl::glctx_init()
+{
+	/* Nothing to do */
+	return true;
+}
+
+void
+headless_sink_c_impl::glctx_swap()
+{
+	/* Nothing to do */
+}
+
+void
+headless_sink_c_impl::glctx_poll()
+{
+	/* Nothing to do (paced by the worker, see set_update_rate()) */
+}
+
+void
+headless_sink_c_impl::glctx_fini()
+{
+	/* Nothing to do */
+}
+
+void
+headless_sink_c_impl::glctx_update()
+{
+	/* Nothing to do */
+}
+
+
+void
+headless_sink_c_impl::publish(const char *port, const std::vector<float> &data,
+                              pmt::pmt_t meta)
+{
+	message_port_pub(pmt::mp(port),
+		pmt::cons(meta, pmt::init_f32vector(data.size(), data)));
+}
+
+void
+headless_sink_c_impl::publish_frame(struct fosphor *fosphor)
+{
+	const int width = this->d_frame_width;
+	int len;
+
+	/* New width, new stream (starts with a key frame) */
+	if (width != this->d_frame_enc_width) {
+		fosphor_frame_enc_free(this->d_frame_enc);
+		this->d_frame_enc = width ? fosphor_frame_enc_alloc(width) : NULL;
+		this->d_frame_enc_width = width;
+	}
+
+	if (!this->d_frame_enc)
+		return;
+
+	this->d_frame_buf.resize(fosphor_frame_max_len(fosphor, this->d_frame_enc));
+
+	len = fosphor_frame_encode(fosphor, this->d_frame_enc,
+		this->d_frame_buf.data(), this->d_frame_buf.size());
+	if (len <= 0)
+		return;
+
+	message_port_pub(pmt::mp("frames"),
+		pmt::cons(pmt::PMT_NIL, pmt::init_u8vector(len, this->d_frame_buf.data())));
+}
+
+void
+headless_sink_c_impl::publish_results(struct fosphor *fosphor)
+{
+	const int fft_len = fosphor_get_fft_len(fosphor);
+	const int bins    = fosphor_get_histogram_bins(fosphor);
+	const int db_min  = this->d_db_ref - 10 * this->k_db_per_div[this->d_db_per_div_idx];
+	double center, span;
+	pmt::pmt_t meta;
+
+	/* Grab results */
+	this->d_live.resize(fft_len);
+	this->d_max_hold.resize(fft_len);
+	this->d_histo.resize(fft_len * bins);
+
+	if (fosphor_get_spectrum(fosphor, this->d_live.data(), this->d_max_hold.data(), fft_len) ||
+	    fosphor_get_histogram(fosphor, this->d_histo.data(), fft_len))
+		return;
+
+	/* Common meta data (range the results were computed with) */
+	this->displayed_frequency(fosphor, center, span);
+
+	meta = pmt::make_dict();
+	meta = pmt::dict_add(meta, pmt::mp("fft_size"), pmt::from_long(fft_len));
+	meta = pmt::dict_add(meta, pmt::mp("center"),   pmt::from_double(center));
+	meta = pmt::dict_add(meta, pmt::mp("span"),     pmt::from_double(span));
+	meta = pmt::dict_add(meta, pmt::mp("channels"), pmt::from_long(this->d_channels));
+	meta = pmt::dict_add(meta, pmt::mp("offset"),   pmt::from_uint64(this->nitems_read(0)));
+
+	this->publish("spectrum", this->d_live, meta);
+	this->publish("max_hold", this->d_max_hold, meta);
+
+	meta = pmt::dict_add(meta, pmt::mp("db_min"), pmt::from_long(db_min));
+	meta = pmt::dict_add(meta, pmt::mp("db_max"), pmt::from_long(this->d_db_ref));
+	meta = pmt::dict_add(meta, pmt::mp("bins"),   pmt::from_long(bins));
+
+	this->publish("histogram", this->d_histo, meta);
+
+	this->publish_frame(fosphor);
+}
+
+  } /* namespace fosphor */
+} /* namespace gr */
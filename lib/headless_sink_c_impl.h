@@ -0,0 +1,70 @@
+/* -*- c++ -*- */
+/*
+ * Copyright 2013-2021 Sylvain Munaut <tnt@246tNt.com>
+ *
+ * This file is part of gr-fosphor
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+#include <vector>
+
+#include <gnuradio/fosphor/headless_sink_c.h>
+
+#include "base_sink_c_impl.h"
+
+struct fosphor_frame_enc;
+
+namespace gr {
+  namespace fosphor {
+
+    /*!
+     * \brief Headless version of fosphor sink (implementation)
+     * \ingroup fosphor
+     */
+    class headless_sink_c_impl : public headless_sink_c, public base_sink_c_impl
+    {
+     private:
+      /* Results buffers */
+      std::vector<float> d_live;
+      std::vector<float> d_max_hold;
+      std::vector<float> d_histo;
+
+      /* Display frames (encoder state only used by the worker) */
+      std::atomic<int> d_frame_width;
+      struct fosphor_frame_enc *d_frame_enc;
+      int d_frame_enc_width;
+      std::vector<uint8_t> d_frame_buf;
+
+      void publish_frame(struct fosphor *fosphor);
+      void publish(const char *port, const std::vector<float> &data,
+                   pmt::pmt_t meta);
+
+     protected:
+      /* Delegated implementation of GL context management (none here) */
+      bool glctx_init();
+      void glctx_swap();
+      void glctx_poll();
+      void glctx_fini();
+      void glctx_update();
+
+      void publish_results(struct fosphor *fosphor);
+
+     public:
+      headless_sink_c_impl(double rate, input_format_t format = INPUT_FC32,
+                           int channels = 1);
+      ~headless_sink_c_impl();
+
+      void set_update_rate(const double rate);
+      double update_rate() const;
+
+      void set_frame_width(const int width);
+      int frame_width() const;
+    };
+
+  } // namespace fosphor
+} // namespace gr
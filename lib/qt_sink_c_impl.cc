@@ -19,7 +19,6 @@
 
 #include <QApplication>
 #include <QWidget>
-#include <QGLWidget>
 
 #include "QGLSurface.h"
 
@@ -28,13 +27,13 @@ namespace gr {
   namespace fosphor {
 
 qt_sink_c::sptr
-qt_sink_c::make(QWidget *parent)
+qt_sink_c::make(QWidget *parent, input_format_t format, int channels)
 {
-	return gnuradio::get_initial_sptr(new qt_sink_c_impl(parent));
+	return gnuradio::get_initial_sptr(new qt_sink_c_impl(parent, format, channels));
 }
 
-qt_sink_c_impl::qt_sink_c_impl(QWidget *parent)
-  : base_sink_c("qt_sink_c")
+qt_sink_c_impl::qt_sink_c_impl(QWidget *parent, input_format_t format, int channels)
+  : base_sink_c("qt_sink_c", format, channels), base_sink_c_impl(false, format, channels)
 {
 	/* QT stuff */
 	if(qApp != NULL) {
@@ -50,17 +49,21 @@ qt_sink_c_impl::qt_sink_c_impl(QWidget *parent)
 }
 
 
-void
+bool
 qt_sink_c_impl::glctx_init()
 {
-	this->d_gui->grabContext();
+	if (!this->d_gui->grabContext())
+		return false;
+
 	this->d_gui->setFocus();
+
+	return true;
 }
 
 void
 qt_sink_c_impl::glctx_swap()
 {
-	this->d_gui->swapBuffers();
+	this->d_gui->swapContext();
 }
 
 void
@@ -78,7 +81,15 @@ qt_sink_c_impl::glctx_fini()
 void
 qt_sink_c_impl::glctx_update()
 {
-	this->d_gui->makeCurrent();
+	this->d_gui->resizeContext(this->d_width, this->d_height);
+}
+
+bool
+qt_sink_c_impl::stop()
+{
+	/* The worker may still be waiting for the widget to be shown */
+	this->d_gui->abortGrab();
+	return base_sink_c_impl::stop();
 }
 
 
@@ -31,14 +31,17 @@ namespace gr {
 
      protected:
       /* Delegated implementation of GL context management */
-      void glctx_init();
+      bool glctx_init();
       void glctx_swap();
       void glctx_poll();
       void glctx_fini();
       void glctx_update();
 
      public:
-      qt_sink_c_impl(QWidget *parent=NULL);
+      qt_sink_c_impl(QWidget *parent=NULL, input_format_t format=INPUT_FC32,
+                     int channels=1);
+
+      bool stop();
 
       void exec_();
       QWidget* qwidget();
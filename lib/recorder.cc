@@ -0,0 +1,281 @@
+/* -*- c++ -*- */
+/*
+ * Copyright 2013-2021 Sylvain Munaut <tnt@246tNt.com>
+ *
+ * This file is part of gr-fosphor
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <gnuradio/thread/thread.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+# define REC_HAS_MMAP
+# include <errno.h>
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <unistd.h>
+#endif
+
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+
+#include "recorder.h"
+
+namespace gr {
+  namespace fosphor {
+
+/* Records file window mapped at once, and queue size (bytes, at least
+ * REC_QUEUE_MIN records) */
+#define REC_WINDOW	(64 * 1024 * 1024)
+#define REC_QUEUE	(32 * 1024 * 1024)
+#define REC_QUEUE_MIN	4
+
+static size_t
+page_size()
+{
+#ifdef REC_HAS_MMAP
+	return sysconf(_SC_PAGESIZE);
+#else
+	return 4096;
+#endif
+}
+
+static size_t
+page_round(size_t len)
+{
+	const size_t pg = page_size();
+	return (len + pg - 1) & ~(pg - 1);
+}
+
+static int64_t
+time_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+
+recorder::recorder(const std::string &path, int fft_size, int flags,
+                   int window, double center, double span) :
+	d_path(path), d_fft_size(fft_size), d_flags(flags),
+	d_record_size(sizeof(struct record_header) +
+		sizeof(float) * fft_size * (!!(flags & REC_LIVE) + !!(flags & REC_MAX_HOLD))),
+	d_fd(-1), d_hdr(NULL), d_win(NULL), d_win_ofs(0), d_win_len(0), d_file_len(0),
+	d_queue(NULL), d_queue_len(0), d_rp(0), d_wp(0), d_used(0), d_stop(false),
+	d_records(0), d_dropped(0), d_failed(false)
+{
+#ifdef REC_HAS_MMAP
+	const size_t hdr_len = page_round(4096);
+	void *m;
+
+	if (!(flags & (REC_LIVE | REC_MAX_HOLD)))
+		throw std::invalid_argument("Nothing selected for recording");
+
+	/* File & header */
+	this->d_fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (this->d_fd < 0)
+		throw std::runtime_error("Unable to open " + path + ": " + strerror(errno));
+
+	if (ftruncate(this->d_fd, hdr_len))
+		goto error;
+
+	m = mmap(NULL, hdr_len, PROT_READ | PROT_WRITE, MAP_SHARED, this->d_fd, 0);
+	if (m == MAP_FAILED)
+		goto error;
+
+	this->d_hdr = (struct file_header *) m;
+	this->d_file_len = hdr_len;
+
+	memcpy(this->d_hdr->magic, "FOSPHSPC", 8);
+	this->d_hdr->version     = 1;
+	this->d_hdr->header_size = hdr_len;
+	this->d_hdr->record_size = this->d_record_size;
+	this->d_hdr->fft_size    = fft_size;
+	this->d_hdr->flags       = flags;
+	this->d_hdr->window      = window;
+	this->d_hdr->center      = center;
+	this->d_hdr->span        = span;
+	this->d_hdr->start_time  = time_ns();
+	this->d_hdr->records     = 0;
+
+	/* Records window (always holds at least a whole record) and queue */
+	this->d_win_len = page_round(std::max((size_t)REC_WINDOW,
+		this->d_record_size + page_size()));
+
+	this->d_queue_len = std::max((int)(REC_QUEUE / this->d_record_size), REC_QUEUE_MIN);
+	this->d_queue = new char[this->d_queue_len * this->d_record_size];
+
+	/* Start writing */
+	this->d_thread = gr::thread::thread(_io_thread, this);
+
+	return;
+
+error:
+	int err = errno;
+
+	if (this->d_hdr)
+		munmap(this->d_hdr, hdr_len);
+	close(this->d_fd);
+
+	throw std::runtime_error("Unable to map " + path + ": " + strerror(err));
+#else
+	throw std::runtime_error("Spectrum recording is not supported on this platform");
+#endif
+}
+
+recorder::~recorder()
+{
+	/* Let the I/O thread write out what's queued */
+	{
+		gr::thread::scoped_lock lock(this->d_mutex);
+		this->d_stop = true;
+	}
+	this->d_cond.notify_one();
+
+	this->d_thread.join();
+
+#ifdef REC_HAS_MMAP
+	/* Don't leave the unused part of the last window in the file */
+	if (this->d_win)
+		munmap(this->d_win, this->d_win_len);
+
+	this->d_hdr->records = this->d_records.load();
+
+	if (ftruncate(this->d_fd, this->d_hdr->header_size + this->d_hdr->records * this->d_record_size))
+		this->d_failed = true;
+
+	msync(this->d_hdr, this->d_hdr->header_size, MS_SYNC);
+	munmap(this->d_hdr, this->d_hdr->header_size);
+
+	close(this->d_fd);
+#endif
+
+	delete[] this->d_queue;
+}
+
+
+void
+recorder::_io_thread(recorder *obj)
+{
+	obj->io_thread();
+}
+
+void
+recorder::io_thread()
+{
+	while (true)
+	{
+		const char *rec;
+
+		{
+			gr::thread::scoped_lock lock(this->d_mutex);
+
+			while (!this->d_used && !this->d_stop)
+				this->d_cond.wait(lock);
+
+			if (!this->d_used)
+				break;
+
+			rec = this->d_queue + this->d_rp * this->d_record_size;
+		}
+
+		/* Copy out of the lock, the producer only touches free slots */
+		if (!this->d_failed && !this->write_record(rec))
+			this->d_failed = true;
+
+		if (this->d_failed)
+			this->d_dropped++;
+
+		{
+			gr::thread::scoped_lock lock(this->d_mutex);
+
+			this->d_rp = (this->d_rp + 1) % this->d_queue_len;
+			this->d_used--;
+		}
+	}
+}
+
+bool
+recorder::write_record(const char *rec)
+{
+#ifdef REC_HAS_MMAP
+	const uint64_t pos = this->d_hdr->header_size + this->d_records.load() * this->d_record_size;
+
+	/* Move the window when the record doesn't fit, growing the file */
+	if (!this->d_win || (pos + this->d_record_size > this->d_win_ofs + this->d_win_len))
+	{
+		void *m;
+
+		if (this->d_win)
+			munmap(this->d_win, this->d_win_len);
+		this->d_win = NULL;
+
+		this->d_win_ofs = pos & ~((uint64_t)page_size() - 1);
+
+		if (this->d_win_ofs + this->d_win_len > this->d_file_len) {
+			if (ftruncate(this->d_fd, this->d_win_ofs + this->d_win_len))
+				return false;
+			this->d_file_len = this->d_win_ofs + this->d_win_len;
+		}
+
+		m = mmap(NULL, this->d_win_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+			this->d_fd, this->d_win_ofs);
+		if (m == MAP_FAILED)
+			return false;
+
+		this->d_win = (char *) m;
+	}
+
+	memcpy(this->d_win + (pos - this->d_win_ofs), rec, this->d_record_size);
+
+	/* Record complete, publish it */
+	this->d_hdr->records = ++this->d_records;
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+
+float *
+recorder::write_prepare()
+{
+	gr::thread::scoped_lock lock(this->d_mutex);
+
+	if (this->d_used == this->d_queue_len) {
+		this->d_dropped++;
+		return NULL;
+	}
+
+	return (float *)(this->d_queue + this->d_wp * this->d_record_size +
+		sizeof(struct record_header));
+}
+
+void
+recorder::write_commit(uint64_t offset, double center, double span)
+{
+	struct record_header *rh =
+		(struct record_header *)(this->d_queue + this->d_wp * this->d_record_size);
+
+	rh->offset = offset;
+	rh->time   = time_ns();
+	rh->center = center;
+	rh->span   = span;
+
+	{
+		gr::thread::scoped_lock lock(this->d_mutex);
+
+		this->d_wp = (this->d_wp + 1) % this->d_queue_len;
+		this->d_used++;
+	}
+
+	this->d_cond.notify_one();
+}
+
+  } /* namespace fosphor */
+} /* namespace gr */
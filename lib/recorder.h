@@ -0,0 +1,121 @@
+/* -*- c++ -*- */
+/*
+ * Copyright 2013-2021 Sylvain Munaut <tnt@246tNt.com>
+ *
+ * This file is part of gr-fosphor
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <gnuradio/fosphor/api.h>
+
+#include <gnuradio/thread/thread.h>
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+
+namespace gr {
+  namespace fosphor {
+
+   /*!
+    * \brief Append-only spectrum recording file
+    *
+    * The file is a header (struct file_header, padded to header_size)
+    * followed by fixed size records: a struct record_header then the
+    * selected spectra, fft_size floats each (dBFS, from -fs/2), live
+    * first. All values are in host byte order.
+    *
+    * Records are filled in a bounded in-memory queue by the caller, which
+    * never blocks (a full queue drops the record), and a background
+    * thread copies them into the file, mapped a window at a time. The
+    * header record count is updated as they land so the file of an
+    * interrupted recording stays readable.
+    */
+   class GR_FOSPHOR_API recorder
+   {
+    public:
+     enum {
+       REC_LIVE     = (1 << 0),	/*!< \brief Records hold the live spectrum */
+       REC_MAX_HOLD = (1 << 1),	/*!< \brief Records hold the max-hold spectrum */
+     };
+
+     struct file_header {
+       char     magic[8];	/* "FOSPHSPC" */
+       uint32_t version;	/* 1 */
+       uint32_t header_size;	/* Offset of the first record */
+       uint32_t record_size;	/* Bytes per record */
+       uint32_t fft_size;
+       uint32_t flags;		/* REC_??? */
+       int32_t  window;		/* gr::fft::window::win_type */
+       double   center;		/* Frequency range at start (Hz) */
+       double   span;
+       int64_t  start_time;	/* ns since the epoch */
+       uint64_t records;	/* Complete records in the file */
+     };
+
+     struct record_header {
+       uint64_t offset;		/* Input samples consumed by the sink */
+       int64_t  time;		/* ns since the epoch */
+       double   center;		/* Frequency range (Hz) */
+       double   span;
+     };
+
+    private:
+     const std::string d_path;
+     const int d_fft_size;
+     const int d_flags;
+     const size_t d_record_size;
+
+     /* File & mappings (header page, and a window for the records) */
+     int d_fd;
+     struct file_header *d_hdr;
+     char *d_win;
+     uint64_t d_win_ofs;
+     size_t d_win_len;
+     uint64_t d_file_len;
+
+     /* Queue of complete records (header + spectra) to write */
+     char *d_queue;
+     int d_queue_len;
+     int d_rp;			/* I/O thread */
+     int d_wp;			/* Producer */
+     int d_used;
+
+     gr::thread::mutex d_mutex;
+     gr::thread::condition_variable d_cond;
+     bool d_stop;
+
+     std::atomic<uint64_t> d_records;
+     std::atomic<uint64_t> d_dropped;
+     std::atomic<bool> d_failed;
+
+     gr::thread::thread d_thread;
+
+     void io_thread();
+     static void _io_thread(recorder *obj);
+     bool write_record(const char *rec);
+
+    public:
+     recorder(const std::string &path, int fft_size, int flags,
+              int window, double center, double span);
+     ~recorder();
+
+     const std::string &path() const { return this->d_path; }
+     int fft_size() const { return this->d_fft_size; }
+     int flags() const { return this->d_flags; }
+
+     uint64_t records() const { return this->d_records.load(); }
+     uint64_t dropped() const { return this->d_dropped.load(); }
+     bool failed() const { return this->d_failed.load(); }	/* I/O error, stopped */
+
+     /* Spectra area of the next record (live then max hold, as selected),
+      * NULL if the queue is full (the record is counted as dropped) */
+     float *write_prepare();
+     void write_commit(uint64_t offset, double center, double span);
+   };
+
+  } // namespace fosphor
+} // namespace gr
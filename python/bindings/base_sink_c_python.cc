@@ -7,6 +7,7 @@
  */
 
 #include <pybind11/complex.h>
+#include <pybind11/numpy.h>
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 
@@ -16,6 +17,16 @@ namespace py = pybind11;
 
 #define D(...) ""
 
+/* Read only NumPy view, the snapshot owning the data as base */
+static py::array
+snapshot_view(py::handle owner, const std::vector<float> &data,
+              std::vector<ssize_t> shape)
+{
+	py::array a(py::dtype::of<float>(), shape, data.data(), owner);
+	a.attr("setflags")(py::arg("write") = false);
+	return a;
+}
+
 void bind_base_sink_c(py::module& m)
 {
 	using base_sink_c = gr::fosphor::base_sink_c;
@@ -26,7 +37,6 @@ void bind_base_sink_c(py::module& m)
 		gr::basic_block,
 		std::shared_ptr<base_sink_c>> sink_class (m, "base_sink_c", D(base_sink_c));
 
-
 	py::enum_<base_sink_c::ui_action_t>(sink_class, "ui_action")
 	.value("DB_PER_DIV_UP",    base_sink_c::DB_PER_DIV_UP)
 	.value("DB_PER_DIV_DOWN",  base_sink_c::DB_PER_DIV_DOWN)
@@ -46,8 +56,78 @@ void bind_base_sink_c(py::module& m)
 	.value("CLICK",           base_sink_c::CLICK)
         .export_values();
 
+	py::enum_<base_sink_c::overflow_policy_t>(sink_class, "overflow_policy")
+	.value("OVERFLOW_BLOCK",       base_sink_c::OVERFLOW_BLOCK)
+	.value("OVERFLOW_DROP_NEWEST", base_sink_c::OVERFLOW_DROP_NEWEST)
+	.value("OVERFLOW_DROP_OLDEST", base_sink_c::OVERFLOW_DROP_OLDEST)
+        .export_values();
+
+	py::enum_<base_sink_c::input_format_t>(sink_class, "input_format")
+	.value("INPUT_FC32", base_sink_c::INPUT_FC32)
+	.value("INPUT_SC16", base_sink_c::INPUT_SC16)
+	.value("INPUT_SC8",  base_sink_c::INPUT_SC8)
+        .export_values();
+
+	py::enum_<base_sink_c::averaging_t>(sink_class, "averaging")
+	.value("AVG_MEAN", base_sink_c::AVG_MEAN)
+	.value("AVG_RMS",  base_sink_c::AVG_RMS)
+	.value("AVG_PEAK", base_sink_c::AVG_PEAK)
+        .export_values();
+
+	py::enum_<base_sink_c::max_hold_t>(sink_class, "max_hold")
+	.value("MAX_HOLD_DECAY",  base_sink_c::MAX_HOLD_DECAY)
+	.value("MAX_HOLD_NORMAL", base_sink_c::MAX_HOLD_NORMAL)
+	.value("MAX_HOLD_LIVE",   base_sink_c::MAX_HOLD_LIVE)
+	.value("MAX_HOLD_HISTO",  base_sink_c::MAX_HOLD_HISTO)
+        .export_values();
+
+	py::enum_<base_sink_c::trigger_action_t>(sink_class, "trigger_action")
+	.value("TRIGGER_FREEZE",  base_sink_c::TRIGGER_FREEZE)
+	.value("TRIGGER_CAPTURE", base_sink_c::TRIGGER_CAPTURE)
+        .export_values();
+
+	py::class_<base_sink_c::device_info>(sink_class, "device_info")
+		.def_readonly("selector",     &base_sink_c::device_info::selector)
+		.def_readonly("name",         &base_sink_c::device_info::name)
+		.def_readonly("vendor",       &base_sink_c::device_info::vendor)
+		.def_readonly("pci_id",       &base_sink_c::device_info::pci_id)
+		.def_readonly("gpu",          &base_sink_c::device_info::gpu)
+		.def_readonly("gl_sharing",   &base_sink_c::device_info::gl_sharing)
+		.def_readonly("host_unified", &base_sink_c::device_info::host_unified)
+		.def_readonly("local_mem",    &base_sink_c::device_info::local_mem)
+		.def_readonly("global_mem",   &base_sink_c::device_info::global_mem)
+		.def_readonly("score",        &base_sink_c::device_info::score)
+		;
+
+	py::class_<base_sink_c::snapshot_t,
+		std::shared_ptr<base_sink_c::snapshot_t>>(sink_class, "snapshot_t")
+		.def_readonly("seq",        &base_sink_c::snapshot_t::seq)
+		.def_readonly("offset",     &base_sink_c::snapshot_t::offset)
+		.def_readonly("center",     &base_sink_c::snapshot_t::center)
+		.def_readonly("span",       &base_sink_c::snapshot_t::span)
+		.def_readonly("fft_len",    &base_sink_c::snapshot_t::fft_len)
+		.def_readonly("histo_bins", &base_sink_c::snapshot_t::histo_bins)
+		.def_property_readonly("live", [](py::object self) {
+			auto &s = self.cast<base_sink_c::snapshot_t &>();
+			return snapshot_view(self, s.live, { s.fft_len });
+		})
+		.def_property_readonly("max_hold", [](py::object self) {
+			auto &s = self.cast<base_sink_c::snapshot_t &>();
+			return snapshot_view(self, s.max_hold, { s.fft_len });
+		})
+		.def_property_readonly("histogram", [](py::object self) {
+			auto &s = self.cast<base_sink_c::snapshot_t &>();
+			return snapshot_view(self, s.histogram, { s.histo_bins, s.fft_len });
+		})
+		;
+
 	py::implicitly_convertible<int, base_sink_c::ui_action_t>();
 	py::implicitly_convertible<int, base_sink_c::mouse_action_t>();
+	py::implicitly_convertible<int, base_sink_c::overflow_policy_t>();
+	py::implicitly_convertible<int, base_sink_c::input_format_t>();
+	py::implicitly_convertible<int, base_sink_c::averaging_t>();
+	py::implicitly_convertible<int, base_sink_c::max_hold_t>();
+	py::implicitly_convertible<int, base_sink_c::trigger_action_t>();
 
 	sink_class
 		.def("execute_ui_action",
@@ -83,6 +163,17 @@ void bind_base_sink_c(py::module& m)
 			D(base_sink_c,set_frequency_span)
 		)
 
+		.def("set_frequency_tags",
+			&base_sink_c::set_frequency_tags,
+			py::arg("enable"),
+			D(base_sink_c,set_frequency_tags)
+		)
+
+		.def("frequency_tags",
+			&base_sink_c::frequency_tags,
+			D(base_sink_c,frequency_tags)
+		)
+
 		.def("set_fft_window",
 			&base_sink_c::set_fft_window,
 			py::arg("win"),
@@ -95,5 +186,347 @@ void bind_base_sink_c(py::module& m)
 			D(base_sink_c,set_fft_size)
 		)
 
+		.def("set_overlap",
+			&base_sink_c::set_overlap,
+			py::arg("overlap"),
+			D(base_sink_c,set_overlap)
+		)
+
+		.def("overlap",
+			&base_sink_c::overlap,
+			D(base_sink_c,overlap)
+		)
+
+		.def("set_averaging",
+			&base_sink_c::set_averaging,
+			py::arg("count"),
+			py::arg("mode") = base_sink_c::AVG_MEAN,
+			py::arg("log_domain") = false,
+			D(base_sink_c,set_averaging)
+		)
+
+		.def("averaging",
+			&base_sink_c::averaging,
+			D(base_sink_c,averaging)
+		)
+
+		.def("set_waterfall_depth",
+			&base_sink_c::set_waterfall_depth,
+			py::arg("rows"),
+			D(base_sink_c,set_waterfall_depth)
+		)
+
+		.def("waterfall_depth",
+			&base_sink_c::waterfall_depth,
+			D(base_sink_c,waterfall_depth)
+		)
+
+		.def("set_waterfall_decimation",
+			&base_sink_c::set_waterfall_decimation,
+			py::arg("decim"),
+			D(base_sink_c,set_waterfall_decimation)
+		)
+
+		.def("waterfall_decimation",
+			&base_sink_c::waterfall_decimation,
+			D(base_sink_c,waterfall_decimation)
+		)
+
+		.def("set_max_hold",
+			&base_sink_c::set_max_hold,
+			py::arg("mode"),
+			D(base_sink_c,set_max_hold)
+		)
+
+		.def("max_hold",
+			&base_sink_c::max_hold,
+			D(base_sink_c,max_hold)
+		)
+
+		.def("set_persistence",
+			&base_sink_c::set_persistence,
+			py::arg("histo_rise") = 16.0f,
+			py::arg("histo_decay") = 1024.0f,
+			py::arg("live_alpha") = 0.002f,
+			D(base_sink_c,set_persistence)
+		)
+
+		.def("set_histogram_bins",
+			&base_sink_c::set_histogram_bins,
+			py::arg("bins"),
+			D(base_sink_c,set_histogram_bins)
+		)
+
+		.def("histogram_bins",
+			&base_sink_c::histogram_bins,
+			D(base_sink_c,histogram_bins)
+		)
+
+		.def("set_half_precision",
+			&base_sink_c::set_half_precision,
+			py::arg("enable"),
+			D(base_sink_c,set_half_precision)
+		)
+
+		.def("half_precision",
+			&base_sink_c::half_precision,
+			D(base_sink_c,half_precision)
+		)
+
+		.def("set_display_reduction",
+			&base_sink_c::set_display_reduction,
+			py::arg("enable"),
+			py::arg("mode") = base_sink_c::AVG_PEAK,
+			D(base_sink_c,set_display_reduction)
+		)
+
+		.def("display_width",
+			&base_sink_c::display_width,
+			D(base_sink_c,display_width)
+		)
+
+		.def("set_zoom_fft",
+			&base_sink_c::set_zoom_fft,
+			py::arg("enable"),
+			D(base_sink_c,set_zoom_fft)
+		)
+
+		.def("zoom_fft",
+			&base_sink_c::zoom_fft,
+			D(base_sink_c,zoom_fft)
+		)
+
+		.def("set_overflow_policy",
+			&base_sink_c::set_overflow_policy,
+			py::arg("policy"),
+			D(base_sink_c,set_overflow_policy)
+		)
+
+		.def("overflow_policy",
+			&base_sink_c::overflow_policy,
+			D(base_sink_c,overflow_policy)
+		)
+
+		.def("dropped_samples",
+			&base_sink_c::dropped_samples,
+			D(base_sink_c,dropped_samples)
+		)
+
+
+		.def("set_target_fps",
+			&base_sink_c::set_target_fps,
+			py::arg("fps"),
+			D(base_sink_c,set_target_fps)
+		)
+
+		.def("set_max_fps",
+			&base_sink_c::set_max_fps,
+			py::arg("fps"),
+			D(base_sink_c,set_max_fps)
+		)
+
+		.def("max_fps",
+			&base_sink_c::max_fps,
+			D(base_sink_c,max_fps)
+		)
+
+		.def("set_profiling",
+			&base_sink_c::set_profiling,
+			py::arg("enable"),
+			D(base_sink_c,set_profiling)
+		)
+
+		.def("profile",
+			&base_sink_c::profile,
+			D(base_sink_c,profile)
+		)
+
+		.def("set_detection",
+			&base_sink_c::set_detection,
+			py::arg("threshold"),
+			py::arg("max_peaks"),
+			D(base_sink_c,set_detection)
+		)
+
+		.def("detection_peaks",
+			&base_sink_c::detection_peaks,
+			D(base_sink_c,detection_peaks)
+		)
+
+		.def("set_trigger",
+			&base_sink_c::set_trigger,
+			py::arg("enable"),
+			py::arg("f_lo"),
+			py::arg("f_hi"),
+			py::arg("threshold"),
+			py::arg("action") = base_sink_c::TRIGGER_FREEZE,
+			py::arg("pre") = 0,
+			py::arg("post") = 0,
+			D(base_sink_c,set_trigger)
+		)
+
+		.def("trigger_count",
+			&base_sink_c::trigger_count,
+			D(base_sink_c,trigger_count)
+		)
+
+		.def("set_recording",
+			&base_sink_c::set_recording,
+			py::arg("path"),
+			py::arg("live") = true,
+			py::arg("max_hold") = false,
+			D(base_sink_c,set_recording)
+		)
+
+		.def("recording",
+			&base_sink_c::recording,
+			D(base_sink_c,recording)
+		)
+
+		.def("set_capture",
+			&base_sink_c::set_capture,
+			py::arg("target"),
+			py::arg("fps") = 25.0,
+			D(base_sink_c,set_capture)
+		)
+
+		.def("capture",
+			&base_sink_c::capture,
+			D(base_sink_c,capture)
+		)
+
+		.def("set_snapshots",
+			&base_sink_c::set_snapshots,
+			py::arg("enable"),
+			D(base_sink_c,set_snapshots)
+		)
+
+		.def("snapshots",
+			&base_sink_c::snapshots,
+			D(base_sink_c,snapshots)
+		)
+
+		.def("snapshot_seq",
+			&base_sink_c::snapshot_seq,
+			D(base_sink_c,snapshot_seq)
+		)
+
+		.def("snapshot",
+			&base_sink_c::snapshot,
+			D(base_sink_c,snapshot)
+		)
+
+		.def("set_fifo_high_water",
+			&base_sink_c::set_fifo_high_water,
+			py::arg("level"),
+			D(base_sink_c,set_fifo_high_water)
+		)
+
+		.def("fifo_fill",
+			&base_sink_c::fifo_fill,
+			D(base_sink_c,fifo_fill)
+		)
+
+		.def("set_worker_affinity",
+			&base_sink_c::set_worker_affinity,
+			py::arg("cpus"),
+			D(base_sink_c,set_worker_affinity)
+		)
+
+		.def("worker_affinity",
+			&base_sink_c::worker_affinity,
+			D(base_sink_c,worker_affinity)
+		)
+
+		.def("set_worker_priority",
+			&base_sink_c::set_worker_priority,
+			py::arg("priority"),
+			D(base_sink_c,set_worker_priority)
+		)
+
+		.def("worker_priority",
+			&base_sink_c::worker_priority,
+			D(base_sink_c,worker_priority)
+		)
+
+		.def("set_gpu_scheduling",
+			&base_sink_c::set_gpu_scheduling,
+			py::arg("enable"),
+			py::arg("weight") = 1.0,
+			py::arg("deadline") = 0.0,
+			D(base_sink_c,set_gpu_scheduling)
+		)
+
+		.def("gpu_scheduling",
+			&base_sink_c::gpu_scheduling,
+			D(base_sink_c,gpu_scheduling)
+		)
+
+		.def("gpu_time",
+			&base_sink_c::gpu_time,
+			D(base_sink_c,gpu_time)
+		)
+
+		.def("set_fifo_latency",
+			&base_sink_c::set_fifo_latency,
+			py::arg("sample_rate"),
+			py::arg("latency"),
+			D(base_sink_c,set_fifo_latency)
+		)
+
+		.def("fifo_size",
+			&base_sink_c::fifo_size,
+			D(base_sink_c,fifo_size)
+		)
+
+		.def("set_max_batch",
+			&base_sink_c::set_max_batch,
+			py::arg("spectra"),
+			D(base_sink_c,set_max_batch)
+		)
+
+		.def("max_batch",
+			&base_sink_c::max_batch,
+			D(base_sink_c,max_batch)
+		)
+
+		.def("memory_usage",
+			&base_sink_c::memory_usage,
+			D(base_sink_c,memory_usage)
+		)
+
+		.def("batch_size",
+			&base_sink_c::batch_size,
+			D(base_sink_c,batch_size)
+		)
+
+		.def("batch_count",
+			&base_sink_c::batch_count,
+			D(base_sink_c,batch_count)
+		)
+
+		.def("set_device",
+			&base_sink_c::set_device,
+			py::arg("selector"),
+			D(base_sink_c,set_device)
+		)
+
+		.def("device",
+			&base_sink_c::device,
+			D(base_sink_c,device)
+		)
+
+		.def_static("list_devices",
+			&base_sink_c::list_devices,
+			D(base_sink_c,list_devices)
+		)
+
+		.def_static("warmup",
+			&base_sink_c::warmup,
+			py::arg("device") = "",
+			py::arg("headless") = true,
+			D(base_sink_c,warmup)
+		)
+
 		;
 }
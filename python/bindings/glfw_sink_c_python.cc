@@ -28,6 +28,8 @@ void bind_glfw_sink_c(py::module& m)
 		std::shared_ptr<glfw_sink_c>>(m, "glfw_sink_c", D(glfw_sink_c))
 
 		.def(py::init(&glfw_sink_c::make),
+			py::arg("format") = gr::fosphor::base_sink_c::INPUT_FC32,
+			py::arg("channels") = 1,
 			D(glfw_sink_c,make)
 		)
 
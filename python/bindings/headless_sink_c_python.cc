@@ -0,0 +1,60 @@
+/*
+ * Copyright 2013-2021 Sylvain Munaut <tnt@246tNt.com>
+ *
+ * This file is part of gr-fosphor
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <pybind11/complex.h>
+#include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
+
+namespace py = pybind11;
+
+#include <gnuradio/fosphor/headless_sink_c.h>
+
+#define D(...) ""
+
+void bind_headless_sink_c(py::module& m)
+{
+	using headless_sink_c = gr::fosphor::headless_sink_c;
+
+	py::class_<headless_sink_c,
+		gr::fosphor::base_sink_c,
+		gr::sync_block,
+		gr::block,
+		gr::basic_block,
+		std::shared_ptr<headless_sink_c>>(m, "headless_sink_c", D(headless_sink_c))
+
+		.def(py::init(&headless_sink_c::make),
+			py::arg("rate") = 10.0,
+			py::arg("format") = gr::fosphor::base_sink_c::INPUT_FC32,
+			py::arg("channels") = 1,
+			D(headless_sink_c,make)
+		)
+
+		.def("set_update_rate",
+			&headless_sink_c::set_update_rate,
+			py::arg("rate"),
+			D(headless_sink_c,set_update_rate)
+		)
+
+		.def("update_rate",
+			&headless_sink_c::update_rate,
+			D(headless_sink_c,update_rate)
+		)
+
+		.def("set_frame_width",
+			&headless_sink_c::set_frame_width,
+			py::arg("width"),
+			D(headless_sink_c,set_frame_width)
+		)
+
+		.def("frame_width",
+			&headless_sink_c::frame_width,
+			D(headless_sink_c,frame_width)
+		)
+
+		;
+}
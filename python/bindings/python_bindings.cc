@@ -16,6 +16,7 @@ namespace py = pybind11;
 
 void bind_base_sink_c(py::module& m);
 void bind_glfw_sink_c(py::module& m);
+void bind_headless_sink_c(py::module& m);
 void bind_qt_sink_c(py::module& m);
 void bind_overlap_cc(py::module& m);
 
@@ -40,6 +41,7 @@ PYBIND11_MODULE(fosphor_python, m)
 
 	bind_base_sink_c(m);
 	bind_glfw_sink_c(m);
+	bind_headless_sink_c(m);
 	bind_qt_sink_c(m);
 	bind_overlap_cc(m);
 }
@@ -31,6 +31,8 @@ void bind_qt_sink_c(py::module& m)
 
 		.def(py::init(&qt_sink_c::make),
 			py::arg("parent") = nullptr,
+			py::arg("format") = gr::fosphor::base_sink_c::INPUT_FC32,
+			py::arg("channels") = 1,
 			D(qt_sink_c,make)
 		)
 